@@ -0,0 +1,127 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <new>
+
+#ifdef WIN32
+    #include <windows.h>
+#else
+    #include <time.h>
+#endif
+
+// ***************************** //
+// benchmark harness
+//      wall clock timer and a heap allocation counter; include in the one translation
+//      unit of a benchmark program, it replaces the global operator new / delete
+
+static volatile long bench_alloc_count = 0;
+
+inline void BenchCountAllocation()
+{
+#ifdef WIN32
+    InterlockedIncrement(&bench_alloc_count);
+#else
+    __sync_fetch_and_add(&bench_alloc_count, 1);
+#endif
+}
+
+// heap allocations through new / new[] since the program started
+inline long BenchAllocationCount()
+{
+    return bench_alloc_count;
+}
+
+void * operator new(size_t size)
+{
+    BenchCountAllocation();
+    void * p = malloc(size == 0 ? 1 : size);
+    if(p == NULL)
+        throw std::bad_alloc();
+    return p;
+}
+
+void * operator new[](size_t size)
+{
+    BenchCountAllocation();
+    void * p = malloc(size == 0 ? 1 : size);
+    if(p == NULL)
+        throw std::bad_alloc();
+    return p;
+}
+
+// the pointers come from the malloc above, which gcc cannot see when inlining
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+    #pragma GCC diagnostic push
+    #pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void operator delete(void * p) throw()
+{
+    free(p);
+}
+
+void operator delete[](void * p) throw()
+{
+    free(p);
+}
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+    #pragma GCC diagnostic pop
+#endif
+
+// seconds from an arbitrary origin
+inline double BenchNow()
+{
+#ifdef WIN32
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (double)count.QuadPart / freq.QuadPart;
+#else
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + 1e-9 * t.tv_nsec;
+#endif
+}
+
+// result of one measured section
+struct BenchResult
+{
+    const char * name;
+    double seconds;
+    double min_seconds;
+    long allocations;
+};
+
+// run func(args) repeat times after one warm-up call
+//      seconds: mean time per call, min_seconds: fastest call
+//      allocations: heap allocations of all measured calls
+template <typename Func, typename Args>
+BenchResult BenchRun(const char * name, Func func, Args * args, int repeat)
+{
+    func(args);
+
+    long alloc0 = BenchAllocationCount();
+    double t0 = BenchNow(), t = t0, min_seconds = 0;
+    for(int i=0; i<repeat; i++)
+    {
+        func(args);
+        double t1 = BenchNow();
+        min_seconds = (i == 0 || t1 - t < min_seconds) ? t1 - t : min_seconds;
+        t = t1;
+    }
+
+    BenchResult r;
+    r.name = name;
+    r.seconds = (t - t0) / repeat;
+    r.min_seconds = min_seconds;
+    r.allocations = BenchAllocationCount() - alloc0;
+    return r;
+}
+
+inline void BenchPrint(const BenchResult * r)
+{
+    printf("%-32s %10.3f ms %8ld allocations\n", r->name, 1000 * r->seconds, r->allocations);
+}
+
+#endif
@@ -0,0 +1,140 @@
+#include <vl/mathop.h>
+#include <math.h>
+#include <string.h>
+#include "batch.h"
+#include "bench.h"
+#include "bench_codebook.h"
+
+// multi-image pipeline against one image at a time
+//      g++ -O2 -mavx2 -pthread -I<vlfeat> -I../header bench_batch.cpp -o bench_batch
+//      bench_batch [images] [image height] [image width]
+// hog patch features, fisher vectors of 64 gaussians pooled over a 1x1 + 2x2 pyramid.
+// decoding is stood in for by a 3x3 box filter of an 8 bit source image.
+// prints both times and whether the pipeline matches the loop bit for bit, exits with 1
+// on a mismatch
+
+struct BatchBenchArgs
+{
+    int nimage;
+    int height, width;
+    unsigned char * source; // dim height x width, shared by the images
+    BatchOpt opt;
+    float * output; // dim column_length x nimage
+    int column_length;
+};
+
+bool BenchDecode(void * args_in, int index, FloatImage * img)
+{
+    BatchBenchArgs * args = (BatchBenchArgs *)args_in;
+    int height = args->height, width = args->width;
+    AllocateImage(img, height, width, 1);
+    for(int x=0; x<width; x++)
+        for(int y=0; y<height; y++)
+        {
+            int sum = 0;
+            for(int dx=-1; dx<=1; dx++)
+                for(int dy=-1; dy<=1; dy++)
+                {
+                    int sx = MIN(MAX(x+dx, 0), width-1), sy = MIN(MAX(y+dy, 0), height-1);
+                    sum += args->source[sx*height + sy];
+                }
+            img->p[x*height + y] = (float)((sum + index) % 256);
+        }
+    return true;
+}
+
+void BenchSink(void * args_in, int index, const FloatMatrix * feat)
+{
+    BatchBenchArgs * args = (BatchBenchArgs *)args_in;
+    memcpy(args->output + (size_t)index * args->column_length, feat->p, sizeof(float) * args->column_length);
+}
+
+// the stages called in a row by the caller, one image after the other
+void RunLoop(BatchBenchArgs * args)
+{
+    BatchOpt * opt = &args->opt;
+    CodingOpt coding_opt = opt->coding_opt;
+    InitCoding(&coding_opt);
+    for(int i=0; i<args->nimage; i++)
+    {
+        FloatImage img;
+        BenchDecode(args, i, &img);
+        PatchFeatureOpt patch_opt = opt->patch_opt;
+        InitPatchFeature(&img, &patch_opt);
+        FloatImage feat, coord;
+        AllocateImage(&coord, patch_opt.height, patch_opt.width, 2);
+        AllocateImage(&feat, patch_opt.length, patch_opt.height * patch_opt.width, 1);
+        PatchFeature(&img, &feat, &coord, &patch_opt);
+        FreePatchFeature(&patch_opt);
+
+        SpatialPyramidOpt pyramid;
+        InitSpatialPyramid(&pyramid, opt->grid_x, opt->grid_y, opt->nlayout, img.height, img.width);
+        SpatialPyramidPooling(&feat, coord.p, args->output + (size_t)i * args->column_length,
+                &coding_opt, &pyramid, opt->normalize);
+        FreeSpatialPyramid(&pyramid);
+        FreeImage(&img);
+        FreeImage(&feat);
+        FreeImage(&coord);
+    }
+    FreeCoding(&coding_opt);
+}
+
+void RunBatch(BatchBenchArgs * args)
+{
+    BatchFeature(args->nimage, &args->opt);
+}
+
+int main(int argc, char ** argv)
+{
+    BatchBenchArgs args;
+    args.nimage = argc > 1 ? atoi(argv[1]) : 32;
+    args.height = argc > 2 ? atoi(argv[2]) : 480;
+    args.width = argc > 3 ? atoi(argv[3]) : 640;
+    printf("%d cores, %d threads\n", ThreadCoreCount(), ThreadNum());
+
+    srand(1);
+    args.source = new unsigned char[args.height * args.width];
+    for(int i=0; i<args.height*args.width; i++)
+        args.source[i] = (unsigned char)(rand() % 256);
+
+    double hog_bins = 18;
+    int grid_x[2] = {1, 2}, grid_y[2] = {1, 2};
+    BatchOpt * opt = &args.opt;
+    memset(opt, 0, sizeof(BatchOpt));
+    opt->patch_opt.use_pixel_feature = true;
+    SetPixelFeature(&opt->patch_opt.pixel_opt, "Gray4N");
+    SetCoding(&opt->patch_opt.pixel_coding_opt, "PixelHOG");
+    opt->patch_opt.pixel_coding_opt.param = &hog_bins;
+    opt->patch_opt.pixel_coding_opt.nparam = 1;
+    opt->patch_opt.size_x = 16;
+    opt->patch_opt.size_y = 16;
+    opt->patch_opt.strip_width = -1;
+    opt->use_coding = true;
+    SetCoding(&opt->coding_opt, "FisherVector");
+    RandomFisherVectorCodeBook(&opt->coding_opt.fv_codebook, 18, 64);
+    opt->nlayout = 2;
+    opt->grid_x = grid_x;
+    opt->grid_y = grid_y;
+    opt->normalize = CODING_NORM_POWER | CODING_NORM_L2;
+    opt->func_load = BenchDecode;
+    opt->func_sink = BenchSink;
+    opt->args = &args;
+
+    args.column_length = 2*18*64 * 5;
+    size_t size = (size_t)args.column_length * args.nimage;
+    float * ref = new float[size];
+    args.output = ref;
+    BenchResult loop = BenchRun("one image at a time", RunLoop, &args, 3);
+    args.output = new float[size];
+    BenchResult batch = BenchRun("pipeline", RunBatch, &args, 3);
+    bool same = memcmp(ref, args.output, sizeof(float)*size) == 0;
+
+    printf("%-32s %10.3f ms per image\n", loop.name, 1000 * loop.seconds / args.nimage);
+    printf("%-32s %10.3f ms per image  x%5.2f  %s\n", batch.name, 1000 * batch.seconds / args.nimage,
+            loop.seconds / batch.seconds, same ? "identical" : "MISMATCH");
+
+    delete[] ref;
+    delete[] args.output;
+    delete[] args.source;
+    return same ? 0 : 1;
+}
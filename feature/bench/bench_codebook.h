@@ -0,0 +1,129 @@
+#ifndef BENCH_CODEBOOK_H
+#define BENCH_CODEBOOK_H
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "coding.h"
+
+// ***************************** //
+// synthetic codebooks and descriptors for the coding benchmarks
+
+inline double Uniform()
+{
+    return rand() / (double)RAND_MAX;
+}
+
+// random diagonal gmm with the derived fields of a matlab codebook
+void RandomFisherVectorCodeBook(FisherVectorCodeBook * cb, int nDim, int nBase)
+{
+    double * priors = new double[nBase], * sqrtPrior = new double[nBase],
+            * sqrt2Prior = new double[nBase], * sumLogSigma = new double[nBase];
+    double * mu = new double[nDim*nBase], * sigma = new double[nDim*nBase],
+            * invSigma = new double[nDim*nBase], * sqrtInvSigma = new double[nDim*nBase];
+
+    double total = 0;
+    for(int i=0; i<nBase; i++)
+    {
+        priors[i] = 0.5 + Uniform();
+        total += priors[i];
+    }
+    for(int i=0; i<nBase; i++)
+    {
+        priors[i] /= total;
+        sqrtPrior[i] = sqrt(priors[i]);
+        sqrt2Prior[i] = sqrt(2*priors[i]);
+        sumLogSigma[i] = 0;
+        for(int k=0; k<nDim; k++)
+        {
+            int j = i*nDim + k;
+            mu[j] = 2*Uniform() - 1;
+            sigma[j] = 0.2 + 0.5*Uniform();
+            invSigma[j] = 1 / sigma[j];
+            sqrtInvSigma[j] = sqrt(invSigma[j]);
+            sumLogSigma[i] += log(sigma[j]);
+        }
+    }
+
+    cb->nDim = nDim;
+    cb->nBase = nBase;
+    cb->priors = priors;
+    cb->mu = mu;
+    cb->sigma = sigma;
+    cb->sqrtPrior = sqrtPrior;
+    cb->sqrt2Prior = sqrt2Prior;
+    cb->invSigma = invSigma;
+    cb->sqrtInvSigma = sqrtInvSigma;
+    cb->sumLogSigma = sumLogSigma;
+}
+
+inline double Normal()
+{
+    double u = (rand() + 1.0) / ((double)RAND_MAX + 2);
+    return sqrt(-2*log(u)) * cos(2*3.14159265358979*Uniform());
+}
+
+// centers drawn around the means of a gmm, so descriptors of the gmm have near centers
+void RandomVQCodeBook(VQCodeBook * cb, const FisherVectorCodeBook * gmm, int nBase)
+{
+    int nDim = gmm->nDim;
+    float * centers = new float[nDim*nBase];
+    for(int i=0; i<nBase; i++)
+    {
+        int g = rand() % gmm->nBase;
+        for(int k=0; k<nDim; k++)
+            centers[i*nDim+k] = (float)(gmm->mu[g*nDim+k] + 0.5*sqrt(gmm->sigma[g*nDim+k])*Normal());
+    }
+    cb->nDim = nDim;
+    cb->nBase = nBase;
+    cb->centers = centers;
+}
+
+// centers picked among the columns of data, as the seeds of k-means
+void SampleVQCodeBook(VQCodeBook * cb, const FloatMatrix * data, int nBase)
+{
+    int nDim = data->height;
+    float * centers = new float[nDim*nBase];
+    for(int i=0; i<nBase; i++)
+        memcpy(centers + i*nDim, data->p + (rand() % data->width)*nDim, sizeof(float)*nDim);
+    cb->nDim = nDim;
+    cb->nBase = nBase;
+    cb->centers = centers;
+}
+
+// sub-centers picked among the subvectors of the columns of data, nDim = nSub x subDim
+void SamplePQCodeBook(PQCodeBook * cb, const FloatMatrix * data, int nSub, int nCenter)
+{
+    int nDim = data->height, subDim = nDim / nSub;
+    float * centers = new float[nDim*nCenter];
+    for(int m=0; m<nSub; m++)
+        for(int i=0; i<nCenter; i++)
+            memcpy(centers + (m*nCenter + i)*subDim, data->p + (rand() % data->width)*nDim + m*subDim,
+                    sizeof(float)*subDim);
+    cb->nDim = nDim;
+    cb->nSub = nSub;
+    cb->subDim = subDim;
+    cb->nCenter = nCenter;
+    cb->centers = centers;
+}
+
+// descriptors drawn from the gmm, column n of data
+void SampleFisherVectorData(const FisherVectorCodeBook * cb, FloatMatrix * data)
+{
+    int nDim = cb->nDim;
+    for(int n=0; n<data->width; n++)
+    {
+        double r = Uniform(), cum = 0;
+        int i = 0;
+        for(; i<cb->nBase-1; i++)
+        {
+            cum += cb->priors[i];
+            if(r <= cum)
+                break;
+        }
+        for(int k=0; k<nDim; k++)
+            data->p[n*nDim+k] = (float)(cb->mu[i*nDim+k] + sqrt(cb->sigma[i*nDim+k])*Normal());
+    }
+}
+
+#endif
@@ -0,0 +1,303 @@
+#include <vl/mathop.h>
+#include <math.h>
+#include <string.h>
+#include "coding.h"
+#include "pooling.h"
+#include "bench.h"
+#include "bench_codebook.h"
+
+// coding benchmark, random data and a random gmm codebook
+//      g++ -O2 -mavx2 -I<vlfeat> -I../header bench_coding.cpp -o bench_coding
+//      add -pthread on linux, -DNO_THREAD for a serial build
+//      bench_coding [descriptor number] [thread number, 0 for the core count]
+// exits with 1 if a coding call touched the heap or the batched fisher vector differs
+// from the per-descriptor one
+
+struct CodingBenchArgs
+{
+    FloatMatrix data;
+    FloatSparseMatrix coding;
+    CodingOpt opt;
+};
+
+void RunCoding(CodingBenchArgs * args)
+{
+    Coding(&args->data, &args->coding, &args->opt);
+}
+
+void RunFisherVectorPerDescriptor(CodingBenchArgs * args)
+{
+    CodingKernel<FuncCodingFisherVector>(&args->data, &args->coding, &args->opt, args->opt.scratch);
+}
+
+void RunFisherVectorFloatPerDescriptor(CodingBenchArgs * args)
+{
+    CodingKernel<FuncCodingFisherVectorFloat>(&args->data, &args->coding, &args->opt, args->opt.scratch);
+}
+
+// image-level vector of a coding, feat is dim opt.length
+struct AggregateBenchArgs
+{
+    CodingBenchArgs * coding;
+    float * feat;
+};
+
+void RunCodingSum(AggregateBenchArgs * args)
+{
+    CodingBenchArgs * c = args->coding;
+    Coding(&c->data, &c->coding, &c->opt);
+    
+    // what callers did with the sparse output
+    memset(args->feat, 0, sizeof(float)*c->opt.length);
+    int block_size = c->opt.block_size;
+    for(int n=0; n<c->coding.width*c->coding.block_num; n++)
+        for(int k=0; k<block_size; k++)
+            args->feat[c->coding.i[n]*block_size + k] += c->coding.p[n*block_size + k];
+}
+
+void RunCodingAggregate(AggregateBenchArgs * args)
+{
+    CodingBenchArgs * c = args->coding;
+    CodingAggregate(&c->data, args->feat, &c->opt, 0);
+}
+
+struct PyramidBenchArgs
+{
+    CodingBenchArgs * coding;
+    const float * coord;
+    SpatialPyramidOpt pyramid;
+    float * feat;
+};
+
+void RunSpatialPyramid(PyramidBenchArgs * args)
+{
+    CodingBenchArgs * c = args->coding;
+    SpatialPyramidPooling(&c->data, args->coord, args->feat, &c->opt, &args->pyramid, 0);
+}
+
+// pyramid cells against aggregating the columns of each cell on their own
+void PrintPyramidDelta(PyramidBenchArgs * args)
+{
+    CodingBenchArgs * c = args->coding;
+    int n = c->data.width, length = c->opt.length;
+    FloatMatrix cell_data;
+    AllocateImage(&cell_data, c->data.height, n, 1);
+    float * cell_feat = new float[length];
+    int * cell = new int[args->pyramid.nlayout];
+    double max_abs = 0, max_ref = 0;
+    for(int k=0; k<args->pyramid.ncell; k++)
+    {
+        cell_data.width = 0;
+        for(int j=0; j<n; j++)
+        {
+            SpatialPyramidCells(args->coord[n+j], args->coord[j], &args->pyramid, cell);
+            bool inside = false;
+            for(int l=0; l<args->pyramid.nlayout; l++)
+                inside = inside || cell[l] == k;
+            if(inside)
+                memcpy(cell_data.p + c->data.height*cell_data.width++, c->data.p + c->data.height*j,
+                        sizeof(float)*c->data.height);
+        }
+        CodingAggregate(&cell_data, cell_feat, &c->opt, 0);
+        for(int i=0; i<length; i++)
+        {
+            max_abs = MAX(max_abs, fabs((double)cell_feat[i] - args->feat[k*length + i]));
+            max_ref = MAX(max_ref, fabs((double)cell_feat[i]));
+        }
+    }
+    printf("%-32s max abs %.3g (max value %.3g)\n", "  delta to masked cells", max_abs, max_ref);
+    cell_data.width = n;
+    FreeImage(&cell_data);
+    delete[] cell_feat;
+    delete[] cell;
+}
+
+// coding by name on n random descriptors
+void SetupCoding(CodingBenchArgs * args, const char * name, int n, double * param)
+{
+    memset(&args->opt, 0, sizeof(CodingOpt));
+    SetCoding(&args->opt, name);
+    args->opt.param = param;
+    args->opt.nparam = param != NULL ? 1 : 0;
+    if(strncmp(name, "FisherVector", 12) == 0)
+    {
+        srand(2);
+        RandomFisherVectorCodeBook(&args->opt.fv_codebook, 80, 256);
+    }
+    InitCoding(&args->opt);
+
+    AllocateImage(&args->data, args->opt.length_input, n, 1);
+    for(int i=0; i<args->opt.length_input*n; i++)
+        args->data.p[i] = (float)(2*Uniform() - 1);
+    AllocateSparseMatrix(&args->coding, args->opt.length, n,
+            args->opt.block_num, args->opt.block_size);
+}
+
+// accuracy of a coding against a reference on the same data, blocks matched by bin
+void PrintCodingDelta(const FloatSparseMatrix * ref, const FloatSparseMatrix * coding)
+{
+    int block_num = ref->block_num, block_size = ref->block_size;
+    long bin_mismatch = 0;
+    double max_abs = 0, max_ref = 0;
+    for(int n=0; n<ref->width; n++)
+    {
+        for(int i=0; i<block_num; i++)
+        {
+            const int * bins = ref->i + n*block_num;
+            int j = 0;
+            while(j < block_num && bins[j] != coding->i[n*block_num + i])
+                j++;
+            if(j == block_num)
+            {
+                bin_mismatch++;
+                continue;
+            }
+            
+            const float * a = ref->p + (n*block_num + j)*block_size;
+            const float * b = coding->p + (n*block_num + i)*block_size;
+            for(int k=0; k<block_size; k++)
+            {
+                max_abs = MAX(max_abs, fabs((double)a[k] - b[k]));
+                max_ref = MAX(max_ref, fabs((double)a[k]));
+            }
+        }
+    }
+    printf("%-32s max abs %.3g (max value %.3g), %ld of %d blocks on other gaussians\n",
+            "  delta to double", max_abs, max_ref, bin_mismatch, ref->width*block_num);
+}
+
+// cost per column measured by Coding() and the schedule derived from it
+void PrintSchedule(const CodingOpt * opt, int n)
+{
+    int nworker = opt->scratch_num;
+    int grain = ParallelGrain(n, opt->item_cost, &nworker);
+    printf("%-32s %.3g us per column, grain %d, %d of %d workers\n", "  schedule",
+            1e6 * opt->item_cost, grain, nworker, ThreadNum());
+}
+
+void FreeSetup(CodingBenchArgs * args)
+{
+    FreeCoding(&args->opt);
+    FreeImage(&args->data);
+    FreeSparseMatrix(&args->coding);
+}
+
+int main(int argc, char ** argv)
+{
+    int n = argc > 1 ? atoi(argv[1]) : 10000;
+    SetThreadNum(argc > 2 ? atoi(argv[2]) : 0);
+    double hog_bins = 18;
+    long allocations = 0;
+    srand(1);
+
+    const char * names[] = {"PixelLBP", "PixelHOG", "PixelHOGUoC"};
+    for(int i=0; i<3; i++)
+    {
+        CodingBenchArgs args;
+        SetupCoding(&args, names[i], 100*n, &hog_bins);
+        BenchResult r = BenchRun(names[i], RunCoding, &args, 10);
+        BenchPrint(&r);
+        allocations += r.allocations;
+        PrintSchedule(&args.opt, 100*n);
+        FreeSetup(&args);
+    }
+
+    // many small calls, as for one image at a time
+    CodingBenchArgs small;
+    SetupCoding(&small, "PixelHOG", 256, &hog_bins);
+    BenchResult r = BenchRun("PixelHOG 256 columns", RunCoding, &small, 1000);
+    BenchPrint(&r);
+    allocations += r.allocations;
+    FreeSetup(&small);
+
+    CodingBenchArgs fv;
+    SetupCoding(&fv, "FisherVector", n, NULL);
+    r = BenchRun("FisherVector per descriptor", RunFisherVectorPerDescriptor, &fv, 3);
+    BenchPrint(&r);
+    allocations += r.allocations;
+    long long fv_values = (long long)n * fv.opt.block_num * fv.opt.block_size;
+    float * ref_p = new float[fv_values];
+    int * ref_i = new int[n * fv.opt.block_num];
+    memcpy(ref_p, fv.coding.p, sizeof(float)*fv_values);
+    memcpy(ref_i, fv.coding.i, sizeof(int)*n*fv.opt.block_num);
+    r = BenchRun("FisherVector batched", RunCoding, &fv, 3);
+    BenchPrint(&r);
+    allocations += r.allocations;
+    // the batched selection replays the per-descriptor heap, bins and values match
+    bool same = memcmp(ref_p, fv.coding.p, sizeof(float)*fv_values) == 0
+            && memcmp(ref_i, fv.coding.i, sizeof(int)*n*fv.opt.block_num) == 0;
+    printf("%-32s %s\n", "  against per descriptor", same ? "identical" : "MISMATCH");
+    delete[] ref_p;
+    delete[] ref_i;
+    PrintSchedule(&fv.opt, n);
+    
+    // image-level fisher vector, sparse output summed after coding against streaming
+    AggregateBenchArgs sum_args, aggregate_args;
+    sum_args.coding = aggregate_args.coding = &fv;
+    sum_args.feat = new float[fv.opt.length];
+    aggregate_args.feat = new float[fv.opt.length];
+    r = BenchRun("FisherVector sparse and sum", RunCodingSum, &sum_args, 3);
+    BenchPrint(&r);
+    r = BenchRun("FisherVector aggregate", RunCodingAggregate, &aggregate_args, 3);
+    BenchPrint(&r);
+    allocations += r.allocations;
+    double max_abs = 0, max_ref = 0;
+    for(int k=0; k<fv.opt.length; k++)
+    {
+        max_abs = MAX(max_abs, fabs((double)sum_args.feat[k] - aggregate_args.feat[k]));
+        max_ref = MAX(max_ref, fabs((double)sum_args.feat[k]));
+    }
+    printf("%-32s max abs %.3g (max value %.3g)\n", "  delta to sum", max_abs, max_ref);
+    delete[] sum_args.feat;
+    delete[] aggregate_args.feat;
+    
+    // spatial pyramid 1x1, 2x2, 3x1 at random coordinates in a 480 x 640 image
+    int grid_x[3] = {1, 2, 3}, grid_y[3] = {1, 2, 1};
+    PyramidBenchArgs pyramid_args;
+    pyramid_args.coding = &fv;
+    InitSpatialPyramid(&pyramid_args.pyramid, grid_x, grid_y, 3, 480, 640);
+    float * coord = new float[2*n];
+    for(int j=0; j<n; j++)
+    {
+        coord[j] = (float)(480*Uniform());
+        coord[n+j] = (float)(640*Uniform());
+    }
+    pyramid_args.coord = coord;
+    pyramid_args.feat = new float[fv.opt.length*pyramid_args.pyramid.ncell];
+    r = BenchRun("FisherVector spatial pyramid", RunSpatialPyramid, &pyramid_args, 3);
+    BenchPrint(&r);
+    allocations += r.allocations;
+    PrintPyramidDelta(&pyramid_args);
+    delete[] coord;
+    delete[] pyramid_args.feat;
+    FreeSpatialPyramid(&pyramid_args.pyramid);
+    
+    // float kernels of each level the cpu has, against the double result
+    const char * levels[] = {"scalar", "sse4", "avx2", "avx512"};
+    int max_level = SimdLevel();
+    for(int level=SIMD_LEVEL_SCALAR; level<=max_level; level++)
+    {
+        SetSimdLevel(level);
+        CodingBenchArgs fv_float;
+        SetupCoding(&fv_float, "FisherVectorFloat", n, NULL);
+        memcpy(fv_float.data.p, fv.data.p, sizeof(float)*fv.data.height*fv.data.width);
+        
+        char name[64];
+        sprintf(name, "FisherVectorFloat %s", levels[fv_float.opt.fv_codebook_float.simd_level]);
+        r = BenchRun(name, RunFisherVectorFloatPerDescriptor, &fv_float, 3);
+        BenchPrint(&r);
+        allocations += r.allocations;
+        PrintCodingDelta(&fv.coding, &fv_float.coding);
+        strcat(name, " batched");
+        r = BenchRun(name, RunCoding, &fv_float, 3);
+        BenchPrint(&r);
+        allocations += r.allocations;
+        PrintCodingDelta(&fv.coding, &fv_float.coding);
+        FreeSetup(&fv_float);
+    }
+    SetSimdLevel(max_level);
+    FreeSetup(&fv);
+
+    printf("%ld heap allocations in coding calls\n", allocations);
+    return allocations == 0 && same ? 0 : 1;
+}
@@ -0,0 +1,126 @@
+#include <vl/mathop.h>
+#include <math.h>
+#include <string.h>
+#include "coding.h"
+#include "bench.h"
+#include "bench_codebook.h"
+
+// recall / speed of the fisher vector gaussian index against exhaustive search
+//      g++ -O2 -I<vlfeat> -I../header bench_fv_index.cpp -o bench_fv_index
+//      bench_fv_index [gaussian number] [descriptor number]
+// descriptors are sampled from a random gmm; for each probe setting it prints the
+// time, the fraction of exhaustive top gaussians found and the posterior mass of
+// the selected gaussians relative to the mass of the exhaustive selection
+
+struct IndexBenchArgs
+{
+    FloatMatrix data;
+    FloatSparseMatrix coding;
+    CodingOpt opt;
+};
+
+void RunIndexCoding(IndexBenchArgs * args)
+{
+    Coding(&args->data, &args->coding, &args->opt);
+}
+
+// posterior of every gaussian for descriptor data, dim nBase
+void Posterior(const float * data, const FisherVectorCodeBook * cb, double * post)
+{
+    double lmax = 0, sum = 0;
+    for(int i=0; i<cb->nBase; i++)
+    {
+        post[i] = FisherVectorLogLikelihood(data, i, cb) + log(cb->priors[i]);
+        lmax = (i == 0 || post[i] > lmax) ? post[i] : lmax;
+    }
+    for(int i=0; i<cb->nBase; i++)
+    {
+        post[i] = exp(post[i] - lmax);
+        sum += post[i];
+    }
+    for(int i=0; i<cb->nBase; i++)
+        post[i] /= sum;
+}
+
+int main(int argc, char ** argv)
+{
+    int nBase = argc > 1 ? atoi(argv[1]) : 512;
+    int n = argc > 2 ? atoi(argv[2]) : 5000;
+    srand(1);
+
+    FisherVectorCodeBook cb;
+    RandomFisherVectorCodeBook(&cb, 80, nBase);
+    FloatMatrix data;
+    AllocateImage(&data, cb.nDim, n, 1);
+    SampleFisherVectorData(&cb, &data);
+
+    // exhaustive reference
+    IndexBenchArgs exact;
+    memset(&exact.opt, 0, sizeof(CodingOpt));
+    SetCoding(&exact.opt, "FisherVector");
+    exact.opt.fv_codebook = cb;
+    InitCoding(&exact.opt);
+    exact.data = data;
+    AllocateSparseMatrix(&exact.coding, exact.opt.length, n, exact.opt.block_num, exact.opt.block_size);
+    BenchResult r = BenchRun("exhaustive", RunIndexCoding, &exact, 3);
+    BenchPrint(&r);
+
+    int block_num = exact.opt.block_num;
+    double * post = new double[nBase];
+    double * post_exact = new double[n];
+    for(int j=0; j<n; j++)
+    {
+        Posterior(data.p + j*cb.nDim, &cb, post);
+        post_exact[j] = 0;
+        for(int i=0; i<block_num; i++)
+            post_exact[j] += post[exact.coding.i[j*block_num + i]];
+    }
+
+    int nCluster = (int)(sqrt((double)nBase) + 0.5);
+    for(int probe=1; probe<=nCluster; probe*=2)
+    {
+        double param[2] = {(double)probe, (double)nCluster};
+        IndexBenchArgs args;
+        memset(&args.opt, 0, sizeof(CodingOpt));
+        SetCoding(&args.opt, "FisherVector");
+        args.opt.fv_codebook = cb;
+        args.opt.param = param;
+        args.opt.nparam = 2;
+        InitCoding(&args.opt);
+        args.data = data;
+        AllocateSparseMatrix(&args.coding, args.opt.length, n, block_num, args.opt.block_size);
+
+        char name[64];
+        sprintf(name, "index probe %d of %d", probe, nCluster);
+        r = BenchRun(name, RunIndexCoding, &args, 3);
+        BenchPrint(&r);
+
+        // recall of the exact bins and the posterior mass kept
+        long found = 0;
+        double mass = 0, mass_exact = 0;
+        for(int j=0; j<n; j++)
+        {
+            Posterior(data.p + j*cb.nDim, &cb, post);
+            for(int i=0; i<block_num; i++)
+            {
+                int bin = args.coding.i[j*block_num + i];
+                mass += post[bin];
+                for(int e=0; e<block_num; e++)
+                    found += (exact.coding.i[j*block_num + e] == bin);
+            }
+            mass_exact += post_exact[j];
+        }
+        printf("%-32s top-%d recall %.4f, posterior mass %.4f of exhaustive (%.4f absolute)\n", "",
+                block_num, found / (double)(n*block_num), mass / mass_exact, mass / n);
+
+        FreeCoding(&args.opt);
+        FreeSparseMatrix(&args.coding);
+    }
+
+    delete[] post;
+    delete[] post_exact;
+    FreeCoding(&exact.opt);
+    FreeSparseMatrix(&exact.coding);
+    FreeImage(&data);
+    return 0;
+}
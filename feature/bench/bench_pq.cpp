@@ -0,0 +1,174 @@
+#include <vl/mathop.h>
+#include <math.h>
+#include <string.h>
+#include "coding.h"
+#include "bench.h"
+#include "bench_codebook.h"
+
+// pq coding: batched encoding against the per-descriptor loop, the asymmetric distance
+// scan of a query against the uint8 codes, and the recall of the scan
+//      g++ -O2 -I<vlfeat> -I../header bench_pq.cpp -o bench_pq
+//      bench_pq [subspace number] [descriptor number] [query number]
+// descriptors are sampled from a random gmm of 256 gaussians in 128 dimensions and
+// the 256 centers of each subspace are picked among them; the scan prints its rate
+// in GB/s of codes and the fraction of queries whose exact nearest descriptor is
+// among the PQ_RECALL_DEPTH nearest by the scan
+
+#define PQ_RECALL_DEPTH 100
+
+struct PQBenchArgs
+{
+    FloatMatrix data;
+    FloatSparseMatrix coding;
+    CodingOpt opt;
+};
+
+void RunPQCoding(PQBenchArgs * args)
+{
+    Coding(&args->data, &args->coding, &args->opt);
+}
+
+// per-descriptor loop, as coding without the batch kernel
+void RunPQSingle(PQBenchArgs * args)
+{
+    int block_num = args->opt.block_num;
+    for(int n=0; n<args->data.width; n++)
+        FuncCodingPQ(args->data.p + n*args->data.height, args->coding.p + n*block_num,
+                args->coding.i + n*block_num, &args->opt);
+}
+
+void InitPQBench(PQBenchArgs * args, const PQCodeBook * cb, const FloatMatrix * data)
+{
+    memset(&args->opt, 0, sizeof(CodingOpt));
+    SetCoding(&args->opt, "PQ");
+    args->opt.pq_codebook = *cb;
+    InitCoding(&args->opt);
+    args->data = *data;
+    AllocateSparseMatrix(&args->coding, args->opt.length, data->width, args->opt.block_num, args->opt.block_size);
+}
+
+void FreePQBench(PQBenchArgs * args)
+{
+    FreeCoding(&args->opt);
+    FreeSparseMatrix(&args->coding);
+}
+
+struct PQScanBenchArgs
+{
+    const PQCodeBook * cb;
+    const FloatMatrix * query;
+    const unsigned char * codes;
+    long long n;
+    float * table;
+    float * dist;
+};
+
+// all queries: table once per query, then the scan
+void RunPQScan(PQScanBenchArgs * args)
+{
+    const PQCodeBook * cb = args->cb;
+    for(int q=0; q<args->query->width; q++)
+    {
+        PQDistanceTable(args->query->p + q*cb->nDim, cb, args->table);
+        PQScan(args->table, args->codes, args->n, cb->nSub, cb->nCenter, args->dist + q*args->n);
+    }
+}
+
+int main(int argc, char ** argv)
+{
+    int nSub = argc > 1 ? atoi(argv[1]) : 8;
+    int n = argc > 2 ? atoi(argv[2]) : 100000;
+    int nQuery = argc > 3 ? atoi(argv[3]) : 20;
+    srand(1);
+
+    FisherVectorCodeBook gmm;
+    RandomFisherVectorCodeBook(&gmm, 128, 256);
+    FloatMatrix data, query;
+    AllocateImage(&data, gmm.nDim, n, 1);
+    SampleFisherVectorData(&gmm, &data);
+    AllocateImage(&query, gmm.nDim, nQuery, 1);
+    SampleFisherVectorData(&gmm, &query);
+    PQCodeBook cb;
+    SamplePQCodeBook(&cb, &data, nSub, 256);
+
+    // encoding, batched and per descriptor
+    PQBenchArgs batch;
+    InitPQBench(&batch, &cb, &data);
+    BenchResult r = BenchRun("encode batched", RunPQCoding, &batch, 3);
+    BenchPrint(&r);
+
+    PQBenchArgs single;
+    InitPQBench(&single, &cb, &data);
+    r = BenchRun("encode per descriptor", RunPQSingle, &single, 1);
+    BenchPrint(&r);
+    long same = 0;
+    for(long long j=0; j<(long long)n*nSub; j++)
+        same += batch.coding.i[j] == single.coding.i[j];
+    printf("%-32s same bins %.4f\n", "", same / ((double)n*nSub));
+    FreePQBench(&single);
+
+    // scan of the uint8 codes
+    unsigned char * codes = new unsigned char[(long long)n*nSub];
+    CodingPQCodes(&batch.coding, &batch.opt, codes);
+    PQScanBenchArgs scan;
+    scan.cb = &batch.opt.pq_codebook;
+    scan.query = &query;
+    scan.codes = codes;
+    scan.n = n;
+    scan.table = new float[nSub*cb.nCenter];
+    scan.dist = new float[(long long)n*nQuery];
+    r = BenchRun("adc scan, all queries", RunPQScan, &scan, 3);
+    BenchPrint(&r);
+    printf("%-32s %.2f GB/s of codes, %d bytes per descriptor\n", "",
+            (double)n*nSub*nQuery / r.min_seconds / 1e9, nSub);
+
+    // exact nearest descriptor among the nearest by the scan
+    double heap_val[PQ_RECALL_DEPTH];
+    int heap_bin[PQ_RECALL_DEPTH];
+    int depth = MIN(PQ_RECALL_DEPTH, n), found = 0;
+    double max_error = 0;
+    for(int q=0; q<nQuery; q++)
+    {
+        const float * x = query.p + q*gmm.nDim;
+        const float * dist = scan.dist + (long long)q*n;
+        int heap_size = 0, nearest = 0;
+        double nearest_dist = 0;
+        for(int j=0; j<n; j++)
+        {
+            double d = 0;
+            for(int k=0; k<gmm.nDim; k++)
+            {
+                double v = (double)x[k] - data.p[(long long)j*gmm.nDim + k];
+                d += v*v;
+            }
+            if(j == 0 || d < nearest_dist)
+            {
+                nearest_dist = d;
+                nearest = j;
+            }
+            FisherVectorHeapPush(heap_val, heap_bin, &heap_size, depth, -dist[j], j);
+        }
+        for(int i=0; i<heap_size; i++)
+            found += heap_bin[i] == nearest;
+
+        // the scan against the table sums of the codes
+        PQDistanceTable(x, &cb, scan.table);
+        for(int j=0; j<n; j+=97)
+        {
+            double d = 0;
+            for(int m=0; m<nSub; m++)
+                d += scan.table[m*cb.nCenter + codes[(long long)j*nSub + m]];
+            max_error = MAX(max_error, fabs(d - dist[j]) / MAX(d, 1e-12));
+        }
+    }
+    printf("%-32s recall@%d %.4f, max relative scan error %.2e\n", "", depth, found / (double)nQuery, max_error);
+
+    delete[] codes;
+    delete[] scan.table;
+    delete[] scan.dist;
+    delete[] cb.centers;
+    FreePQBench(&batch);
+    FreeImage(&data);
+    FreeImage(&query);
+    return 0;
+}
@@ -0,0 +1,141 @@
+#include <vl/mathop.h>
+#include <math.h>
+#include <string.h>
+#include "patch_feature.h"
+#include "bench.h"
+
+// thread scaling of pixel features and patch features
+//      g++ -O2 -mavx2 -pthread -I<vlfeat> -I../header bench_scaling.cpp -o bench_scaling
+//      bench_scaling [image height] [image width] [max threads]
+// thread numbers 1, 2, 4, .. up to max threads (32 by default); prints the time, the
+// speedup over 1 thread and whether the output matches the 1 thread output bit for bit;
+// the last patch case runs with the default strip width of the matlab and cli callers.
+// exits with 1 on a mismatch
+
+struct ScalingArgs
+{
+    FloatImage * img;
+    FloatImage feat;
+    FloatImage coord;
+    PixelFeatureOpt pixel_opt;
+    PatchFeatureOpt patch_opt;
+};
+
+void RunPixelFeature(ScalingArgs * args)
+{
+    PixelFeature(args->img, &args->feat, &args->coord, &args->pixel_opt);
+}
+
+void RunPatchFeature(ScalingArgs * args)
+{
+    memset(args->feat.p, 0, sizeof(float) * args->feat.height * args->feat.width);
+    PatchFeature(args->img, &args->feat, &args->coord, &args->patch_opt);
+}
+
+// options of a run are built after SetThreadNum(), per worker buffers follow it
+void SetupPixel(ScalingArgs * args, FloatImage * img, const char * name)
+{
+    memset(args, 0, sizeof(ScalingArgs));
+    args->img = img;
+    SetPixelFeature(&args->pixel_opt, name);
+    InitPixelFeature(img, &args->pixel_opt);
+    int npixel = args->pixel_opt.height * args->pixel_opt.width;
+    AllocateImage(&args->feat, args->pixel_opt.length, npixel, 1);
+    AllocateImage(&args->coord, args->pixel_opt.height, args->pixel_opt.width, 2);
+}
+
+void SetupPatch(ScalingArgs * args, FloatImage * img, const char * pixel_name, const char * coding_name,
+        double * param, int strip_width)
+{
+    memset(args, 0, sizeof(ScalingArgs));
+    args->img = img;
+    PatchFeatureOpt * opt = &args->patch_opt;
+    opt->use_pixel_feature = true;
+    SetPixelFeature(&opt->pixel_opt, pixel_name);
+    SetCoding(&opt->pixel_coding_opt, coding_name);
+    opt->pixel_coding_opt.param = param;
+    opt->pixel_coding_opt.nparam = 1;
+    opt->size_x = 16;
+    opt->size_y = 16;
+    opt->strip_width = strip_width;
+    InitPatchFeature(img, opt);
+    AllocateImage(&args->feat, opt->length, opt->height * opt->width, 1);
+    AllocateImage(&args->coord, opt->height, opt->width, 2);
+}
+
+void FreeScaling(ScalingArgs * args)
+{
+    if(args->patch_opt.use_pixel_feature)
+        FreePatchFeature(&args->patch_opt);
+    FreeImage(&args->feat);
+    FreeImage(&args->coord);
+}
+
+int main(int argc, char ** argv)
+{
+    int height = argc > 1 ? atoi(argv[1]) : 480;
+    int width = argc > 2 ? atoi(argv[2]) : 640;
+    int max_thread = argc > 3 ? atoi(argv[3]) : 32;
+    printf("%d cores\n", ThreadCoreCount());
+
+    FloatImage img;
+    AllocateImage(&img, height, width, 1);
+    srand(1);
+    for(int i=0; i<height*width; i++)
+        img.p[i] = (float)(rand() % 256);
+
+    // the last case keeps the strip width of the matlab and cli callers
+    double hog_bins = 18;
+    const char * names[] = {"Gray8N", "Gray8N PixelLBP", "Gray4N PixelHOG", "Gray4N PixelHOGUoC",
+            "Gray4N PixelHOG default"};
+    const char * coding_names[] = {NULL, "PixelLBP", "PixelHOG", "PixelHOGUoC", "PixelHOG"};
+    int strip_widths[] = {0, -1, -1, -1, STRIP_WIDTH_DEFAULT};
+    int mismatch = 0;
+    for(int k=0; k<5; k++)
+    {
+        float * ref = NULL;
+        int ref_size = 0;
+        double ref_seconds = 0;
+        for(int t=1; t<=max_thread; t*=2)
+        {
+            SetThreadNum(t);
+            ScalingArgs args;
+            BenchResult r;
+            char name[64];
+            sprintf(name, "%s, %d threads", names[k], t);
+            if(k == 0)
+            {
+                SetupPixel(&args, &img, names[k]);
+                r = BenchRun(name, RunPixelFeature, &args, 10);
+            }
+            else
+            {
+                char pixel_name[16];
+                sscanf(names[k], "%15s", pixel_name);
+                SetupPatch(&args, &img, pixel_name, coding_names[k], &hog_bins, strip_widths[k]);
+                r = BenchRun(name, RunPatchFeature, &args, 10);
+            }
+
+            int size = args.feat.height * args.feat.width;
+            bool same = true;
+            if(t == 1)
+            {
+                ref = new float[size];
+                ref_size = size;
+                memcpy(ref, args.feat.p, sizeof(float)*size);
+                ref_seconds = r.seconds;
+            }
+            else
+                same = (size == ref_size && memcmp(ref, args.feat.p, sizeof(float)*size) == 0);
+            mismatch += same ? 0 : 1;
+
+            printf("%-36s %10.3f ms  x%5.2f  %s\n", r.name, 1000 * r.seconds, ref_seconds / r.seconds,
+                    same ? "identical" : "MISMATCH");
+            FreeScaling(&args);
+        }
+        delete[] ref;
+    }
+
+    FreeImage(&img);
+    return mismatch == 0 ? 0 : 1;
+}
@@ -0,0 +1,187 @@
+#include <math.h>
+#include <string.h>
+#include "feature_store.h"
+#include "bench.h"
+
+// feature store round trip: writing, mapping and reading back dense and block sparse
+// records in float32 and fp16, a store left unclosed and records of a wrong size
+//      g++ -O2 -mavx2 -mf16c -I../header bench_store.cpp -o bench_store
+//      bench_store [images] [columns] [store path]
+// even images are dense 128 x columns, odd ones sparse fisher vector codes of 7 blocks
+// of 160 over 64 gaussians; the images are written in reverse order. prints the times
+// and whether every record reads back as written, fp16 ones as rounded by FloatToHalf(),
+// exits with 1 on a mismatch
+
+struct StoreBenchArgs
+{
+    const char * path;
+    int type;
+    int nimage;
+    bool close;
+    FloatMatrix dense;
+    FloatSparseMatrix sparse;
+    FeatureStoreWriter writer;
+    FeatureStore store;
+    float * buffer;
+};
+
+// the features of image, element 0 of each record tells the images apart
+void SetStoreImage(StoreBenchArgs * args, int image)
+{
+    args->dense.p[0] = (float)image;
+    args->sparse.p[0] = (float)image;
+    args->sparse.i[0] = image % 64;
+}
+
+void RunStoreWrite(StoreBenchArgs * args)
+{
+    OpenFeatureStore(&args->writer, args->path, args->type);
+    for(int image=args->nimage-1; image>=0; image--)
+    {
+        SetStoreImage(args, image);
+        if(image % 2 == 0)
+            AppendDenseFeature(&args->writer, image, &args->dense);
+        else
+            AppendSparseFeature(&args->writer, image, &args->sparse);
+    }
+    if(args->close)
+        CloseFeatureStore(&args->writer);
+    else
+        fflush(args->writer.file);
+}
+
+// every record widened to float32
+void RunStoreRead(StoreBenchArgs * args)
+{
+    MapFeatureStore(&args->store, args->path);
+    FeatureRecord record;
+    for(int k=0; k<args->store.record_num; k++)
+    {
+        FeatureStoreRecord(&args->store, k, &record);
+        FeatureStoreToFloat(&record, args->buffer);
+    }
+    UnmapFeatureStore(&args->store);
+}
+
+// value as read back from a store of type
+inline float StoreRounded(float value, int type)
+{
+    return type == FEATURE_STORE_HALF ? HalfToFloat(FloatToHalf(value)) : value;
+}
+
+// records of the mapped store against the written features, mismatching records
+int VerifyStore(StoreBenchArgs * args)
+{
+    FeatureStore * store = &args->store;
+    if(!MapFeatureStore(store, args->path))
+        return args->nimage;
+    int mismatch = store->record_num == args->nimage ? 0 : 1;
+
+    FeatureRecord record;
+    for(int image=0; image<args->nimage; image++)
+    {
+        int k = FindFeatureStoreImage(store, image);
+        if(k < 0)
+        {
+            mismatch++;
+            continue;
+        }
+        FeatureStoreRecord(store, k, &record);
+        SetStoreImage(args, image);
+        bool dense = image % 2 == 0;
+        const float * src = dense ? args->dense.p : args->sparse.p;
+        size_t n = dense ? (size_t)args->dense.height * args->dense.width
+                : (size_t)args->sparse.block_size * args->sparse.block_num * args->sparse.width;
+        bool same = record.encoding == (dense ? FEATURE_STORE_DENSE : FEATURE_STORE_SPARSE)
+                && FeatureRecordSize(&record) == n;
+        if(same)
+        {
+            FeatureStoreToFloat(&record, args->buffer);
+            for(size_t j=0; same && j<n; j++)
+                same = args->buffer[j] == StoreRounded(src[j], store->header->type);
+        }
+        if(same && !dense)
+            same = memcmp(record.bin, args->sparse.i, sizeof(int) * args->sparse.block_num * args->sparse.width) == 0;
+        mismatch += same ? 0 : 1;
+    }
+    UnmapFeatureStore(store);
+    return mismatch;
+}
+
+// the first record claims 64 bytes more than its sizes, the store is rejected
+bool RejectsWrongSize(StoreBenchArgs * args)
+{
+    FILE * file = fopen(args->path, "r+b");
+    if(file == NULL)
+        return false;
+    FeatureStoreRecordHeader record;
+    long offset = (long)sizeof(FeatureStoreHeader);
+    bool ok = fseek(file, offset, SEEK_SET) == 0 && fread(&record, sizeof(record), 1, file) == 1;
+    record.bytes += FEATURE_STORE_ALIGN;
+    ok = ok && fseek(file, offset, SEEK_SET) == 0 && fwrite(&record, sizeof(record), 1, file) == 1;
+    fclose(file);
+
+    FeatureStore store;
+    bool mapped = MapFeatureStore(&store, args->path);
+    if(mapped)
+        UnmapFeatureStore(&store);
+    return ok && !mapped;
+}
+
+int main(int argc, char ** argv)
+{
+    int nimage = argc > 1 ? atoi(argv[1]) : 200;
+    int cols = argc > 2 ? atoi(argv[2]) : 500;
+    const char * path = argc > 3 ? argv[3] : "bench_store.fstr";
+    srand(1);
+
+    StoreBenchArgs args;
+    memset(&args, 0, sizeof(StoreBenchArgs));
+    args.path = path;
+    args.nimage = nimage;
+    AllocateImage(&args.dense, 128, cols, 1);
+    for(int j=0; j<args.dense.height*args.dense.width; j++)
+        args.dense.p[j] = (float)(4.0*rand()/RAND_MAX - 2);
+    AllocateSparseMatrix(&args.sparse, 160*64, cols, 7, 160);
+    for(int j=0; j<7*cols; j++)
+        args.sparse.i[j] = rand() % 64;
+    for(int j=0; j<160*7*cols; j++)
+        args.sparse.p[j] = (float)((double)rand()/RAND_MAX - 0.5);
+    args.buffer = new float[(size_t)160*7*cols > (size_t)128*cols ? (size_t)160*7*cols : (size_t)128*cols];
+
+    const char * types[] = {"float32", "fp16"};
+    int mismatch = 0;
+    for(int type=FEATURE_STORE_FLOAT; type<=FEATURE_STORE_HALF; type++)
+    {
+        args.type = type;
+        args.close = true;
+        char name[64];
+        sprintf(name, "write %s", types[type]);
+        BenchResult r = BenchRun(name, RunStoreWrite, &args, 3);
+        BenchPrint(&r);
+        sprintf(name, "map and read %s", types[type]);
+        r = BenchRun(name, RunStoreRead, &args, 3);
+        BenchPrint(&r);
+        int m = VerifyStore(&args);
+        printf("%-32s %s\n", "  round trip", m == 0 ? "identical" : "MISMATCH");
+        mismatch += m;
+
+        // the index recovered by walking the records
+        args.close = false;
+        RunStoreWrite(&args);
+        m = VerifyStore(&args);
+        printf("%-32s %s\n", "  unclosed store", m == 0 ? "identical" : "MISMATCH");
+        mismatch += m;
+        CloseFeatureStore(&args.writer);
+
+        bool rejected = RejectsWrongSize(&args);
+        printf("%-32s %s\n", "  record of a wrong size", rejected ? "rejected" : "MISMATCH");
+        mismatch += rejected ? 0 : 1;
+    }
+    remove(path);
+
+    delete[] args.buffer;
+    FreeImage(&args.dense);
+    FreeSparseMatrix(&args.sparse);
+    return mismatch == 0 ? 0 : 1;
+}
@@ -0,0 +1,558 @@
+#include <vl/mathop.h>
+#include <math.h>
+#include <string.h>
+#include "patch_feature.h"
+#include "pooling.h"
+#include "pyramid.h"
+#include "hog_feature.h"
+#include "image_io.h"
+#include "bench.h"
+#include "bench_codebook.h"
+
+// benchmark suite of the feature engines, machine readable
+//      built by the root CMakeLists.txt, or
+//      g++ -O2 -march=native -pthread -DUSE_JPEG -I<vlfeat> -I../header -I../cli bench_suite.cpp -ljpeg
+//      bench_suite [options]
+//          --size HxW      synthetic image size, repeatable (240x320, 480x640, 960x1280)
+//          --image path    image file, repeatable, e.g. ../../test/test.jpg
+//          --threads list  comma separated thread numbers (1, 2, 4, .. up to the cores)
+//          --repeat n      measured calls per case (10), after one warm-up call
+//          --filter text   only cases whose name contains text
+//          --json          json lines instead of csv
+//          --baseline file csv of an earlier run; cases whose min time grew by more
+//                          than --tolerance (0.1) are flagged, and the exit code is 1
+//
+//      cases, on every input and thread number:
+//          pixel/Gray8N, pixel/Gray4N, pixel/Color         PixelFeature()
+//          coding/PixelHOG, coding/PixelHOGUoC             Coding() of Gray4N pixels
+//          coding/PixelLBP                                 Coding() of Gray8N pixels
+//          coding/FisherVector, coding/FisherVectorFloat   Coding() of hog patch features,
+//                                                          random gmm of 64 gaussians
+//          coding/VQ, coding/VQIndex                       Coding() of hog patch features,
+//                                                          1024 centers, 5 nearest, index probe 4
+//          coding/PQ                                       Coding() of hog patch features,
+//                                                          8 subspaces (fewer if they do not
+//                                                          divide the dimension) of 256 centers
+//          pooling/aggregate, pooling/pyramid              CodingAggregate() and
+//                                                          SpatialPyramidPooling() 1x1, 2x2, 3x1
+//          patch/HOG, patch/HOGUoC, patch/LBP              PatchFeature() end to end
+//          patch/pyramid                                   PatchFeaturePyramid() of patch/HOG,
+//                                                          scale 0.8, min size 50
+//          hog31                                           HOGFeature() of the color image, sbin 8
+//      items are pixels for pixel cases and pixel codings, cells for hog31, patches otherwise
+//
+//      csv columns: case, input, height, width, threads, repeat, items, mean_ms, min_ms,
+//      items_per_s (from min_ms), allocations per call
+
+#define SUITE_MAX_INPUT 32
+#define SUITE_MAX_THREAD 16
+#define SUITE_FV_BASE 64
+#define SUITE_VQ_BASE 1024
+#define SUITE_PQ_SUB 8
+#define SUITE_PQ_CENTER 256
+
+struct SuiteArgs
+{
+    FloatImage * img;
+    PixelFeatureOpt pixel_opt;
+    FloatImage pixel_feat;
+    FloatImage pixel_coord;
+    PatchFeatureOpt patch_opt;
+    FloatImage feat;
+    FloatImage coord;
+    CodingOpt coding_opt;
+    FloatSparseMatrix coding;
+    SpatialPyramidOpt pyramid;
+    float * pooled;
+    PyramidOpt pyra_opt;
+    FloatImage * level_feat;
+    FloatImage * level_coord;
+    HOGFeatureOpt hog_opt;
+    double hog_bins;
+    double vq_param[3];
+    double items;
+};
+
+// ***************************** //
+// setup shared by the cases
+
+void SuitePixel(SuiteArgs * args, const char * name)
+{
+    SetPixelFeature(&args->pixel_opt, name);
+    InitPixelFeature(args->img, &args->pixel_opt);
+    int npixel = args->pixel_opt.height * args->pixel_opt.width;
+    AllocateImage(&args->pixel_feat, args->pixel_opt.length, npixel, 1);
+    AllocateImage(&args->pixel_coord, args->pixel_opt.height, args->pixel_opt.width, 2);
+    PixelFeature(args->img, &args->pixel_feat, &args->pixel_coord, &args->pixel_opt);
+    args->items = npixel;
+}
+
+void SuitePatch(SuiteArgs * args, const char * pixel_name, const char * coding_name)
+{
+    PatchFeatureOpt * opt = &args->patch_opt;
+    opt->use_pixel_feature = true;
+    SetPixelFeature(&opt->pixel_opt, pixel_name);
+    SetCoding(&opt->pixel_coding_opt, coding_name);
+    opt->pixel_coding_opt.param = &args->hog_bins;
+    opt->pixel_coding_opt.nparam = 1;
+    opt->size_x = 16;
+    opt->size_y = 16;
+    opt->strip_width = -1;
+    InitPatchFeature(args->img, opt);
+    AllocateImage(&args->feat, opt->length, opt->height * opt->width, 1);
+    AllocateImage(&args->coord, opt->height, opt->width, 2);
+    PatchFeature(args->img, &args->feat, &args->coord, opt);
+    args->items = opt->height * opt->width;
+}
+
+void SuiteCoding(SuiteArgs * args, const char * name, FloatMatrix * data)
+{
+    SetCoding(&args->coding_opt, name);
+    args->coding_opt.param = &args->hog_bins;
+    args->coding_opt.nparam = 1;
+    if(strncmp(name, "FisherVector", 12) == 0)
+    {
+        srand(2);
+        RandomFisherVectorCodeBook(&args->coding_opt.fv_codebook, data->height, SUITE_FV_BASE);
+        args->coding_opt.param = NULL;
+        args->coding_opt.nparam = 0;
+    }
+    else if(strcmp(name, "VQ") == 0)
+    {
+        srand(2);
+        SampleVQCodeBook(&args->coding_opt.vq_codebook, data, SUITE_VQ_BASE);
+        args->coding_opt.param = args->vq_param;
+        args->coding_opt.nparam = 3;
+    }
+    else if(strcmp(name, "PQ") == 0)
+    {
+        srand(2);
+        int nSub = SUITE_PQ_SUB;
+        while(data->height % nSub != 0)
+            nSub--;
+        SamplePQCodeBook(&args->coding_opt.pq_codebook, data, nSub, SUITE_PQ_CENTER);
+        args->coding_opt.param = NULL;
+        args->coding_opt.nparam = 0;
+    }
+    InitCoding(&args->coding_opt);
+    AllocateSparseMatrix(&args->coding, args->coding_opt.length, data->width,
+            args->coding_opt.block_num, args->coding_opt.block_size);
+}
+
+// ***************************** //
+// cases
+
+void SetupPixelGray8N(SuiteArgs * args) { SuitePixel(args, "Gray8N"); }
+void SetupPixelGray4N(SuiteArgs * args) { SuitePixel(args, "Gray4N"); }
+void SetupPixelColor(SuiteArgs * args) { SuitePixel(args, "Color"); }
+
+void RunPixel(SuiteArgs * args)
+{
+    PixelFeature(args->img, &args->pixel_feat, &args->pixel_coord, &args->pixel_opt);
+}
+
+void SetupCodingPixelHOG(SuiteArgs * args)
+{
+    SuitePixel(args, "Gray4N");
+    SuiteCoding(args, "PixelHOG", &args->pixel_feat);
+}
+
+void SetupCodingPixelHOGUoC(SuiteArgs * args)
+{
+    SuitePixel(args, "Gray4N");
+    SuiteCoding(args, "PixelHOGUoC", &args->pixel_feat);
+}
+
+void SetupCodingPixelLBP(SuiteArgs * args)
+{
+    SuitePixel(args, "Gray8N");
+    SuiteCoding(args, "PixelLBP", &args->pixel_feat);
+}
+
+void RunPixelCoding(SuiteArgs * args)
+{
+    Coding(&args->pixel_feat, &args->coding, &args->coding_opt);
+}
+
+void SetupCodingFisherVector(SuiteArgs * args)
+{
+    SuitePatch(args, "Gray4N", "PixelHOG");
+    SuiteCoding(args, "FisherVector", &args->feat);
+}
+
+void SetupCodingFisherVectorFloat(SuiteArgs * args)
+{
+    SuitePatch(args, "Gray4N", "PixelHOG");
+    SuiteCoding(args, "FisherVectorFloat", &args->feat);
+}
+
+void SetupCodingVQ(SuiteArgs * args)
+{
+    SuitePatch(args, "Gray4N", "PixelHOG");
+    args->vq_param[0] = 5;
+    args->vq_param[1] = 0;
+    args->vq_param[2] = 0;
+    SuiteCoding(args, "VQ", &args->feat);
+}
+
+void SetupCodingVQIndex(SuiteArgs * args)
+{
+    SuitePatch(args, "Gray4N", "PixelHOG");
+    args->vq_param[0] = 5;
+    args->vq_param[1] = 0;
+    args->vq_param[2] = 4;
+    SuiteCoding(args, "VQ", &args->feat);
+}
+
+void SetupCodingPQ(SuiteArgs * args)
+{
+    SuitePatch(args, "Gray4N", "PixelHOG");
+    SuiteCoding(args, "PQ", &args->feat);
+}
+
+void RunPatchCoding(SuiteArgs * args)
+{
+    Coding(&args->feat, &args->coding, &args->coding_opt);
+}
+
+void SetupPoolingAggregate(SuiteArgs * args)
+{
+    SetupCodingFisherVector(args);
+    args->pooled = new float[args->coding_opt.length];
+}
+
+void RunPoolingAggregate(SuiteArgs * args)
+{
+    CodingAggregate(&args->feat, args->pooled, &args->coding_opt, CODING_NORM_POWER | CODING_NORM_L2);
+}
+
+void SetupPoolingPyramid(SuiteArgs * args)
+{
+    SetupCodingFisherVector(args);
+    int grid_x[3] = {1, 2, 3}, grid_y[3] = {1, 2, 1};
+    InitSpatialPyramid(&args->pyramid, grid_x, grid_y, 3, args->img->height, args->img->width);
+    args->pooled = new float[args->coding_opt.length * args->pyramid.ncell];
+}
+
+void RunPoolingPyramid(SuiteArgs * args)
+{
+    SpatialPyramidPooling(&args->feat, args->coord.p, args->pooled, &args->coding_opt, &args->pyramid,
+            CODING_NORM_POWER | CODING_NORM_L2);
+}
+
+void SetupPatchHOG(SuiteArgs * args) { SuitePatch(args, "Gray4N", "PixelHOG"); }
+void SetupPatchHOGUoC(SuiteArgs * args) { SuitePatch(args, "Gray4N", "PixelHOGUoC"); }
+void SetupPatchLBP(SuiteArgs * args) { SuitePatch(args, "Gray8N", "PixelLBP"); }
+
+void RunPatch(SuiteArgs * args)
+{
+    PatchFeature(args->img, &args->feat, &args->coord, &args->patch_opt);
+}
+
+void SetupPatchPyramid(SuiteArgs * args)
+{
+    SetupPatchHOG(args);
+    args->pyra_opt.scale = 0.8;
+    args->pyra_opt.min_size = 50;
+    InitPatchFeaturePyramid(args->img, &args->patch_opt, &args->pyra_opt);
+    int level_num = args->pyra_opt.level_num;
+    args->level_feat = new FloatImage[level_num];
+    args->level_coord = new FloatImage[level_num];
+    args->items = 0;
+    for(int k=0; k<level_num; k++)
+    {
+        PatchFeatureOpt * opt = &args->pyra_opt.levels[k].opt;
+        AllocateImage(args->level_feat + k, opt->length, opt->height * opt->width, 1);
+        AllocateImage(args->level_coord + k, opt->height, opt->width, 2);
+        args->items += opt->height * opt->width;
+    }
+}
+
+void RunPatchPyramid(SuiteArgs * args)
+{
+    PatchFeaturePyramid(args->img, args->level_feat, args->level_coord, &args->pyra_opt);
+}
+
+void SetupHOG31(SuiteArgs * args)
+{
+    args->hog_opt.sbin = 8;
+    InitHOGFeature(args->img, &args->hog_opt);
+    AllocateImage(&args->feat, args->hog_opt.height, args->hog_opt.width, args->hog_opt.length);
+    args->items = args->hog_opt.height * args->hog_opt.width;
+}
+
+void RunHOG31(SuiteArgs * args)
+{
+    HOGFeature(args->img, &args->feat, &args->hog_opt);
+}
+
+void FreeSuite(SuiteArgs * args)
+{
+    for(int k=0; k<args->pyra_opt.level_num; k++)
+    {
+        FreeImage(args->level_feat + k);
+        FreeImage(args->level_coord + k);
+    }
+    if(args->pyra_opt.level_num > 0)
+        FreePatchFeaturePyramid(&args->pyra_opt);
+    delete[] args->level_feat;
+    delete[] args->level_coord;
+    if(args->hog_opt.sbin > 0)
+        FreeImage(&args->feat);
+    if(args->pixel_feat.p != NULL)
+    {
+        FreeImage(&args->pixel_feat);
+        FreeImage(&args->pixel_coord);
+    }
+    if(args->patch_opt.use_pixel_feature)
+    {
+        FreePatchFeature(&args->patch_opt);
+        FreeImage(&args->feat);
+        FreeImage(&args->coord);
+    }
+    if(args->coding.p != NULL)
+    {
+        FreeCoding(&args->coding_opt);
+        FreeSparseMatrix(&args->coding);
+    }
+    if(args->pyramid.nlayout > 0)
+        FreeSpatialPyramid(&args->pyramid);
+    delete[] args->pooled;
+}
+
+struct SuiteCase
+{
+    const char * name;
+    int depth;
+    void (*setup)(SuiteArgs * args);
+    void (*run)(SuiteArgs * args);
+};
+
+static const SuiteCase SuiteCases[] =
+{
+    {"pixel/Gray8N", 1, SetupPixelGray8N, RunPixel},
+    {"pixel/Gray4N", 1, SetupPixelGray4N, RunPixel},
+    {"pixel/Color", 3, SetupPixelColor, RunPixel},
+    {"coding/PixelHOG", 1, SetupCodingPixelHOG, RunPixelCoding},
+    {"coding/PixelHOGUoC", 1, SetupCodingPixelHOGUoC, RunPixelCoding},
+    {"coding/PixelLBP", 1, SetupCodingPixelLBP, RunPixelCoding},
+    {"coding/FisherVector", 1, SetupCodingFisherVector, RunPatchCoding},
+    {"coding/FisherVectorFloat", 1, SetupCodingFisherVectorFloat, RunPatchCoding},
+    {"coding/VQ", 1, SetupCodingVQ, RunPatchCoding},
+    {"coding/VQIndex", 1, SetupCodingVQIndex, RunPatchCoding},
+    {"coding/PQ", 1, SetupCodingPQ, RunPatchCoding},
+    {"pooling/aggregate", 1, SetupPoolingAggregate, RunPoolingAggregate},
+    {"pooling/pyramid", 1, SetupPoolingPyramid, RunPoolingPyramid},
+    {"patch/HOG", 1, SetupPatchHOG, RunPatch},
+    {"patch/HOGUoC", 1, SetupPatchHOGUoC, RunPatch},
+    {"patch/LBP", 1, SetupPatchLBP, RunPatch},
+    {"patch/pyramid", 1, SetupPatchPyramid, RunPatchPyramid},
+    {"hog31", 3, SetupHOG31, RunHOG31},
+    {NULL, 0, NULL, NULL}
+};
+
+// ***************************** //
+// inputs and results
+
+// a synthetic image (path NULL) or an image file, in gray and color
+struct SuiteInput
+{
+    const char * path;
+    int height, width;
+    FloatImage img[2];
+    bool loaded;
+};
+
+// smooth random uint8 planes, so gradients and lbp codes are not all noise
+void SyntheticImage(FloatImage * img, int height, int width, int depth)
+{
+    AllocateTypedImage(img, height, width, depth, IMAGE_UINT8);
+    unsigned char * p = (unsigned char *)img->p;
+    srand(1);
+    for(int c=0; c<depth; c++)
+        for(int x=0; x<width; x++)
+            for(int y=0; y<height; y++)
+            {
+                double v = 128 + 60*sin(0.05*x + 0.3*c) * cos(0.07*y) + (rand() % 64) - 32;
+                p[((size_t)c*width + x)*height + y] = (unsigned char)MIN(MAX(v, 0.0), 255.0);
+            }
+}
+
+bool LoadSuiteInput(SuiteInput * input)
+{
+    if(input->path == NULL)
+    {
+        SyntheticImage(input->img, input->height, input->width, 1);
+        SyntheticImage(input->img + 1, input->height, input->width, 3);
+    }
+    else
+    {
+        if(!ReadImageFile(input->path, 1, input->img))
+            return false;
+        ReadImageFile(input->path, 3, input->img + 1);
+        input->height = input->img[0].height;
+        input->width = input->img[0].width;
+    }
+    input->loaded = true;
+    return true;
+}
+
+// min time of a case in a baseline csv, 0 if absent
+double BaselineMin(FILE * file, const char * name, const char * input, const SuiteInput * size, int threads)
+{
+    if(file == NULL)
+        return 0;
+    rewind(file);
+    char line[1024];
+    while(fgets(line, sizeof(line), file) != NULL)
+    {
+        char line_name[256], line_input[512];
+        int height, width, line_threads, repeat;
+        double items, mean_ms, min_ms;
+        if(sscanf(line, "%255[^,],%511[^,],%d,%d,%d,%d,%lf,%lf,%lf", line_name, line_input, &height, &width,
+                &line_threads, &repeat, &items, &mean_ms, &min_ms) == 9
+                && strcmp(line_name, name) == 0 && strcmp(line_input, input) == 0 && line_threads == threads
+                && height == size->height && width == size->width)
+            return min_ms;
+    }
+    return 0;
+}
+
+int ParseThreads(const char * text, int * threads)
+{
+    int n = 0;
+    while(*text != 0 && n < SUITE_MAX_THREAD)
+    {
+        threads[n++] = atoi(text);
+        const char * comma = strchr(text, ',');
+        if(comma == NULL)
+            break;
+        text = comma + 1;
+    }
+    return n;
+}
+
+int main(int argc, char ** argv)
+{
+    SuiteInput inputs[SUITE_MAX_INPUT];
+    int ninput = 0;
+    int threads[SUITE_MAX_THREAD];
+    int nthread = 0;
+    int repeat = 10;
+    const char * filter = NULL;
+    const char * baseline_path = NULL;
+    double tolerance = 0.1;
+    bool json = false;
+    memset(inputs, 0, sizeof(inputs));
+
+    for(int i=1; i<argc; i++)
+    {
+        bool has_value = i+1 < argc;
+        if(strcmp(argv[i], "--size") == 0 && has_value && ninput < SUITE_MAX_INPUT)
+        {
+            SuiteInput * input = inputs + ninput++;
+            if(sscanf(argv[++i], "%dx%d", &input->height, &input->width) != 2)
+                input->height = input->width = 0;
+        }
+        else if(strcmp(argv[i], "--image") == 0 && has_value && ninput < SUITE_MAX_INPUT)
+            inputs[ninput++].path = argv[++i];
+        else if(strcmp(argv[i], "--threads") == 0 && has_value)
+            nthread = ParseThreads(argv[++i], threads);
+        else if(strcmp(argv[i], "--repeat") == 0 && has_value)
+            repeat = MAX(atoi(argv[++i]), 1);
+        else if(strcmp(argv[i], "--filter") == 0 && has_value)
+            filter = argv[++i];
+        else if(strcmp(argv[i], "--baseline") == 0 && has_value)
+            baseline_path = argv[++i];
+        else if(strcmp(argv[i], "--tolerance") == 0 && has_value)
+            tolerance = atof(argv[++i]);
+        else if(strcmp(argv[i], "--json") == 0)
+            json = true;
+        else
+        {
+            fprintf(stderr, "unknown option %s, see the comment of bench_suite.cpp\n", argv[i]);
+            return 2;
+        }
+    }
+    if(ninput == 0)
+    {
+        int sizes[3][2] = {{240, 320}, {480, 640}, {960, 1280}};
+        for(int k=0; k<3; k++)
+        {
+            inputs[ninput].height = sizes[k][0];
+            inputs[ninput++].width = sizes[k][1];
+        }
+    }
+    if(nthread == 0)
+        for(int t=1; t<ThreadCoreCount()*2 && nthread < SUITE_MAX_THREAD; t*=2)
+            threads[nthread++] = MIN(t, ThreadCoreCount());
+
+    FILE * baseline = baseline_path != NULL ? fopen(baseline_path, "r") : NULL;
+    if(baseline_path != NULL && baseline == NULL)
+        fprintf(stderr, "cannot open baseline %s\n", baseline_path);
+    int regressions = 0;
+
+    if(!json)
+        printf("case,input,height,width,threads,repeat,items,mean_ms,min_ms,items_per_s,allocations\n");
+    for(int k=0; k<ninput; k++)
+    {
+        SuiteInput * input = inputs + k;
+        if((input->path == NULL && (input->height < 16 || input->width < 16)) || !LoadSuiteInput(input))
+        {
+            fprintf(stderr, "skipping input %d, bad size or unreadable image\n", k);
+            continue;
+        }
+        char input_name[512];
+        if(input->path != NULL)
+            snprintf(input_name, sizeof(input_name), "%s", input->path);
+        else
+            snprintf(input_name, sizeof(input_name), "synthetic");
+
+        for(const SuiteCase * c = SuiteCases; c->name != NULL; c++)
+        {
+            if(filter != NULL && strstr(c->name, filter) == NULL)
+                continue;
+            for(int t=0; t<nthread; t++)
+            {
+                // options are set up after SetThreadNum(), per worker buffers follow it
+                SetThreadNum(threads[t]);
+                SuiteArgs args;
+                memset(&args, 0, sizeof(SuiteArgs));
+                args.img = input->img + (c->depth == 3 ? 1 : 0);
+                args.hog_bins = 18;
+                c->setup(&args);
+                BenchResult r = BenchRun(c->name, c->run, &args, repeat);
+                FreeSuite(&args);
+
+                double min_ms = 1000 * r.min_seconds;
+                double items_per_s = r.min_seconds > 0 ? args.items / r.min_seconds : 0;
+                double allocations = (double)r.allocations / repeat;
+                if(json)
+                    printf("{\"case\": \"%s\", \"input\": \"%s\", \"height\": %d, \"width\": %d, \"threads\": %d, "
+                            "\"repeat\": %d, \"items\": %.0f, \"mean_ms\": %.4f, \"min_ms\": %.4f, "
+                            "\"items_per_s\": %.0f, \"allocations\": %.1f}\n",
+                            c->name, input_name, input->height, input->width, ThreadNum(), repeat,
+                            args.items, 1000 * r.seconds, min_ms, items_per_s, allocations);
+                else
+                    printf("%s,%s,%d,%d,%d,%d,%.0f,%.4f,%.4f,%.0f,%.1f\n", c->name, input_name,
+                            input->height, input->width, ThreadNum(), repeat, args.items,
+                            1000 * r.seconds, min_ms, items_per_s, allocations);
+                fflush(stdout);
+
+                double base_ms = BaselineMin(baseline, c->name, input_name, input, ThreadNum());
+                if(base_ms > 0 && min_ms > base_ms * (1 + tolerance))
+                {
+                    fprintf(stderr, "regression: %s, %s, %d threads: %.4f ms against %.4f ms\n",
+                            c->name, input_name, ThreadNum(), min_ms, base_ms);
+                    regressions++;
+                }
+            }
+        }
+        FreeImage(input->img);
+        FreeImage(input->img + 1);
+    }
+
+    if(baseline != NULL)
+        fclose(baseline);
+    return regressions == 0 ? 0 : 1;
+}
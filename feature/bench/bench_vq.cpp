@@ -0,0 +1,112 @@
+#include <vl/mathop.h>
+#include <math.h>
+#include <string.h>
+#include "coding.h"
+#include "bench.h"
+#include "bench_codebook.h"
+
+// vq coding: batched search against the per-descriptor loop, and the recall / speed
+// of the center index against exhaustive search
+//      g++ -O2 -I<vlfeat> -I../header bench_vq.cpp -o bench_vq
+//      bench_vq [center number] [descriptor number] [knn]
+// descriptors are sampled from a random gmm of 256 gaussians in 128 dimensions,
+// centers are drawn around its means; for each probe setting it prints the time
+// and the fraction of exhaustive nearest centers found
+
+struct VQBenchArgs
+{
+    FloatMatrix data;
+    FloatSparseMatrix coding;
+    CodingOpt opt;
+};
+
+void RunVQCoding(VQBenchArgs * args)
+{
+    Coding(&args->data, &args->coding, &args->opt);
+}
+
+// per-descriptor loop, as coding without the batch kernel
+void RunVQSingle(VQBenchArgs * args)
+{
+    int block_num = args->opt.block_num;
+    for(int n=0; n<args->data.width; n++)
+        FuncCodingVQ(args->data.p + n*args->data.height, args->coding.p + n*block_num,
+                args->coding.i + n*block_num, &args->opt);
+}
+
+void InitVQBench(VQBenchArgs * args, const VQCodeBook * cb, const FloatMatrix * data, double * param)
+{
+    memset(&args->opt, 0, sizeof(CodingOpt));
+    SetCoding(&args->opt, "VQ");
+    args->opt.vq_codebook = *cb;
+    args->opt.param = param;
+    args->opt.nparam = 4;
+    InitCoding(&args->opt);
+    args->data = *data;
+    AllocateSparseMatrix(&args->coding, args->opt.length, data->width, args->opt.block_num, args->opt.block_size);
+}
+
+void FreeVQBench(VQBenchArgs * args)
+{
+    FreeCoding(&args->opt);
+    FreeSparseMatrix(&args->coding);
+}
+
+int main(int argc, char ** argv)
+{
+    int nBase = argc > 1 ? atoi(argv[1]) : 4096;
+    int n = argc > 2 ? atoi(argv[2]) : 5000;
+    int knn = argc > 3 ? atoi(argv[3]) : 1;
+    srand(1);
+
+    FisherVectorCodeBook gmm;
+    RandomFisherVectorCodeBook(&gmm, 128, 256);
+    FloatMatrix data;
+    AllocateImage(&data, gmm.nDim, n, 1);
+    SampleFisherVectorData(&gmm, &data);
+    VQCodeBook cb;
+    RandomVQCodeBook(&cb, &gmm, nBase);
+
+    // exhaustive reference, batched and per descriptor
+    double param[4] = {(double)knn, 0, 0, 0};
+    VQBenchArgs exact;
+    InitVQBench(&exact, &cb, &data, param);
+    BenchResult r = BenchRun("exhaustive batched", RunVQCoding, &exact, 3);
+    BenchPrint(&r);
+
+    VQBenchArgs single;
+    InitVQBench(&single, &cb, &data, param);
+    r = BenchRun("exhaustive per descriptor", RunVQSingle, &single, 1);
+    BenchPrint(&r);
+    long same = 0;
+    for(int j=0; j<n*knn; j++)
+        same += exact.coding.i[j] == single.coding.i[j];
+    printf("%-32s same bins %.4f\n", "", same / (double)(n*knn));
+    FreeVQBench(&single);
+
+    int nCluster = (int)(sqrt((double)nBase) + 0.5);
+    for(int probe=1; probe<=nCluster; probe*=2)
+    {
+        double index_param[4] = {(double)knn, 0, (double)probe, (double)nCluster};
+        VQBenchArgs args;
+        InitVQBench(&args, &cb, &data, index_param);
+
+        char name[64];
+        sprintf(name, "index probe %d of %d", probe, nCluster);
+        r = BenchRun(name, RunVQCoding, &args, 3);
+        BenchPrint(&r);
+
+        // recall of the exact bins
+        long found = 0;
+        for(int j=0; j<n; j++)
+            for(int i=0; i<knn; i++)
+                for(int e=0; e<knn; e++)
+                    found += (exact.coding.i[j*knn + e] == args.coding.i[j*knn + i]);
+        printf("%-32s %d-nn recall %.4f\n", "", knn, found / (double)(n*knn));
+        FreeVQBench(&args);
+    }
+
+    FreeVQBench(&exact);
+    FreeImage(&data);
+    return 0;
+}
@@ -0,0 +1,509 @@
+#include <vl/mathop.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "batch.h"
+#include "codebook_io.h"
+#include "feature_store.h"
+#include "image_io.h"
+
+// ***************************** //
+// native batch extractor
+//      extract_feature -c config [-b codebook] [-o output] [-t threads] [--half] input
+//      input: a directory (its .jpg, .jpeg, .pgm, .ppm, .pnm files in name order)
+//      or a text file with one image path per line.
+//      codebook: a codebook file or a raw gmm file, a vq file for VQ or a pq file for PQ,
+//      see codebook_io.h
+//      images go through the pipeline of batch.h on all cores.
+//
+//      config, one "key values" per line, # starts a comment:
+//          pixel_feature Gray4N        pixel feature name, as pixel_opt.name
+//          pixel_coding PixelHOG       pixel coding name, as pixel_coding_opt.name
+//          pixel_coding_param 18       pixel coding parameters
+//          patch_size 16 16            size_x size_y, at least 2 so the patch step is positive
+//          strip_width -1              as opt.strip_width
+//          coding FisherVector         patch coding, fisher vectors, VQ and PQ need -b;
+//                                      none writes the patch features
+//          coding_param 8              patch coding parameters
+//          normalize 3                 0 none, 1 power, 2 l2, 3 power and l2
+//          grid 1 1 2 2                spatial pyramid, pairs of positive cells in x and y
+//          output pooled               pooled, or codes for the sparse code of each patch
+//          precision float             float, or half for fp16 output, as --half
+//          thread_num 0                workers, 0 for the core count, as -t
+//
+//      output (features.bin by default) is a feature store, see feature_store.h,
+//      written as the images complete and indexed by the image number of the input.
+//      coded images have rows = coding length and one column per pyramid cell,
+//      patch features and codes have one column per patch; codes are block sparse
+//      records. unreadable images have empty records, their paths are reported on
+//      stderr and the exit code is 1 if any
+
+#define EXTRACT_MAX_PARAM 16
+#define EXTRACT_MAX_LAYOUT 16
+#define EXTRACT_LINE 4096
+
+struct ExtractConfig
+{
+    char pixel_feature[64];
+    char pixel_coding[64];
+    double pixel_coding_param[EXTRACT_MAX_PARAM];
+    int pixel_coding_nparam;
+    int size_x, size_y;
+    int strip_width;
+    char coding[64];
+    double coding_param[EXTRACT_MAX_PARAM];
+    int coding_nparam;
+    int normalize;
+    int nlayout;
+    int grid_x[EXTRACT_MAX_LAYOUT];
+    int grid_y[EXTRACT_MAX_LAYOUT];
+    bool sparse_codes;
+    bool half;
+    int thread_num;
+};
+
+// name after a key
+bool ReadConfigName(const char * text, char * name)
+{
+    char value[64];
+    if(sscanf(text, " %63s", value) != 1)
+        return false;
+    strcpy(name, value);
+    return true;
+}
+
+// numbers after a key, at most max
+int ReadConfigNumbers(const char * text, double * value, int max)
+{
+    int n = 0;
+    char * end;
+    while(n < max)
+    {
+        double v = strtod(text, &end);
+        if(end == text)
+            break;
+        value[n++] = v;
+        text = end;
+    }
+    return n;
+}
+
+bool ReadExtractConfig(const char * path, ExtractConfig * config)
+{
+    memset(config, 0, sizeof(ExtractConfig));
+    strcpy(config->pixel_feature, "Gray4N");
+    strcpy(config->pixel_coding, "PixelHOG");
+    config->pixel_coding_param[0] = 18;
+    config->pixel_coding_nparam = 1;
+    config->size_x = 16;
+    config->size_y = 16;
+    config->strip_width = STRIP_WIDTH_DEFAULT;
+    strcpy(config->coding, "none");
+
+    FILE * file = fopen(path, "r");
+    if(file == NULL)
+    {
+        fprintf(stderr, "cannot open config %s\n", path);
+        return false;
+    }
+
+    char line[EXTRACT_LINE];
+    int line_num = 0;
+    bool ok = true;
+    while(ok && fgets(line, EXTRACT_LINE, file) != NULL)
+    {
+        line_num++;
+        char * comment = strchr(line, '#');
+        if(comment != NULL)
+            *comment = 0;
+        char key[64];
+        int used;
+        if(sscanf(line, " %63s%n", key, &used) != 1)
+            continue;
+        const char * rest = line + used;
+
+        double value[2*EXTRACT_MAX_LAYOUT];
+        if(strcmp(key, "pixel_feature") == 0)
+            ok = ReadConfigName(rest, config->pixel_feature);
+        else if(strcmp(key, "pixel_coding") == 0)
+            ok = ReadConfigName(rest, config->pixel_coding);
+        else if(strcmp(key, "coding") == 0)
+            ok = ReadConfigName(rest, config->coding);
+        else if(strcmp(key, "pixel_coding_param") == 0)
+            config->pixel_coding_nparam = ReadConfigNumbers(rest, config->pixel_coding_param, EXTRACT_MAX_PARAM);
+        else if(strcmp(key, "coding_param") == 0)
+            config->coding_nparam = ReadConfigNumbers(rest, config->coding_param, EXTRACT_MAX_PARAM);
+        else if(strcmp(key, "patch_size") == 0)
+        {
+            ok = ReadConfigNumbers(rest, value, 2) == 2 && value[0] >= 2 && value[1] >= 2;
+            if(ok)
+            {
+                config->size_x = (int)value[0];
+                config->size_y = (int)value[1];
+            }
+        }
+        else if(strcmp(key, "strip_width") == 0)
+        {
+            ok = ReadConfigNumbers(rest, value, 1) == 1;
+            if(ok)
+                config->strip_width = (int)value[0];
+        }
+        else if(strcmp(key, "normalize") == 0)
+        {
+            ok = ReadConfigNumbers(rest, value, 1) == 1;
+            if(ok)
+                config->normalize = (int)value[0];
+        }
+        else if(strcmp(key, "output") == 0)
+        {
+            char name[64];
+            ok = ReadConfigName(rest, name) && (strcmp(name, "pooled") == 0 || strcmp(name, "codes") == 0);
+            config->sparse_codes = ok && strcmp(name, "codes") == 0;
+        }
+        else if(strcmp(key, "precision") == 0)
+        {
+            char name[64];
+            ok = ReadConfigName(rest, name) && (strcmp(name, "float") == 0 || strcmp(name, "half") == 0);
+            config->half = ok && strcmp(name, "half") == 0;
+        }
+        else if(strcmp(key, "thread_num") == 0)
+        {
+            ok = ReadConfigNumbers(rest, value, 1) == 1;
+            if(ok)
+                config->thread_num = (int)value[0];
+        }
+        else if(strcmp(key, "grid") == 0)
+        {
+            int n = ReadConfigNumbers(rest, value, 2*EXTRACT_MAX_LAYOUT);
+            ok = n > 0 && n % 2 == 0;
+            config->nlayout = n / 2;
+            for(int l=0; l<config->nlayout; l++)
+            {
+                ok = ok && value[2*l] >= 1 && value[2*l+1] >= 1;
+                config->grid_x[l] = (int)value[2*l];
+                config->grid_y[l] = (int)value[2*l+1];
+            }
+        }
+        else
+            ok = false;
+    }
+    fclose(file);
+
+    if(!ok)
+        fprintf(stderr, "%s:%d: bad config line\n", path, line_num);
+    return ok;
+}
+
+// ***************************** //
+// inputs
+
+struct ImageList
+{
+    char ** path;
+    int num;
+    int capacity;
+};
+
+void AddImagePath(ImageList * list, const char * path)
+{
+    if(list->num == list->capacity)
+    {
+        int capacity = MAX(2*list->capacity, 256);
+        char ** grown = ALLOCATE(char *, capacity);
+        if(list->num > 0)
+            memcpy(grown, list->path, sizeof(char *) * list->num);
+        if(list->path != NULL)
+            FREE(list->path);
+        list->path = grown;
+        list->capacity = capacity;
+    }
+    size_t len = strlen(path);
+    list->path[list->num] = ALLOCATE(char, len+1);
+    memcpy(list->path[list->num], path, len+1);
+    list->num++;
+}
+
+void FreeImageList(ImageList * list)
+{
+    for(int i=0; i<list->num; i++)
+        FREE(list->path[i]);
+    if(list->path != NULL)
+        FREE(list->path);
+    list->num = 0;
+}
+
+bool IsImageName(const char * name)
+{
+    const char * dot = strrchr(name, '.');
+    if(dot == NULL)
+        return false;
+    char ext[8];
+    int n = 0;
+    for(dot++; *dot != 0 && n < 7; dot++)
+        ext[n++] = (char)tolower(*dot);
+    ext[n] = 0;
+    return strcmp(ext, "jpg") == 0 || strcmp(ext, "jpeg") == 0 || strcmp(ext, "pgm") == 0
+            || strcmp(ext, "ppm") == 0 || strcmp(ext, "pnm") == 0;
+}
+
+int ComparePath(const void * a, const void * b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+// images of a directory in name order, or the lines of a list file
+bool ReadImageList(const char * input, ImageList * list)
+{
+    memset(list, 0, sizeof(ImageList));
+    struct stat info;
+    if(stat(input, &info) != 0)
+    {
+        fprintf(stderr, "cannot open input %s\n", input);
+        return false;
+    }
+
+    char path[EXTRACT_LINE];
+    if(S_ISDIR(info.st_mode))
+    {
+        DIR * dir = opendir(input);
+        if(dir == NULL)
+            return false;
+        struct dirent * entry;
+        while((entry = readdir(dir)) != NULL)
+            if(IsImageName(entry->d_name))
+            {
+                snprintf(path, EXTRACT_LINE, "%s/%s", input, entry->d_name);
+                AddImagePath(list, path);
+            }
+        closedir(dir);
+        qsort(list->path, list->num, sizeof(char *), ComparePath);
+        return true;
+    }
+
+    FILE * file = fopen(input, "r");
+    if(file == NULL)
+        return false;
+    while(fgets(path, EXTRACT_LINE, file) != NULL)
+    {
+        size_t len = strlen(path);
+        while(len > 0 && (path[len-1] == '\n' || path[len-1] == '\r' || path[len-1] == ' '))
+            path[--len] = 0;
+        if(len > 0)
+            AddImagePath(list, path);
+    }
+    fclose(file);
+    return true;
+}
+
+// ***************************** //
+// pipeline callbacks
+
+struct ExtractArgs
+{
+    ImageList * list;
+    int depth;
+    FeatureStoreWriter * store;
+    int failed;
+};
+
+bool ExtractLoad(void * args_in, int index, FloatImage * img)
+{
+    ExtractArgs * args = (ExtractArgs *)args_in;
+    return ReadImageFile(args->list->path[index], args->depth, img);
+}
+
+// called under the sink lock of the pipeline
+void ExtractSink(void * args_in, int index, const FloatMatrix * feat)
+{
+    ExtractArgs * args = (ExtractArgs *)args_in;
+    if(feat == NULL)
+    {
+        fprintf(stderr, "cannot read %s\n", args->list->path[index]);
+        args->failed++;
+    }
+    AppendDenseFeature(args->store, index, feat);
+}
+
+void ExtractSparseSink(void * args_in, int index, const FloatSparseMatrix * codes)
+{
+    ExtractArgs * args = (ExtractArgs *)args_in;
+    if(codes == NULL)
+    {
+        fprintf(stderr, "cannot read %s\n", args->list->path[index]);
+        args->failed++;
+        AppendDenseFeature(args->store, index, NULL);
+    }
+    else
+        AppendSparseFeature(args->store, index, codes);
+}
+
+// ***************************** //
+
+void PrintUsage()
+{
+    fprintf(stderr, "usage: extract_feature -c config [-b codebook] [-o output] [-t threads] [--half] "
+            "<image directory | image list>\n");
+}
+
+int main(int argc, char ** argv)
+{
+    const char * config_path = NULL;
+    const char * codebook_path = NULL;
+    const char * output_path = "features.bin";
+    const char * input = NULL;
+    int thread_num = -1;
+    bool half = false;
+    for(int i=1; i<argc; i++)
+    {
+        if(strcmp(argv[i], "-c") == 0 && i+1 < argc)
+            config_path = argv[++i];
+        else if(strcmp(argv[i], "-b") == 0 && i+1 < argc)
+            codebook_path = argv[++i];
+        else if(strcmp(argv[i], "-o") == 0 && i+1 < argc)
+            output_path = argv[++i];
+        else if(strcmp(argv[i], "-t") == 0 && i+1 < argc)
+            thread_num = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--half") == 0)
+            half = true;
+        else if(argv[i][0] != '-' && input == NULL)
+            input = argv[i];
+        else
+        {
+            PrintUsage();
+            return 2;
+        }
+    }
+    if(config_path == NULL || input == NULL)
+    {
+        PrintUsage();
+        return 2;
+    }
+
+    ExtractConfig config;
+    if(!ReadExtractConfig(config_path, &config))
+        return 2;
+    SetThreadNum(thread_num >= 0 ? thread_num : config.thread_num);
+    half = half || config.half;
+
+    // options; names and parameters stay in config for the whole run
+    BatchOpt opt;
+    memset(&opt, 0, sizeof(BatchOpt));
+    PatchFeatureOpt * patch_opt = &opt.patch_opt;
+    patch_opt->use_pixel_feature = true;
+    patch_opt->size_x = config.size_x;
+    patch_opt->size_y = config.size_y;
+    patch_opt->strip_width = config.strip_width;
+    patch_opt->pixel_opt.name = config.pixel_feature;
+    patch_opt->pixel_coding_opt.name = config.pixel_coding;
+    patch_opt->pixel_coding_opt.param = config.pixel_coding_param;
+    patch_opt->pixel_coding_opt.nparam = config.pixel_coding_nparam;
+    if(!SetPixelFeature(&patch_opt->pixel_opt, config.pixel_feature)
+            || !SetCoding(&patch_opt->pixel_coding_opt, config.pixel_coding))
+    {
+        fprintf(stderr, "unknown pixel feature %s or pixel coding %s\n", config.pixel_feature, config.pixel_coding);
+        return 2;
+    }
+
+    opt.use_coding = strcmp(config.coding, "none") != 0;
+    bool use_codebook = false;
+    bool use_vq_codebook = false;
+    bool use_pq_codebook = false;
+    MappedFile codebook_map;
+    memset(&codebook_map, 0, sizeof(MappedFile));
+    if(opt.use_coding)
+    {
+        opt.coding_opt.name = config.coding;
+        opt.coding_opt.param = config.coding_param;
+        opt.coding_opt.nparam = config.coding_nparam;
+        if(!SetCoding(&opt.coding_opt, config.coding))
+        {
+            fprintf(stderr, "unknown coding %s\n", config.coding);
+            return 2;
+        }
+        use_codebook = strstr(config.coding, "FisherVector") != NULL;
+        use_vq_codebook = strstr(config.coding, "VQ") != NULL;
+        if(use_vq_codebook && (codebook_path == NULL
+                || !ReadVQCodeBookFile(codebook_path, &opt.coding_opt.vq_codebook)))
+        {
+            fprintf(stderr, "coding %s needs a valid vq codebook, -b\n", config.coding);
+            return 2;
+        }
+        use_pq_codebook = strstr(config.coding, "PQ") != NULL;
+        if(use_pq_codebook && (codebook_path == NULL
+                || !ReadPQCodeBookFile(codebook_path, &opt.coding_opt.pq_codebook)))
+        {
+            fprintf(stderr, "coding %s needs a valid pq codebook, -b\n", config.coding);
+            return 2;
+        }
+        if(use_codebook && (codebook_path == NULL
+                || (!MapFisherVectorCodeBookFile(&codebook_map, codebook_path, &opt.coding_opt.fv_codebook)
+                && !ReadFisherVectorCodeBookFile(codebook_path, &opt.coding_opt.fv_codebook))))
+        {
+            fprintf(stderr, "coding %s needs a valid codebook, -b\n", config.coding);
+            return 2;
+        }
+        const char * error = CodingOptError(&opt.coding_opt);
+        if(error != NULL)
+        {
+            fprintf(stderr, "coding %s: %s\n", config.coding, error);
+            return 2;
+        }
+    }
+    if(config.sparse_codes && !opt.use_coding)
+    {
+        fprintf(stderr, "output codes needs a coding\n");
+        return 2;
+    }
+    opt.sparse_codes = config.sparse_codes;
+    opt.nlayout = config.nlayout;
+    opt.grid_x = config.grid_x;
+    opt.grid_y = config.grid_y;
+    opt.normalize = config.normalize;
+
+    // image planes asked for by the pixel feature
+    PixelFeatureOpt pixel_opt = patch_opt->pixel_opt;
+    pixel_opt.func_init(&pixel_opt);
+
+    ImageList list;
+    if(!ReadImageList(input, &list))
+        return 2;
+
+    ExtractArgs args;
+    args.list = &list;
+    args.depth = pixel_opt.image_depth;
+    args.failed = 0;
+    FeatureStoreWriter store;
+    args.store = &store;
+    if(!OpenFeatureStore(&store, output_path, half ? FEATURE_STORE_HALF : FEATURE_STORE_FLOAT))
+    {
+        fprintf(stderr, "cannot write %s\n", output_path);
+        return 2;
+    }
+
+    opt.func_load = ExtractLoad;
+    opt.func_sink = ExtractSink;
+    opt.func_sparse_sink = ExtractSparseSink;
+    opt.args = &args;
+    double t0 = ThreadClock();
+    BatchFeature(list.num, &opt);
+    double seconds = ThreadClock() - t0;
+
+    bool write_error = !CloseFeatureStore(&store);
+    fprintf(stderr, "%d images, %d failed, %.3f s, %d threads\n", list.num, args.failed, seconds, ThreadNum());
+    if(write_error)
+        fprintf(stderr, "error writing %s\n", output_path);
+
+    if(codebook_map.base != NULL)
+        UnmapFile(&codebook_map);
+    else if(use_codebook)
+        FreeFisherVectorCodeBookFile(&opt.coding_opt.fv_codebook);
+    if(use_vq_codebook)
+        FreeVQCodeBookFile(&opt.coding_opt.vq_codebook);
+    if(use_pq_codebook)
+        FreePQCodeBookFile(&opt.coding_opt.pq_codebook);
+    FreeImageList(&list);
+    return (args.failed > 0 || write_error) ? 1 : 0;
+}
@@ -0,0 +1,225 @@
+#ifndef IMAGE_IO_H
+#define IMAGE_IO_H
+
+#include <stdio.h>
+#include <string.h>
+#include <setjmp.h>
+#include "image.h"
+
+#ifdef USE_JPEG
+#include <jpeglib.h>
+#endif
+
+// ***************************** //
+// image files for the native tools
+//      images are read into uint8 or uint16 planes, matlab layout (column major,
+//      height x width x depth), as imread gives them to the mex functions.
+//      jpeg needs USE_JPEG and libjpeg; binary and ascii pnm (pgm, ppm) always work.
+//      color is turned to gray with the weights of rgb2gray when depth is 1,
+//      gray is repeated over the planes when depth is 3
+
+// planes of the given element type, released by FreeImage()
+void AllocateTypedImage(FloatImage * img, int height, int width, int depth, int type)
+{
+    int element = type == IMAGE_UINT8 ? 1 : (type == IMAGE_UINT16 ? 2 : 4);
+    size_t bytes = (size_t)height * width * depth * element;
+    img->p = ALLOCATE(float, (bytes + sizeof(float)-1) / sizeof(float));
+    img->height = height;
+    img->width = width;
+    img->depth = depth;
+    img->stride = height;
+    img->type = type;
+}
+
+// interleaved rows of channels samples to planes of depth
+//      rgb2gray: round(0.2989 r + 0.5870 g + 0.1140 b)
+template <typename T>
+void InterleavedToPlanes(const T * src, int y, int width, int channels, FloatImage * img)
+{
+    T * dst = (T *)img->p;
+    size_t plane = (size_t)img->height * width;
+    for(int x=0; x<width; x++)
+    {
+        const T * s = src + x*channels;
+        T * d = dst + (size_t)x*img->height + y;
+        if(img->depth == channels)
+            for(int c=0; c<channels; c++)
+                d[c*plane] = s[c];
+        else if(img->depth == 1)
+            d[0] = (T)(0.298936021293775*s[0] + 0.587043074451121*s[1] + 0.114020904255103*s[2] + 0.5);
+        else
+            for(int c=0; c<img->depth; c++)
+                d[c*plane] = s[0];
+    }
+}
+
+// ***************************** //
+// pnm
+
+// next header number, skipping white space and comments
+bool PnmNumber(FILE * file, int * value)
+{
+    int c = fgetc(file);
+    while(c == '#' || c == ' ' || c == '\t' || c == '\r' || c == '\n')
+    {
+        if(c == '#')
+            while(c != '\n' && c != EOF)
+                c = fgetc(file);
+        c = fgetc(file);
+    }
+    if(c < '0' || c > '9')
+        return false;
+    *value = 0;
+    while(c >= '0' && c <= '9')
+    {
+        *value = *value * 10 + (c - '0');
+        c = fgetc(file);
+    }
+    return true;
+}
+
+bool ReadPnm(FILE * file, int depth, FloatImage * img)
+{
+    char magic[2];
+    if(fread(magic, 1, 2, file) != 2 || magic[0] != 'P' || magic[1] < '2' || magic[1] > '6' || magic[1] == '4')
+        return false;
+    bool ascii = magic[1] <= '3';
+    int channels = (magic[1] == '3' || magic[1] == '6') ? 3 : 1;
+    int width, height, maxval;
+    if(!PnmNumber(file, &width) || !PnmNumber(file, &height) || !PnmNumber(file, &maxval))
+        return false;
+    if(width <= 0 || height <= 0 || maxval <= 0 || maxval > 65535)
+        return false;
+
+    int type = maxval < 256 ? IMAGE_UINT8 : IMAGE_UINT16;
+    AllocateTypedImage(img, height, width, depth, type);
+
+    int row_size = width * channels;
+    unsigned char * row8 = ALLOCATE(unsigned char, row_size * 2);
+    unsigned short * row16 = ALLOCATE(unsigned short, row_size);
+    bool ok = true;
+    for(int y=0; y<height && ok; y++)
+    {
+        if(ascii)
+        {
+            for(int i=0; i<row_size && ok; i++)
+            {
+                int v;
+                ok = PnmNumber(file, &v);
+                row16[i] = (unsigned short)v;
+                row8[i] = (unsigned char)v;
+            }
+        }
+        else if(type == IMAGE_UINT8)
+            ok = fread(row8, 1, row_size, file) == (size_t)row_size;
+        else
+        {
+            // 16 bit samples are big endian
+            ok = fread(row8, 2, row_size, file) == (size_t)row_size;
+            for(int i=0; i<row_size; i++)
+                row16[i] = (unsigned short)(row8[2*i] << 8 | row8[2*i+1]);
+        }
+
+        if(type == IMAGE_UINT8)
+            InterleavedToPlanes(row8, y, width, channels, img);
+        else
+            InterleavedToPlanes(row16, y, width, channels, img);
+    }
+    FREE(row8);
+    FREE(row16);
+    if(!ok)
+        FreeImage(img);
+    return ok;
+}
+
+// ***************************** //
+// jpeg
+
+#ifdef USE_JPEG
+// libjpeg exits on errors by default, jump back instead
+struct JpegError
+{
+    jpeg_error_mgr mgr;
+    jmp_buf jump;
+};
+
+void JpegErrorExit(j_common_ptr info)
+{
+    longjmp(((JpegError *)info->err)->jump, 1);
+}
+
+void JpegNoMessage(j_common_ptr)
+{
+}
+
+bool ReadJpeg(FILE * file, int depth, FloatImage * img)
+{
+    jpeg_decompress_struct info;
+    JpegError error;
+    info.err = jpeg_std_error(&error.mgr);
+    error.mgr.error_exit = JpegErrorExit;
+    error.mgr.output_message = JpegNoMessage;
+
+    img->p = NULL;
+    unsigned char * volatile row = NULL;
+    if(setjmp(error.jump))
+    {
+        jpeg_destroy_decompress(&info);
+        if(row != NULL)
+            FREE(row);
+        FreeImage(img);
+        img->p = NULL;
+        return false;
+    }
+
+    jpeg_create_decompress(&info);
+    jpeg_stdio_src(&info, file);
+    jpeg_read_header(&info, TRUE);
+    // cmyk and others are left to libjpeg's rgb conversion
+    if(info.jpeg_color_space != JCS_GRAYSCALE)
+        info.out_color_space = JCS_RGB;
+    jpeg_start_decompress(&info);
+
+    int height = info.output_height, width = info.output_width, channels = info.output_components;
+    AllocateTypedImage(img, height, width, depth, IMAGE_UINT8);
+    row = ALLOCATE(unsigned char, width * channels);
+    while(info.output_scanline < info.output_height)
+    {
+        int y = info.output_scanline;
+        JSAMPROW rows[1] = {row};
+        jpeg_read_scanlines(&info, rows, 1);
+        InterleavedToPlanes((const unsigned char *)row, y, width, channels, img);
+    }
+    jpeg_finish_decompress(&info);
+    jpeg_destroy_decompress(&info);
+    FREE(row);
+    return true;
+}
+#endif
+
+// ***************************** //
+// entry
+
+// read image file path to depth planes, false if it cannot be read or decoded
+bool ReadImageFile(const char * path, int depth, FloatImage * img)
+{
+    FILE * file = fopen(path, "rb");
+    if(file == NULL)
+        return false;
+
+    unsigned char magic[2] = {0, 0};
+    size_t n = fread(magic, 1, 2, file);
+    rewind(file);
+
+    bool ok = false;
+    if(n == 2 && magic[0] == 'P')
+        ok = ReadPnm(file, depth, img);
+#ifdef USE_JPEG
+    else if(n == 2 && magic[0] == 0xFF && magic[1] == 0xD8)
+        ok = ReadJpeg(file, depth, img);
+#endif
+    fclose(file);
+    return ok;
+}
+
+#endif
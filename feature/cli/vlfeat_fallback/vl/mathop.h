@@ -0,0 +1,68 @@
+#ifndef VL_MATHOP_H
+#define VL_MATHOP_H
+
+#include <math.h>
+#include <float.h>
+
+// ***************************** //
+// the vlfeat 0.9.13 math routines used by the feature headers, same arithmetic
+// so codes match the mex build; put on the include path only when vlfeat is absent
+
+#define VL_PI 3.141592653589793
+
+static inline float vl_fast_atan2_f(float y, float x)
+{
+    float angle, r;
+    float const c3 = 0.1821F;
+    float const c1 = 0.9675F;
+    float abs_y = fabsf(y) + FLT_MIN;
+
+    if(x >= 0)
+    {
+        r = (x - abs_y) / (x + abs_y);
+        angle = (float)(VL_PI/4);
+    }
+    else
+    {
+        r = (x + abs_y) / (abs_y - x);
+        angle = (float)(3*VL_PI/4);
+    }
+    angle += (c3*r*r - c1) * r;
+    return (y < 0) ? - angle : angle;
+}
+
+static inline float vl_fast_resqrt_f(float x)
+{
+    union { float x; int i; } u;
+    float xhalf = (float)0.5 * x;
+    u.x = x;
+    u.i = 0x5f3759df - (u.i >> 1);
+    u.x = u.x * ((float)1.5 - xhalf*u.x*u.x);
+    u.x = u.x * ((float)1.5 - xhalf*u.x*u.x);
+    return u.x;
+}
+
+static inline float vl_fast_sqrt_f(float x)
+{
+    return (x < 1e-8) ? 0 : x * vl_fast_resqrt_f(x);
+}
+
+static inline float vl_mod_2pi_f(float x)
+{
+    while(x > (float)(2*VL_PI))
+        x -= (float)(2*VL_PI);
+    while(x < 0.0F)
+        x += (float)(2*VL_PI);
+    return x;
+}
+
+static inline long vl_floor_f(float x)
+{
+    long xi = (long)x;
+    if(x >= 0 || (float)xi == x)
+        return xi;
+    else
+        return xi - 1;
+}
+
+#endif
@@ -0,0 +1,382 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "image.h"
+#include "thread.h"
+#include "patch_feature.h"
+#include "coding.h"
+#include "pooling.h"
+
+// ***************************** //
+// multi-image pipeline
+//      images go through three stages, each run by its own threads:
+//      load (read and decode, by the caller's func_load), extract (PatchFeature)
+//      and code (CodingAggregate or SpatialPyramidPooling of the patch features,
+//      or the per-patch sparse codes of Coding).
+//      the stages are joined by bounded queues, so decoding overlaps extraction
+//      and coding while at most queue_size images wait between two stages.
+//      extract and code threads own copies of the patch and coding options.
+//      built with NO_THREAD the images go through the stages one by one
+
+// loads image index into img, false if it cannot be read
+typedef bool (*FuncBatchLoad)(void * args, int index, FloatImage * img);
+// releases an image of func_load, FreeImage() if NULL
+typedef void (*FuncBatchRelease)(void * args, int index, FloatImage * img);
+// receives the result of image index, NULL if the image could not be loaded
+//      feat: coded length x cells, or patch length x patches without coding;
+//      valid during the call only. calls are serialized, in completion order
+typedef void (*FuncBatchSink)(void * args, int index, const FloatMatrix * feat);
+// as FuncBatchSink for sparse_codes, codes: one column per patch
+typedef void (*FuncBatchSparseSink)(void * args, int index, const FloatSparseMatrix * codes);
+
+// batch options:
+//      patch_opt: patch feature options, read but not initialized
+//      use_coding: code the patch features with coding_opt, else pass them to the sink
+//      coding_opt: coding options, read but not initialized; a grain set in it is
+//          kept by the initialized copy of each coding thread
+//      sparse_codes: with use_coding, pass the sparse code of each patch to
+//          func_sparse_sink instead of pooling them
+//      nlayout, grid_x, grid_y: spatial pyramid layouts over the image, 0 for one
+//          image-level vector
+//      normalize: CODING_NORM_* flags
+//      load_threads, extract_threads, code_threads: 0 for a share of ThreadNum()
+//      queue_size: images held between two stages, 0 for twice the consumer threads
+struct BatchOpt
+{
+    PatchFeatureOpt patch_opt;
+    bool use_coding;
+    CodingOpt coding_opt;
+    bool sparse_codes;
+    int nlayout;
+    const int * grid_x;
+    const int * grid_y;
+    int normalize;
+
+    FuncBatchLoad func_load;
+    FuncBatchRelease func_release;
+    FuncBatchSink func_sink;
+    FuncBatchSparseSink func_sparse_sink;
+    void * args;
+
+    int load_threads;
+    int extract_threads;
+    int code_threads;
+    int queue_size;
+};
+
+// an image on its way through the stages
+struct BatchItem
+{
+    int index;
+    bool loaded;
+    int height, width; // of the image, kept once it is released
+    FloatImage img;
+    FloatImage feat;
+    FloatImage coord;
+    FloatSparseMatrix codes; // sparse_codes only
+};
+
+// ***************************** //
+// stages of one image, shared by the threaded and the serial pipeline
+
+bool BatchLoad(BatchOpt * opt, int index, BatchItem * item)
+{
+    memset(item, 0, sizeof(BatchItem));
+    item->index = index;
+    item->loaded = opt->func_load(opt->args, index, &item->img);
+    return item->loaded;
+}
+
+void BatchReleaseImage(BatchOpt * opt, BatchItem * item)
+{
+    if(opt->func_release != NULL)
+        opt->func_release(opt->args, item->index, &item->img);
+    else
+        FreeImage(&item->img);
+}
+
+// patch_opt: the copy of the calling thread
+void BatchExtract(BatchOpt * opt, PatchFeatureOpt * patch_opt, BatchItem * item)
+{
+    if(!item->loaded)
+        return;
+
+    item->height = item->img.height;
+    item->width = item->img.width;
+    *patch_opt = opt->patch_opt;
+    InitPatchFeature(&item->img, patch_opt);
+    AllocateImage(&item->coord, patch_opt->height, patch_opt->width, 2);
+    AllocateImage(&item->feat, patch_opt->length, patch_opt->height * patch_opt->width, 1);
+    PatchFeature(&item->img, &item->feat, &item->coord, patch_opt);
+    FreePatchFeature(patch_opt);
+    BatchReleaseImage(opt, item);
+}
+
+// coding_opt: the initialized copy of the calling thread
+//      result: dim coding length x cells, grown as needed
+void BatchCode(BatchOpt * opt, CodingOpt * coding_opt, BatchItem * item, FloatMatrix * result)
+{
+    if(!item->loaded || !opt->use_coding)
+        return;
+
+    if(opt->sparse_codes)
+    {
+        AllocateSparseMatrix(&item->codes, coding_opt->length, item->feat.width,
+                coding_opt->block_num, coding_opt->block_size);
+        Coding(&item->feat, &item->codes, coding_opt);
+        return;
+    }
+
+    SpatialPyramidOpt pyramid;
+    int ncell = 1;
+    if(opt->nlayout > 0)
+    {
+        InitSpatialPyramid(&pyramid, opt->grid_x, opt->grid_y, opt->nlayout,
+                item->height, item->width);
+        ncell = pyramid.ncell;
+    }
+    if(result->p == NULL || result->width < ncell)
+    {
+        if(result->p != NULL)
+            FreeImage(result);
+        AllocateImage(result, coding_opt->length, ncell, 1);
+    }
+    result->width = ncell;
+
+    if(opt->nlayout > 0)
+    {
+        SpatialPyramidPooling(&item->feat, item->coord.p, result->p, coding_opt, &pyramid, opt->normalize);
+        FreeSpatialPyramid(&pyramid);
+    }
+    else
+        CodingAggregate(&item->feat, result->p, coding_opt, opt->normalize);
+}
+
+void BatchSink(BatchOpt * opt, BatchItem * item, FloatMatrix * result)
+{
+    bool sparse = opt->use_coding && opt->sparse_codes;
+    if(sparse)
+        opt->func_sparse_sink(opt->args, item->index, item->loaded ? &item->codes : NULL);
+    else if(!item->loaded)
+        opt->func_sink(opt->args, item->index, NULL);
+    else if(opt->use_coding)
+        opt->func_sink(opt->args, item->index, result);
+    else
+        opt->func_sink(opt->args, item->index, &item->feat);
+
+    if(item->loaded)
+    {
+        FreeImage(&item->feat);
+        FreeImage(&item->coord);
+        if(sparse)
+            FreeSparseMatrix(&item->codes);
+    }
+}
+
+#ifndef NO_THREAD
+// ***************************** //
+// bounded queue between two stages, closed when its last producer is done
+
+struct BatchQueue
+{
+    BatchItem * item;
+    int capacity;
+    int head, count;
+    int producers;
+
+    PoolMutex mutex;
+    PoolCond not_empty;
+    PoolCond not_full;
+};
+
+void InitBatchQueue(BatchQueue * queue, int capacity, int producers)
+{
+    queue->item = ALLOCATE(BatchItem, capacity);
+    queue->capacity = capacity;
+    queue->head = 0;
+    queue->count = 0;
+    queue->producers = producers;
+    InitPoolMutex(&queue->mutex);
+    InitPoolCond(&queue->not_empty);
+    InitPoolCond(&queue->not_full);
+}
+
+void FreeBatchQueue(BatchQueue * queue)
+{
+    FREE(queue->item);
+    FreePoolMutex(&queue->mutex);
+    FreePoolCond(&queue->not_empty);
+    FreePoolCond(&queue->not_full);
+}
+
+void BatchQueuePush(BatchQueue * queue, const BatchItem * item)
+{
+    PoolLock(&queue->mutex);
+    while(queue->count == queue->capacity)
+        PoolWait(&queue->not_full, &queue->mutex);
+    queue->item[(queue->head + queue->count) % queue->capacity] = *item;
+    queue->count++;
+    PoolBroadcast(&queue->not_empty);
+    PoolUnlock(&queue->mutex);
+}
+
+// false once the queue is closed and empty
+bool BatchQueuePop(BatchQueue * queue, BatchItem * item)
+{
+    PoolLock(&queue->mutex);
+    while(queue->count == 0 && queue->producers > 0)
+        PoolWait(&queue->not_empty, &queue->mutex);
+    bool found = queue->count > 0;
+    if(found)
+    {
+        *item = queue->item[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+        PoolBroadcast(&queue->not_full);
+    }
+    PoolUnlock(&queue->mutex);
+    return found;
+}
+
+void BatchQueueDone(BatchQueue * queue)
+{
+    PoolLock(&queue->mutex);
+    queue->producers--;
+    PoolBroadcast(&queue->not_empty);
+    PoolUnlock(&queue->mutex);
+}
+
+// ***************************** //
+// stage threads
+
+struct BatchPipeline
+{
+    BatchOpt * opt;
+    int nimage;
+    volatile long next_image;
+    BatchQueue loaded;
+    BatchQueue extracted;
+    PoolMutex sink_mutex;
+};
+
+void BatchLoadThread(void * args_in)
+{
+    BatchPipeline * pipe = (BatchPipeline *)args_in;
+    while(true)
+    {
+        int index = (int)AtomicAdd(&pipe->next_image, 1);
+        if(index >= pipe->nimage)
+            break;
+        BatchItem item;
+        BatchLoad(pipe->opt, index, &item);
+        BatchQueuePush(&pipe->loaded, &item);
+    }
+    BatchQueueDone(&pipe->loaded);
+}
+
+void BatchExtractThread(void * args_in)
+{
+    BatchPipeline * pipe = (BatchPipeline *)args_in;
+    PatchFeatureOpt patch_opt;
+    BatchItem item;
+    while(BatchQueuePop(&pipe->loaded, &item))
+    {
+        BatchExtract(pipe->opt, &patch_opt, &item);
+        BatchQueuePush(&pipe->extracted, &item);
+    }
+    BatchQueueDone(&pipe->extracted);
+}
+
+void BatchCodeThread(void * args_in)
+{
+    BatchPipeline * pipe = (BatchPipeline *)args_in;
+    BatchOpt * opt = pipe->opt;
+    CodingOpt coding_opt;
+    if(opt->use_coding)
+    {
+        coding_opt = opt->coding_opt;
+        InitCoding(&coding_opt);
+        coding_opt.grain = opt->coding_opt.grain;
+    }
+    FloatMatrix result;
+    result.p = NULL;
+
+    BatchItem item;
+    while(BatchQueuePop(&pipe->extracted, &item))
+    {
+        BatchCode(opt, &coding_opt, &item, &result);
+        PoolLock(&pipe->sink_mutex);
+        BatchSink(opt, &item, &result);
+        PoolUnlock(&pipe->sink_mutex);
+    }
+
+    if(result.p != NULL)
+        FreeImage(&result);
+    if(opt->use_coding)
+        FreeCoding(&coding_opt);
+}
+#endif
+
+// ***************************** //
+// entry
+
+// runs images 0..nimage-1 through the pipeline, returns when the sink has all
+void BatchFeature(int nimage, BatchOpt * opt)
+{
+#ifdef NO_THREAD
+    PatchFeatureOpt patch_opt;
+    CodingOpt coding_opt;
+    if(opt->use_coding)
+    {
+        coding_opt = opt->coding_opt;
+        InitCoding(&coding_opt);
+        coding_opt.grain = opt->coding_opt.grain;
+    }
+    FloatMatrix result;
+    result.p = NULL;
+    for(int index=0; index<nimage; index++)
+    {
+        BatchItem item;
+        BatchLoad(opt, index, &item);
+        BatchExtract(opt, &patch_opt, &item);
+        BatchCode(opt, &coding_opt, &item, &result);
+        BatchSink(opt, &item, &result);
+    }
+    if(result.p != NULL)
+        FreeImage(&result);
+    if(opt->use_coding)
+        FreeCoding(&coding_opt);
+#else
+    // a quarter of the threads decode, the others extract and code
+    int nthread = ThreadNum();
+    int nload = opt->load_threads > 0 ? opt->load_threads : MAX(nthread/4, 1);
+    int nextract = opt->extract_threads > 0 ? opt->extract_threads : MAX((nthread - nload)/2, 1);
+    int ncode = opt->code_threads > 0 ? opt->code_threads : MAX(nthread - nload - nextract, 1);
+
+    BatchPipeline pipe;
+    pipe.opt = opt;
+    pipe.nimage = nimage;
+    pipe.next_image = 0;
+    InitBatchQueue(&pipe.loaded, opt->queue_size > 0 ? opt->queue_size : 2*nextract, nload);
+    InitBatchQueue(&pipe.extracted, opt->queue_size > 0 ? opt->queue_size : 2*ncode, nextract);
+    InitPoolMutex(&pipe.sink_mutex);
+
+    int nstage = nload + nextract + ncode;
+    ThreadHandle * handle = ALLOCATE(ThreadHandle, nstage);
+    for(int t=0; t<nstage; t++)
+    {
+        FuncThreadMain func = t < nload ? BatchLoadThread
+                : (t < nload + nextract ? BatchExtractThread : BatchCodeThread);
+        StartThread(handle + t, func, &pipe);
+    }
+    for(int t=0; t<nstage; t++)
+        JoinThread(handle + t);
+
+    FREE(handle);
+    FreeBatchQueue(&pipe.loaded);
+    FreeBatchQueue(&pipe.extracted);
+    FreePoolMutex(&pipe.sink_mutex);
+#endif
+}
+
+#endif
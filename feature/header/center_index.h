@@ -0,0 +1,291 @@
+#ifndef CENTER_INDEX_H
+#define CENTER_INDEX_H
+
+#include <math.h>
+#include <string.h>
+#include "image.h"
+#include "gemm.h"
+
+// ***************************** //
+// two-level index over a set of centers for approximate nearest centers, shared by
+// FisherVectorIndex (gaussian means, double) and VQIndex (vq centers, float)
+//      the centers are grouped by k-means into nCluster clusters; a descriptor is
+//      compared to the cluster centroids first and only the centers of its probe
+//      nearest clusters are scored, by the expanded weights of their members.
+//      distances are taken after scaling dimension d by scale[d] if it is given.
+//      the clusters are trained on at most CENTER_INDEX_SAMPLE centers per cluster
+//      probe is the recall / speed knob, probe = nCluster is exhaustive
+
+#define CENTER_INDEX_ITERATION 20
+#define CENTER_INDEX_SAMPLE 64
+
+// descriptors per product and rows of the score buffer of CenterNearest()
+#define CENTER_GEMM_BLOCK 64
+#define CENTER_GEMM_ROWS 1024
+
+template <typename T>
+struct CenterIndex
+{
+    int nDim, nBase;
+    int nCluster;
+    int probe;
+
+    T * scale; // dim nDim, NULL for unscaled distances
+    T * centroid; // dim nDim x nCluster, scaled
+    int * start; // dim nCluster+1, cluster c holds member[start[c]..start[c+1]-1]
+    int * member; // dim nBase, center ids grouped by cluster, ascending in a cluster
+
+    // expanded weights (width columns) and bias of the members, cluster by cluster,
+    // each cluster padded with zero rows to a multiple of GEMM_MR so products take
+    // full tiles
+    //      cluster c: rows = row_start[c+1]-row_start[c], w(m, j) at
+    //      weight[width*row_start[c] + j*rows + m], bias at bias[row_start[c] + m]
+    int width;
+    int * row_start; // dim nCluster+1
+    int max_rows;
+    T * weight;
+    T * bias;
+};
+
+// nearest of m expanded centers (weight m x nDim, lda m, and bias) for the
+// n columns of x (nDim x n, column j at x + j*x_stride), by the expanded distance
+//      score: dim CENTER_GEMM_ROWS x CENTER_GEMM_BLOCK
+template <typename T>
+void CenterNearest(const T * x, int n, int nDim, int x_stride, const T * weight, const T * bias, int m,
+        int * nearest, T * score)
+{
+    T best[CENTER_GEMM_BLOCK];
+    for(int j0=0; j0<n; j0+=CENTER_GEMM_BLOCK)
+    {
+        int nc = MIN(CENTER_GEMM_BLOCK, n-j0);
+        for(int i0=0; i0<m; i0+=CENTER_GEMM_ROWS)
+        {
+            int rows = MIN(CENTER_GEMM_ROWS, m-i0);
+            for(int j=0; j<nc; j++)
+                memcpy(score + j*rows, bias + i0, sizeof(T)*rows);
+            Gemm(rows, nc, nDim, weight + i0, m, x + j0*x_stride, x_stride, score, rows);
+            for(int j=0; j<nc; j++)
+                for(int i=0; i<rows; i++)
+                    if((i0 == 0 && i == 0) || score[j*rows + i] < best[j])
+                    {
+                        best[j] = score[j*rows + i];
+                        nearest[j0+j] = i0 + i;
+                    }
+        }
+    }
+}
+
+// expanded centroids of index, for CenterNearest()
+template <typename T>
+void CenterIndexCentroidGemm(const CenterIndex<T> * index, T * weight, T * bias)
+{
+    int nDim = index->nDim, nCluster = index->nCluster;
+    for(int c=0; c<nCluster; c++)
+    {
+        double norm = 0;
+        for(int k=0; k<nDim; k++)
+        {
+            T v = index->centroid[c*nDim+k];
+            weight[k*nCluster + c] = -2*v;
+            norm += (double)v*v;
+        }
+        bias[c] = (T)norm;
+    }
+}
+
+// index of the nBase centers (nDim x nBase), scale: dim nDim or NULL, copied
+//      gemm_weight, gemm_bias: expanded weights of the centers, w(i, j) at
+//      gemm_weight[j*nBase + i] for j < width, packed per cluster
+template <typename T>
+void InitCenterIndex(CenterIndex<T> * index, const T * centers, const T * scale, int nDim, int nBase,
+        int nCluster, int probe, const T * gemm_weight, const T * gemm_bias, int width)
+{
+    nCluster = MIN(MAX(nCluster, 1), nBase);
+    index->nDim = nDim;
+    index->nBase = nBase;
+    index->nCluster = nCluster;
+    index->probe = MIN(MAX(probe, 1), nCluster);
+
+    index->centroid = ALLOCATE(T, nDim*nCluster);
+    index->start = ALLOCATE(int, nCluster+1);
+    index->member = ALLOCATE(int, nBase);
+
+    // scaled centers
+    T * scaled = NULL;
+    index->scale = NULL;
+    if(scale != NULL)
+    {
+        index->scale = ALLOCATE(T, nDim);
+        memcpy(index->scale, scale, sizeof(T)*nDim);
+        scaled = ALLOCATE(T, nDim*nBase);
+        for(int i=0; i<nBase; i++)
+            for(int k=0; k<nDim; k++)
+                scaled[i*nDim+k] = centers[i*nDim+k] * scale[k];
+        centers = scaled;
+    }
+
+    // evenly spaced training sample
+    int nSample = MIN(nBase, CENTER_INDEX_SAMPLE*nCluster);
+    T * sample = ALLOCATE(T, nDim*nSample);
+    for(int s=0; s<nSample; s++)
+        memcpy(sample + s*nDim, centers + (int)((long long)s*nBase/nSample)*nDim, sizeof(T)*nDim);
+
+    // lloyd iterations from evenly spaced samples, deterministic
+    int * assign = ALLOCATE(int, nBase);
+    int * count = ALLOCATE(int, nCluster);
+    double * sum = ALLOCATE(double, nDim*nCluster);
+    T * weight = ALLOCATE(T, nDim*nCluster);
+    T * bias = ALLOCATE(T, nCluster);
+    T * score = ALLOCATE(T, CENTER_GEMM_ROWS*CENTER_GEMM_BLOCK);
+    int * nearest = ALLOCATE(int, nBase);
+    for(int c=0; c<nCluster; c++)
+        memcpy(index->centroid + c*nDim, sample + (int)((long long)c*nSample/nCluster)*nDim, sizeof(T)*nDim);
+
+    for(int it=0; it<CENTER_INDEX_ITERATION; it++)
+    {
+        CenterIndexCentroidGemm(index, weight, bias);
+        CenterNearest(sample, nSample, nDim, nDim, weight, bias, nCluster, nearest, score);
+        bool changed = it == 0;
+        for(int s=0; s<nSample; s++)
+        {
+            changed = changed || assign[s] != nearest[s];
+            assign[s] = nearest[s];
+        }
+        if(!changed)
+            break;
+
+        // empty clusters keep their centroid
+        memset(count, 0, sizeof(int)*nCluster);
+        memset(sum, 0, sizeof(double)*nDim*nCluster);
+        for(int s=0; s<nSample; s++)
+        {
+            count[assign[s]]++;
+            for(int k=0; k<nDim; k++)
+                sum[assign[s]*nDim+k] += sample[s*nDim+k];
+        }
+        for(int c=0; c<nCluster; c++)
+            if(count[c] > 0)
+                for(int k=0; k<nDim; k++)
+                    index->centroid[c*nDim+k] = (T)(sum[c*nDim+k] / count[c]);
+    }
+
+    // all centers to their nearest centroid
+    CenterIndexCentroidGemm(index, weight, bias);
+    CenterNearest(centers, nBase, nDim, nDim, weight, bias, nCluster, assign, score);
+
+    // members grouped by cluster
+    memset(index->start, 0, sizeof(int)*(nCluster+1));
+    for(int i=0; i<nBase; i++)
+        index->start[assign[i]+1]++;
+    for(int c=0; c<nCluster; c++)
+        index->start[c+1] += index->start[c];
+    memset(count, 0, sizeof(int)*nCluster);
+    for(int i=0; i<nBase; i++)
+        index->member[index->start[assign[i]] + count[assign[i]]++] = i;
+
+    if(scaled != NULL)
+        FREE(scaled);
+    FREE(sample);
+    FREE(assign);
+    FREE(count);
+    FREE(sum);
+    FREE(weight);
+    FREE(bias);
+    FREE(score);
+    FREE(nearest);
+
+    // expanded weights, contiguous per cluster
+    index->width = width;
+    index->row_start = ALLOCATE(int, nCluster+1);
+    index->max_rows = 0;
+    for(int c=0; c<nCluster; c++)
+    {
+        int size = index->start[c+1] - index->start[c];
+        int rows = (size + GEMM_MR-1) / GEMM_MR * GEMM_MR;
+        index->row_start[c+1] = index->row_start[c] + rows;
+        index->max_rows = MAX(index->max_rows, rows);
+    }
+    index->weight = ALLOCATE(T, width*index->row_start[nCluster]);
+    index->bias = ALLOCATE(T, index->row_start[nCluster]);
+    for(int c=0; c<nCluster; c++)
+    {
+        int size = index->start[c+1] - index->start[c];
+        int rows = index->row_start[c+1] - index->row_start[c];
+        T * w = index->weight + width*index->row_start[c];
+        for(int m=0; m<size; m++)
+        {
+            int i = index->member[index->start[c] + m];
+            for(int j=0; j<width; j++)
+                w[j*rows + m] = gemm_weight[j*nBase + i];
+            index->bias[index->row_start[c] + m] = gemm_bias[i];
+        }
+    }
+}
+
+template <typename T>
+void FreeCenterIndex(CenterIndex<T> * index)
+{
+    if(index->scale != NULL)
+        FREE(index->scale);
+    FREE(index->centroid);
+    FREE(index->start);
+    FREE(index->member);
+    FREE(index->row_start);
+    FREE(index->weight);
+    FREE(index->bias);
+    index->scale = NULL;
+    index->nCluster = 0;
+}
+
+// probe nearest clusters of data, widened until they hold min_num centers
+//      cluster: dim nCluster, the selected clusters come first by ascending id
+//      returns the number of selected clusters
+template <typename T>
+inline int CenterIndexProbe(const float * data, const CenterIndex<T> * index, int min_num, T * dist, int * cluster)
+{
+    int nDim = index->nDim, nCluster = index->nCluster;
+    for(int c=0; c<nCluster; c++)
+    {
+        const T * centroid = index->centroid + c*nDim;
+        T sum = 0;
+        if(index->scale != NULL)
+            for(int k=0; k<nDim; k++)
+            {
+                T d = data[k]*index->scale[k] - centroid[k];
+                sum += d*d;
+            }
+        else
+            for(int k=0; k<nDim; k++)
+            {
+                T d = data[k] - centroid[k];
+                sum += d*d;
+            }
+        dist[c] = sum;
+        cluster[c] = c;
+    }
+
+    // partial selection sort, probe is small
+    int selected = 0, num = 0;
+    while(selected < nCluster && (selected < index->probe || num < min_num))
+    {
+        int best = selected;
+        for(int c=selected+1; c<nCluster; c++)
+            if(dist[c] < dist[best])
+                best = c;
+        T d = dist[best]; dist[best] = dist[selected]; dist[selected] = d;
+        int t = cluster[best]; cluster[best] = cluster[selected]; cluster[selected] = t;
+
+        num += index->start[cluster[selected]+1] - index->start[cluster[selected]];
+        selected++;
+    }
+
+    // ascending ids, so centers reach the heap in the same order on every path
+    for(int i=1; i<selected; i++)
+        for(int j=i; j>0 && cluster[j] < cluster[j-1]; j--)
+        {
+            int t = cluster[j]; cluster[j] = cluster[j-1]; cluster[j-1] = t;
+        }
+    return selected;
+}
+
+#endif
@@ -0,0 +1,404 @@
+#ifndef CODEBOOK_IO_H
+#define CODEBOOK_IO_H
+
+#include <stdio.h>
+#include <math.h>
+#include "image.h"
+#include "fisher_vector_coding.h"
+#include "vq_coding.h"
+#include "pq_coding.h"
+#include "mapped_file.h"
+
+// ***************************** //
+// codebook files for the native tools
+//      gmm file, little endian: int32 nDim, int32 nBase, then double priors (nBase),
+//      mu (nDim x nBase) and sigma (nDim x nBase, variances) as GMM.Priors, GMM.Mu
+//      and GMM.Sigma of matlab_test.m, written from matlab by
+//          fwrite(f, [nDim nBase], 'int32'); fwrite(f, [Priors(:); Mu(:); Sigma(:)], 'double');
+//      the derived fields are computed on loading as matlab_test.m does
+//
+//      codebook file, little endian, version 1, written by WriteFisherVectorCodeBookFile()
+//      or WriteFisherVectorCodeBook.m:
+//          header (128 bytes): char[4] "FVCB", int32 version, nDim, nBase, then the int64
+//              offsets of priors, mu, sigma, sqrtPrior, sqrt2Prior, sumLogSigma, invSigma
+//              and sqrtInvSigma
+//          the arrays as double, each at a 64 byte aligned offset
+//      it is mapped read only, so processes coding with the same file share one copy.
+//      the codebook is checked once when it is mapped
+//
+//      vq file, little endian: int32 nDim, int32 nBase, then float centers (nDim x nBase),
+//      written from matlab by
+//          fwrite(f, size(C), 'int32'); fwrite(f, C, 'single');
+//
+//      pq file, little endian: int32 subDim, int32 nCenter, int32 nSub, then float
+//      centers (subDim x nCenter x nSub), written from matlab by
+//          fwrite(f, size(C, 1:3), 'int32'); fwrite(f, C, 'single');
+
+// derived fields of cb from priors, mu and sigma, into block
+//      block: dim 3*nBase + 2*nDim*nBase, after the gmm itself
+void DeriveFisherVectorCodeBook(FisherVectorCodeBook * cb, double * block)
+{
+    int nDim = cb->nDim, nBase = cb->nBase;
+    double * sqrtPrior = block;
+    double * sqrt2Prior = sqrtPrior + nBase;
+    double * sumLogSigma = sqrt2Prior + nBase;
+    double * invSigma = sumLogSigma + nBase;
+    double * sqrtInvSigma = invSigma + nDim*nBase;
+
+    for(int i=0; i<nBase; i++)
+    {
+        sqrtPrior[i] = sqrt(cb->priors[i]);
+        sqrt2Prior[i] = sqrt(2*cb->priors[i]);
+        sumLogSigma[i] = nDim * log(2*VL_PI);
+        for(int k=0; k<nDim; k++)
+        {
+            int j = i*nDim + k;
+            invSigma[j] = 1 / cb->sigma[j];
+            sqrtInvSigma[j] = 1 / sqrt(cb->sigma[j]);
+            sumLogSigma[i] += log(cb->sigma[j]);
+        }
+    }
+
+    cb->sqrtPrior = sqrtPrior;
+    cb->sqrt2Prior = sqrt2Prior;
+    cb->sumLogSigma = sumLogSigma;
+    cb->invSigma = invSigma;
+    cb->sqrtInvSigma = sqrtInvSigma;
+}
+
+// read gmm file path into cb, false if it cannot be read
+//      all arrays share one allocation, released by FreeFisherVectorCodeBookFile()
+bool ReadFisherVectorCodeBookFile(const char * path, FisherVectorCodeBook * cb)
+{
+    FILE * file = fopen(path, "rb");
+    if(file == NULL)
+        return false;
+
+    int size[2];
+    bool ok = fread(size, sizeof(int), 2, file) == 2 && size[0] > 0 && size[1] > 0;
+    // the file holds exactly the gmm, e.g. not a codebook file
+    long long ngmm_file = (long long)size[1] + 2*(long long)size[0]*size[1];
+    ok = ok && fseek(file, 0, SEEK_END) == 0 && ftell(file) == (long)(2*sizeof(int) + ngmm_file*sizeof(double))
+            && fseek(file, 2*sizeof(int), SEEK_SET) == 0;
+    if(!ok)
+    {
+        fclose(file);
+        return false;
+    }
+    int nDim = size[0], nBase = size[1];
+    size_t ngmm = (size_t)nBase + 2*(size_t)nDim*nBase;
+    double * block = ALLOCATE(double, ngmm + 3*nBase + 2*(size_t)nDim*nBase);
+    ok = fread(block, sizeof(double), ngmm, file) == ngmm;
+    fclose(file);
+
+    for(size_t j=nBase+(size_t)nDim*nBase; ok && j<ngmm; j++)
+        ok = block[j] > 0;
+    if(!ok)
+    {
+        FREE(block);
+        return false;
+    }
+
+    memset(cb, 0, sizeof(FisherVectorCodeBook));
+    cb->nDim = nDim;
+    cb->nBase = nBase;
+    cb->priors = block;
+    cb->mu = block + nBase;
+    cb->sigma = block + nBase + nDim*nBase;
+    DeriveFisherVectorCodeBook(cb, block + ngmm);
+    return true;
+}
+
+void FreeFisherVectorCodeBookFile(FisherVectorCodeBook * cb)
+{
+    double * block = (double *)cb->priors;
+    FREE(block);
+    cb->priors = NULL;
+}
+
+// read vq file path into cb, false if it cannot be read
+//      released by FreeVQCodeBookFile()
+bool ReadVQCodeBookFile(const char * path, VQCodeBook * cb)
+{
+    FILE * file = fopen(path, "rb");
+    if(file == NULL)
+        return false;
+
+    int size[2];
+    bool ok = fread(size, sizeof(int), 2, file) == 2 && size[0] > 0 && size[1] > 0;
+    long long ncenter = (long long)size[0] * size[1];
+    ok = ok && fseek(file, 0, SEEK_END) == 0 && ftell(file) == (long)(2*sizeof(int) + ncenter*sizeof(float))
+            && fseek(file, 2*sizeof(int), SEEK_SET) == 0;
+    float * centers = NULL;
+    if(ok)
+    {
+        centers = ALLOCATE(float, (size_t)ncenter);
+        ok = fread(centers, sizeof(float), (size_t)ncenter, file) == (size_t)ncenter;
+    }
+    fclose(file);
+
+    for(long long j=0; ok && j<ncenter; j++)
+        ok = centers[j] - centers[j] == 0;
+    if(!ok)
+    {
+        if(centers != NULL)
+            FREE(centers);
+        return false;
+    }
+
+    memset(cb, 0, sizeof(VQCodeBook));
+    cb->nDim = size[0];
+    cb->nBase = size[1];
+    cb->centers = centers;
+    return true;
+}
+
+void FreeVQCodeBookFile(VQCodeBook * cb)
+{
+    float * centers = (float *)cb->centers;
+    FREE(centers);
+    cb->centers = NULL;
+}
+
+// read pq file path into cb, false if it cannot be read
+//      released by FreePQCodeBookFile()
+bool ReadPQCodeBookFile(const char * path, PQCodeBook * cb)
+{
+    FILE * file = fopen(path, "rb");
+    if(file == NULL)
+        return false;
+
+    int size[3];
+    bool ok = fread(size, sizeof(int), 3, file) == 3 && size[0] > 0 && size[1] > 0 && size[1] <= PQ_CENTER_MAX
+            && size[2] > 0;
+    long long ncenter = ok ? (long long)size[0] * size[1] * size[2] : 0;
+    ok = ok && fseek(file, 0, SEEK_END) == 0 && ftell(file) == (long)(3*sizeof(int) + ncenter*sizeof(float))
+            && fseek(file, 3*sizeof(int), SEEK_SET) == 0;
+    float * centers = NULL;
+    if(ok)
+    {
+        centers = ALLOCATE(float, (size_t)ncenter);
+        ok = fread(centers, sizeof(float), (size_t)ncenter, file) == (size_t)ncenter;
+    }
+    fclose(file);
+
+    for(long long j=0; ok && j<ncenter; j++)
+        ok = centers[j] - centers[j] == 0;
+    if(!ok)
+    {
+        if(centers != NULL)
+            FREE(centers);
+        return false;
+    }
+
+    memset(cb, 0, sizeof(PQCodeBook));
+    cb->subDim = size[0];
+    cb->nCenter = size[1];
+    cb->nSub = size[2];
+    cb->nDim = size[0] * size[2];
+    cb->centers = centers;
+    return true;
+}
+
+void FreePQCodeBookFile(PQCodeBook * cb)
+{
+    float * centers = (float *)cb->centers;
+    FREE(centers);
+    cb->centers = NULL;
+}
+
+// ***************************** //
+// codebook file
+
+#define CODEBOOK_FILE_VERSION 1
+#define CODEBOOK_FILE_ALIGN 64
+#define CODEBOOK_FILE_ARRAYS 8
+
+struct FisherVectorCodeBookHeader
+{
+    char magic[4];
+    int version;
+    int nDim, nBase;
+    long long offset[CODEBOOK_FILE_ARRAYS];
+    long long reserved[6];
+};
+
+// arrays of cb in file order, with their lengths
+void FisherVectorCodeBookArrays(const FisherVectorCodeBook * cb, const double ** array, long long * length)
+{
+    long long nBase = cb->nBase, nGauss = (long long)cb->nDim * cb->nBase;
+    const double * arrays[CODEBOOK_FILE_ARRAYS] = {cb->priors, cb->mu, cb->sigma,
+            cb->sqrtPrior, cb->sqrt2Prior, cb->sumLogSigma, cb->invSigma, cb->sqrtInvSigma};
+    long long lengths[CODEBOOK_FILE_ARRAYS] = {nBase, nGauss, nGauss, nBase, nBase, nBase, nGauss, nGauss};
+    for(int k=0; k<CODEBOOK_FILE_ARRAYS; k++)
+    {
+        array[k] = arrays[k];
+        length[k] = lengths[k];
+    }
+}
+
+inline bool CodeBookClose(double value, double expected)
+{
+    return fabs(value - expected) <= 1e-9 * MAX(fabs(expected), 1.0);
+}
+
+// gmm finite with positive variances, derived fields matching it
+bool CheckFisherVectorCodeBook(const FisherVectorCodeBook * cb)
+{
+    int nDim = cb->nDim, nBase = cb->nBase;
+    if(nDim <= 0 || nBase <= 0)
+        return false;
+    for(int i=0; i<nBase; i++)
+    {
+        double prior = cb->priors[i];
+        // x - x is 0 for finite x only
+        if(!(prior >= 0 && prior - prior == 0) || !CodeBookClose(cb->sqrtPrior[i], sqrt(prior))
+                || !CodeBookClose(cb->sqrt2Prior[i], sqrt(2*prior)))
+            return false;
+        double sumLogSigma = nDim * log(2*VL_PI);
+        for(int k=0; k<nDim; k++)
+        {
+            int j = i*nDim + k;
+            double sigma = cb->sigma[j];
+            if(!(sigma > 0 && sigma - sigma == 0) || cb->mu[j] - cb->mu[j] != 0
+                    || !CodeBookClose(cb->invSigma[j], 1 / sigma)
+                    || !CodeBookClose(cb->sqrtInvSigma[j], 1 / sqrt(sigma)))
+                return false;
+            sumLogSigma += log(sigma);
+        }
+        if(!CodeBookClose(cb->sumLogSigma[i], sumLogSigma))
+            return false;
+    }
+    return true;
+}
+
+// write cb with its derived fields to path, false on a write error
+bool WriteFisherVectorCodeBookFile(const char * path, const FisherVectorCodeBook * cb)
+{
+    FILE * file = fopen(path, "wb");
+    if(file == NULL)
+        return false;
+
+    const double * array[CODEBOOK_FILE_ARRAYS];
+    long long length[CODEBOOK_FILE_ARRAYS];
+    FisherVectorCodeBookArrays(cb, array, length);
+
+    FisherVectorCodeBookHeader header;
+    memset(&header, 0, sizeof(FisherVectorCodeBookHeader));
+    memcpy(header.magic, "FVCB", 4);
+    header.version = CODEBOOK_FILE_VERSION;
+    header.nDim = cb->nDim;
+    header.nBase = cb->nBase;
+    long long offset = sizeof(FisherVectorCodeBookHeader);
+    for(int k=0; k<CODEBOOK_FILE_ARRAYS; k++)
+    {
+        header.offset[k] = offset;
+        offset += (length[k] * (long long)sizeof(double) + CODEBOOK_FILE_ALIGN-1) / CODEBOOK_FILE_ALIGN * CODEBOOK_FILE_ALIGN;
+    }
+
+    static const char zero[CODEBOOK_FILE_ALIGN] = {0};
+    bool ok = fwrite(&header, sizeof(FisherVectorCodeBookHeader), 1, file) == 1;
+    for(int k=0; ok && k<CODEBOOK_FILE_ARRAYS; k++)
+    {
+        size_t n = (size_t)length[k];
+        size_t pad = (size_t)((k+1 < CODEBOOK_FILE_ARRAYS ? header.offset[k+1] : offset)
+                - header.offset[k]) - n*sizeof(double);
+        ok = fwrite(array[k], sizeof(double), n, file) == n
+                && (pad == 0 || fwrite(zero, 1, pad, file) == pad);
+    }
+    ok = (fclose(file) == 0) && ok;
+    return ok;
+}
+
+// map codebook file path into cb, pointers into map; false if it is not a valid codebook
+//      released by UnmapFile(map)
+bool MapFisherVectorCodeBookFile(MappedFile * map, const char * path, FisherVectorCodeBook * cb)
+{
+    if(!MapFile(map, path, sizeof(FisherVectorCodeBookHeader)))
+        return false;
+
+    const FisherVectorCodeBookHeader * header = (const FisherVectorCodeBookHeader *)map->base;
+    bool ok = memcmp(header->magic, "FVCB", 4) == 0 && header->version == CODEBOOK_FILE_VERSION
+            && header->nDim > 0 && header->nBase > 0;
+    if(ok)
+    {
+        memset(cb, 0, sizeof(FisherVectorCodeBook));
+        cb->nDim = header->nDim;
+        cb->nBase = header->nBase;
+        const double * array[CODEBOOK_FILE_ARRAYS];
+        long long length[CODEBOOK_FILE_ARRAYS];
+        FisherVectorCodeBookArrays(cb, array, length);
+        for(int k=0; ok && k<CODEBOOK_FILE_ARRAYS; k++)
+        {
+            long long offset = header->offset[k];
+            ok = offset >= (long long)sizeof(FisherVectorCodeBookHeader) && offset % CODEBOOK_FILE_ALIGN == 0
+                    && offset + length[k] * (long long)sizeof(double) <= map->size;
+            array[k] = (const double *)(map->base + offset);
+        }
+        if(ok)
+        {
+            cb->priors = array[0];
+            cb->mu = array[1];
+            cb->sigma = array[2];
+            cb->sqrtPrior = array[3];
+            cb->sqrt2Prior = array[4];
+            cb->sumLogSigma = array[5];
+            cb->invSigma = array[6];
+            cb->sqrtInvSigma = array[7];
+            ok = CheckFisherVectorCodeBook(cb);
+        }
+    }
+    if(!ok)
+        UnmapFile(map);
+    return ok;
+}
+
+#ifdef MATLAB_COMPILE
+// matlab helper function
+//      opt.fv_codebook given as the path of a codebook file; the mapping is kept
+//      between calls and replaced when the path, the size or the write time of the
+//      file changes, so a file is checked once and a rewritten one is mapped again
+MappedFile mat_codebook_map;
+FisherVectorCodeBook mat_codebook;
+char * mat_codebook_path = NULL;
+long long mat_codebook_size = 0, mat_codebook_mtime = 0;
+
+void MatUnmapFisherVectorCodebook()
+{
+    UnmapFile(&mat_codebook_map);
+    if(mat_codebook_path != NULL)
+        mxFree(mat_codebook_path);
+    mat_codebook_path = NULL;
+}
+
+void MatMapFisherVectorCodebook(const mxArray * mx_path, FisherVectorCodeBook * opt)
+{
+    char * path = mxArrayToString(mx_path);
+    long long size = 0, mtime = 0;
+    if(!FileVersion(path, &size, &mtime))
+    {
+        mxFree(path);
+        mexErrMsgTxt("Invalid codebook file");
+    }
+    if(mat_codebook_path == NULL || strcmp(path, mat_codebook_path) != 0
+            || size != mat_codebook_size || mtime != mat_codebook_mtime)
+    {
+        MatUnmapFisherVectorCodebook();
+        if(!MapFisherVectorCodeBookFile(&mat_codebook_map, path, &mat_codebook))
+        {
+            mxFree(path);
+            mexErrMsgTxt("Invalid codebook file");
+        }
+        mat_codebook_path = path;
+        mat_codebook_size = size;
+        mat_codebook_mtime = mtime;
+        mexMakeMemoryPersistent(mat_codebook_path);
+        mexAtExit(MatUnmapFisherVectorCodebook);
+    }
+    else
+        mxFree(path);
+    *opt = mat_codebook;
+}
+#endif
+
+#endif
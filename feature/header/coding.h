@@ -1,8 +1,19 @@
 
 #ifndef CODING_H
 #define CODING_H
+#include <float.h>
 #include "image.h"
 #include "fisher_vector_coding.h"
+#include "fisher_vector_float.h"
+#include "fisher_vector_index.h"
+#include "vq_coding.h"
+#include "pq_coding.h"
+#include "gemm.h"
+#include "scratch.h"
+#include "thread.h"
+#ifdef MATLAB_COMPILE
+    #include "codebook_io.h"
+#endif
 
 // coding struct:
 //      name: name of coding
@@ -13,12 +24,20 @@
 struct CodingOpt;
 
 typedef void (*FuncCodingInit)(CodingOpt * opt);
+typedef void (*FuncCodingFree)(CodingOpt * opt);
 typedef void (*FuncCodingProc)(float * data, float * coding, int * coding_bin, const CodingOpt * opt);
+// code all columns of data, resolved from func_proc by InitCoding()
+//      scratch: arena of the calling thread, scratch_bytes large
+typedef void (*FuncCodingBatch)(FloatMatrix * data, FloatSparseMatrix * coding, const CodingOpt * opt,
+        ScratchArena * scratch);
 
 struct CodingOpt{
     char* name;
     FuncCodingInit func_init;
     FuncCodingProc func_proc;
+    FuncCodingBatch func_batch;
+    // releases what func_init allocated, set by func_init if needed
+    FuncCodingFree func_free;
     
     double * param;
     int nparam;
@@ -27,8 +46,15 @@ struct CodingOpt{
     union
     {
         FisherVectorCodeBook fv_codebook;
-        //VQCodeBook vq_codebook;
+        VQCodeBook vq_codebook;
+        PQCodeBook pq_codebook;
     };
+    // float32 copy of fv_codebook, built by InitCodingFisherVectorFloat()
+    FisherVectorCodeBookFloat fv_codebook_float;
+    // approximate gaussian selection of FisherVector, nCluster = 0 if exhaustive
+    FisherVectorIndex fv_index;
+    // approximate nearest centers of VQ, nCluster = 0 if exhaustive
+    VQIndex vq_index;
     
     int length_input;
     int length;
@@ -36,7 +62,21 @@ struct CodingOpt{
     // sparse info
     int block_size;
     int block_num;
-            
+    
+    // per thread scratch of func_batch, scratch_bytes is set by func_init,
+    // the arenas are allocated by InitCoding()
+    size_t scratch_bytes;
+    int scratch_num;
+    ScratchArena * scratch;
+    
+    // per thread dense accumulators of CodingAggregate(), allocated on first use
+    ScratchArena * aggregate;
+    
+    // scheduling of Coding(), reset by InitCoding(), set after it to override
+    //      item_cost: seconds per column, measured on the first call if 0
+    //      grain: columns per chunk, derived from item_cost if 0
+    double item_cost;
+    int grain;
 };
 
 // ********************************* //
@@ -110,9 +150,6 @@ void InitCodingPixelHOGUoC(CodingOpt * opt)
 inline void FuncCodingPixelHOGUoC (float * data, float * coding, int * coding_bin, const CodingOpt * opt)
 {    
     float gx, gy;
-    int bint ;    
-        
-    int num_ori = int(opt->param[0]);
     
     gy = 0.5f * (data[2] - data[0]);
     gx = 0.5f * (data[1] - data[3]);
@@ -170,21 +207,53 @@ inline void FuncCodingPixelLBP(float * data, float * coding, int * coding_bin, c
     coding_bin[0] = LBP59_Map[bitString];
 }
 
-// *************************************** //
-// Vector Quantization
+// ********************************* //
+// compile-time specialized batch kernel, CodingProc is inlined in the loop
 
-inline void FuncCodingVQ (float * data, float * coding, int * coding_bin, const CodingOpt * opt)
+template <FuncCodingProc CodingProc>
+void CodingKernel(FloatMatrix * data, FloatSparseMatrix * coding, const CodingOpt * opt,
+        ScratchArena * scratch)
 {
+    float * p = data->p;
+    float * coding_val = coding->p;
+    int * coding_bin = coding->i;
+    int block_stride = opt->block_size * opt->block_num;
+    int block_num = opt->block_num;
+    
+    for(int n=0; n<data->width; n++){
+        CodingProc(p, coding_val, coding_bin, opt); 
+        p += opt->length_input;
+        coding_val += block_stride;
+        coding_bin += block_num;
+    }
 }
 
-inline void FuncCodingPQ (float * data, float * coding, int * coding_bin, const CodingOpt * opt)
+// *************************************** //
+// Fisher Vector
+
+#ifndef FV_GEMM_BLOCK
+#define FV_GEMM_BLOCK 64
+#endif
+
+// most gaussians a descriptor is coded with
+#define FV_BLOCK_MAX 32
+// most clusters of the gaussian index
+#define FV_INDEX_CLUSTER_MAX 256
+
+void FreeCodingFisherVector(CodingOpt * opt)
 {
+    if(opt->fv_index.nCluster > 0)
+        FreeFisherVectorIndex(&opt->fv_index);
+    FREE(opt->fv_codebook.gemm_weight);
+    FREE(opt->fv_codebook.gemm_bias);
+    FREE(opt->fv_codebook.gemm_bound);
+    opt->fv_codebook.gemm_weight = NULL;
+    opt->fv_codebook.gemm_bias = NULL;
+    opt->fv_codebook.gemm_bound = NULL;
 }
 
-
-// *************************************** //
-// Fisher Vector
-void InitCodingFisherVector(CodingOpt * opt)
+// coded length and sparse blocks, shared by the double and float codings
+void InitFisherVectorLength(CodingOpt * opt)
 {
     opt->length_input = opt->fv_codebook.nDim;
     // sparse block #
@@ -196,47 +265,112 @@ void InitCodingFisherVector(CodingOpt * opt)
     opt->block_size = 2*opt->fv_codebook.nDim;
     opt->length = 2*opt->fv_codebook.nDim * opt->fv_codebook.nBase;
 #endif
+    ASSERT(opt->block_num <= FV_BLOCK_MAX);
 }
 
-inline void FuncCodingFisherVector (float * data, float * coding, int * coding_bin, const CodingOpt * opt)
-{    
-    // codebook data
-    const FisherVectorCodeBook * cb = &opt->fv_codebook;
-    int nDim = cb->nDim, nBase = cb->nBase;
-    const double * mu = cb->mu, *priors = cb->priors,
-            * invSigma = cb->invSigma, 
-            * sqrtInvSigma = cb->sqrtInvSigma,
-            * sumLogSigma = cb->sumLogSigma;
-    
-    // initialize for prob computation    
-    double probtemp = 0;
-    int indi = 0;
-    int heap_size = 1;
-    double * prob_val = new double[opt->block_num];
-    int * prob_bin = new int[opt->block_num];
-    prob_val[0] = -1;
+void InitCodingFisherVector(CodingOpt * opt)
+{
+    InitFisherVectorLength(opt);
     
-    // find high probability GMM
+    // (x-mu)^2 iS = x^2 iS - 2 x mu iS + mu^2 iS, summed over dimensions
+    FisherVectorCodeBook * cb = &opt->fv_codebook;
+    int nDim = cb->nDim, nBase = cb->nBase;
+    cb->gemm_weight = ALLOCATE(double, 2*nDim*nBase);
+    cb->gemm_bias = ALLOCATE(double, nBase);
+    cb->gemm_bound = ALLOCATE(double, nDim+2);
     for (int i=0; i<nBase; i++){
-        probtemp = sumLogSigma[i];
-        for (int k=0; k<nDim; k++)            
-            probtemp += ((double)data[k]-mu[indi+k])*((double)data[k]-mu[indi+k])*invSigma[indi+k];
-                 
-        probtemp *= -0.5;  
-        indi = indi+nDim;
-                
-        // a min-heap to keep max prob centers        
-        if(heap_size < opt->block_num)
-        {
-            UpHeap(prob_val, prob_bin, &heap_size, probtemp, i);         
-        }
-        else if(probtemp > prob_val[0])
-        {
-            DownHeap(prob_val, prob_bin, &heap_size);
-            UpHeap(prob_val, prob_bin, &heap_size, probtemp, i);     
+        double bias = cb->sumLogSigma[i], mu_norm = 0;
+        for (int k=0; k<nDim; k++){
+            double mu = cb->mu[i*nDim+k], iS = cb->invSigma[i*nDim+k];
+            cb->gemm_weight[k*nBase + i] = iS;
+            cb->gemm_weight[(nDim+k)*nBase + i] = -2*mu*iS;
+            bias += mu*mu*iS;
+            mu_norm += mu*mu*iS;
+            cb->gemm_bound[k] = MAX(cb->gemm_bound[k], iS);
         }
+        cb->gemm_bias[i] = bias;
+        cb->gemm_bound[nDim] = MAX(cb->gemm_bound[nDim], mu_norm);
+        cb->gemm_bound[nDim+1] = MAX(cb->gemm_bound[nDim+1], fabs(cb->sumLogSigma[i]));
+    }
+    opt->func_free = FreeCodingFisherVector;
+    
+    // param: [probe, cluster number], gaussian index if given,
+    // probe clusters of round(sqrt(nBase)) by default are scored
+    opt->fv_index.nCluster = 0;
+    if(opt->nparam >= 1 && opt->param[0] > 0)
+    {
+        int nCluster = opt->nparam >= 2 ? (int)opt->param[1] : (int)(sqrt((double)nBase) + 0.5);
+        ASSERT(nCluster <= FV_INDEX_CLUSTER_MAX);
+        InitFisherVectorIndex(&opt->fv_index, cb, nCluster, (int)opt->param[0]);
     }
     
+    // batch scratch: [x^2; x], likelihoods and the heap of one block
+    opt->scratch_bytes = SCRATCH_BYTES(double, 2*nDim*FV_GEMM_BLOCK)
+            + SCRATCH_BYTES(double, nBase*FV_GEMM_BLOCK)
+            + SCRATCH_BYTES(double, opt->block_num) + SCRATCH_BYTES(int, opt->block_num);
+    if(opt->fv_index.nCluster > 0)
+    {
+        // index: the block gathered by cluster, probe lists and a heap per descriptor
+        int nCluster = opt->fv_index.nCluster;
+        opt->scratch_bytes = 2*SCRATCH_BYTES(double, 2*nDim*FV_GEMM_BLOCK)
+                + SCRATCH_BYTES(double, opt->fv_index.max_rows*FV_GEMM_BLOCK)
+                + 2*SCRATCH_BYTES(int, nCluster*FV_GEMM_BLOCK) + SCRATCH_BYTES(int, nCluster+1)
+                + SCRATCH_BYTES(double, opt->block_num*FV_GEMM_BLOCK)
+                + SCRATCH_BYTES(int, opt->block_num*FV_GEMM_BLOCK) + 2*SCRATCH_BYTES(int, FV_GEMM_BLOCK);
+    }
+}
+
+// log likelihood of gaussian i up to a constant, before the prior
+inline double FisherVectorLogLikelihood(const float * data, int i, const FisherVectorCodeBook * cb)
+{
+    int nDim = cb->nDim;
+    const double * mu = cb->mu + i*nDim, * invSigma = cb->invSigma + i*nDim;
+    
+    double probtemp = cb->sumLogSigma[i];
+    for (int k=0; k<nDim; k++)            
+        probtemp += ((double)data[k]-mu[k])*((double)data[k]-mu[k])*invSigma[k];
+    return -0.5 * probtemp;
+}
+
+// bound of |expanded - FisherVectorLogLikelihood()| over all gaussians for one
+// descriptor: the two forms of -2 log p differ by at most (2 nDim + 4) eps sum |terms|,
+// sum |terms| <= |sumLogSigma| + (sqrt(sum x^2 iS) + sqrt(sum mu^2 iS))^2
+inline double FisherVectorGemmError(const float * data, const FisherVectorCodeBook * cb)
+{
+    int nDim = cb->nDim;
+    double x_norm = 0;
+    for (int k=0; k<nDim; k++)
+        x_norm += (double)data[k]*data[k]*cb->gemm_bound[k];
+    double terms = cb->gemm_bound[nDim+1] + (sqrt(x_norm) + sqrt(cb->gemm_bound[nDim]))
+            * (sqrt(x_norm) + sqrt(cb->gemm_bound[nDim]));
+    return 0.5 * (4*nDim + 8) * DBL_EPSILON * terms;
+}
+
+// a min-heap to keep max prob centers, gaussians are pushed in order
+inline void FisherVectorHeapPush(double * prob_val, int * prob_bin, int * heap_size, int block_num,
+        double probtemp, int i)
+{
+    if(*heap_size < block_num)
+    {
+        UpHeap(prob_val, prob_bin, heap_size, probtemp, i);         
+    }
+    else if(probtemp > prob_val[0])
+    {
+        DownHeap(prob_val, prob_bin, heap_size);
+        UpHeap(prob_val, prob_bin, heap_size, probtemp, i);     
+    }
+}
+
+// coding of one descriptor from the log likelihoods of its top gaussians
+inline void FisherVectorEncode(const float * data, double * prob_val, const int * prob_bin,
+        float * coding, int * coding_bin, const CodingOpt * opt)
+{
+    const FisherVectorCodeBook * cb = &opt->fv_codebook;
+    int nDim = cb->nDim;
+    const double * mu = cb->mu, *priors = cb->priors,
+            * invSigma = cb->invSigma, 
+            * sqrtInvSigma = cb->sqrtInvSigma;
+    
     double probsum = 0;  
     // normalize probs
     for (int i=0; i<opt->block_num; i++){
@@ -246,7 +380,6 @@ inline void FuncCodingFisherVector (float * data, float * coding, int * coding_b
     }
     for (int i=0; i<opt->block_num; i++){
         prob_val[i] /= probsum;
-//         coding[i] = (float)prob_val[i];
     }
         
     // coding vector
@@ -269,144 +402,1130 @@ inline void FuncCodingFisherVector (float * data, float * coding, int * coding_b
 #endif
         }        
     }
+}
+
+// coding with the gaussians of the probed clusters only
+inline void FisherVectorIndexCoding(float * data, float * coding, int * coding_bin, const CodingOpt * opt)
+{
+    const FisherVectorCodeBook * cb = &opt->fv_codebook;
+    const FisherVectorIndex * index = &opt->fv_index;
+    
+    double dist[FV_INDEX_CLUSTER_MAX];
+    int cluster[FV_INDEX_CLUSTER_MAX];
+    int nprobe = FisherVectorIndexProbe(data, index, opt->block_num, dist, cluster);
+    
+    int heap_size = 0;
+    double prob_val[FV_BLOCK_MAX];
+    int prob_bin[FV_BLOCK_MAX];
+    for (int c=0; c<nprobe; c++)
+    {
+        for (int m=index->start[cluster[c]]; m<index->start[cluster[c]+1]; m++)
+        {
+            int i = index->member[m];
+            FisherVectorHeapPush(prob_val, prob_bin, &heap_size, opt->block_num,
+                    FisherVectorLogLikelihood(data, i, cb), i);
+        }
+    }
     
-    delete [] prob_val;
-    delete [] prob_bin;
+    FisherVectorEncode(data, prob_val, prob_bin, coding, coding_bin, opt);
+}
+
+inline void FuncCodingFisherVector (float * data, float * coding, int * coding_bin, const CodingOpt * opt)
+{    
+    const FisherVectorCodeBook * cb = &opt->fv_codebook;
+    if(opt->fv_index.nCluster > 0)
+    {
+        FisherVectorIndexCoding(data, coding, coding_bin, opt);
+        return;
+    }
+    
+    // initialize for prob computation    
+    int heap_size = 0;
+    double prob_val[FV_BLOCK_MAX];
+    int prob_bin[FV_BLOCK_MAX];
+    
+    // find high probability GMM
+    for (int i=0; i<cb->nBase; i++)
+        FisherVectorHeapPush(prob_val, prob_bin, &heap_size, opt->block_num,
+                FisherVectorLogLikelihood(data, i, cb), i);
+    
+    FisherVectorEncode(data, prob_val, prob_bin, coding, coding_bin, opt);
+}
+
+// batched index version: a block of descriptors is probed, then each cluster
+// scores the descriptors that probed it in one product with its member weights;
+// the winners are recomputed directly as in CodingBatchFisherVector()
+void CodingBatchFisherVectorIndex(FloatMatrix * data, FloatSparseMatrix * coding, const CodingOpt * opt,
+        ScratchArena * scratch)
+{
+    const FisherVectorCodeBook * cb = &opt->fv_codebook;
+    const FisherVectorIndex * index = &opt->fv_index;
+    int nDim = cb->nDim, nCluster = index->nCluster;
+    int block_num = opt->block_num;
+    int block_stride = opt->block_size * block_num;
+    
+    ResetScratchArena(scratch);
+    double * x = SCRATCH_ALLOCATE(scratch, double, 2*nDim*FV_GEMM_BLOCK);
+    double * x_cluster = SCRATCH_ALLOCATE(scratch, double, 2*nDim*FV_GEMM_BLOCK);
+    double * loglik = SCRATCH_ALLOCATE(scratch, double, index->max_rows*FV_GEMM_BLOCK);
+    int * probe = SCRATCH_ALLOCATE(scratch, int, nCluster*FV_GEMM_BLOCK);
+    int * probe_num = SCRATCH_ALLOCATE(scratch, int, FV_GEMM_BLOCK);
+    int * list_start = SCRATCH_ALLOCATE(scratch, int, nCluster+1);
+    int * list = SCRATCH_ALLOCATE(scratch, int, nCluster*FV_GEMM_BLOCK);
+    double * prob_val = SCRATCH_ALLOCATE(scratch, double, block_num*FV_GEMM_BLOCK);
+    int * prob_bin = SCRATCH_ALLOCATE(scratch, int, block_num*FV_GEMM_BLOCK);
+    int * heap_size = SCRATCH_ALLOCATE(scratch, int, FV_GEMM_BLOCK);
+    double dist[FV_INDEX_CLUSTER_MAX];
+    
+    for(int n0=0; n0<data->width; n0+=FV_GEMM_BLOCK)
+    {
+        int nc = MIN(FV_GEMM_BLOCK, data->width-n0);
+        
+        // [x^2; x] and probed clusters per descriptor
+        memset(list_start, 0, sizeof(int)*(nCluster+1));
+        for(int j=0; j<nc; j++)
+        {
+            const float * p = data->p + (n0+j)*opt->length_input;
+            double * xj = x + j*2*nDim;
+            for(int k=0; k<nDim; k++)
+            {
+                xj[k] = (double)p[k]*p[k];
+                xj[nDim+k] = p[k];
+            }
+            
+            probe_num[j] = FisherVectorIndexProbe(p, index, block_num, dist, probe + j*nCluster);
+            for(int c=0; c<probe_num[j]; c++)
+                list_start[probe[j*nCluster + c]+1]++;
+            heap_size[j] = 0;
+        }
+        
+        // descriptors by cluster
+        for(int c=0; c<nCluster; c++)
+            list_start[c+1] += list_start[c];
+        for(int j=0; j<nc; j++)
+            for(int c=0; c<probe_num[j]; c++)
+                list[list_start[probe[j*nCluster + c]]++] = j;
+        for(int c=nCluster; c>0; c--)
+            list_start[c] = list_start[c-1];
+        list_start[0] = 0;
+        
+        for(int c=0; c<nCluster; c++)
+        {
+            int nd = list_start[c+1] - list_start[c];
+            int size = index->start[c+1] - index->start[c];
+            int rows = index->row_start[c+1] - index->row_start[c];
+            if(nd == 0 || size == 0)
+                continue;
+            
+            // padding rows are computed and skipped
+            const int * desc = list + list_start[c];
+            for(int t=0; t<nd; t++)
+            {
+                memcpy(x_cluster + t*2*nDim, x + desc[t]*2*nDim, sizeof(double)*2*nDim);
+                memcpy(loglik + t*rows, index->bias + index->row_start[c], sizeof(double)*rows);
+            }
+            Gemm(rows, nd, 2*nDim, index->weight + 2*nDim*index->row_start[c], rows,
+                    x_cluster, 2*nDim, loglik, rows);
+            
+            for(int t=0; t<nd; t++)
+            {
+                int j = desc[t];
+                for(int m=0; m<size; m++)
+                    FisherVectorHeapPush(prob_val + j*block_num, prob_bin + j*block_num, heap_size + j,
+                            block_num, -0.5*loglik[t*rows + m], index->member[index->start[c] + m]);
+            }
+        }
+        
+        for(int j=0; j<nc; j++)
+        {
+            float * p = data->p + (n0+j)*opt->length_input;
+            double * val = prob_val + j*block_num;
+            int * bin = prob_bin + j*block_num;
+            for(int i=0; i<block_num; i++)
+                val[i] = FisherVectorLogLikelihood(p, bin[i], cb);
+            FisherVectorEncode(p, val, bin,
+                    coding->p + (n0+j)*block_stride, coding->i + (n0+j)*block_num, opt);
+        }
+    }
+}
+
+// batched version, the likelihoods of FV_GEMM_BLOCK descriptors against all gaussians
+// are one matrix product [x^2; x] x gemm_weight'. the heap of FuncCodingFisherVector()
+// is then replayed on exact likelihoods: a gaussian whose expanded value plus the
+// rounding bound is not above the heap minimum would not be pushed and is skipped,
+// the others are recomputed directly, so the coding and its bins are the same
+void CodingBatchFisherVector(FloatMatrix * data, FloatSparseMatrix * coding, const CodingOpt * opt,
+        ScratchArena * scratch)
+{
+    const FisherVectorCodeBook * cb = &opt->fv_codebook;
+    int nDim = cb->nDim, nBase = cb->nBase;
+    int block_num = opt->block_num;
+    int block_stride = opt->block_size * block_num;
+    
+    if(opt->fv_index.nCluster > 0)
+    {
+        CodingBatchFisherVectorIndex(data, coding, opt, scratch);
+        return;
+    }
+    
+    ResetScratchArena(scratch);
+    double * x = SCRATCH_ALLOCATE(scratch, double, 2*nDim*FV_GEMM_BLOCK);
+    double * loglik = SCRATCH_ALLOCATE(scratch, double, nBase*FV_GEMM_BLOCK);
+    double * prob_val = SCRATCH_ALLOCATE(scratch, double, block_num);
+    int * prob_bin = SCRATCH_ALLOCATE(scratch, int, block_num);
+    
+    for(int n0=0; n0<data->width; n0+=FV_GEMM_BLOCK)
+    {
+        int nc = MIN(FV_GEMM_BLOCK, data->width-n0);
+        
+        // [x^2; x] per descriptor, likelihoods start from the bias
+        for(int j=0; j<nc; j++)
+        {
+            const float * p = data->p + (n0+j)*opt->length_input;
+            double * xj = x + j*2*nDim;
+            for(int k=0; k<nDim; k++)
+            {
+                xj[k] = (double)p[k]*p[k];
+                xj[nDim+k] = p[k];
+            }
+            memcpy(loglik + j*nBase, cb->gemm_bias, sizeof(double)*nBase);
+        }
+        Gemm(nBase, nc, 2*nDim, cb->gemm_weight, nBase, x, 2*nDim, loglik, nBase);
+        
+        for(int j=0; j<nc; j++)
+        {
+            float * p = data->p + (n0+j)*opt->length_input;
+            const double * l = loglik + j*nBase;
+            
+            double error = FisherVectorGemmError(p, cb);
+            
+            int heap_size = 0;
+            for(int i=0; i<nBase; i++)
+                if(heap_size < block_num || -0.5*l[i] + error > prob_val[0])
+                    FisherVectorHeapPush(prob_val, prob_bin, &heap_size, block_num,
+                            FisherVectorLogLikelihood(p, i, cb), i);
+            
+            FisherVectorEncode(p, prob_val, prob_bin,
+                    coding->p + (n0+j)*block_stride, coding->i + (n0+j)*block_num, opt);
+        }
+    }
+}
+
+// *************************************** //
+// Fisher Vector in single precision, kernels picked by the cpu at init
+
+void FreeCodingFisherVectorFloat(CodingOpt * opt)
+{
+    FreeFisherVectorCodeBookFloat(&opt->fv_codebook_float);
+}
+
+void InitCodingFisherVectorFloat(CodingOpt * opt)
+{
+    InitFisherVectorLength(opt);
+    InitFisherVectorCodeBookFloat(&opt->fv_codebook_float, &opt->fv_codebook);
+    opt->func_free = FreeCodingFisherVectorFloat;
+    
+    // batch scratch: likelihoods of one descriptor group
+    opt->scratch_bytes = SCRATCH_BYTES(float, FV_FLOAT_GROUP*opt->fv_codebook.nBase);
+}
+
+// coding of one descriptor from its top gaussians, prob_val as log likelihoods
+inline void FisherVectorFloatEncodeTop(const float * data, const double * prob_val,
+        float * coding, const int * coding_bin, const CodingOpt * opt)
+{
+    float loglik_buffer[FV_BLOCK_MAX + FV_FLOAT_PAD];
+    float * loglik = (float *)(((size_t)loglik_buffer + SCRATCH_ALIGN-1) / SCRATCH_ALIGN * SCRATCH_ALIGN);
+    
+    // padding is read by the vector weights, keep it finite
+    for(int i=0; i<FV_BLOCK_MAX; i++)
+        loglik[i] = (float)prob_val[i < opt->block_num ? i : 0];
+    opt->fv_codebook_float.func_encode(data, loglik, coding_bin, opt->block_num, opt->block_size,
+            coding, &opt->fv_codebook_float);
+}
+
+// gaussians in chunks of FV_FLOAT_CHUNK, so no likelihood buffer of nBase is needed
+#define FV_FLOAT_CHUNK 64
+
+inline void FuncCodingFisherVectorFloat (float * data, float * coding, int * coding_bin, const CodingOpt * opt)
+{
+    const FisherVectorCodeBookFloat * cb = &opt->fv_codebook_float;
+    
+    int heap_size = 0;
+    double prob_val[FV_BLOCK_MAX];
+    float loglik[FV_FLOAT_CHUNK];
+    for(int i0=0; i0<cb->nBase; i0+=FV_FLOAT_CHUNK)
+    {
+        int i1 = MIN(i0+FV_FLOAT_CHUNK, cb->nBase);
+        cb->func_loglik(data, 0, 1, i0, i1, cb, loglik);
+        for(int i=i0; i<i1; i++)
+            FisherVectorHeapPush(prob_val, coding_bin, &heap_size, opt->block_num, loglik[i-i0], i);
+    }
+    
+    FisherVectorFloatEncodeTop(data, prob_val, coding, coding_bin, opt);
+}
+
+// batched version, FV_FLOAT_GROUP descriptors share the codebook loads
+void CodingBatchFisherVectorFloat(FloatMatrix * data, FloatSparseMatrix * coding, const CodingOpt * opt,
+        ScratchArena * scratch)
+{
+    const FisherVectorCodeBookFloat * cb = &opt->fv_codebook_float;
+    int nBase = cb->nBase;
+    int block_num = opt->block_num;
+    int block_stride = opt->block_size * block_num;
+    
+    ResetScratchArena(scratch);
+    float * loglik = SCRATCH_ALLOCATE(scratch, float, FV_FLOAT_GROUP*nBase);
+    double prob_val[FV_BLOCK_MAX];
+    
+    for(int n0=0; n0<data->width; n0+=FV_FLOAT_GROUP)
+    {
+        int nc = MIN(FV_FLOAT_GROUP, data->width-n0);
+        cb->func_loglik(data->p + n0*opt->length_input, opt->length_input, nc, 0, nBase, cb, loglik);
+        
+        for(int j=0; j<nc; j++)
+        {
+            float * p = data->p + (n0+j)*opt->length_input;
+            int * coding_bin = coding->i + (n0+j)*block_num;
+            
+            int heap_size = 0;
+            for(int i=0; i<nBase; i++)
+                FisherVectorHeapPush(prob_val, coding_bin, &heap_size, block_num, loglik[j*nBase + i], i);
+            
+            FisherVectorFloatEncodeTop(p, prob_val, coding->p + (n0+j)*block_stride, coding_bin, opt);
+        }
+    }
+}
+
+// *************************************** //
+// Vector Quantization
+//      bag of words on descriptors, hard or soft assignment to the knn nearest centers
+//      param: [knn, beta, probe, cluster number]
+//          knn: centers a descriptor is coded with, 1 (hard assignment) by default
+//          beta: soft weights exp(-beta d^2) of the knn centers, normalized to sum 1;
+//              0 or none for equal weights
+//          probe, cluster number: center index if probe > 0, as in CodingFisherVector
+//      bins by ascending distance, block_size = 1
+
+// most centers a descriptor is coded with
+#define VQ_BLOCK_MAX 32
+// most clusters of the center index
+#define VQ_INDEX_CLUSTER_MAX 1024
+
+// knn of param, 1 by default
+inline int CodingVQKnn(const CodingOpt * opt)
+{
+    return (opt->nparam >= 1 && opt->param[0] > 0) ? (int)opt->param[0] : 1;
+}
+
+// clusters of the center index, 0 without it, round(sqrt(nBase)) by default
+inline int CodingVQCluster(const CodingOpt * opt)
+{
+    if(opt->nparam < 3 || opt->param[2] <= 0)
+        return 0;
+    return (opt->nparam >= 4 && opt->param[3] > 0) ? (int)opt->param[3] : (int)(sqrt((double)opt->vq_codebook.nBase) + 0.5);
+}
+
+void FreeCodingVQ(CodingOpt * opt)
+{
+    if(opt->vq_index.nCluster > 0)
+        FreeVQIndex(&opt->vq_index);
+    FreeVQCodeBookGemm(&opt->vq_codebook);
+}
+
+void InitCodingVQ(CodingOpt * opt)
+{
+    VQCodeBook * cb = &opt->vq_codebook;
+    int knn = CodingVQKnn(opt);
+    ASSERT(knn >= 1 && knn <= VQ_BLOCK_MAX && knn <= cb->nBase);
+    opt->length_input = cb->nDim;
+    opt->length = cb->nBase;
+    opt->block_num = knn;
+    opt->block_size = 1;
+    InitVQCodeBookGemm(cb);
+    opt->func_free = FreeCodingVQ;
+    
+    opt->vq_index.nCluster = 0;
+    int nCluster = CodingVQCluster(opt);
+    if(nCluster > 0)
+    {
+        ASSERT(nCluster <= VQ_INDEX_CLUSTER_MAX);
+        InitVQIndex(&opt->vq_index, cb, nCluster, (int)opt->param[2]);
+    }
+    
+    // batch scratch: distances of a block against a chunk of centers, heaps of the block
+    int nDim = cb->nDim;
+    opt->scratch_bytes = SCRATCH_BYTES(float, VQ_GEMM_ROWS*VQ_GEMM_BLOCK)
+            + SCRATCH_BYTES(double, knn*VQ_GEMM_BLOCK) + SCRATCH_BYTES(int, knn*VQ_GEMM_BLOCK)
+            + SCRATCH_BYTES(int, VQ_GEMM_BLOCK);
+    if(opt->vq_index.nCluster > 0)
+    {
+        // index: the block gathered by cluster, probe lists
+        int nCluster = opt->vq_index.nCluster;
+        opt->scratch_bytes = SCRATCH_BYTES(float, nDim*VQ_GEMM_BLOCK)
+                + SCRATCH_BYTES(float, opt->vq_index.max_rows*VQ_GEMM_BLOCK)
+                + 2*SCRATCH_BYTES(int, nCluster*VQ_GEMM_BLOCK) + SCRATCH_BYTES(int, nCluster+1)
+                + SCRATCH_BYTES(double, knn*VQ_GEMM_BLOCK) + SCRATCH_BYTES(int, knn*VQ_GEMM_BLOCK)
+                + 2*SCRATCH_BYTES(int, VQ_GEMM_BLOCK);
+    }
+}
+
+// coding of one descriptor from its nearest centers bin, in any order;
+// the distances are recomputed directly, so all paths weight alike
+inline void VQEncode(const float * data, const int * bin, float * coding, int * coding_bin, const CodingOpt * opt)
+{
+    const VQCodeBook * cb = &opt->vq_codebook;
+    int knn = opt->block_num;
+    double dist[VQ_BLOCK_MAX];
+    for(int i=0; i<knn; i++)
+    {
+        coding_bin[i] = bin[i];
+        dist[i] = VQDistance(data, bin[i], cb);
+    }
+    
+    // ascending distance, ties by center id
+    for(int i=1; i<knn; i++)
+        for(int j=i; j>0 && (dist[j] < dist[j-1] || (dist[j] == dist[j-1] && coding_bin[j] < coding_bin[j-1])); j--)
+        {
+            double d = dist[j]; dist[j] = dist[j-1]; dist[j-1] = d;
+            int t = coding_bin[j]; coding_bin[j] = coding_bin[j-1]; coding_bin[j-1] = t;
+        }
+    
+    double beta = opt->nparam >= 2 ? opt->param[1] : 0;
+    double sum = 0;
+    for(int i=0; i<knn; i++)
+    {
+        dist[i] = beta > 0 ? exp(-beta*(dist[i] - dist[0])) : 1;
+        sum += dist[i];
+    }
+    for(int i=0; i<knn; i++)
+        coding[i] = (float)(dist[i] / sum);
+}
+
+inline void FuncCodingVQ (float * data, float * coding, int * coding_bin, const CodingOpt * opt)
+{
+    const VQCodeBook * cb = &opt->vq_codebook;
+    const VQIndex * index = &opt->vq_index;
+    
+    int heap_size = 0;
+    double heap_val[VQ_BLOCK_MAX];
+    int heap_bin[VQ_BLOCK_MAX];
+    if(index->nCluster > 0)
+    {
+        float dist[VQ_INDEX_CLUSTER_MAX];
+        int cluster[VQ_INDEX_CLUSTER_MAX];
+        int nprobe = VQIndexProbe(data, index, opt->block_num, dist, cluster);
+        for(int c=0; c<nprobe; c++)
+            for(int m=index->start[cluster[c]]; m<index->start[cluster[c]+1]; m++)
+                FisherVectorHeapPush(heap_val, heap_bin, &heap_size, opt->block_num,
+                        -VQDistance(data, index->member[m], cb), index->member[m]);
+    }
+    else
+    {
+        for(int i=0; i<cb->nBase; i++)
+            FisherVectorHeapPush(heap_val, heap_bin, &heap_size, opt->block_num, -VQDistance(data, i, cb), i);
+    }
+    
+    VQEncode(data, heap_bin, coding, coding_bin, opt);
+}
+
+// batched index version: a block of descriptors is probed, then each cluster
+// scores the descriptors that probed it in one product with its member weights
+void CodingBatchVQIndex(FloatMatrix * data, FloatSparseMatrix * coding, const CodingOpt * opt,
+        ScratchArena * scratch)
+{
+    const VQIndex * index = &opt->vq_index;
+    int nDim = opt->vq_codebook.nDim, nCluster = index->nCluster;
+    int knn = opt->block_num;
+    
+    ResetScratchArena(scratch);
+    float * x_cluster = SCRATCH_ALLOCATE(scratch, float, nDim*VQ_GEMM_BLOCK);
+    float * score = SCRATCH_ALLOCATE(scratch, float, index->max_rows*VQ_GEMM_BLOCK);
+    int * probe = SCRATCH_ALLOCATE(scratch, int, nCluster*VQ_GEMM_BLOCK);
+    int * probe_num = SCRATCH_ALLOCATE(scratch, int, VQ_GEMM_BLOCK);
+    int * list_start = SCRATCH_ALLOCATE(scratch, int, nCluster+1);
+    int * list = SCRATCH_ALLOCATE(scratch, int, nCluster*VQ_GEMM_BLOCK);
+    double * heap_val = SCRATCH_ALLOCATE(scratch, double, knn*VQ_GEMM_BLOCK);
+    int * heap_bin = SCRATCH_ALLOCATE(scratch, int, knn*VQ_GEMM_BLOCK);
+    int * heap_size = SCRATCH_ALLOCATE(scratch, int, VQ_GEMM_BLOCK);
+    float dist[VQ_INDEX_CLUSTER_MAX];
+    
+    for(int n0=0; n0<data->width; n0+=VQ_GEMM_BLOCK)
+    {
+        int nc = MIN(VQ_GEMM_BLOCK, data->width-n0);
+        
+        // probed clusters per descriptor
+        memset(list_start, 0, sizeof(int)*(nCluster+1));
+        for(int j=0; j<nc; j++)
+        {
+            const float * p = data->p + (n0+j)*opt->length_input;
+            probe_num[j] = VQIndexProbe(p, index, knn, dist, probe + j*nCluster);
+            for(int c=0; c<probe_num[j]; c++)
+                list_start[probe[j*nCluster + c]+1]++;
+            heap_size[j] = 0;
+        }
+        
+        // descriptors by cluster
+        for(int c=0; c<nCluster; c++)
+            list_start[c+1] += list_start[c];
+        for(int j=0; j<nc; j++)
+            for(int c=0; c<probe_num[j]; c++)
+                list[list_start[probe[j*nCluster + c]]++] = j;
+        for(int c=nCluster; c>0; c--)
+            list_start[c] = list_start[c-1];
+        list_start[0] = 0;
+        
+        for(int c=0; c<nCluster; c++)
+        {
+            int nd = list_start[c+1] - list_start[c];
+            int size = index->start[c+1] - index->start[c];
+            int rows = index->row_start[c+1] - index->row_start[c];
+            if(nd == 0 || size == 0)
+                continue;
+            
+            // padding rows are computed and skipped
+            const int * desc = list + list_start[c];
+            for(int t=0; t<nd; t++)
+            {
+                memcpy(x_cluster + t*nDim, data->p + (n0+desc[t])*opt->length_input, sizeof(float)*nDim);
+                memcpy(score + t*rows, index->bias + index->row_start[c], sizeof(float)*rows);
+            }
+            Gemm(rows, nd, nDim, index->weight + nDim*index->row_start[c], rows,
+                    x_cluster, nDim, score, rows);
+            
+            for(int t=0; t<nd; t++)
+            {
+                int j = desc[t];
+                for(int m=0; m<size; m++)
+                    FisherVectorHeapPush(heap_val + j*knn, heap_bin + j*knn, heap_size + j,
+                            knn, -score[t*rows + m], index->member[index->start[c] + m]);
+            }
+        }
+        
+        for(int j=0; j<nc; j++)
+            VQEncode(data->p + (n0+j)*opt->length_input, heap_bin + j*knn,
+                    coding->p + (n0+j)*knn, coding->i + (n0+j)*knn, opt);
+    }
+}
+
+// batched version, the distances of VQ_GEMM_BLOCK descriptors to VQ_GEMM_ROWS centers
+// at a time are one matrix product with gemm_weight, |x|^2 is left out as it does
+// not change the order. near ties may pick other centers than FuncCodingVQ()
+void CodingBatchVQ(FloatMatrix * data, FloatSparseMatrix * coding, const CodingOpt * opt,
+        ScratchArena * scratch)
+{
+    const VQCodeBook * cb = &opt->vq_codebook;
+    int nDim = cb->nDim, nBase = cb->nBase;
+    int knn = opt->block_num;
+    
+    if(opt->vq_index.nCluster > 0)
+    {
+        CodingBatchVQIndex(data, coding, opt, scratch);
+        return;
+    }
+    
+    ResetScratchArena(scratch);
+    float * score = SCRATCH_ALLOCATE(scratch, float, VQ_GEMM_ROWS*VQ_GEMM_BLOCK);
+    double * heap_val = SCRATCH_ALLOCATE(scratch, double, knn*VQ_GEMM_BLOCK);
+    int * heap_bin = SCRATCH_ALLOCATE(scratch, int, knn*VQ_GEMM_BLOCK);
+    int * heap_size = SCRATCH_ALLOCATE(scratch, int, VQ_GEMM_BLOCK);
+    
+    for(int n0=0; n0<data->width; n0+=VQ_GEMM_BLOCK)
+    {
+        int nc = MIN(VQ_GEMM_BLOCK, data->width-n0);
+        const float * x = data->p + n0*opt->length_input;
+        for(int j=0; j<nc; j++)
+            heap_size[j] = 0;
+        
+        for(int i0=0; i0<nBase; i0+=VQ_GEMM_ROWS)
+        {
+            int rows = MIN(VQ_GEMM_ROWS, nBase-i0);
+            for(int j=0; j<nc; j++)
+                memcpy(score + j*rows, cb->gemm_bias + i0, sizeof(float)*rows);
+            Gemm(rows, nc, nDim, cb->gemm_weight + i0, nBase, x, opt->length_input, score, rows);
+            
+            for(int j=0; j<nc; j++)
+                for(int i=0; i<rows; i++)
+                    FisherVectorHeapPush(heap_val + j*knn, heap_bin + j*knn, heap_size + j,
+                            knn, -score[j*rows + i], i0 + i);
+        }
+        
+        for(int j=0; j<nc; j++)
+            VQEncode(x + j*opt->length_input, heap_bin + j*knn,
+                    coding->p + (n0+j)*knn, coding->i + (n0+j)*knn, opt);
+    }
+}
+
+// *************************************** //
+// Product Quantization
+//      descriptors split into nSub subspaces, each hard assigned to the nearest center
+//      of its own sub-codebook, see pq_coding.h
+//      bin m is m*nCenter + code of subspace m, value 1; block_num = nSub, block_size = 1
+//      CodingPQCodes() packs a coding into uint8 codes for PQDistanceTable() / PQScan()
+
+void FreeCodingPQ(CodingOpt * opt)
+{
+    FreePQCodeBookGemm(&opt->pq_codebook);
+}
+
+void InitCodingPQ(CodingOpt * opt)
+{
+    PQCodeBook * cb = &opt->pq_codebook;
+    ASSERT(cb->nCenter <= PQ_CENTER_MAX && cb->nSub*cb->subDim == cb->nDim);
+    opt->length_input = cb->nDim;
+    opt->length = cb->nSub*cb->nCenter;
+    opt->block_num = cb->nSub;
+    opt->block_size = 1;
+    InitPQCodeBookGemm(cb);
+    opt->func_free = FreeCodingPQ;
+    
+    // batch scratch: distances of a block against a sub-codebook, codes of the block
+    opt->scratch_bytes = SCRATCH_BYTES(float, VQ_GEMM_ROWS*VQ_GEMM_BLOCK) + SCRATCH_BYTES(int, VQ_GEMM_BLOCK)
+            + SCRATCH_BYTES(unsigned char, cb->nSub*VQ_GEMM_BLOCK);
+}
+
+inline void FuncCodingPQ (float * data, float * coding, int * coding_bin, const CodingOpt * opt)
+{
+    const PQCodeBook * cb = &opt->pq_codebook;
+    for(int m=0; m<cb->nSub; m++)
+    {
+        int best = 0;
+        double best_dist = PQSubDistance(data, m, 0, cb);
+        for(int i=1; i<cb->nCenter; i++)
+        {
+            double dist = PQSubDistance(data, m, i, cb);
+            if(dist < best_dist)
+            {
+                best_dist = dist;
+                best = i;
+            }
+        }
+        coding[m] = 1;
+        coding_bin[m] = m*cb->nCenter + best;
+    }
+}
+
+// batched version, PQEncode() of VQ_GEMM_BLOCK descriptors at a time.
+// near ties may pick other centers than FuncCodingPQ()
+void CodingBatchPQ(FloatMatrix * data, FloatSparseMatrix * coding, const CodingOpt * opt,
+        ScratchArena * scratch)
+{
+    const PQCodeBook * cb = &opt->pq_codebook;
+    int nSub = cb->nSub;
+    
+    ResetScratchArena(scratch);
+    float * score = SCRATCH_ALLOCATE(scratch, float, VQ_GEMM_ROWS*VQ_GEMM_BLOCK);
+    int * nearest = SCRATCH_ALLOCATE(scratch, int, VQ_GEMM_BLOCK);
+    unsigned char * codes = SCRATCH_ALLOCATE(scratch, unsigned char, nSub*VQ_GEMM_BLOCK);
+    
+    for(int n0=0; n0<data->width; n0+=VQ_GEMM_BLOCK)
+    {
+        int nc = MIN(VQ_GEMM_BLOCK, data->width-n0);
+        PQEncode(data->p + n0*opt->length_input, nc, cb, codes, nearest, score);
+        for(int j=0; j<nc*nSub; j++)
+        {
+            coding->p[n0*nSub + j] = 1;
+            coding->i[n0*nSub + j] = (j % nSub)*cb->nCenter + codes[j];
+        }
+    }
+}
+
+// uint8 codes of a CodingPQ coding, codes: dim nSub x coding->width
+void CodingPQCodes(const FloatSparseMatrix * coding, const CodingOpt * opt, unsigned char * codes)
+{
+    int nSub = opt->pq_codebook.nSub, nCenter = opt->pq_codebook.nCenter;
+    for(long long j=0; j<(long long)coding->width*nSub; j++)
+        codes[j] = (unsigned char)(coding->i[j] - (int)(j % nSub)*nCenter);
+}
+
+// ********************************* //
+// registry by name
+
+struct CodingEntry
+{
+    const char * name;
+    FuncCodingInit func_init;
+    FuncCodingProc func_proc;
+    FuncCodingBatch func_batch;
+};
+
+#define CODING_ENTRY(name) {#name, Init ## name, Func ## name, CodingKernel<Func ## name>}
+
+static const CodingEntry CodingRegistry[] = 
+{
+    CODING_ENTRY(CodingPixelHOG),
+    CODING_ENTRY(CodingPixelHOGUoC),
+    CODING_ENTRY(CodingPixelLBP),
+    {"CodingFisherVector", InitCodingFisherVector, FuncCodingFisherVector, CodingBatchFisherVector},
+    {"CodingFisherVectorFloat", InitCodingFisherVectorFloat, FuncCodingFisherVectorFloat, CodingBatchFisherVectorFloat},
+    {"CodingVQ", InitCodingVQ, FuncCodingVQ, CodingBatchVQ},
+    {"CodingPQ", InitCodingPQ, FuncCodingPQ, CodingBatchPQ},
+    {NULL, NULL, NULL, NULL}
+};
+
+// set coding functions from name, false if not found
+bool SetCoding(CodingOpt * opt, const char * name)
+{
+    for(const CodingEntry * e = CodingRegistry; e->name != NULL; e++)
+    {
+        if(RegistryNameMatch(e->name, "Coding", name))
+        {
+            opt->func_init = e->func_init;
+            opt->func_proc = e->func_proc;
+            opt->func_batch = e->func_batch;
+            return true;
+        }
+    }
+    return false;
+}
+
+// specialized batch kernel of a coding function, NULL if not registered
+FuncCodingBatch FindCodingBatch(FuncCodingProc func_proc)
+{
+    for(const CodingEntry * e = CodingRegistry; e->name != NULL; e++)
+        if(e->func_proc == func_proc)
+            return e->func_batch;
+    return NULL;
 }
 
 // ********************************* //
 
 void InitCoding(CodingOpt * opt)
 {
+    opt->func_free = NULL;
+    opt->scratch_bytes = 0;
+    opt->fv_index.nCluster = 0;
+    opt->fv_index.probe = 0;
+    opt->vq_index.nCluster = 0;
+    opt->vq_index.probe = 0;
     opt->func_init(opt);
+    opt->func_batch = FindCodingBatch(opt->func_proc);
+    
+    // one arena per coding thread
+    opt->scratch_num = ThreadNum();
+    opt->scratch = ALLOCATE(ScratchArena, opt->scratch_num);
+    for(int t=0; t<opt->scratch_num; t++)
+        AllocateScratchArena(opt->scratch + t, opt->scratch_bytes);
+    opt->aggregate = NULL;
+    opt->item_cost = 0;
+    opt->grain = 0;
 }
 
-#ifndef THREAD_MAX
-// normal version
-void Coding(FloatMatrix * data, FloatSparseMatrix * coding, CodingOpt * opt)
+void FreeCoding(CodingOpt * opt)
 {
-    float * p = data->p;
-    float * coding_val = coding->p;
-    int * coding_bin = coding->i;
-    int block_stride = opt->block_size * opt->block_num;
-    int block_num = opt->block_num;
+    if(opt->func_free != NULL)
+        opt->func_free(opt);
+    opt->func_free = NULL;
     
-    for(int n=0; n<data->width; n++){
-        opt->func_proc(p, coding_val, coding_bin, opt); 
-        p += opt->length_input;
-        coding_val += block_stride;
-        coding_bin += block_num;
+    for(int t=0; t<opt->scratch_num; t++)
+    {
+        FreeScratchArena(opt->scratch + t);
+        if(opt->aggregate != NULL)
+            FreeScratchArena(opt->aggregate + t);
     }
+    FREE(opt->scratch);
+    FREE(opt->aggregate);
+    opt->aggregate = NULL;
+    opt->scratch = NULL;
+    opt->scratch_num = 0;
 }
 
-#else
-// MT version
-struct CodingMTArgs
+// NULL if opt, read but not initialized, can be initialized, else the reason;
+// for options from users, before InitCoding() whose checks are asserts
+const char * CodingOptError(const CodingOpt * opt)
+{
+    if(opt->func_init == InitCodingVQ)
+    {
+        int knn = CodingVQKnn(opt);
+        if(opt->vq_codebook.nDim <= 0 || opt->vq_codebook.nBase <= 0)
+            return "vq codebook is empty";
+        if(knn < 1 || knn > VQ_BLOCK_MAX || knn > opt->vq_codebook.nBase)
+            return "vq knn must be 1 to 32 and at most the center number";
+        if(CodingVQCluster(opt) > VQ_INDEX_CLUSTER_MAX)
+            return "vq index takes at most 1024 clusters";
+    }
+    if(opt->func_init == InitCodingPQ)
+    {
+        const PQCodeBook * cb = &opt->pq_codebook;
+        if(cb->subDim <= 0 || cb->nSub <= 0 || cb->nCenter <= 0 || cb->nSub*cb->subDim != cb->nDim)
+            return "pq codebook is empty or its sizes do not match";
+        if(cb->nCenter > PQ_CENTER_MAX)
+            return "pq codes are uint8, at most 256 centers per subspace";
+    }
+    return NULL;
+}
+
+// coded length of opt, read but not initialized, without building its tables:
+// the codebook codings take it from the codebook, the others are cheap to initialize
+int CodingLength(const CodingOpt * opt)
+{
+    CodingOpt init = *opt;
+    if(opt->func_init == InitCodingFisherVector || opt->func_init == InitCodingFisherVectorFloat)
+    {
+        InitFisherVectorLength(&init);
+        return init.length;
+    }
+    if(opt->func_init == InitCodingVQ)
+        return opt->vq_codebook.nBase;
+    if(opt->func_init == InitCodingPQ)
+        return opt->pq_codebook.nSub*opt->pq_codebook.nCenter;
+    
+    init.func_free = NULL;
+    init.func_init(&init);
+    if(init.func_free != NULL)
+        init.func_free(&init);
+    return init.length;
+}
+
+struct CodingArgs
 {
-    FloatMatrix data;
-    FloatSparseMatrix coding;
+    FloatMatrix * data;
+    FloatSparseMatrix * coding;
     const CodingOpt * opt;
+    int start;
 };
 
-// thread function
-#if defined(WIN32)
-DWORD WINAPI
-#elif defined(__UNIX__)  
-void *
-#endif 
-CodingThread(
-#if defined(WIN32)
-        LPVOID 
-#elif defined(__UNIX__)   
-        void *
-#endif
-        args_in)
+// columns start+begin..start+end-1, on the scratch of the running worker
+void CodingTask(void * args_in, int begin, int end)
 {
-    CodingMTArgs * args = (CodingMTArgs *) args_in;
-    FloatMatrix * data = &args->data;
-    FloatSparseMatrix * coding = &args->coding;
+    CodingArgs * args = (CodingArgs *)args_in;
     const CodingOpt * opt = args->opt;
-    
-    float * p = data->p;
-    float * coding_val = coding->p;
-    int * coding_bin = coding->i;
-    int block_stride = opt->block_size * opt->block_num;
     int block_num = opt->block_num;
-    //printf("%d, %d, %d, %d\n", data->width, opt->length_input, block_num, block_stride);
-	//return 0;
-	
-    for(int n=0; n<data->width; n++){
-        opt->func_proc(p, coding_val, coding_bin, opt);   
+    int block_stride = opt->block_size * block_num;
+    begin += args->start;
+    end += args->start;
+    
+    FloatMatrix data = *args->data;
+    data.p += opt->length_input*begin;
+    data.width = end - begin;
+    FloatSparseMatrix coding = *args->coding;
+    coding.p += block_stride*begin;
+    coding.i += block_num*begin;
+    coding.width = end - begin;
+    
+    if(opt->func_batch != NULL)
+    {
+        if(ThreadIndex() < opt->scratch_num)
+        {
+            opt->func_batch(&data, &coding, opt, opt->scratch + ThreadIndex());
+            return;
+        }
+        
+        // a worker the pool gained after InitCoding(), when nested in its task
+        ScratchArena scratch;
+        AllocateScratchArena(&scratch, opt->scratch_bytes);
+        opt->func_batch(&data, &coding, opt, &scratch);
+        FreeScratchArena(&scratch);
+        return;
+    }
+    
+    float * p = data.p;
+    float * coding_val = coding.p;
+    int * coding_bin = coding.i;
+    for(int n=0; n<data.width; n++){
+        opt->func_proc(p, coding_val, coding_bin, opt); 
         p += opt->length_input;
         coding_val += block_stride;
         coding_bin += block_num;
     }
+}
+
+// ********************************* //
+// cost per column of each coding, shared by all CodingOpt in the process
+//      keyed by the coding function and the sizes its cost depends on
+
+#define CODING_COST_CACHE 64
+// a calibration codes columns until this long, or CODING_CALIBRATE_MAX columns
+#define CODING_CALIBRATE_TIME 200e-6
+#define CODING_CALIBRATE_MAX 4096
 
-	return 0;
+struct CodingCost
+{
+    FuncCodingProc func_proc;
+    int length_input, length, block_num;
+    // of the index the coding uses, 0 without one
+    int nCluster, probe;
+    double item_cost;
+};
+
+static CodingCost coding_cost[CODING_COST_CACHE];
+static int coding_cost_num = 0;
+static volatile long coding_cost_lock = 0;
+
+// clusters and probe of the index opt uses, FisherVector or VQ
+inline void CodingCostIndex(const CodingOpt * opt, int * nCluster, int * probe)
+{
+    *nCluster = opt->vq_index.nCluster > 0 ? opt->vq_index.nCluster : opt->fv_index.nCluster;
+    *probe = opt->vq_index.nCluster > 0 ? opt->vq_index.probe : opt->fv_index.probe;
 }
 
-// thread caller
-void Coding(FloatMatrix * data, FloatSparseMatrix * coding, CodingOpt * opt)
+inline bool CodingCostMatch(const CodingCost * cost, const CodingOpt * opt)
 {
-#if defined(WIN32) 
-    HANDLE  hThreadArray[THREAD_MAX];
-#elif defined(__UNIX__)   
-    pthread_t hThreadArray[THREAD_MAX];
-#endif
+    int nCluster, probe;
+    CodingCostIndex(opt, &nCluster, &probe);
+    return cost->func_proc == opt->func_proc && cost->length_input == opt->length_input
+            && cost->length == opt->length && cost->block_num == opt->block_num
+            && cost->nCluster == nCluster && cost->probe == probe;
+}
+
+// 0 if the coding was not calibrated yet
+double FindCodingCost(const CodingOpt * opt)
+{
+    double item_cost = 0;
+    SpinLock(&coding_cost_lock);
+    for(int k=0; k<coding_cost_num; k++)
+        if(CodingCostMatch(coding_cost + k, opt))
+            item_cost = coding_cost[k].item_cost;
+    SpinUnlock(&coding_cost_lock);
+    return item_cost;
+}
+
+void SaveCodingCost(const CodingOpt * opt, double item_cost)
+{
+    SpinLock(&coding_cost_lock);
+    int k = 0;
+    while(k < coding_cost_num && !CodingCostMatch(coding_cost + k, opt))
+        k++;
+    if(k == CODING_COST_CACHE)
+        k = CODING_COST_CACHE-1;
+    coding_cost_num = MAX(coding_cost_num, k+1);
+    coding_cost[k].func_proc = opt->func_proc;
+    coding_cost[k].length_input = opt->length_input;
+    coding_cost[k].length = opt->length;
+    coding_cost[k].block_num = opt->block_num;
+    CodingCostIndex(opt, &coding_cost[k].nCluster, &coding_cost[k].probe);
+    coding_cost[k].item_cost = item_cost;
+    SpinUnlock(&coding_cost_lock);
+}
+
+// sets opt->item_cost from the cache, or by timing the first columns of data
+// serially in growing batches; returns the number of columns coded
+int CalibrateCoding(FloatMatrix * data, FloatSparseMatrix * coding, CodingOpt * opt)
+{
+    opt->item_cost = FindCodingCost(opt);
+    if(opt->item_cost > 0)
+        return 0;
     
-    CodingMTArgs thread_arg[THREAD_MAX];
-    int ntask = data->width;
-    int task_per_thread = (int)ceil(1.0*ntask/THREAD_MAX);
+    CodingArgs args;
+    args.data = data;
+    args.coding = coding;
+    args.opt = opt;
+    args.start = 0;
     
+    int num = 0, batch = 8;
+    double start = ThreadClock(), elapsed = 0;
+    while(num < data->width && num < CODING_CALIBRATE_MAX && elapsed < CODING_CALIBRATE_TIME)
+    {
+        int end = MIN(num + batch, data->width);
+        CodingTask(&args, num, end);
+        num = end;
+        batch *= 2;
+        elapsed = ThreadClock() - start;
+    }
+    
+    if(num > 0)
+        opt->item_cost = MAX(elapsed / num, 1e-10);
+    // too few columns for a stable figure are not shared
+    if(elapsed >= CODING_CALIBRATE_TIME || num >= CODING_CALIBRATE_MAX)
+        SaveCodingCost(opt, opt->item_cost);
+    return num;
+}
+
+// columns are coded in chunks on the thread pool, one scratch arena per worker;
+// the chunk size and worker number follow the cost of a column
+void Coding(FloatMatrix * data, FloatSparseMatrix * coding, CodingOpt * opt)
+{
+    CodingArgs args;
+    args.data = data;
+    args.coding = coding;
+    args.opt = opt;
+    args.start = 0;
+    // nested in a parallel loop the columns are coded serially, nothing to tune
+    if(opt->item_cost <= 0 && opt->grain <= 0 && ThreadNum() > 1 && !ThreadInTask())
+        args.start = CalibrateCoding(data, coding, opt);
+    
+    int ntask = data->width - args.start;
+    int nworker = opt->scratch_num;
+    int grain = opt->grain;
+    if(grain <= 0)
+        grain = ParallelGrain(ntask, opt->item_cost, &nworker);
+    ParallelFor(ntask, CodingTask, &args, grain, nworker);
+}
+
+// ********************************* //
+// image-level aggregation
+//      sums the codes of all columns of data into dense vectors of opt->length,
+//      without the per-descriptor sparse output. a column is coded once and added
+//      to each of its cells, one cell for the whole image by default. the columns
+//      are split into ThreadNum() contiguous parts, each coded chunk by chunk into
+//      the dense accumulators of its part; the parts are reduced in order, so the
+//      result does not depend on thread timing
+
+#define CODING_AGGREGATE_CHUNK 64
+
+// normalization flags of CodingAggregate(), applied to each cell
+#define CODING_NORM_POWER 1 // signed square root
+#define CODING_NORM_L2 2
+
+// cells of column n, dim per_column
+typedef void (*FuncAggregateCells)(const void * args, int n, int * cell);
+
+struct AggregateCells
+{
+    FuncAggregateCells func;
+    const void * args;
+    int per_column;
+    int ncell;
+};
+
+struct CodingAggregateArgs
+{
+    FloatMatrix * data;
+    const CodingOpt * opt;
+    const AggregateCells * cells;
+    int part_size;
+};
+
+void CodingAggregateTask(void * args_in, int begin, int end)
+{
+    CodingAggregateArgs * args = (CodingAggregateArgs *)args_in;
+    const CodingOpt * opt = args->opt;
+    const AggregateCells * cells = args->cells;
+    FloatMatrix * data = args->data;
+    int length = opt->length;
     int block_num = opt->block_num;
     int block_size = opt->block_size;
     int block_stride = block_size * block_num;
-
-	//mexPrintf("%d, %d, %d, %d, %d, %d\n", ntask, task_per_thread, THREAD_MAX, block_num, block_stride, opt->length_input);
-	//return;
+    int per_column = cells->per_column;
     
-    for(int t=0; t<THREAD_MAX; t++)
+    for(int t=begin; t<end; t++)
     {
-        int task_start = t*task_per_thread;
-        int task_num = MIN(task_per_thread, ntask-task_start);
-        
-        // assign input
-        thread_arg[t].data.p = data->p + opt->length_input*task_start;
-        thread_arg[t].data.width = task_num;
-        thread_arg[t].data.height = data->height;
-        thread_arg[t].data.depth = data->depth;
-        thread_arg[t].data.stride = data->stride;
+        ScratchArena * arena = opt->aggregate + t;
+        ResetScratchArena(arena);
+        double * sum = SCRATCH_ALLOCATE(arena, double, length*cells->ncell);
+        float * chunk_val = SCRATCH_ALLOCATE(arena, float, block_stride*CODING_AGGREGATE_CHUNK);
+        int * chunk_bin = SCRATCH_ALLOCATE(arena, int, block_num*CODING_AGGREGATE_CHUNK);
+        int * chunk_cell = SCRATCH_ALLOCATE(arena, int, per_column*CODING_AGGREGATE_CHUNK);
+        memset(sum, 0, sizeof(double)*length*cells->ncell);
         
-        // assign output
-        thread_arg[t].coding.p = coding->p + block_stride*task_start;
-        thread_arg[t].coding.i = coding->i + block_num*task_start;
-        thread_arg[t].coding.width = task_num;
-        thread_arg[t].coding.height = coding->height;
-        thread_arg[t].coding.block_num = block_num;
-        thread_arg[t].coding.block_size = block_size;
-        
-        // assign opt
-        thread_arg[t].opt = opt;
-        // launch thread
-#if defined(WIN32) 
-        hThreadArray[t] = CreateThread(NULL, 0, CodingThread, &thread_arg[t], 0, NULL);
-#elif defined(__UNIX__)   
-        pthread_create(&hThreadArray[t], NULL, CodingThread, (void *)&thread_arg[t])
-#endif
-        
-    }    
-    
-#if defined(WIN32) 
-    WaitForMultipleObjects(THREAD_MAX, hThreadArray, TRUE, INFINITE);
-#elif defined(__UNIX__) 
-    void * status;
-    for(int t=0; t<THREAD_MAX; t++) 
-        pthread_join(hThreadArray[t], &status);
-#endif
-
+        int part_start = t*args->part_size;
+        int part_end = MIN(part_start + args->part_size, data->width);
+        for(int start=part_start; start<part_end; start+=CODING_AGGREGATE_CHUNK)
+        {
+            int num = MIN(CODING_AGGREGATE_CHUNK, part_end-start);
+            float * p = data->p + opt->length_input*start;
+            
+            if(opt->func_batch != NULL)
+            {
+                FloatMatrix chunk_data = *data;
+                chunk_data.p = p;
+                chunk_data.width = num;
+                
+                FloatSparseMatrix chunk_coding;
+                chunk_coding.p = chunk_val;
+                chunk_coding.i = chunk_bin;
+                chunk_coding.width = num;
+                chunk_coding.height = length;
+                chunk_coding.block_num = block_num;
+                chunk_coding.block_size = block_size;
+                opt->func_batch(&chunk_data, &chunk_coding, opt, opt->scratch + t);
+            }
+            else
+            {
+                for(int n=0; n<num; n++)
+                    opt->func_proc(p + opt->length_input*n, chunk_val + block_stride*n, chunk_bin + block_num*n, opt);
+            }
+            
+            if(cells->func == NULL)
+                memset(chunk_cell, 0, sizeof(int)*per_column*num);
+            else
+                for(int n=0; n<num; n++)
+                    cells->func(cells->args, start+n, chunk_cell + per_column*n);
+            
+            // scatter the blocks to their bins in every cell of the column
+            for(int n=0; n<num; n++)
+            {
+                const int * cell = chunk_cell + per_column*n;
+                for(int b=0; b<block_num; b++)
+                {
+                    const float * src = chunk_val + (n*block_num + b)*block_size;
+                    int offset = chunk_bin[n*block_num + b]*block_size;
+                    for(int c=0; c<per_column; c++)
+                    {
+                        double * dst = sum + cell[c]*length + offset;
+                        for(int k=0; k<block_size; k++)
+                            dst[k] += src[k];
+                    }
+                }
+            }
+        }
+    }
 }
 
-#endif
+// feat: dim opt->length x cells->ncell, cells: NULL for one cell of all columns
+// normalize: CODING_NORM_* flags
+void CodingAggregate(FloatMatrix * data, float * feat, CodingOpt * opt, int normalize,
+        const AggregateCells * cells = NULL)
+{
+    AggregateCells image_cell = {NULL, NULL, 1, 1};
+    if(cells == NULL)
+        cells = &image_cell;
+    
+    int length = opt->length;
+    int nthread = opt->scratch_num;
+    size_t bytes = SCRATCH_BYTES(double, length*cells->ncell)
+            + SCRATCH_BYTES(float, opt->block_size*opt->block_num*CODING_AGGREGATE_CHUNK)
+            + SCRATCH_BYTES(int, opt->block_num*CODING_AGGREGATE_CHUNK)
+            + SCRATCH_BYTES(int, cells->per_column*CODING_AGGREGATE_CHUNK);
+    if(opt->aggregate == NULL)
+        opt->aggregate = ALLOCATE(ScratchArena, nthread);
+    if(opt->aggregate[0].size < bytes)
+    {
+        for(int t=0; t<nthread; t++)
+        {
+            FreeScratchArena(opt->aggregate + t);
+            AllocateScratchArena(opt->aggregate + t, bytes);
+        }
+    }
+    
+    // one part per thread, no thread gets less than a chunk
+    int nchunk = (data->width + CODING_AGGREGATE_CHUNK-1) / CODING_AGGREGATE_CHUNK;
+    int npart = MAX(MIN(nthread, nchunk), 1);
+    CodingAggregateArgs args;
+    args.data = data;
+    args.opt = opt;
+    args.cells = cells;
+    args.part_size = (nchunk + npart-1) / npart * CODING_AGGREGATE_CHUNK;
+    ParallelFor(npart, CodingAggregateTask, &args);
+    
+    // reduce in part order
+    int total = length*cells->ncell;
+    double * sum = (double *)opt->aggregate[0].base;
+    for(int t=1; t<npart; t++)
+    {
+        const double * part = (const double *)opt->aggregate[t].base;
+        for(int k=0; k<total; k++)
+            sum[k] += part[k];
+    }
+    
+    for(int c=0; c<cells->ncell; c++)
+    {
+        double * cell_sum = sum + c*length;
+        if(normalize & CODING_NORM_POWER)
+            for(int k=0; k<length; k++)
+                cell_sum[k] = cell_sum[k] < 0 ? -sqrt(-cell_sum[k]) : sqrt(cell_sum[k]);
+        
+        double scale = 1;
+        if(normalize & CODING_NORM_L2)
+        {
+            double norm = 0;
+            for(int k=0; k<length; k++)
+                norm += cell_sum[k]*cell_sum[k];
+            scale = norm > 0 ? 1/sqrt(norm) : 0;
+        }
+        for(int k=0; k<length; k++)
+            feat[c*length + k] = (float)(cell_sum[k]*scale);
+    }
+}
 
 #ifdef MATLAB_COMPILE
 // matlab helper function
@@ -431,11 +1550,47 @@ void MatReadCodingOpt(const mxArray * mat_opt, CodingOpt * opt)
         opt->nparam = mxGetNumberOfElements(mxGetField(mat_opt, 0, "param"));    
     }
     
-    // get codebook
-    MatReadFisherVectorCodebook(mxGetField(mat_opt, 0, "fv_codebook"), &opt->fv_codebook);    
+    // get codebook, a struct or the path of a codebook file
+    mxArray * mx_codebook = mxGetField(mat_opt, 0, "fv_codebook");
+    if(mx_codebook != NULL && mxIsChar(mx_codebook))
+        MatMapFisherVectorCodebook(mx_codebook, &opt->fv_codebook);
+    else
+        MatReadFisherVectorCodebook(mx_codebook, &opt->fv_codebook);
+    MatReadVQCodebook(mxGetField(mat_opt, 0, "vq_codebook"), &opt->vq_codebook);
+    MatReadPQCodebook(mxGetField(mat_opt, 0, "pq_codebook"), &opt->pq_codebook);
     
+#ifdef CODING_NAME
     opt->func_init = FUNC_INIT(CODING_NAME);
     opt->func_proc = FUNC_PROC(CODING_NAME);
+#else
+    // pick the coding at runtime
+    bool found = SetCoding(opt, opt->name);
+    if(!found)
+        mexErrMsgTxt("Unknown coding name");
+#endif
+    
+    const char * error = CodingOptError(opt);
+    if(error != NULL)
+        mexErrMsgTxt(error);
+}
+
+// optional scheduling fields, before InitCoding() so the arenas follow thread_num
+//      thread_num: workers of the call, 0 for the core count; returns the previous
+//          thread number, set back with SetThreadNum() before the call returns
+//      grain: columns per chunk of Coding(), 0 to derive it from the measured cost;
+//          InitCoding() clears opt->grain, so it is set after it from *grain
+int MatReadCodingSchedule(const mxArray * mat_opt, int * grain)
+{
+    int thread_num = ThreadNum();
+    mxArray * mx_thread_num = mxGetField(mat_opt, 0, "thread_num");
+    if(mx_thread_num != NULL && !mxIsEmpty(mx_thread_num))
+        SetThreadNum((int)mxGetScalar(mx_thread_num));
+    
+    *grain = 0;
+    mxArray * mx_grain = mxGetField(mat_opt, 0, "grain");
+    if(mx_grain != NULL && !mxIsEmpty(mx_grain))
+        *grain = (int)mxGetScalar(mx_grain);
+    return thread_num;
 }
 #endif
 
@@ -0,0 +1,547 @@
+#ifndef FEATURE_STORE_H
+#define FEATURE_STORE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "image.h"
+#include "mapped_file.h"
+
+#if defined(__F16C__)
+    #include <immintrin.h>
+#endif
+
+// ***************************** //
+// append-only binary store of extracted features, read back through mmap
+//      file: header, records, index
+//          header (64 bytes): magic "FSTR", version, payload type, record number,
+//              index offset; the last two are 0 until the store is closed
+//          record (64 byte header, then payload), at 64 byte aligned offsets:
+//              dense: rows x cols elements, column major
+//              block sparse: the block bins (int32, block_num x cols), padded to
+//              the payload type, then block_size x block_num x cols elements,
+//              as FloatSparseMatrix
+//          index: one entry (offset, image) per record, by ascending image
+//      elements are float32 or fp16 (FEATURE_STORE_HALF); float32 records are read
+//      in place, fp16 ones are widened by FeatureStoreToFloat().
+//      a store that was not closed, e.g. after a crash, is read by walking the records
+//      little endian, the layout of the host
+
+#define FEATURE_STORE_VERSION 1
+#define FEATURE_STORE_ALIGN 64
+
+// payload type
+#define FEATURE_STORE_FLOAT 0
+#define FEATURE_STORE_HALF 1
+
+// record encoding
+#define FEATURE_STORE_DENSE 0
+#define FEATURE_STORE_SPARSE 1
+
+struct FeatureStoreHeader
+{
+    char magic[4];
+    int version;
+    int type;
+    int record_num;
+    long long index_offset;
+    long long reserved[5];
+};
+
+struct FeatureStoreRecordHeader
+{
+    int image;
+    int encoding;
+    int rows, cols;
+    int block_num, block_size;
+    long long bytes; // payload bytes, without the padding to the next record
+    long long reserved[4];
+};
+
+struct FeatureStoreEntry
+{
+    long long offset;
+    int image;
+    int reserved;
+};
+
+// ***************************** //
+// fp16, round to nearest even
+
+inline unsigned short FloatToHalf(float value)
+{
+    unsigned int x;
+    memcpy(&x, &value, sizeof(float));
+    unsigned int sign = (x >> 16) & 0x8000;
+    unsigned int mant = x & 0x7fffff;
+    int exp = (int)((x >> 23) & 0xff);
+
+    if(exp == 255)
+        return (unsigned short)(sign | 0x7c00 | (mant != 0 ? 0x200 : 0));
+    int e = exp - 127 + 15;
+    if(e >= 31)
+        return (unsigned short)(sign | 0x7c00);
+    if(e <= 0)
+    {
+        // subnormal half, units of 2^-24
+        if(e < -10)
+            return (unsigned short)sign;
+        mant |= 0x800000;
+        int shift = 14 - e;
+        unsigned int half = mant >> shift;
+        unsigned int rest = mant & ((1u << shift) - 1), mid = 1u << (shift-1);
+        if(rest > mid || (rest == mid && (half & 1)))
+            half++;
+        return (unsigned short)(sign | half);
+    }
+
+    // a carry out of the mantissa moves to the next exponent, up to inf
+    unsigned int half = ((unsigned int)e << 10) | (mant >> 13);
+    unsigned int rest = mant & 0x1fff;
+    if(rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+        half++;
+    return (unsigned short)(sign | half);
+}
+
+inline float HalfToFloat(unsigned short half)
+{
+    unsigned int sign = (unsigned int)(half & 0x8000) << 16;
+    int exp = (half >> 10) & 0x1f;
+    unsigned int mant = half & 0x3ff;
+    unsigned int x;
+    if(exp == 0 && mant == 0)
+        x = sign;
+    else if(exp == 0)
+    {
+        // subnormal, normalized for float
+        exp = 1;
+        while((mant & 0x400) == 0)
+        {
+            mant <<= 1;
+            exp--;
+        }
+        x = sign | ((unsigned int)(exp + 127 - 15) << 23) | ((mant & 0x3ff) << 13);
+    }
+    else if(exp == 31)
+        x = sign | 0x7f800000 | (mant << 13);
+    else
+        x = sign | ((unsigned int)(exp + 127 - 15) << 23) | (mant << 13);
+
+    float value;
+    memcpy(&value, &x, sizeof(float));
+    return value;
+}
+
+void FloatToHalfArray(const float * src, unsigned short * dst, size_t n)
+{
+    size_t i = 0;
+#if defined(__F16C__)
+    for(; i+8 <= n; i+=8)
+        _mm_storeu_si128((__m128i *)(dst + i), _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT));
+#endif
+    for(; i<n; i++)
+        dst[i] = FloatToHalf(src[i]);
+}
+
+void HalfToFloatArray(const unsigned short * src, float * dst, size_t n)
+{
+    size_t i = 0;
+#if defined(__F16C__)
+    for(; i+8 <= n; i+=8)
+        _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(src + i))));
+#endif
+    for(; i<n; i++)
+        dst[i] = HalfToFloat(src[i]);
+}
+
+inline long long FeatureStorePad(long long bytes)
+{
+    return (bytes + FEATURE_STORE_ALIGN-1) / FEATURE_STORE_ALIGN * FEATURE_STORE_ALIGN;
+}
+
+inline int FeatureStoreElement(int type)
+{
+    return type == FEATURE_STORE_HALF ? 2 : 4;
+}
+
+// bytes of the bins of a sparse record, padded to the element size
+inline long long FeatureStoreBinBytes(long long nbin, int type)
+{
+    int element = FeatureStoreElement(type);
+    return (nbin * sizeof(int) + element-1) / element * element;
+}
+
+// ***************************** //
+// writer
+//      one thread appends at a time, e.g. the serialized sink of BatchFeature()
+
+struct FeatureStoreWriter
+{
+    FILE * file;
+    int type;
+    long long offset;
+    FeatureStoreEntry * entry;
+    int entry_num, entry_capacity;
+    unsigned short * half; // conversion buffer
+    size_t half_size;
+    bool error;
+};
+
+// false if path cannot be created
+bool OpenFeatureStore(FeatureStoreWriter * writer, const char * path, int type)
+{
+    memset(writer, 0, sizeof(FeatureStoreWriter));
+    writer->type = type;
+    writer->file = fopen(path, "wb");
+    if(writer->file == NULL)
+        return false;
+
+    FeatureStoreHeader header;
+    memset(&header, 0, sizeof(FeatureStoreHeader));
+    memcpy(header.magic, "FSTR", 4);
+    header.version = FEATURE_STORE_VERSION;
+    header.type = type;
+    writer->error = fwrite(&header, sizeof(FeatureStoreHeader), 1, writer->file) != 1;
+    writer->offset = sizeof(FeatureStoreHeader);
+    return !writer->error;
+}
+
+// n elements of data in the payload type
+void FeatureStoreWriteElements(FeatureStoreWriter * writer, const float * data, size_t n)
+{
+    if(writer->type == FEATURE_STORE_FLOAT)
+    {
+        writer->error = writer->error || fwrite(data, sizeof(float), n, writer->file) != n;
+        return;
+    }
+    if(writer->half_size < n)
+    {
+        if(writer->half != NULL)
+            FREE(writer->half);
+        writer->half_size = n > 2*writer->half_size ? n : 2*writer->half_size;
+        writer->half = ALLOCATE(unsigned short, writer->half_size);
+    }
+    FloatToHalfArray(data, writer->half, n);
+    writer->error = writer->error || fwrite(writer->half, sizeof(unsigned short), n, writer->file) != n;
+}
+
+void FeatureStoreBeginRecord(FeatureStoreWriter * writer, FeatureStoreRecordHeader * record)
+{
+    if(writer->entry_num == writer->entry_capacity)
+    {
+        int capacity = MAX(2*writer->entry_capacity, 1024);
+        FeatureStoreEntry * grown = ALLOCATE(FeatureStoreEntry, capacity);
+        if(writer->entry_num > 0)
+            memcpy(grown, writer->entry, sizeof(FeatureStoreEntry) * writer->entry_num);
+        if(writer->entry != NULL)
+            FREE(writer->entry);
+        writer->entry = grown;
+        writer->entry_capacity = capacity;
+    }
+    FeatureStoreEntry * entry = writer->entry + writer->entry_num++;
+    entry->offset = writer->offset;
+    entry->image = record->image;
+    entry->reserved = 0;
+    writer->error = writer->error || fwrite(record, sizeof(FeatureStoreRecordHeader), 1, writer->file) != 1;
+}
+
+void FeatureStoreEndRecord(FeatureStoreWriter * writer, long long bytes)
+{
+    static const char zero[FEATURE_STORE_ALIGN] = {0};
+    long long padded = FeatureStorePad(bytes);
+    if(padded > bytes)
+        writer->error = writer->error || fwrite(zero, 1, (size_t)(padded - bytes), writer->file) != (size_t)(padded - bytes);
+    writer->offset += sizeof(FeatureStoreRecordHeader) + padded;
+}
+
+// feat of image, rows x cols; a NULL feat stores an empty record, e.g. for an unreadable image
+void AppendDenseFeature(FeatureStoreWriter * writer, int image, const FloatMatrix * feat)
+{
+    FeatureStoreRecordHeader record;
+    memset(&record, 0, sizeof(FeatureStoreRecordHeader));
+    record.image = image;
+    record.encoding = FEATURE_STORE_DENSE;
+    if(feat != NULL)
+    {
+        record.rows = feat->height;
+        record.cols = feat->width;
+    }
+    size_t n = (size_t)record.rows * record.cols;
+    record.bytes = (long long)n * FeatureStoreElement(writer->type);
+
+    FeatureStoreBeginRecord(writer, &record);
+    if(n > 0)
+        FeatureStoreWriteElements(writer, feat->p, n);
+    FeatureStoreEndRecord(writer, record.bytes);
+}
+
+void AppendSparseFeature(FeatureStoreWriter * writer, int image, const FloatSparseMatrix * coding)
+{
+    FeatureStoreRecordHeader record;
+    memset(&record, 0, sizeof(FeatureStoreRecordHeader));
+    record.image = image;
+    record.encoding = FEATURE_STORE_SPARSE;
+    record.rows = coding->height;
+    record.cols = coding->width;
+    record.block_num = coding->block_num;
+    record.block_size = coding->block_size;
+    size_t nbin = (size_t)coding->block_num * coding->width;
+    size_t n = nbin * coding->block_size;
+    long long bin_bytes = FeatureStoreBinBytes(nbin, writer->type);
+    record.bytes = bin_bytes + (long long)n * FeatureStoreElement(writer->type);
+
+    static const char zero[4] = {0};
+    FeatureStoreBeginRecord(writer, &record);
+    writer->error = writer->error || fwrite(coding->i, sizeof(int), nbin, writer->file) != nbin;
+    if(bin_bytes > (long long)(nbin * sizeof(int)))
+        writer->error = writer->error || fwrite(zero, 1, (size_t)(bin_bytes - nbin*sizeof(int)), writer->file) == 0;
+    FeatureStoreWriteElements(writer, coding->p, n);
+    FeatureStoreEndRecord(writer, record.bytes);
+}
+
+int CompareFeatureStoreEntry(const void * a, const void * b)
+{
+    const FeatureStoreEntry * x = (const FeatureStoreEntry *)a;
+    const FeatureStoreEntry * y = (const FeatureStoreEntry *)b;
+    if(x->image != y->image)
+        return x->image < y->image ? -1 : 1;
+    return x->offset < y->offset ? -1 : (x->offset > y->offset ? 1 : 0);
+}
+
+// writes the index and completes the header, false if any write failed
+bool CloseFeatureStore(FeatureStoreWriter * writer)
+{
+    if(writer->file == NULL)
+        return false;
+
+    qsort(writer->entry, writer->entry_num, sizeof(FeatureStoreEntry), CompareFeatureStoreEntry);
+    long long index_offset = writer->offset;
+    if(writer->entry_num > 0)
+        writer->error = writer->error
+                || fwrite(writer->entry, sizeof(FeatureStoreEntry), writer->entry_num, writer->file) != (size_t)writer->entry_num;
+
+    FeatureStoreHeader header;
+    memset(&header, 0, sizeof(FeatureStoreHeader));
+    memcpy(header.magic, "FSTR", 4);
+    header.version = FEATURE_STORE_VERSION;
+    header.type = writer->type;
+    header.record_num = writer->entry_num;
+    header.index_offset = index_offset;
+    writer->error = writer->error || fseek(writer->file, 0, SEEK_SET) != 0
+            || fwrite(&header, sizeof(FeatureStoreHeader), 1, writer->file) != 1;
+    writer->error = (fclose(writer->file) != 0) || writer->error;
+    writer->file = NULL;
+
+    if(writer->entry != NULL)
+        FREE(writer->entry);
+    if(writer->half != NULL)
+        FREE(writer->half);
+    writer->entry = NULL;
+    writer->half = NULL;
+    return !writer->error;
+}
+
+// ***************************** //
+// reader
+
+struct FeatureStore
+{
+    MappedFile map;
+    const FeatureStoreHeader * header;
+    const FeatureStoreEntry * entry;
+    int record_num;
+    FeatureStoreEntry * recovered; // index of an unclosed store
+};
+
+// a record, pointers into the mapping
+//      data: rows x cols or block_size x block_num x cols elements of the payload type
+//      bin: block_num x cols, sparse records only
+struct FeatureRecord
+{
+    int image;
+    int encoding;
+    int type;
+    int rows, cols;
+    int block_num, block_size;
+    const void * data;
+    const int * bin;
+};
+
+// payload bytes implied by the sizes of record, -1 if a size is negative, the
+// encoding is unknown or the payload would be over limit bytes
+long long FeatureStoreRecordBytes(const FeatureStoreRecordHeader * record, int type, long long limit)
+{
+    if(record->rows < 0 || record->cols < 0 || record->block_num < 0 || record->block_size < 0)
+        return -1;
+    long long element = FeatureStoreElement(type);
+    if(record->encoding == FEATURE_STORE_DENSE)
+    {
+        long long n = (long long)record->rows * record->cols;
+        return n > limit / element ? -1 : n * element;
+    }
+    if(record->encoding != FEATURE_STORE_SPARSE)
+        return -1;
+    long long nbin = (long long)record->block_num * record->cols;
+    if(nbin > limit / (long long)sizeof(int)
+            || (record->block_size > 0 && nbin > limit / element / record->block_size))
+        return -1;
+    return FeatureStoreBinBytes(nbin, type) + nbin * record->block_size * element;
+}
+
+// the record at offset if it lies in the file and its bytes match its sizes, else NULL
+const FeatureStoreRecordHeader * FeatureStoreRecordAt(const FeatureStore * store, long long offset)
+{
+    if(offset < (long long)sizeof(FeatureStoreHeader) || offset % FEATURE_STORE_ALIGN != 0
+            || offset + (long long)sizeof(FeatureStoreRecordHeader) > store->map.size)
+        return NULL;
+    const FeatureStoreRecordHeader * record = (const FeatureStoreRecordHeader *)(store->map.base + offset);
+    if(record->bytes < 0 || offset + (long long)sizeof(FeatureStoreRecordHeader) + record->bytes > store->map.size)
+        return NULL;
+    if(record->bytes != FeatureStoreRecordBytes(record, store->header->type, store->map.size))
+        return NULL;
+    return record;
+}
+
+// index of an unclosed store, walking the records
+void RecoverFeatureStoreIndex(FeatureStore * store)
+{
+    int capacity = 1024, num = 0;
+    FeatureStoreEntry * entry = ALLOCATE(FeatureStoreEntry, capacity);
+    long long offset = sizeof(FeatureStoreHeader);
+    const FeatureStoreRecordHeader * record;
+    while((record = FeatureStoreRecordAt(store, offset)) != NULL)
+    {
+        if(num == capacity)
+        {
+            FeatureStoreEntry * grown = ALLOCATE(FeatureStoreEntry, 2*capacity);
+            memcpy(grown, entry, sizeof(FeatureStoreEntry) * num);
+            FREE(entry);
+            entry = grown;
+            capacity *= 2;
+        }
+        entry[num].offset = offset;
+        entry[num].image = record->image;
+        entry[num].reserved = 0;
+        num++;
+        offset += sizeof(FeatureStoreRecordHeader) + FeatureStorePad(record->bytes);
+    }
+    qsort(entry, num, sizeof(FeatureStoreEntry), CompareFeatureStoreEntry);
+    store->recovered = entry;
+    store->entry = entry;
+    store->record_num = num;
+}
+
+void UnmapFeatureStore(FeatureStore * store)
+{
+    if(store->recovered != NULL)
+        FREE(store->recovered);
+    UnmapFile(&store->map);
+    memset(store, 0, sizeof(FeatureStore));
+}
+
+// map path read only, false if it is not a valid store
+bool MapFeatureStore(FeatureStore * store, const char * path)
+{
+    memset(store, 0, sizeof(FeatureStore));
+    if(!MapFile(&store->map, path, sizeof(FeatureStoreHeader)))
+        return false;
+
+    store->header = (const FeatureStoreHeader *)store->map.base;
+    const FeatureStoreHeader * header = store->header;
+    if(memcmp(header->magic, "FSTR", 4) != 0 || header->version != FEATURE_STORE_VERSION
+            || (header->type != FEATURE_STORE_FLOAT && header->type != FEATURE_STORE_HALF))
+    {
+        UnmapFeatureStore(store);
+        return false;
+    }
+
+    // the index of a closed store, checked once here
+    if(header->index_offset > 0)
+    {
+        bool valid = header->record_num >= 0 && header->index_offset
+                + (long long)header->record_num * (long long)sizeof(FeatureStoreEntry) <= store->map.size;
+        store->entry = (const FeatureStoreEntry *)(store->map.base + header->index_offset);
+        for(int k=0; valid && k<header->record_num; k++)
+            valid = FeatureStoreRecordAt(store, store->entry[k].offset) != NULL;
+        if(!valid)
+        {
+            UnmapFeatureStore(store);
+            return false;
+        }
+        store->record_num = header->record_num;
+    }
+    else
+        RecoverFeatureStoreIndex(store);
+    return true;
+}
+
+// record k of the index, by ascending image
+void FeatureStoreRecord(const FeatureStore * store, int k, FeatureRecord * record)
+{
+    ASSERT(k >= 0 && k < store->record_num);
+    const FeatureStoreRecordHeader * header = (const FeatureStoreRecordHeader *)(store->map.base + store->entry[k].offset);
+    const char * payload = (const char *)(header + 1);
+    record->image = header->image;
+    record->encoding = header->encoding;
+    record->type = store->header->type;
+    record->rows = header->rows;
+    record->cols = header->cols;
+    record->block_num = header->block_num;
+    record->block_size = header->block_size;
+    record->bin = NULL;
+    record->data = payload;
+    if(header->encoding == FEATURE_STORE_SPARSE)
+    {
+        record->bin = (const int *)payload;
+        record->data = payload + FeatureStoreBinBytes((long long)header->block_num * header->cols, record->type);
+    }
+}
+
+// index of the first record of image, -1 if absent
+int FindFeatureStoreImage(const FeatureStore * store, int image)
+{
+    int lo = 0, hi = store->record_num;
+    while(lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if(store->entry[mid].image < image)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return (lo < store->record_num && store->entry[lo].image == image) ? lo : -1;
+}
+
+// elements of a record
+inline size_t FeatureRecordSize(const FeatureRecord * record)
+{
+    if(record->encoding == FEATURE_STORE_SPARSE)
+        return (size_t)record->block_size * record->block_num * record->cols;
+    return (size_t)record->rows * record->cols;
+}
+
+// view of a dense float32 record, no copy; false for other records
+bool FeatureRecordMatrix(const FeatureRecord * record, FloatMatrix * matrix)
+{
+    if(record->encoding != FEATURE_STORE_DENSE || record->type != FEATURE_STORE_FLOAT)
+        return false;
+    matrix->p = (float *)record->data;
+    matrix->height = record->rows;
+    matrix->width = record->cols;
+    matrix->depth = 1;
+    matrix->stride = record->rows;
+    matrix->type = IMAGE_FLOAT;
+    return true;
+}
+
+// elements of a record as float32, dst: dim FeatureRecordSize()
+void FeatureStoreToFloat(const FeatureRecord * record, float * dst)
+{
+    size_t n = FeatureRecordSize(record);
+    if(record->type == FEATURE_STORE_HALF)
+        HalfToFloatArray((const unsigned short *)record->data, dst, n);
+    else
+        memcpy(dst, record->data, sizeof(float) * n);
+}
+
+#endif
@@ -17,6 +17,14 @@ struct FisherVectorCodeBook
     const double * invSigma; // dim nDim x nBase
     const double * sqrtInvSigma; // dim nDim x nBase
     const double * sumLogSigma; // dim nBase
+    
+    // expanded quadratic form for the batched likelihood, set by InitCodingFisherVector()
+    //      -2 log p_k(x) = gemm_bias[k] + sum_d w(k, d) x_d^2 + w(k, nDim+d) x_d
+    double * gemm_weight; // dim nBase x 2nDim, w(k, j) at gemm_weight[j*nBase + k]
+    double * gemm_bias; // dim nBase
+    // rounding bound of the expanded form: max_k invSigma(k, d) for each d, then
+    // max_k sum_d mu^2 invSigma and max_k |sumLogSigma|
+    double * gemm_bound; // dim nDim + 2
 };
 
 // Binary heap operation
@@ -41,8 +49,7 @@ inline void DownHeap(double * ele, int * idx, int * heap_size)
         return;
     }
     
-    float ele_min = ele[0];
-    float ele_last = ele[(*heap_size)-1];
+    double ele_last = ele[(*heap_size)-1];
     int idx_last = idx[(*heap_size)-1];
     (*heap_size)--;
     
@@ -82,6 +89,9 @@ void MatReadFisherVectorCodebook(const mxArray * mat_opt, FisherVectorCodeBook *
     COPY_MATRIX_FIELD(invSigma, double);
     COPY_MATRIX_FIELD(sqrtInvSigma, double);
     COPY_MATRIX_FIELD(sumLogSigma, double);
+    opt->gemm_weight = NULL;
+    opt->gemm_bias = NULL;
+    opt->gemm_bound = NULL;
 //     mexPrintf("%d, %d, %f, %f\n", opt->nDim, opt->nBase, opt->priors[0], opt->mu[0]);
 }
 
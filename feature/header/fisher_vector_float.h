@@ -0,0 +1,539 @@
+#ifndef FISHER_VECTOR_FLOAT_H
+#define FISHER_VECTOR_FLOAT_H
+
+#include <math.h>
+#include "image.h"
+#include "simd.h"
+#include "scratch.h"
+#include "fisher_vector_coding.h"
+
+// ***************************** //
+// single precision fisher vector coding
+//      the double codebook repacked as float struct-of-arrays, each gaussian row
+//      padded to FV_FLOAT_PAD floats with zeros so rows start on a cache line;
+//      likelihoods, exp and coding run in float with the kernel of SimdLevel()
+
+#define FV_FLOAT_PAD 16
+// descriptors sharing each codebook load
+#define FV_FLOAT_GROUP 4
+
+struct FisherVectorCodeBookFloat;
+
+// log likelihoods of gaussians base1..base2-1 for nx <= FV_FLOAT_GROUP descriptors,
+//      descriptor j at x + j*x_stride, its likelihoods at loglik + j*(base2-base1)
+typedef void (*FuncFisherVectorFloatLogLikelihood)(const float * x, int x_stride, int nx,
+        int base1, int base2, const FisherVectorCodeBookFloat * cb, float * loglik);
+// coding of x from the log likelihoods loglik[block_num] of gaussians prob_bin;
+//      loglik is FV_FLOAT_PAD aligned and padded, it is overwritten by the weights
+typedef void (*FuncFisherVectorFloatEncode)(const float * x, float * loglik, const int * prob_bin,
+        int block_num, int block_size, float * coding, const FisherVectorCodeBookFloat * cb);
+
+struct FisherVectorCodeBookFloat
+{
+    int nDim, nBase;
+    int nDimPad;
+
+    // dim nDimPad x nBase
+    float * mu;
+    float * invSigma;
+    float * sqrtInvSigma;
+    float * muSqrtInvSigma; // distance terms as (x sqrtIS - mu sqrtIS)^2
+    // dim nBase
+    float * halfLogSigma; // -0.5 sumLogSigma
+    float * priors;
+    float * invSqrtPrior;
+    float * invSqrt2Prior;
+
+    int simd_level;
+    FuncFisherVectorFloatLogLikelihood func_loglik;
+    FuncFisherVectorFloatEncode func_encode;
+
+    ScratchArena storage;
+};
+
+// ********************************* //
+// scalar kernels
+
+inline void FisherVectorFloatLogLikelihoodScalar(const float * x, int x_stride, int nx,
+        int base1, int base2, const FisherVectorCodeBookFloat * cb, float * loglik)
+{
+    int n = base2 - base1;
+    for(int j=0; j<nx; j++, x += x_stride, loglik += n)
+    {
+        for(int i=base1; i<base2; i++)
+        {
+            const float * mu = cb->mu + i*cb->nDimPad, * iS = cb->invSigma + i*cb->nDimPad;
+            float sum = 0;
+            for(int k=0; k<cb->nDim; k++)
+                sum += (x[k]-mu[k]) * (x[k]-mu[k]) * iS[k];
+            loglik[i-base1] = cb->halfLogSigma[i] - 0.5f*sum;
+        }
+    }
+}
+
+// weights exp(l - max) * prior normalized to sum 1, padding weighs 0
+inline void FisherVectorFloatWeightScalar(float * loglik, const int * prob_bin, int block_num,
+        const FisherVectorCodeBookFloat * cb)
+{
+    float lmax = loglik[0];
+    for(int i=1; i<block_num; i++)
+        lmax = MAX(lmax, loglik[i]);
+
+    float sum = 0;
+    for(int i=0; i<block_num; i++)
+    {
+        loglik[i] = expf(loglik[i] - lmax) * cb->priors[prob_bin[i]];
+        sum += loglik[i];
+    }
+    for(int i=0; i<block_num; i++)
+        loglik[i] /= sum;
+}
+
+inline void FisherVectorFloatEncodeScalar(const float * x, float * loglik, const int * prob_bin,
+        int block_num, int block_size, float * coding, const FisherVectorCodeBookFloat * cb)
+{
+    FisherVectorFloatWeightScalar(loglik, prob_bin, block_num, cb);
+
+    int nDim = cb->nDim;
+    for(int i=0; i<block_num; i++, coding += block_size)
+    {
+        int bin = prob_bin[i];
+        const float * mu = cb->mu + bin*cb->nDimPad,
+                * iS = cb->invSigma + bin*cb->nDimPad,
+                * sqrtIS = cb->sqrtInvSigma + bin*cb->nDimPad;
+        float a = loglik[i] * cb->invSqrtPrior[bin];
+        float b = loglik[i] * cb->invSqrt2Prior[bin];
+
+        for(int k=0; k<nDim; k++)
+        {
+            float diff = x[k] - mu[k];
+            coding[k] = a * diff * sqrtIS[k];
+#ifndef FIRST_ORDER
+            coding[nDim+k] = b * diff * diff * iS[k] - b;
+#endif
+        }
+    }
+}
+
+#ifdef SIMD_DISPATCH
+// ********************************* //
+// sse4 kernels
+
+SIMD_TARGET("sse4.1") inline float HorizontalSum(__m128 s)
+{
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    return _mm_cvtss_f32(_mm_add_ss(s, _mm_shuffle_ps(s, s, 1)));
+}
+
+// cephes expf: 2^n * p(r), x = n ln2 + r
+SIMD_TARGET("sse4.1") inline __m128 ExpFloat4(__m128 x)
+{
+    x = _mm_max_ps(_mm_min_ps(x, _mm_set1_ps(88.37f)), _mm_set1_ps(-87.33f));
+    __m128 n = _mm_round_ps(_mm_mul_ps(x, _mm_set1_ps(1.44269504f)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    x = _mm_sub_ps(x, _mm_mul_ps(n, _mm_set1_ps(0.693359375f)));
+    x = _mm_sub_ps(x, _mm_mul_ps(n, _mm_set1_ps(-2.12194440e-4f)));
+
+    __m128 p = _mm_set1_ps(1.9875691500e-4f);
+    p = _mm_add_ps(_mm_mul_ps(p, x), _mm_set1_ps(1.3981999507e-3f));
+    p = _mm_add_ps(_mm_mul_ps(p, x), _mm_set1_ps(8.3334519073e-3f));
+    p = _mm_add_ps(_mm_mul_ps(p, x), _mm_set1_ps(4.1665795894e-2f));
+    p = _mm_add_ps(_mm_mul_ps(p, x), _mm_set1_ps(1.6666665459e-1f));
+    p = _mm_add_ps(_mm_mul_ps(p, x), _mm_set1_ps(5.0000001201e-1f));
+    p = _mm_add_ps(_mm_add_ps(_mm_mul_ps(p, _mm_mul_ps(x, x)), x), _mm_set1_ps(1.0f));
+
+    __m128i e = _mm_slli_epi32(_mm_add_epi32(_mm_cvtps_epi32(n), _mm_set1_epi32(127)), 23);
+    return _mm_mul_ps(p, _mm_castsi128_ps(e));
+}
+
+// the vector kernels run FV_FLOAT_GROUP descriptors against each gaussian row,
+// a short group repeats its last descriptor and drops the copies
+SIMD_TARGET("sse4.1") void FisherVectorFloatLogLikelihoodSSE4(const float * x, int x_stride, int nx,
+        int base1, int base2, const FisherVectorCodeBookFloat * cb, float * loglik)
+{
+    int nDim = cb->nDim, n = base2 - base1;
+    const float * x0 = x, * x1 = x + MIN(1, nx-1)*x_stride,
+            * x2 = x + MIN(2, nx-1)*x_stride, * x3 = x + MIN(3, nx-1)*x_stride;
+    for(int i=base1; i<base2; i++)
+    {
+        const float * ms = cb->muSqrtInvSigma + i*cb->nDimPad, * sw = cb->sqrtInvSigma + i*cb->nDimPad;
+        __m128 s0 = _mm_setzero_ps(), s1 = _mm_setzero_ps(),
+                s2 = _mm_setzero_ps(), s3 = _mm_setzero_ps();
+        int k = 0;
+        for(; k+4 <= nDim; k += 4)
+        {
+            __m128 m = _mm_load_ps(ms+k), w = _mm_load_ps(sw+k), d;
+            d = _mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(x0+k), w), m);
+            s0 = _mm_add_ps(s0, _mm_mul_ps(d, d));
+            d = _mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(x1+k), w), m);
+            s1 = _mm_add_ps(s1, _mm_mul_ps(d, d));
+            d = _mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(x2+k), w), m);
+            s2 = _mm_add_ps(s2, _mm_mul_ps(d, d));
+            d = _mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(x3+k), w), m);
+            s3 = _mm_add_ps(s3, _mm_mul_ps(d, d));
+        }
+        float sum[4];
+        _mm_storeu_ps(sum, _mm_hadd_ps(_mm_hadd_ps(s0, s1), _mm_hadd_ps(s2, s3)));
+        for(; k<nDim; k++)
+            for(int j=0; j<4; j++)
+            {
+                float d = x[MIN(j, nx-1)*x_stride+k]*sw[k] - ms[k];
+                sum[j] += d * d;
+            }
+        
+        for(int j=0; j<nx; j++)
+            loglik[j*n + i-base1] = cb->halfLogSigma[i] - 0.5f*sum[j];
+    }
+}
+
+SIMD_TARGET("sse4.1") void FisherVectorFloatEncodeSSE4(const float * x, float * loglik, const int * prob_bin,
+        int block_num, int block_size, float * coding, const FisherVectorCodeBookFloat * cb)
+{
+    // weights, 4 at a time over the padded list
+    float lmax = loglik[0];
+    for(int i=1; i<block_num; i++)
+        lmax = MAX(lmax, loglik[i]);
+    __m128 sum = _mm_setzero_ps();
+    for(int i=0; i<block_num; i+=4)
+    {
+        float prior[4];
+        for(int j=0; j<4; j++)
+            prior[j] = i+j < block_num ? cb->priors[prob_bin[i+j]] : 0;
+        __m128 w = _mm_mul_ps(ExpFloat4(_mm_sub_ps(_mm_load_ps(loglik+i), _mm_set1_ps(lmax))), _mm_loadu_ps(prior));
+        _mm_store_ps(loglik+i, w);
+        sum = _mm_add_ps(sum, w);
+    }
+    float inv_sum = 1 / HorizontalSum(sum);
+
+    int nDim = cb->nDim;
+    for(int i=0; i<block_num; i++, coding += block_size)
+    {
+        int bin = prob_bin[i];
+        const float * mu = cb->mu + bin*cb->nDimPad,
+                * iS = cb->invSigma + bin*cb->nDimPad,
+                * sqrtIS = cb->sqrtInvSigma + bin*cb->nDimPad;
+        float a = loglik[i] * inv_sum * cb->invSqrtPrior[bin];
+        float b = loglik[i] * inv_sum * cb->invSqrt2Prior[bin];
+        __m128 a4 = _mm_set1_ps(a), b4 = _mm_set1_ps(b);
+
+        int k = 0;
+        for(; k+4 <= nDim; k += 4)
+        {
+            __m128 diff = _mm_sub_ps(_mm_loadu_ps(x+k), _mm_load_ps(mu+k));
+            _mm_storeu_ps(coding+k, _mm_mul_ps(_mm_mul_ps(a4, diff), _mm_load_ps(sqrtIS+k)));
+#ifndef FIRST_ORDER
+            __m128 d2 = _mm_mul_ps(_mm_mul_ps(b4, diff), diff);
+            _mm_storeu_ps(coding+nDim+k, _mm_sub_ps(_mm_mul_ps(d2, _mm_load_ps(iS+k)), b4));
+#endif
+        }
+        for(; k<nDim; k++)
+        {
+            float diff = x[k] - mu[k];
+            coding[k] = a * diff * sqrtIS[k];
+#ifndef FIRST_ORDER
+            coding[nDim+k] = b * diff * diff * iS[k] - b;
+#endif
+        }
+    }
+}
+
+// ********************************* //
+// avx2 + fma kernels
+
+SIMD_TARGET("avx2,fma") inline float HorizontalSum(__m256 s)
+{
+    __m128 s4 = _mm_add_ps(_mm256_castps256_ps128(s), _mm256_extractf128_ps(s, 1));
+    s4 = _mm_add_ps(s4, _mm_movehl_ps(s4, s4));
+    return _mm_cvtss_f32(_mm_add_ss(s4, _mm_shuffle_ps(s4, s4, 1)));
+}
+
+SIMD_TARGET("avx2,fma") inline __m256 ExpFloat8(__m256 x)
+{
+    x = _mm256_max_ps(_mm256_min_ps(x, _mm256_set1_ps(88.37f)), _mm256_set1_ps(-87.33f));
+    __m256 n = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504f)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    x = _mm256_fnmadd_ps(n, _mm256_set1_ps(0.693359375f), x);
+    x = _mm256_fnmadd_ps(n, _mm256_set1_ps(-2.12194440e-4f), x);
+
+    __m256 p = _mm256_set1_ps(1.9875691500e-4f);
+    p = _mm256_fmadd_ps(p, x, _mm256_set1_ps(1.3981999507e-3f));
+    p = _mm256_fmadd_ps(p, x, _mm256_set1_ps(8.3334519073e-3f));
+    p = _mm256_fmadd_ps(p, x, _mm256_set1_ps(4.1665795894e-2f));
+    p = _mm256_fmadd_ps(p, x, _mm256_set1_ps(1.6666665459e-1f));
+    p = _mm256_fmadd_ps(p, x, _mm256_set1_ps(5.0000001201e-1f));
+    p = _mm256_add_ps(_mm256_fmadd_ps(p, _mm256_mul_ps(x, x), x), _mm256_set1_ps(1.0f));
+
+    __m256i e = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(p, _mm256_castsi256_ps(e));
+}
+
+SIMD_TARGET("avx2,fma") void FisherVectorFloatLogLikelihoodAVX2(const float * x, int x_stride, int nx,
+        int base1, int base2, const FisherVectorCodeBookFloat * cb, float * loglik)
+{
+    int nDim = cb->nDim, n = base2 - base1;
+    const float * x0 = x, * x1 = x + MIN(1, nx-1)*x_stride,
+            * x2 = x + MIN(2, nx-1)*x_stride, * x3 = x + MIN(3, nx-1)*x_stride;
+    for(int i=base1; i<base2; i++)
+    {
+        const float * ms = cb->muSqrtInvSigma + i*cb->nDimPad, * sw = cb->sqrtInvSigma + i*cb->nDimPad;
+        __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps(),
+                s2 = _mm256_setzero_ps(), s3 = _mm256_setzero_ps();
+        int k = 0;
+        for(; k+8 <= nDim; k += 8)
+        {
+            __m256 m = _mm256_load_ps(ms+k), w = _mm256_load_ps(sw+k), d;
+            d = _mm256_fmsub_ps(_mm256_loadu_ps(x0+k), w, m);
+            s0 = _mm256_fmadd_ps(d, d, s0);
+            d = _mm256_fmsub_ps(_mm256_loadu_ps(x1+k), w, m);
+            s1 = _mm256_fmadd_ps(d, d, s1);
+            d = _mm256_fmsub_ps(_mm256_loadu_ps(x2+k), w, m);
+            s2 = _mm256_fmadd_ps(d, d, s2);
+            d = _mm256_fmsub_ps(_mm256_loadu_ps(x3+k), w, m);
+            s3 = _mm256_fmadd_ps(d, d, s3);
+        }
+        // lane sums of s0..s3 side by side
+        __m256 t = _mm256_hadd_ps(_mm256_hadd_ps(s0, s1), _mm256_hadd_ps(s2, s3));
+        float sum[4];
+        _mm_storeu_ps(sum, _mm_add_ps(_mm256_castps256_ps128(t), _mm256_extractf128_ps(t, 1)));
+        for(; k<nDim; k++)
+            for(int j=0; j<4; j++)
+            {
+                float d = x[MIN(j, nx-1)*x_stride+k]*sw[k] - ms[k];
+                sum[j] += d * d;
+            }
+        
+        for(int j=0; j<nx; j++)
+            loglik[j*n + i-base1] = cb->halfLogSigma[i] - 0.5f*sum[j];
+    }
+}
+
+SIMD_TARGET("avx2,fma") void FisherVectorFloatEncodeAVX2(const float * x, float * loglik, const int * prob_bin,
+        int block_num, int block_size, float * coding, const FisherVectorCodeBookFloat * cb)
+{
+    float lmax = loglik[0];
+    for(int i=1; i<block_num; i++)
+        lmax = MAX(lmax, loglik[i]);
+    __m256 sum = _mm256_setzero_ps();
+    for(int i=0; i<block_num; i+=8)
+    {
+        float prior[8];
+        for(int j=0; j<8; j++)
+            prior[j] = i+j < block_num ? cb->priors[prob_bin[i+j]] : 0;
+        __m256 w = _mm256_mul_ps(ExpFloat8(_mm256_sub_ps(_mm256_load_ps(loglik+i), _mm256_set1_ps(lmax))), _mm256_loadu_ps(prior));
+        _mm256_store_ps(loglik+i, w);
+        sum = _mm256_add_ps(sum, w);
+    }
+    float inv_sum = 1 / HorizontalSum(sum);
+
+    int nDim = cb->nDim;
+    for(int i=0; i<block_num; i++, coding += block_size)
+    {
+        int bin = prob_bin[i];
+        const float * mu = cb->mu + bin*cb->nDimPad,
+                * iS = cb->invSigma + bin*cb->nDimPad,
+                * sqrtIS = cb->sqrtInvSigma + bin*cb->nDimPad;
+        float a = loglik[i] * inv_sum * cb->invSqrtPrior[bin];
+        float b = loglik[i] * inv_sum * cb->invSqrt2Prior[bin];
+        __m256 a8 = _mm256_set1_ps(a), b8 = _mm256_set1_ps(b);
+
+        int k = 0;
+        for(; k+8 <= nDim; k += 8)
+        {
+            __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(x+k), _mm256_load_ps(mu+k));
+            _mm256_storeu_ps(coding+k, _mm256_mul_ps(_mm256_mul_ps(a8, diff), _mm256_load_ps(sqrtIS+k)));
+#ifndef FIRST_ORDER
+            __m256 d2 = _mm256_mul_ps(_mm256_mul_ps(b8, diff), diff);
+            _mm256_storeu_ps(coding+nDim+k, _mm256_fmsub_ps(d2, _mm256_load_ps(iS+k), b8));
+#endif
+        }
+        for(; k<nDim; k++)
+        {
+            float diff = x[k] - mu[k];
+            coding[k] = a * diff * sqrtIS[k];
+#ifndef FIRST_ORDER
+            coding[nDim+k] = b * diff * diff * iS[k] - b;
+#endif
+        }
+    }
+}
+
+// ********************************* //
+// avx-512 kernels, dimension tails by masked loads
+
+// gcc 12 masked intrinsics start from _mm512_undefined_ps(), which -Wall reports
+// as uninitialized in every kernel that inlines them
+#if defined(__GNUC__) && !defined(__clang__)
+    #pragma GCC diagnostic push
+    #pragma GCC diagnostic ignored "-Wuninitialized"
+    #pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+SIMD_TARGET("avx512f") inline __m512 ExpFloat16(__m512 x)
+{
+    x = _mm512_max_ps(_mm512_min_ps(x, _mm512_set1_ps(88.37f)), _mm512_set1_ps(-87.33f));
+    __m512 n = _mm512_roundscale_ps(_mm512_mul_ps(x, _mm512_set1_ps(1.44269504f)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    x = _mm512_fnmadd_ps(n, _mm512_set1_ps(0.693359375f), x);
+    x = _mm512_fnmadd_ps(n, _mm512_set1_ps(-2.12194440e-4f), x);
+
+    __m512 p = _mm512_set1_ps(1.9875691500e-4f);
+    p = _mm512_fmadd_ps(p, x, _mm512_set1_ps(1.3981999507e-3f));
+    p = _mm512_fmadd_ps(p, x, _mm512_set1_ps(8.3334519073e-3f));
+    p = _mm512_fmadd_ps(p, x, _mm512_set1_ps(4.1665795894e-2f));
+    p = _mm512_fmadd_ps(p, x, _mm512_set1_ps(1.6666665459e-1f));
+    p = _mm512_fmadd_ps(p, x, _mm512_set1_ps(5.0000001201e-1f));
+    p = _mm512_add_ps(_mm512_fmadd_ps(p, _mm512_mul_ps(x, x), x), _mm512_set1_ps(1.0f));
+
+    return _mm512_scalef_ps(p, n);
+}
+
+SIMD_TARGET("avx512f") void FisherVectorFloatLogLikelihoodAVX512(const float * x, int x_stride, int nx,
+        int base1, int base2, const FisherVectorCodeBookFloat * cb, float * loglik)
+{
+    int nDim = cb->nDim, n = base2 - base1;
+    const float * x0 = x, * x1 = x + MIN(1, nx-1)*x_stride,
+            * x2 = x + MIN(2, nx-1)*x_stride, * x3 = x + MIN(3, nx-1)*x_stride;
+    __mmask16 tail = (__mmask16)((1u << (nDim % 16)) - 1);
+    for(int i=base1; i<base2; i++)
+    {
+        const float * ms = cb->muSqrtInvSigma + i*cb->nDimPad, * sw = cb->sqrtInvSigma + i*cb->nDimPad;
+        __m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps(),
+                s2 = _mm512_setzero_ps(), s3 = _mm512_setzero_ps();
+        // padding is 0, so the masked tail adds 0 terms
+        for(int k=0; k<nDim; k += 16)
+        {
+            __mmask16 mask = k+16 <= nDim ? (__mmask16)0xffff : tail;
+            __m512 m = _mm512_load_ps(ms+k), w = _mm512_load_ps(sw+k), d;
+            d = _mm512_fmsub_ps(_mm512_maskz_loadu_ps(mask, x0+k), w, m);
+            s0 = _mm512_fmadd_ps(d, d, s0);
+            d = _mm512_fmsub_ps(_mm512_maskz_loadu_ps(mask, x1+k), w, m);
+            s1 = _mm512_fmadd_ps(d, d, s1);
+            d = _mm512_fmsub_ps(_mm512_maskz_loadu_ps(mask, x2+k), w, m);
+            s2 = _mm512_fmadd_ps(d, d, s2);
+            d = _mm512_fmsub_ps(_mm512_maskz_loadu_ps(mask, x3+k), w, m);
+            s3 = _mm512_fmadd_ps(d, d, s3);
+        }
+        float sum[4] = {_mm512_reduce_add_ps(s0), _mm512_reduce_add_ps(s1),
+                _mm512_reduce_add_ps(s2), _mm512_reduce_add_ps(s3)};
+        
+        for(int j=0; j<nx; j++)
+            loglik[j*n + i-base1] = cb->halfLogSigma[i] - 0.5f*sum[j];
+    }
+}
+
+SIMD_TARGET("avx512f") void FisherVectorFloatEncodeAVX512(const float * x, float * loglik, const int * prob_bin,
+        int block_num, int block_size, float * coding, const FisherVectorCodeBookFloat * cb)
+{
+    float lmax = loglik[0];
+    for(int i=1; i<block_num; i++)
+        lmax = MAX(lmax, loglik[i]);
+    __m512 sum = _mm512_setzero_ps();
+    for(int i=0; i<block_num; i+=16)
+    {
+        __mmask16 valid = (__mmask16)(block_num-i >= 16 ? 0xffff : (1u << (block_num-i)) - 1);
+        __m512i bin = _mm512_maskz_loadu_epi32(valid, prob_bin+i);
+        __m512 prior = _mm512_mask_i32gather_ps(_mm512_setzero_ps(), valid, bin, cb->priors, 4);
+        __m512 w = _mm512_mul_ps(ExpFloat16(_mm512_sub_ps(_mm512_load_ps(loglik+i), _mm512_set1_ps(lmax))), prior);
+        _mm512_store_ps(loglik+i, w);
+        sum = _mm512_add_ps(sum, w);
+    }
+    float inv_sum = 1 / _mm512_reduce_add_ps(sum);
+
+    int nDim = cb->nDim;
+    __mmask16 tail = (__mmask16)((1u << (nDim % 16)) - 1);
+    for(int i=0; i<block_num; i++, coding += block_size)
+    {
+        int bin = prob_bin[i];
+        const float * mu = cb->mu + bin*cb->nDimPad,
+                * iS = cb->invSigma + bin*cb->nDimPad,
+                * sqrtIS = cb->sqrtInvSigma + bin*cb->nDimPad;
+        __m512 a = _mm512_set1_ps(loglik[i] * inv_sum * cb->invSqrtPrior[bin]);
+        __m512 b = _mm512_set1_ps(loglik[i] * inv_sum * cb->invSqrt2Prior[bin]);
+
+        for(int k=0; k<nDim; k += 16)
+        {
+            __mmask16 m = k+16 <= nDim ? (__mmask16)0xffff : tail;
+            __m512 diff = _mm512_sub_ps(_mm512_maskz_loadu_ps(m, x+k), _mm512_load_ps(mu+k));
+            _mm512_mask_storeu_ps(coding+k, m, _mm512_mul_ps(_mm512_mul_ps(a, diff), _mm512_load_ps(sqrtIS+k)));
+#ifndef FIRST_ORDER
+            __m512 d2 = _mm512_mul_ps(_mm512_mul_ps(b, diff), diff);
+            _mm512_mask_storeu_ps(coding+nDim+k, m, _mm512_fmsub_ps(d2, _mm512_load_ps(iS+k), b));
+#endif
+        }
+    }
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+    #pragma GCC diagnostic pop
+#endif
+#endif
+
+// ********************************* //
+// kernel table, the best one not above SimdLevel() is taken
+
+struct FisherVectorFloatKernel
+{
+    int simd_level;
+    FuncFisherVectorFloatLogLikelihood func_loglik;
+    FuncFisherVectorFloatEncode func_encode;
+};
+
+static const FisherVectorFloatKernel FisherVectorFloatKernels[] =
+{
+#ifdef SIMD_DISPATCH
+    {SIMD_LEVEL_AVX512, FisherVectorFloatLogLikelihoodAVX512, FisherVectorFloatEncodeAVX512},
+    {SIMD_LEVEL_AVX2, FisherVectorFloatLogLikelihoodAVX2, FisherVectorFloatEncodeAVX2},
+    {SIMD_LEVEL_SSE4, FisherVectorFloatLogLikelihoodSSE4, FisherVectorFloatEncodeSSE4},
+#endif
+    {SIMD_LEVEL_SCALAR, FisherVectorFloatLogLikelihoodScalar, FisherVectorFloatEncodeScalar}
+};
+
+// ********************************* //
+
+void InitFisherVectorCodeBookFloat(FisherVectorCodeBookFloat * fcb, const FisherVectorCodeBook * cb)
+{
+    int nDim = cb->nDim, nBase = cb->nBase;
+    int nDimPad = (nDim + FV_FLOAT_PAD-1) / FV_FLOAT_PAD * FV_FLOAT_PAD;
+    int nBasePad = (nBase + FV_FLOAT_PAD-1) / FV_FLOAT_PAD * FV_FLOAT_PAD;
+    fcb->nDim = nDim;
+    fcb->nBase = nBase;
+    fcb->nDimPad = nDimPad;
+
+    // zero filled, so padding never contributes
+    AllocateScratchArena(&fcb->storage, 4*SCRATCH_BYTES(float, nDimPad*nBase) + 4*SCRATCH_BYTES(float, nBasePad));
+    fcb->mu = SCRATCH_ALLOCATE(&fcb->storage, float, nDimPad*nBase);
+    fcb->invSigma = SCRATCH_ALLOCATE(&fcb->storage, float, nDimPad*nBase);
+    fcb->sqrtInvSigma = SCRATCH_ALLOCATE(&fcb->storage, float, nDimPad*nBase);
+    fcb->muSqrtInvSigma = SCRATCH_ALLOCATE(&fcb->storage, float, nDimPad*nBase);
+    fcb->halfLogSigma = SCRATCH_ALLOCATE(&fcb->storage, float, nBasePad);
+    fcb->priors = SCRATCH_ALLOCATE(&fcb->storage, float, nBasePad);
+    fcb->invSqrtPrior = SCRATCH_ALLOCATE(&fcb->storage, float, nBasePad);
+    fcb->invSqrt2Prior = SCRATCH_ALLOCATE(&fcb->storage, float, nBasePad);
+
+    for(int i=0; i<nBase; i++)
+    {
+        for(int k=0; k<nDim; k++)
+        {
+            fcb->mu[i*nDimPad + k] = (float)cb->mu[i*nDim + k];
+            fcb->invSigma[i*nDimPad + k] = (float)cb->invSigma[i*nDim + k];
+            fcb->sqrtInvSigma[i*nDimPad + k] = (float)cb->sqrtInvSigma[i*nDim + k];
+            fcb->muSqrtInvSigma[i*nDimPad + k] = (float)(cb->mu[i*nDim + k] * cb->sqrtInvSigma[i*nDim + k]);
+        }
+        fcb->halfLogSigma[i] = (float)(-0.5 * cb->sumLogSigma[i]);
+        fcb->priors[i] = (float)cb->priors[i];
+        fcb->invSqrtPrior[i] = (float)(1 / cb->sqrtPrior[i]);
+        fcb->invSqrt2Prior[i] = (float)(1 / cb->sqrt2Prior[i]);
+    }
+
+    int level = SimdLevel();
+    const FisherVectorFloatKernel * k = FisherVectorFloatKernels;
+    while(k->simd_level > level)
+        k++;
+    fcb->simd_level = k->simd_level;
+    fcb->func_loglik = k->func_loglik;
+    fcb->func_encode = k->func_encode;
+}
+
+void FreeFisherVectorCodeBookFloat(FisherVectorCodeBookFloat * fcb)
+{
+    FreeScratchArena(&fcb->storage);
+}
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef FISHER_VECTOR_INDEX_H
+#define FISHER_VECTOR_INDEX_H
+
+#include <math.h>
+#include "image.h"
+#include "fisher_vector_coding.h"
+#include "center_index.h"
+
+// ***************************** //
+// two-level index over the gaussian means for approximate top-k selection
+//      a CenterIndex of the means, the members scored by the expanded
+//      likelihood of gemm_weight and gemm_bias, 2 nDim columns.
+//      distances are taken after scaling dimension d by sqrt of the mean invSigma
+//      probe is the recall / speed knob, probe = nCluster is exhaustive
+
+typedef CenterIndex<double> FisherVectorIndex;
+
+// cb->gemm_weight and cb->gemm_bias must be set
+void InitFisherVectorIndex(FisherVectorIndex * index, const FisherVectorCodeBook * cb, int nCluster, int probe)
+{
+    int nDim = cb->nDim, nBase = cb->nBase;
+    double * scale = ALLOCATE(double, nDim);
+    for(int i=0; i<nBase; i++)
+        for(int k=0; k<nDim; k++)
+            scale[k] += cb->invSigma[i*nDim+k] / nBase;
+    for(int k=0; k<nDim; k++)
+        scale[k] = sqrt(scale[k]);
+
+    InitCenterIndex(index, cb->mu, scale, nDim, nBase, nCluster, probe, cb->gemm_weight, cb->gemm_bias, 2*nDim);
+    FREE(scale);
+}
+
+void FreeFisherVectorIndex(FisherVectorIndex * index)
+{
+    FreeCenterIndex(index);
+}
+
+// probe nearest clusters of data, widened until they hold min_num gaussians
+//      cluster: dim nCluster, the selected clusters come first by ascending id
+//      returns the number of selected clusters
+inline int FisherVectorIndexProbe(const float * data, const FisherVectorIndex * index, int min_num,
+        double * dist, int * cluster)
+{
+    return CenterIndexProbe(data, index, min_num, dist, cluster);
+}
+
+#endif
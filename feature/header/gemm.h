@@ -0,0 +1,182 @@
+#ifndef GEMM_H
+#define GEMM_H
+
+#include "image.h"
+#include "simd.h"
+
+// ***************************** //
+// cache blocked matrix product, column-major as in matlab
+//      C(m, n) += sum_k A(m, k) * B(k, n), for float (sgemm) or double (dgemm)
+//      A: M x K, lda >= M; B: K x N, ldb >= K; C: M x N, ldc >= M
+// K is split into panels that stay in L1/L2 with the current columns of B, M into
+// row blocks of A, and each block is swept by a register tile of GEMM_MR x GEMM_NR
+
+#ifndef GEMM_BLOCK_K
+#define GEMM_BLOCK_K 128
+#endif
+#ifndef GEMM_BLOCK_M
+#define GEMM_BLOCK_M 64
+#endif
+
+#define GEMM_MR 8
+#define GEMM_NR 4
+
+// full GEMM_MR x GEMM_NR tile over k panel kc, generic version
+template <typename T>
+inline void GemmTile(int kc, const T * A, int lda, const T * B, int ldb, T * C, int ldc)
+{
+    T c[GEMM_NR][GEMM_MR];
+    for(int j=0; j<GEMM_NR; j++)
+        for(int i=0; i<GEMM_MR; i++)
+            c[j][i] = 0;
+
+    for(int k=0; k<kc; k++, A += lda)
+    {
+        for(int j=0; j<GEMM_NR; j++)
+        {
+            T b = B[j*ldb + k];
+            for(int i=0; i<GEMM_MR; i++)
+                c[j][i] += A[i] * b;
+        }
+    }
+
+    for(int j=0; j<GEMM_NR; j++)
+        for(int i=0; i<GEMM_MR; i++)
+            C[j*ldc + i] += c[j][i];
+}
+
+#if defined(SIMD_AVX2)
+template <>
+inline void GemmTile<double>(int kc, const double * A, int lda, const double * B, int ldb, double * C, int ldc)
+{
+    __m256d c00 = _mm256_setzero_pd(), c01 = _mm256_setzero_pd(),
+            c10 = _mm256_setzero_pd(), c11 = _mm256_setzero_pd(),
+            c20 = _mm256_setzero_pd(), c21 = _mm256_setzero_pd(),
+            c30 = _mm256_setzero_pd(), c31 = _mm256_setzero_pd();
+
+    for(int k=0; k<kc; k++, A += lda)
+    {
+        __m256d a0 = _mm256_loadu_pd(A);
+        __m256d a1 = _mm256_loadu_pd(A + 4);
+        __m256d b;
+        b = _mm256_broadcast_sd(B + k);
+        c00 = _mm256_add_pd(c00, _mm256_mul_pd(a0, b));
+        c01 = _mm256_add_pd(c01, _mm256_mul_pd(a1, b));
+        b = _mm256_broadcast_sd(B + ldb + k);
+        c10 = _mm256_add_pd(c10, _mm256_mul_pd(a0, b));
+        c11 = _mm256_add_pd(c11, _mm256_mul_pd(a1, b));
+        b = _mm256_broadcast_sd(B + 2*ldb + k);
+        c20 = _mm256_add_pd(c20, _mm256_mul_pd(a0, b));
+        c21 = _mm256_add_pd(c21, _mm256_mul_pd(a1, b));
+        b = _mm256_broadcast_sd(B + 3*ldb + k);
+        c30 = _mm256_add_pd(c30, _mm256_mul_pd(a0, b));
+        c31 = _mm256_add_pd(c31, _mm256_mul_pd(a1, b));
+    }
+
+    _mm256_storeu_pd(C, _mm256_add_pd(_mm256_loadu_pd(C), c00));
+    _mm256_storeu_pd(C + 4, _mm256_add_pd(_mm256_loadu_pd(C + 4), c01));
+    C += ldc;
+    _mm256_storeu_pd(C, _mm256_add_pd(_mm256_loadu_pd(C), c10));
+    _mm256_storeu_pd(C + 4, _mm256_add_pd(_mm256_loadu_pd(C + 4), c11));
+    C += ldc;
+    _mm256_storeu_pd(C, _mm256_add_pd(_mm256_loadu_pd(C), c20));
+    _mm256_storeu_pd(C + 4, _mm256_add_pd(_mm256_loadu_pd(C + 4), c21));
+    C += ldc;
+    _mm256_storeu_pd(C, _mm256_add_pd(_mm256_loadu_pd(C), c30));
+    _mm256_storeu_pd(C + 4, _mm256_add_pd(_mm256_loadu_pd(C + 4), c31));
+}
+
+template <>
+inline void GemmTile<float>(int kc, const float * A, int lda, const float * B, int ldb, float * C, int ldc)
+{
+    __m256 c0 = _mm256_setzero_ps(), c1 = _mm256_setzero_ps(),
+            c2 = _mm256_setzero_ps(), c3 = _mm256_setzero_ps();
+
+    for(int k=0; k<kc; k++, A += lda)
+    {
+        __m256 a = _mm256_loadu_ps(A);
+        c0 = _mm256_add_ps(c0, _mm256_mul_ps(a, _mm256_broadcast_ss(B + k)));
+        c1 = _mm256_add_ps(c1, _mm256_mul_ps(a, _mm256_broadcast_ss(B + ldb + k)));
+        c2 = _mm256_add_ps(c2, _mm256_mul_ps(a, _mm256_broadcast_ss(B + 2*ldb + k)));
+        c3 = _mm256_add_ps(c3, _mm256_mul_ps(a, _mm256_broadcast_ss(B + 3*ldb + k)));
+    }
+
+    _mm256_storeu_ps(C, _mm256_add_ps(_mm256_loadu_ps(C), c0));
+    _mm256_storeu_ps(C + ldc, _mm256_add_ps(_mm256_loadu_ps(C + ldc), c1));
+    _mm256_storeu_ps(C + 2*ldc, _mm256_add_ps(_mm256_loadu_ps(C + 2*ldc), c2));
+    _mm256_storeu_ps(C + 3*ldc, _mm256_add_ps(_mm256_loadu_ps(C + 3*ldc), c3));
+}
+#elif defined(SIMD_SSE)
+template <>
+inline void GemmTile<double>(int kc, const double * A, int lda, const double * B, int ldb, double * C, int ldc)
+{
+    __m128d c[GEMM_NR][4];
+    for(int j=0; j<GEMM_NR; j++)
+        for(int i=0; i<4; i++)
+            c[j][i] = _mm_setzero_pd();
+
+    for(int k=0; k<kc; k++, A += lda)
+    {
+        __m128d a0 = _mm_loadu_pd(A), a1 = _mm_loadu_pd(A + 2),
+                a2 = _mm_loadu_pd(A + 4), a3 = _mm_loadu_pd(A + 6);
+        for(int j=0; j<GEMM_NR; j++)
+        {
+            __m128d b = _mm_set1_pd(B[j*ldb + k]);
+            c[j][0] = _mm_add_pd(c[j][0], _mm_mul_pd(a0, b));
+            c[j][1] = _mm_add_pd(c[j][1], _mm_mul_pd(a1, b));
+            c[j][2] = _mm_add_pd(c[j][2], _mm_mul_pd(a2, b));
+            c[j][3] = _mm_add_pd(c[j][3], _mm_mul_pd(a3, b));
+        }
+    }
+
+    for(int j=0; j<GEMM_NR; j++)
+        for(int i=0; i<4; i++)
+            _mm_storeu_pd(C + j*ldc + 2*i, _mm_add_pd(_mm_loadu_pd(C + j*ldc + 2*i), c[j][i]));
+}
+#endif
+
+// partial tile at the matrix border, mr <= GEMM_MR rows and nr <= GEMM_NR columns
+template <typename T>
+inline void GemmEdge(int mr, int nr, int kc, const T * A, int lda, const T * B, int ldb, T * C, int ldc)
+{
+    for(int j=0; j<nr; j++)
+    {
+        for(int i=0; i<mr; i++)
+        {
+            T sum = 0;
+            for(int k=0; k<kc; k++)
+                sum += A[k*lda + i] * B[j*ldb + k];
+            C[j*ldc + i] += sum;
+        }
+    }
+}
+
+template <typename T>
+void Gemm(int M, int N, int K, const T * A, int lda, const T * B, int ldb, T * C, int ldc)
+{
+    for(int k0=0; k0<K; k0+=GEMM_BLOCK_K)
+    {
+        int kc = MIN(GEMM_BLOCK_K, K-k0);
+        for(int m0=0; m0<M; m0+=GEMM_BLOCK_M)
+        {
+            int mc = MIN(GEMM_BLOCK_M, M-m0);
+            const T * a_block = A + k0*lda + m0;
+
+            for(int n=0; n<N; n+=GEMM_NR)
+            {
+                int nr = MIN(GEMM_NR, N-n);
+                const T * b = B + n*ldb + k0;
+                T * c = C + n*ldc + m0;
+
+                int m = 0;
+                if(nr == GEMM_NR)
+                    for(; m+GEMM_MR <= mc; m += GEMM_MR)
+                        GemmTile(kc, a_block + m, lda, b, ldb, c + m, ldc);
+                if(m < mc)
+                    GemmEdge(mc-m, nr, kc, a_block + m, lda, b, ldb, c + m, ldc);
+            }
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,482 @@
+#ifndef HOG_FEATURE_H
+#define HOG_FEATURE_H
+
+#include <math.h>
+#include "image.h"
+#include "simd.h"
+#include "thread.h"
+
+// ***************************** //
+// 31-dimensional hog of the deformable part model
+//      single precision port of mex/baseline/features_hog.cc: 18 contrast sensitive,
+//      9 contrast insensitive and 4 texture dimensions per cell
+//      any image depth, the channel with the strongest gradient is taken per pixel
+
+// hog options:
+//      sbin: cell size in pixels
+//      blocks_y, blocks_x: cell number, initialized by InitHOGFeature()
+//      height, width: output cell number, the border cells are dropped
+//      length: 31
+struct HOGFeatureOpt
+{
+    int sbin;
+
+    int blocks_y, blocks_x;
+    int height, width;
+    int length;
+};
+
+#define HOG_EPS 0.0001f
+#define HOG_CLIP 0.2f
+#define HOG_TEXTURE 0.2357f
+
+// unit vectors of the 9 orientations in [0, pi)
+static const float HOGUnitX[9] = {1.0000f, 0.9397f, 0.7660f, 0.500f, 0.1736f, -0.1736f, -0.5000f, -0.7660f, -0.9397f};
+static const float HOGUnitY[9] = {0.0000f, 0.3420f, 0.6428f, 0.8660f, 0.9848f, 0.9848f, 0.8660f, 0.6428f, 0.3420f};
+
+// ***************************** //
+// lanes of the gradient and normalization kernels, one float or a simd vector
+
+struct HOGLaneScalar
+{
+    typedef float V;
+    enum {N = 1};
+    template <typename T> static V Load(const T * p) {return (float)(*p);}
+    static void Store(float * p, V a) {*p = a;}
+    static V Set(float a) {return a;}
+    static V Add(V a, V b) {return a + b;}
+    static V Sub(V a, V b) {return a - b;}
+    static V Mul(V a, V b) {return a * b;}
+    static V Min(V a, V b) {return a < b ? a : b;}
+    static V Abs(V a) {return fabsf(a);}
+    static V Sqrt(V a) {return sqrtf(a);}
+    static V InvSqrt(V a) {return 1.0f / sqrtf(a);}
+    // a > b ? x : y
+    static V SelectGreater(V a, V b, V x, V y) {return a > b ? x : y;}
+};
+
+#if defined(SIMD_AVX2)
+struct HOGLaneSIMD
+{
+    typedef __m256 V;
+    enum {N = 8};
+    template <typename T> static V Load(const T * p) {return LoadFloat8(p);}
+    static void Store(float * p, V a) {_mm256_storeu_ps(p, a);}
+    static V Set(float a) {return _mm256_set1_ps(a);}
+    static V Add(V a, V b) {return _mm256_add_ps(a, b);}
+    static V Sub(V a, V b) {return _mm256_sub_ps(a, b);}
+    static V Mul(V a, V b) {return _mm256_mul_ps(a, b);}
+    static V Min(V a, V b) {return _mm256_min_ps(a, b);}
+    static V Abs(V a) {return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a);}
+    static V Sqrt(V a) {return _mm256_sqrt_ps(a);}
+    static V InvSqrt(V a) {return _mm256_div_ps(_mm256_set1_ps(1.0f), _mm256_sqrt_ps(a));}
+    static V SelectGreater(V a, V b, V x, V y) {return _mm256_blendv_ps(y, x, _mm256_cmp_ps(a, b, _CMP_GT_OQ));}
+};
+#elif defined(SIMD_SSE)
+struct HOGLaneSIMD
+{
+    typedef __m128 V;
+    enum {N = 4};
+    template <typename T> static V Load(const T * p) {return LoadFloat4(p);}
+    static void Store(float * p, V a) {_mm_storeu_ps(p, a);}
+    static V Set(float a) {return _mm_set1_ps(a);}
+    static V Add(V a, V b) {return _mm_add_ps(a, b);}
+    static V Sub(V a, V b) {return _mm_sub_ps(a, b);}
+    static V Mul(V a, V b) {return _mm_mul_ps(a, b);}
+    static V Min(V a, V b) {return _mm_min_ps(a, b);}
+    static V Abs(V a) {return _mm_andnot_ps(_mm_set1_ps(-0.0f), a);}
+    static V Sqrt(V a) {return _mm_sqrt_ps(a);}
+    static V InvSqrt(V a) {return _mm_div_ps(_mm_set1_ps(1.0f), _mm_sqrt_ps(a));}
+    static V SelectGreater(V a, V b, V x, V y)
+    {
+        V m = _mm_cmpgt_ps(a, b);
+        return _mm_or_ps(_mm_and_ps(m, x), _mm_andnot_ps(m, y));
+    }
+};
+#else
+typedef HOGLaneScalar HOGLaneSIMD;
+#endif
+
+// magnitude and orientation bin of L pixels down a column, s points at the first one
+// the strongest channel and the best of 18 orientations are picked without branches
+template <typename L, typename T>
+inline void HOGGradientLanes(const T * s, int height, int plane, int depth, float * mag, float * ori)
+{
+    typedef typename L::V V;
+
+    V dy = L::Sub(L::Load(s+1), L::Load(s-1));
+    V dx = L::Sub(L::Load(s+height), L::Load(s-height));
+    V v = L::Add(L::Mul(dx, dx), L::Mul(dy, dy));
+
+    for(int c=1; c<depth; c++)
+    {
+        s += plane;
+        V dy2 = L::Sub(L::Load(s+1), L::Load(s-1));
+        V dx2 = L::Sub(L::Load(s+height), L::Load(s-height));
+        V v2 = L::Add(L::Mul(dx2, dx2), L::Mul(dy2, dy2));
+        dx = L::SelectGreater(v2, v, dx2, dx);
+        dy = L::SelectGreater(v2, v, dy2, dy);
+        v = L::SelectGreater(v2, v, v2, v);
+    }
+
+    // snap to one of 18 orientations within 2*pi, first best wins as in the baseline
+    V zero = L::Set(0);
+    V best_dot = zero, best_o = zero;
+    for(int o=0; o<9; o++)
+    {
+        V dot = L::Add(L::Mul(L::Set(HOGUnitX[o]), dx), L::Mul(L::Set(HOGUnitY[o]), dy));
+        V o_signed = L::SelectGreater(dot, zero, L::Set((float)o), L::Set((float)(o+9)));
+        V a = L::Abs(dot);
+        best_o = L::SelectGreater(a, best_dot, o_signed, best_o);
+        best_dot = L::SelectGreater(a, best_dot, a, best_dot);
+    }
+
+    L::Store(mag, L::Sqrt(v));
+    L::Store(ori, best_o);
+}
+
+// pixels y1..y2 of column x, sources clamped to the image interior as in the baseline
+template <typename T>
+void HOGGradientColumn(const T * img, int height, int width, int depth, int x, int y1, int y2,
+        float * mag, float * ori)
+{
+    int plane = height * width;
+    const T * col = img + MIN(x, width-2) * height;
+
+    // rows below height-2 read the last interior row
+    int y_inner = MIN(y2, height-2);
+    int y = y1;
+    for(; y+HOGLaneSIMD::N-1 <= y_inner; y += HOGLaneSIMD::N)
+        HOGGradientLanes<HOGLaneSIMD>(col + y, height, plane, depth, mag + y, ori + y);
+    for(; y <= y2; y++)
+        HOGGradientLanes<HOGLaneScalar>(col + MIN(y, height-2), height, plane, depth, mag + y, ori + y);
+}
+
+// ***************************** //
+// histogram accumulation
+
+// pixel columns of a histogram band, the band count depends on the image only, so
+// the summation order of cells on band edges does not depend on the thread count
+#define HOG_BAND_COLUMNS 64
+
+struct HOGFeatureArgs
+{
+    FloatImage * img;
+    HOGFeatureOpt * opt;
+    int ntask;
+
+    // per task partial histograms over cell columns band_x1[t].., 18 x blocks_y x band width,
+    // at band + band_offset[t] of one zeroed buffer
+    float * band;
+    long long * band_offset;
+    int * band_x1;
+    int * band_width;
+
+    // gradient column of rows 0..y2 per worker, at mag + ThreadIndex() * column,
+    // the cell and weight of each row shared
+    int column;
+    float * mag;
+    float * ori;
+    int * cell_y;
+    float * wy;
+
+    float * hist;
+    float * energy;
+    float * inv_norm;
+    float * feat;
+};
+
+// cell and weight of the upper cell of pixel position i
+inline void HOGCellMap(int i, int sbin, int * cell, float * w)
+{
+    float p = (i + 0.5f) / sbin - 0.5f;
+    *cell = (int)floorf(p);
+    *w = p - *cell;
+}
+
+// pixel columns of task t
+inline void HOGTaskColumns(HOGFeatureOpt * opt, int ntask, int t, int * x1, int * x2)
+{
+    int visible_x = opt->blocks_x * opt->sbin;
+    int ncol = MAX(visible_x - 2, 0);
+    *x1 = 1 + (int)(1.0 * ncol * t / ntask);
+    *x2 = (int)(1.0 * ncol * (t+1) / ntask);
+}
+
+// cells touched by the pixel columns of task t
+inline void HOGTaskCells(HOGFeatureOpt * opt, int ntask, int t, int * c1, int * band_width)
+{
+    int x1, x2, c2;
+    float w;
+    HOGTaskColumns(opt, ntask, t, &x1, &x2);
+    HOGCellMap(x1, opt->sbin, c1, &w);
+    HOGCellMap(x2, opt->sbin, &c2, &w);
+    *c1 = MAX(*c1, 0);
+    c2 = MIN(c2 + 1, opt->blocks_x - 1);
+    *band_width = MAX(c2 - *c1 + 1, 0);
+}
+
+void HOGHistogramTask(void * args_in, int begin, int end)
+{
+    HOGFeatureArgs * args = (HOGFeatureArgs *)args_in;
+    HOGFeatureOpt * opt = args->opt;
+    FloatImage * img = args->img;
+    int sbin = opt->sbin;
+    int blocks_y = opt->blocks_y, blocks_x = opt->blocks_x;
+    int y2 = blocks_y * sbin - 2;
+    float * mag = args->mag + ThreadIndex() * args->column;
+    float * ori = args->ori + ThreadIndex() * args->column;
+    const int * cell_y = args->cell_y;
+    const float * wy = args->wy;
+
+    for(int t=begin; t<end; t++)
+    {
+        int x1, x2;
+        HOGTaskColumns(opt, args->ntask, t, &x1, &x2);
+        int c1 = args->band_x1[t];
+        float * band = args->band + args->band_offset[t];
+        int band_plane = blocks_y * args->band_width[t];
+
+        for(int x=x1; x<=x2; x++)
+        {
+            IMAGE_TYPE_CALL(img, 0, HOGGradientColumn, img->height, img->width, img->depth,
+                    x, 1, y2, mag, ori);
+
+            int ixp;
+            float vx0;
+            HOGCellMap(x, sbin, &ixp, &vx0);
+            float vx1 = 1.0f - vx0;
+            bool has_x0 = (ixp >= 0), has_x1 = (ixp+1 < blocks_x);
+
+            // add to 4 histograms around pixel using linear interpolation between cells
+            for(int y=1; y<=y2; y++)
+            {
+                int iyp = cell_y[y];
+                float vy0 = wy[y], vy1 = 1.0f - vy0;
+                float v = mag[y];
+                float * h = band + (int)ori[y] * band_plane + (ixp - c1) * blocks_y + iyp;
+                bool has_y0 = (iyp >= 0), has_y1 = (iyp+1 < blocks_y);
+
+                if(has_x0 && has_y0)
+                    h[0] += vx1*vy1*v;
+                if(has_x1 && has_y0)
+                    h[blocks_y] += vx0*vy1*v;
+                if(has_x0 && has_y1)
+                    h[1] += vx1*vy0*v;
+                if(has_x1 && has_y1)
+                    h[blocks_y+1] += vx0*vy0*v;
+            }
+        }
+    }
+}
+
+// ***************************** //
+// block normalization
+
+// energy of cell columns begin..end-1, opposite orientations summed first
+void HOGEnergyTask(void * args_in, int begin, int end)
+{
+    HOGFeatureArgs * args = (HOGFeatureArgs *)args_in;
+    int blocks_y = args->opt->blocks_y;
+    int plane = blocks_y * args->opt->blocks_x;
+
+    for(int bx=begin; bx<end; bx++)
+    {
+        float * energy = args->energy + bx * blocks_y;
+        memset(energy, 0, sizeof(float) * blocks_y);
+        for(int o=0; o<9; o++)
+        {
+            const float * src1 = args->hist + o*plane + bx*blocks_y;
+            const float * src2 = src1 + 9*plane;
+            for(int y=0; y<blocks_y; y++)
+                energy[y] += (src1[y] + src2[y]) * (src1[y] + src2[y]);
+        }
+    }
+}
+
+template <typename L>
+inline void HOGInverseNormLanes(const float * energy, int blocks_y, float * inv)
+{
+    typedef typename L::V V;
+    V sum = L::Add(L::Add(L::Load(energy), L::Load(energy + 1)),
+            L::Add(L::Load(energy + blocks_y), L::Load(energy + blocks_y + 1)));
+    L::Store(inv, L::InvSqrt(L::Add(sum, L::Set(HOG_EPS))));
+}
+
+// 1 / sqrt of the energy of the 2x2 block starting at each cell of columns begin..end-1
+void HOGInverseNormTask(void * args_in, int begin, int end)
+{
+    HOGFeatureArgs * args = (HOGFeatureArgs *)args_in;
+    int blocks_y = args->opt->blocks_y;
+    int n = blocks_y - 1;
+
+    for(int bx=begin; bx<end; bx++)
+    {
+        const float * energy = args->energy + bx * blocks_y;
+        float * inv = args->inv_norm + bx * blocks_y;
+
+        int y = 0;
+        for(; y+HOGLaneSIMD::N <= n; y += HOGLaneSIMD::N)
+            HOGInverseNormLanes<HOGLaneSIMD>(energy + y, blocks_y, inv + y);
+        for(; y < n; y++)
+            HOGInverseNormLanes<HOGLaneScalar>(energy + y, blocks_y, inv + y);
+    }
+}
+
+template <typename L>
+inline void HOGFeatureLanes(const float * src, int plane, const float * inv, int inv_stride,
+        float * dst, int dst_plane)
+{
+    typedef typename L::V V;
+
+    // the four blocks holding the cell
+    V n1 = L::Load(inv + inv_stride + 1);
+    V n2 = L::Load(inv + inv_stride);
+    V n3 = L::Load(inv + 1);
+    V n4 = L::Load(inv);
+    V clip = L::Set(HOG_CLIP), half = L::Set(0.5f);
+    V t1 = L::Set(0), t2 = L::Set(0), t3 = L::Set(0), t4 = L::Set(0);
+
+    // contrast sensitive
+    const float * s = src;
+    for(int o=0; o<18; o++, s += plane, dst += dst_plane)
+    {
+        V h = L::Load(s);
+        V h1 = L::Min(L::Mul(h, n1), clip);
+        V h2 = L::Min(L::Mul(h, n2), clip);
+        V h3 = L::Min(L::Mul(h, n3), clip);
+        V h4 = L::Min(L::Mul(h, n4), clip);
+        L::Store(dst, L::Mul(half, L::Add(L::Add(h1, h2), L::Add(h3, h4))));
+        t1 = L::Add(t1, h1);
+        t2 = L::Add(t2, h2);
+        t3 = L::Add(t3, h3);
+        t4 = L::Add(t4, h4);
+    }
+
+    // contrast insensitive
+    s = src;
+    for(int o=0; o<9; o++, s += plane, dst += dst_plane)
+    {
+        V h = L::Add(L::Load(s), L::Load(s + 9*plane));
+        V h1 = L::Min(L::Mul(h, n1), clip);
+        V h2 = L::Min(L::Mul(h, n2), clip);
+        V h3 = L::Min(L::Mul(h, n3), clip);
+        V h4 = L::Min(L::Mul(h, n4), clip);
+        L::Store(dst, L::Mul(half, L::Add(L::Add(h1, h2), L::Add(h3, h4))));
+    }
+
+    // texture
+    V texture = L::Set(HOG_TEXTURE);
+    L::Store(dst, L::Mul(texture, t1));
+    L::Store(dst + dst_plane, L::Mul(texture, t2));
+    L::Store(dst + 2*dst_plane, L::Mul(texture, t3));
+    L::Store(dst + 3*dst_plane, L::Mul(texture, t4));
+}
+
+// output columns begin..end-1
+void HOGNormalizeTask(void * args_in, int begin, int end)
+{
+    HOGFeatureArgs * args = (HOGFeatureArgs *)args_in;
+    HOGFeatureOpt * opt = args->opt;
+    int blocks_y = opt->blocks_y;
+    int plane = blocks_y * opt->blocks_x;
+    int dst_plane = opt->height * opt->width;
+
+    for(int x=begin; x<end; x++)
+    {
+        const float * src = args->hist + (x+1)*blocks_y + 1;
+        const float * inv = args->inv_norm + x*blocks_y;
+        float * dst = args->feat + x*opt->height;
+
+        int y = 0;
+        for(; y+HOGLaneSIMD::N <= opt->height; y += HOGLaneSIMD::N)
+            HOGFeatureLanes<HOGLaneSIMD>(src + y, plane, inv + y, blocks_y, dst + y, dst_plane);
+        for(; y < opt->height; y++)
+            HOGFeatureLanes<HOGLaneScalar>(src + y, plane, inv + y, blocks_y, dst + y, dst_plane);
+    }
+}
+
+// ***************************** //
+// entry
+
+void InitHOGFeature(FloatImage * img, HOGFeatureOpt * opt)
+{
+    ASSERT(opt->sbin > 0);
+    ASSERT(img->height >= 3 && img->width >= 3);
+
+    opt->blocks_y = (int)(1.0 * img->height / opt->sbin + 0.5);
+    opt->blocks_x = (int)(1.0 * img->width / opt->sbin + 0.5);
+    opt->height = MAX(opt->blocks_y - 2, 0);
+    opt->width = MAX(opt->blocks_x - 2, 0);
+    opt->length = 31;
+}
+
+// feat: allocated by the caller, height x width x 31
+void HOGFeature(FloatImage * img, FloatImage * feat, HOGFeatureOpt * opt)
+{
+    int blocks_y = opt->blocks_y, blocks_x = opt->blocks_x;
+    int plane = blocks_y * blocks_x;
+
+    HOGFeatureArgs args;
+    args.img = img;
+    args.opt = opt;
+    int ncol = MAX(blocks_x * opt->sbin - 2, 0);
+    args.ntask = MAX((ncol + HOG_BAND_COLUMNS-1) / HOG_BAND_COLUMNS, 1);
+    args.band_offset = ALLOCATE(long long, args.ntask+1);
+    args.band_x1 = ALLOCATE(int, args.ntask);
+    args.band_width = ALLOCATE(int, args.ntask);
+    for(int t=0; t<args.ntask; t++)
+    {
+        HOGTaskCells(opt, args.ntask, t, args.band_x1 + t, args.band_width + t);
+        args.band_offset[t+1] = args.band_offset[t] + 18LL * blocks_y * args.band_width[t];
+    }
+    args.band = ALLOCATE(float, args.band_offset[args.ntask] > 0 ? args.band_offset[args.ntask] : 1);
+    int y2 = blocks_y * opt->sbin - 2;
+    int nworker = MAX(ThreadNum(), ThreadIndex()+1);
+    args.column = MAX(y2+1, 1);
+    args.mag = ALLOCATE(float, nworker * args.column);
+    args.ori = ALLOCATE(float, nworker * args.column);
+    args.cell_y = ALLOCATE(int, args.column);
+    args.wy = ALLOCATE(float, args.column);
+    for(int y=1; y<=y2; y++)
+        HOGCellMap(y, opt->sbin, args.cell_y + y, args.wy + y);
+    args.hist = ALLOCATE(float, 18 * MAX(plane, 1));
+    args.energy = ALLOCATE(float, MAX(plane, 1));
+    args.inv_norm = ALLOCATE(float, MAX(plane, 1));
+    args.feat = feat->p;
+
+    // partial histograms of column bands, summed in task order
+    ParallelFor(args.ntask, HOGHistogramTask, &args);
+    memset(args.hist, 0, sizeof(float) * 18 * plane);
+    for(int t=0; t<args.ntask; t++)
+    {
+        int band_plane = blocks_y * args.band_width[t];
+        for(int o=0; o<18; o++)
+        {
+            float * dst = args.hist + o*plane + args.band_x1[t]*blocks_y;
+            float * src = args.band + args.band_offset[t] + o*band_plane;
+            for(int i=0; i<band_plane; i++)
+                dst[i] += src[i];
+        }
+    }
+
+    // cell energy, then 1 / sqrt of the 2x2 block sums
+    ParallelFor(blocks_x, HOGEnergyTask, &args);
+    ParallelFor(blocks_x-1, HOGInverseNormTask, &args);
+
+    ParallelFor(opt->width, HOGNormalizeTask, &args);
+
+    FREE(args.band);
+    FREE(args.band_offset);
+    FREE(args.band_x1);
+    FREE(args.band_width);
+    FREE(args.mag);
+    FREE(args.ori);
+    FREE(args.cell_y);
+    FREE(args.wy);
+    FREE(args.hist);
+    FREE(args.energy);
+    FREE(args.inv_norm);
+}
+
+#endif
@@ -1,11 +1,15 @@
 #ifndef FLOAT_IMAGE_H
 #define FLOAT_IMAGE_H
 
+#include <string.h>
+
 #ifdef MATLAB_COMPILE
     #include <matrix.h>
+    #include <stdlib.h>
     #define ASSERT(expr) mxAssert((expr), "Assertion Failed");
-    #define ALLOCATE(type, size) (type *)mxCalloc((size), sizeof(type))
-    #define FREE(ptr) mxFree((ptr))
+    // worker threads allocate too, mxCalloc is not thread safe
+    #define ALLOCATE(type, size) (type *)calloc((size), sizeof(type))
+    #define FREE(ptr) free((ptr))
 #else
     #include <assert.h>
     #define ASSERT(expr) assert((expr));
@@ -13,14 +17,6 @@
     #define FREE(ptr) delete[] ptr
 #endif
 
-// multi-thread
-#ifdef THREAD_MAX
-#ifdef WIN32
-    #include <windows.h>
-#elif defined(__UNIX__)
-    #include <pthread.h>
-#endif
-#endif
             
 static inline double MIN(double x, double y) { return (x <= y ? x : y); }
 static inline double MAX(double x, double y) { return (x <= y ? y : x); }
@@ -30,8 +26,29 @@ static inline float MAX(float x, float y) { return (x <= y ? y : x); }
 
 static inline int MIN(int x, int y) { return (x <= y ? x : y); }
 static inline int MAX(int x, int y) { return (x <= y ? y : x); }
+
+// registry name match, the prefix of the registered name is optional
+//      e.g. "PixelGray8N" is found by "PixelGray8N" or "Gray8N"
+inline bool RegistryNameMatch(const char * entry, const char * prefix, const char * name)
+{
+    if(strcmp(entry, name) == 0)
+        return true;
+    
+    size_t len = strlen(prefix);
+    return strncmp(entry, prefix, len) == 0 && strcmp(entry + len, name) == 0;
+}
             
             
+// element type of image data
+enum ImageType
+{
+    IMAGE_FLOAT = 0,
+    IMAGE_UINT8,
+    IMAGE_UINT16
+};
+
+// p points to elements of the given type, cast to float *
+// for uint8 / uint16 planes used without conversion
 struct FloatImage
 {
     float * p;
@@ -39,10 +56,23 @@ struct FloatImage
     int height;
     int depth;
     int stride;
+    int type;
 };
 
 typedef struct FloatImage FloatMatrix;
 
+// call func(typed pointer to element offset, ...) by the element type of img
+#define IMAGE_TYPE_CALL(img, offset, func, ...) \
+    switch((img)->type) \
+    { \
+        case IMAGE_UINT8: \
+            func((const unsigned char *)(img)->p + (offset), __VA_ARGS__); break; \
+        case IMAGE_UINT16: \
+            func((const unsigned short *)(img)->p + (offset), __VA_ARGS__); break; \
+        default: \
+            func((const float *)(img)->p + (offset), __VA_ARGS__); break; \
+    }
+
 // matlab style height x width x depth
 void AllocateImage(FloatImage * img, int height, int width, int depth)
 {
@@ -52,6 +82,7 @@ void AllocateImage(FloatImage * img, int height, int width, int depth)
     img->height = height;
     img->depth = depth;   
     img->stride = height;   
+    img->type = IMAGE_FLOAT;
 }
 
 // move image to another struct
@@ -62,6 +93,7 @@ void MoveImage(FloatImage * src, FloatImage * dst)
     dst->height = src->height;
     dst->depth = src->depth;   
     dst->stride = src->height;   
+    dst->type = src->type;
     src->p = NULL;
 }
 
@@ -152,12 +184,174 @@ inline void AddSparseMatrix(FloatSparseMatrix * sparse, int idx, float coef, flo
     }
 }
 
+// ***************************** //
+// coded pixel map, bin-major alternative to FloatSparseMatrix without -1 padding
+//      CODED_DENSE: one plane per bin, value of pixel n in bin b at p[b*width + n]
+//      CODED_CSR: blocks of pixel n are start[n]..start[n+1]-1, block k holds the
+//          values p[k*block_size].. of block bin[k], as in FloatSparseMatrix
+//      height: coded length, width: pixel number
+//      block_num, block_size: blocks per pixel written by the coding function
+//      stage_val, stage_bin: CODED_DENSE only, the blocks of one pixel before they
+//          are added to the planes
+
+#ifndef CODED_DENSE_MAX_LENGTH
+#define CODED_DENSE_MAX_LENGTH 64
+#endif
+
+enum {CODED_DENSE = 0, CODED_CSR = 1};
+
+struct CodedPixelMap
+{
+    int layout;
+    float * p;
+    int * bin;
+    int * start;
+    int height;
+    int width;
+    int block_num;
+    int block_size;
+    float * stage_val;
+    int * stage_bin;
+};
+
+// dense planes for short or densely filled codes, csr otherwise
+inline int CodedPixelLayout(int length, int block_num, int block_size)
+{
+    if(length <= CODED_DENSE_MAX_LENGTH || 4*block_num*block_size >= length)
+        return CODED_DENSE;
+    return CODED_CSR;
+}
+
+// bytes of one coded pixel
+inline int CodedPixelBytes(int layout, int length, int block_num, int block_size)
+{
+    if(layout == CODED_DENSE)
+        return (int)sizeof(float) * length;
+    return block_num * (int)(sizeof(int) + sizeof(float) * block_size) + (int)sizeof(int);
+}
+
+void AllocateCodedPixelMap(CodedPixelMap * map, int height, int width, int block_num, int block_size)
+{
+    map->layout = CodedPixelLayout(height, block_num, block_size);
+    map->height = height;
+    map->width = width;
+    map->block_num = block_num;
+    map->block_size = block_size;
+    
+    if(map->layout == CODED_DENSE)
+    {
+        map->p = ALLOCATE(float, height*width);
+        map->bin = NULL;
+        map->start = NULL;
+        map->stage_val = ALLOCATE(float, block_num*block_size);
+        map->stage_bin = ALLOCATE(int, block_num);
+    }
+    else
+    {
+        map->p = ALLOCATE(float, width*block_num*block_size);
+        map->bin = ALLOCATE(int, width*block_num);
+        map->start = ALLOCATE(int, width+1);
+        map->stage_val = NULL;
+        map->stage_bin = NULL;
+    }
+}
+
+void FreeCodedPixelMap(CodedPixelMap * map)
+{
+    FREE(map->p);
+    if(map->layout == CODED_CSR)
+    {
+        FREE(map->bin);
+        FREE(map->start);
+    }
+    else
+    {
+        FREE(map->stage_val);
+        FREE(map->stage_bin);
+    }
+}
+
+// empty the map for width pixels, no more than allocated
+void ResetCodedPixelMap(CodedPixelMap * map, int width)
+{
+    map->width = width;
+    if(map->layout == CODED_DENSE)
+        memset(map->p, 0, sizeof(float)*map->height*width);
+    else
+        map->start[0] = 0;
+}
+
+// set pixel n from blocks of a coding function, pixels are set in order
+//      csr: val and bin may point into the map at block start[n], unused blocks are dropped
+inline void SetCodedPixel(CodedPixelMap * map, int n, const float * val, const int * bin)
+{
+    int block_size = map->block_size;
+    if(map->layout == CODED_DENSE)
+    {
+        for(int k=0; k<map->block_num; k++, val += block_size)
+        {
+            if(bin[k] < 0)
+                continue;
+            float * dst = map->p + bin[k]*block_size*map->width + n;
+            for(int j=0; j<block_size; j++, dst += map->width)
+                *dst += val[j];
+        }
+    }
+    else
+    {
+        int m = map->start[n];
+        for(int k=0; k<map->block_num; k++, val += block_size)
+        {
+            if(bin[k] < 0)
+                continue;
+            map->bin[m] = bin[k];
+            memmove(map->p + m*block_size, val, sizeof(float)*block_size);
+            m++;
+        }
+        map->start[n+1] = m;
+    }
+}
+
+// dst += coef * coded pixel idx
+inline void AddCodedPixel(CodedPixelMap * map, int idx, float coef, float * dst)
+{
+    if(map->layout == CODED_DENSE)
+    {
+        const float * src = map->p + idx;
+        for(int b=0; b<map->height; b++, src += map->width)
+            dst[b] += coef * (*src);
+    }
+    else
+    {
+        int block_size = map->block_size;
+        for(int k=map->start[idx]; k<map->start[idx+1]; k++)
+        {
+            const float * val = map->p + k*block_size;
+            float * dense = dst + map->bin[k]*block_size;
+            for(int j=0; j<block_size; j++)
+                dense[j] += coef * val[j];
+        }
+    }
+}
+
+// convert all pixels of a sparse matrix, the map is reset to its width
+void SparseToCodedPixelMap(FloatSparseMatrix * sparse, CodedPixelMap * map)
+{
+    ASSERT(sparse->block_num == map->block_num && sparse->block_size == map->block_size);
+    ResetCodedPixelMap(map, sparse->width);
+    for(int n=0; n<sparse->width; n++)
+        SetCodedPixel(map, n, sparse->p + n*sparse->block_num*sparse->block_size,
+                sparse->i + n*sparse->block_num);
+}
+
 #ifdef MATLAB_COMPILE
 
 #define FUNC_PROC2(name) Func ## name
 #define FUNC_PROC(name) FUNC_PROC2(name)
 #define FUNC_INIT2(name) Init ## name
 #define FUNC_INIT(name) FUNC_INIT2(name)
+#define FUNC_SPAN2(name) Span ## name
+#define FUNC_SPAN(name) FUNC_SPAN2(name)
 
 #define COPY_INT_FIELD(field_name) opt->field_name = (mxGetField(mat_opt, 0, #field_name)==NULL)?0:(int)mxGetScalar(mxGetField(mat_opt, 0, #field_name))
 #define COPY_MATRIX_FIELD(field_name, type) opt->field_name = (mxGetField(mat_opt, 0, #field_name)==NULL)?NULL:(type *)mxGetPr(mxGetField(mat_opt, 0, #field_name))
@@ -169,6 +363,7 @@ inline void AddSparseMatrix(FloatSparseMatrix * sparse, int idx, float coef, flo
 void MatReadFloatMatrix(const mxArray * mat_matrix, FloatMatrix * matrix)
 {    
     matrix->p = (float *)mxGetPr(mat_matrix);
+    matrix->type = IMAGE_FLOAT;
     int ndims = mxGetNumberOfDimensions(mat_matrix);
     const mwSize * dims = mxGetDimensions(mat_matrix);
     
@@ -224,9 +419,43 @@ void MatCopyToFloatMatrix(const mxArray * mx_image, FloatImage * image)
         for(int i=0; i<mxGetNumberOfElements(mx_image); i++)
             image->p[i] = (float)src[i];
     }
+    else if(mxGetClassID(mx_image) == mxUINT16_CLASS)
+    {        
+        unsigned short * src = (unsigned short * )mxGetPr(mx_image);
+
+        for(int i=0; i<mxGetNumberOfElements(mx_image); i++)
+            image->p[i] = (float)src[i];
+    }
+    else if(mxGetClassID(mx_image) == mxSINGLE_CLASS)
+    {        
+        memcpy(image->p, mxGetData(mx_image), sizeof(float)*mxGetNumberOfElements(mx_image));
+    }
         
 }
 
+// read image for pixel features without conversion
+//      single, uint8, uint16: view of the matlab array, no copy
+//      other classes: copied to a new float image
+// returns true if the image is a copy and must be freed
+bool MatReadImage(const mxArray * mx_image, FloatImage * image)
+{
+    mxClassID class_id = mxGetClassID(mx_image);
+    if(class_id != mxSINGLE_CLASS && class_id != mxUINT8_CLASS && class_id != mxUINT16_CLASS)
+    {
+        MatCopyToFloatMatrix(mx_image, image);
+        return true;
+    }
+    
+    MatReadFloatMatrix(mx_image, image);
+    image->stride = image->height;
+    if(class_id == mxUINT8_CLASS)
+        image->type = IMAGE_UINT8;
+    else if(class_id == mxUINT16_CLASS)
+        image->type = IMAGE_UINT16;
+    
+    return false;
+}
+
 mxArray * MatCopyFromFloatMatrix(FloatImage * image)
 {
     mwSize dims[3] = {image->height, image->width, image->depth};   
@@ -247,6 +476,7 @@ mxArray * MatAllocateFloatMatrix(FloatMatrix * matrix, int height, int width, in
     mwSize dims[3]= {height, width, depth};
     mxArray * ret = mxCreateNumericArray(3, dims, mxSINGLE_CLASS, mxREAL);
     matrix->p = (float *)mxGetPr(ret);
+    matrix->type = IMAGE_FLOAT;
     matrix->height = height;
     matrix->width = width;
     matrix->depth = depth;
@@ -0,0 +1,104 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <string.h>
+
+#if defined(WIN32) || defined(_WIN32)
+    #include <windows.h>
+#else
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+#endif
+
+// ***************************** //
+// read only file mappings, shared by all processes mapping the same file
+
+struct MappedFile
+{
+    const char * base;
+    long long size;
+#if defined(WIN32) || defined(_WIN32)
+    HANDLE file, mapping;
+#endif
+};
+
+void UnmapFile(MappedFile * map)
+{
+#if defined(WIN32) || defined(_WIN32)
+    if(map->base != NULL)
+        UnmapViewOfFile(map->base);
+    if(map->mapping != NULL)
+        CloseHandle(map->mapping);
+    if(map->file != NULL && map->file != INVALID_HANDLE_VALUE)
+        CloseHandle(map->file);
+#else
+    if(map->base != NULL)
+        munmap((void *)map->base, (size_t)map->size);
+#endif
+    memset(map, 0, sizeof(MappedFile));
+}
+
+// size and last write time of path, to tell a rewritten file from the mapped one,
+// false if it does not exist. the time is in the units of the system, 100ns or 1ns
+bool FileVersion(const char * path, long long * size, long long * mtime)
+{
+#if defined(WIN32) || defined(_WIN32)
+    WIN32_FILE_ATTRIBUTE_DATA info;
+    if(!GetFileAttributesExA(path, GetFileExInfoStandard, &info))
+        return false;
+    *size = ((long long)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+    *mtime = ((long long)info.ftLastWriteTime.dwHighDateTime << 32) | info.ftLastWriteTime.dwLowDateTime;
+#else
+    struct stat info;
+    if(stat(path, &info) != 0)
+        return false;
+    *size = info.st_size;
+#ifdef __APPLE__
+    *mtime = (long long)info.st_mtimespec.tv_sec * 1000000000LL + info.st_mtimespec.tv_nsec;
+#else
+    *mtime = (long long)info.st_mtim.tv_sec * 1000000000LL + info.st_mtim.tv_nsec;
+#endif
+#endif
+    return true;
+}
+
+// maps path, false if it cannot be opened or is shorter than min_size bytes
+bool MapFile(MappedFile * map, const char * path, long long min_size)
+{
+    memset(map, 0, sizeof(MappedFile));
+#if defined(WIN32) || defined(_WIN32)
+    map->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(map->file == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER size;
+    if(GetFileSizeEx(map->file, &size) && size.QuadPart >= min_size && size.QuadPart > 0)
+    {
+        map->size = size.QuadPart;
+        map->mapping = CreateFileMappingA(map->file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if(map->mapping != NULL)
+            map->base = (const char *)MapViewOfFile(map->mapping, FILE_MAP_READ, 0, 0, 0);
+    }
+#else
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+        return false;
+    struct stat info;
+    if(fstat(fd, &info) == 0 && info.st_size >= min_size && info.st_size > 0)
+    {
+        map->size = info.st_size;
+        void * base = mmap(NULL, (size_t)map->size, PROT_READ, MAP_SHARED, fd, 0);
+        map->base = base == MAP_FAILED ? NULL : (const char *)base;
+    }
+    close(fd);
+#endif
+    if(map->base == NULL)
+    {
+        UnmapFile(map);
+        return false;
+    }
+    return true;
+}
+
+#endif
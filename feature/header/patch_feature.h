@@ -6,6 +6,8 @@
 
 // coding with pixel coding method
 #include "coding.h"
+#include "pixel_coding.h"
+#include "pooling.h"
 
 // ***************************** //
 // for patch feature extraction
@@ -18,6 +20,7 @@
 //      numbin_{x,y}: bin number in each patch
 //      sizebin_{x,y}: patch step of each bin
 //      length: patch featue length of each bin
+//      strip_width: process the image in column strips of this width, 0 for whole image, <0 for auto (default)
 //      param, nparam: code parameter
 //      codebook: learning based encoding after extracting feature
 
@@ -37,14 +40,273 @@ struct PatchFeatureOpt
     bool use_pixel_feature;
     PixelFeatureOpt pixel_opt; 
     CodingOpt pixel_coding_opt;
+    FuncPixelCodingProc func_pixel_coding;
     
     int size_x, size_y;    
     int length;
     
     int height, width;
     bool use_default_patch;
+    
+    // column strip width for streaming pixel coding and pooling
+    int strip_width;
 };
 
+// ***************************** //
+// pooling helpers
+
+#ifndef STRIP_CACHE_BYTES
+#define STRIP_CACHE_BYTES (512*1024)
+#endif
+
+// strip_width of the callers that leave it unset, matlab and the cli
+#define STRIP_WIDTH_DEFAULT (-1)
+
+// strip width in patch x coordinates
+//      strip_width > 0: fixed width
+//      strip_width < 0: sized so a strip of pixel features and codes fits STRIP_CACHE_BYTES
+//      strip_width = 0: one strip for the whole image
+int PatchStripWidth(PatchFeatureOpt * opt, int patch_range)
+{
+    if(opt->strip_width > 0)
+        return opt->strip_width;
+    
+    if(opt->strip_width == 0)
+        return MAX(patch_range, 1);
+    
+    const CodingOpt * coding_opt = &opt->pixel_coding_opt;
+    int layout = CodedPixelLayout(coding_opt->length, coding_opt->block_num, coding_opt->block_size);
+    int col_bytes = opt->pixel_opt.height * (int)sizeof(float) * opt->pixel_opt.length
+            + opt->pixel_opt.height * CodedPixelBytes(layout, coding_opt->length,
+            coding_opt->block_num, coding_opt->block_size);
+    
+    int strip = STRIP_CACHE_BYTES / MAX(col_bytes, 1) - (opt->size_x - 1);
+    return MIN(MAX(strip, MAX(opt->size_x/2, 1)), MAX(patch_range, 1));
+}
+
+#ifndef SEPARABLE_BUFFER_BYTES
+#define SEPARABLE_BUFFER_BYTES (4*STRIP_CACHE_BYTES)
+#endif
+
+// separable pooling of the default grid pays a dense vertical pass over the coded
+// length, direct pooling scatters each coded pixel into about 2 x size_x patches;
+// dense coded planes are always pooled separably
+bool UseSeparablePooling(PatchFeatureOpt * opt)
+{
+    if(!opt->use_default_patch)
+        return false;
+    
+    // dense rows of one grid column must stay cached
+    if(sizeof(float) * opt->length * opt->pixel_opt.height > SEPARABLE_BUFFER_BYTES)
+        return false;
+    
+    const CodingOpt * coding_opt = &opt->pixel_coding_opt;
+    if(CodedPixelLayout(coding_opt->length, coding_opt->block_num, coding_opt->block_size) == CODED_DENSE)
+        return true;
+    
+    float nnz = 1.0f * coding_opt->block_num * coding_opt->block_size;
+    float cost_direct = 2.0f * opt->size_x * nnz;
+    float cost_separable = opt->size_x * nnz + 2.0f * opt->length / SIMD_WIDTH;
+    return cost_separable < cost_direct;
+}
+
+// triangle weight of pixels in a patch
+void PatchPixelWeight(FloatMatrix * pixel_weight, int size_x, int size_y)
+{
+    AllocateImage(pixel_weight, size_y, size_x, 1);
+    for(int px=0; px<size_x; px++){
+        for(int py=0; py<size_y; py++){
+            float vx = 1 - abs(px+0.5f - 1.0f*size_x/2) / (1.0f*size_x/2),
+                    vy = 1 - abs(py+0.5f - 1.0f*size_y/2) / (1.0f*size_y/2);
+            
+            pixel_weight->p[px*size_y + py] = vx * vy;
+        }
+    }
+}
+
+// pool coded pixels of patch (x, y) into dst
+// coding holds pixel feature columns starting from col1
+inline void PoolPatch(CodedPixelMap * coding, int col1, int x, int y,
+        FloatMatrix * pixel_weight, float * dst, PixelFeatureOpt * pixel_opt)
+{
+    int size_y = pixel_weight->height,
+            size_x = pixel_weight->width;
+    
+    for(int px=0; px<size_x; px++){
+        int ix = MIN(MAX(x+px-pixel_opt->margin, 0), pixel_opt->width-1);
+        const float * weight = pixel_weight->p + px*size_y;
+        
+        if(coding->layout == CODED_DENSE)
+        {
+            // one weighted column sum per bin plane
+            const float * plane = coding->p + (ix-col1)*pixel_opt->height;
+            for(int b=0; b<coding->height; b++, plane += coding->width)
+                dst[b] += ClampedDotProduct(weight, plane, y-pixel_opt->margin, size_y, pixel_opt->height);
+            continue;
+        }
+        
+        for(int py=0; py<size_y; py++){
+            int iy = MIN(MAX(y+py-pixel_opt->margin, 0), pixel_opt->height-1);
+            
+            int idx = iy + (ix-col1)*pixel_opt->height;
+            AddCodedPixel(coding, idx, weight[py], dst);
+        }
+    }
+}
+
+// ***************************** //
+// strips of the pixel feature path
+
+// per worker strip buffers, reused by all strips of the worker
+//      the generic path codes into a sparse matrix and converts it
+struct PatchStripCache
+{
+    bool allocated;
+    FloatMatrix pixel_feat;
+    FloatSparseMatrix pixel_sparse;
+    CodedPixelMap pixel_coding;
+    float * grid_buffer;
+};
+
+struct PatchStripArgs
+{
+    FloatImage * img;
+    FloatImage * feat;
+    FloatImage * coord;
+    PatchFeatureOpt * opt;
+    
+    int patch_x1, patch_x2;
+    int strip;
+    int strip_pixels;
+    bool use_fused;
+    bool use_separable;
+    FloatMatrix pixel_weight;
+    PoolingOpt grid_pool;
+    
+    // direct pooling: patches of strip s at strip_patch[strip_start[s]..strip_start[s+1]-1],
+    // ascending ids
+    int * strip_start;
+    int * strip_patch;
+    
+    PatchStripCache * cache;
+    int cache_num;
+};
+
+void AllocatePatchStripCache(PatchStripCache * cache, const PatchStripArgs * args)
+{
+    const PixelFeatureOpt * pixel_opt = &args->opt->pixel_opt;
+    const CodingOpt * pixel_coding_opt = &args->opt->pixel_coding_opt;
+    
+    AllocateImage(&cache->pixel_feat, pixel_opt->length,
+            args->use_fused ? pixel_opt->height : args->strip_pixels, 1);
+    if(!args->use_fused)
+        AllocateSparseMatrix(&cache->pixel_sparse,
+                pixel_coding_opt->length,
+                args->strip_pixels,
+                pixel_coding_opt->block_num,
+                pixel_coding_opt->block_size);
+    AllocateCodedPixelMap(&cache->pixel_coding,
+            pixel_coding_opt->length,
+            args->strip_pixels,
+            pixel_coding_opt->block_num,
+            pixel_coding_opt->block_size);
+    cache->grid_buffer = NULL;
+    if(args->use_separable)
+        cache->grid_buffer = ALLOCATE(float, args->opt->length * pixel_opt->height);
+    cache->allocated = true;
+}
+
+void FreePatchStripCache(PatchStripCache * cache, const PatchStripArgs * args)
+{
+    if(!cache->allocated)
+        return;
+    FreeImage(&cache->pixel_feat);
+    if(!args->use_fused)
+        FreeSparseMatrix(&cache->pixel_sparse);
+    FreeCodedPixelMap(&cache->pixel_coding);
+    FREE(cache->grid_buffer);
+    cache->allocated = false;
+}
+
+// strips begin..end-1: pixel features, coding and pooling to the patches of each
+void PatchStripTask(void * args_in, int begin, int end)
+{
+    PatchStripArgs * args = (PatchStripArgs *)args_in;
+    PatchFeatureOpt * opt = args->opt;
+    PixelFeatureOpt * pixel_opt = &opt->pixel_opt;
+    CodingOpt * pixel_coding_opt = &opt->pixel_coding_opt;
+    FloatImage * coord = args->coord;
+    int npatch = coord->width * coord->height;
+    int margin = pixel_opt->margin;
+    
+    // a local cache for a worker the pool gained after the caches were allocated
+    PatchStripCache local_cache;
+    memset(&local_cache, 0, sizeof(PatchStripCache));
+    PatchStripCache * cache = ThreadIndex() < args->cache_num ? args->cache + ThreadIndex() : &local_cache;
+    if(!cache->allocated)
+        AllocatePatchStripCache(cache, args);
+    
+    for(int s=begin; s<end; s++)
+    {
+        int sx1 = args->patch_x1 + s*args->strip;
+        int sx2 = sx1 + args->strip - 1;
+        
+        // pixel feature columns touched by patches with x in [sx1, sx2]
+        int col1 = MIN(MAX(sx1 - margin, 0), pixel_opt->width-1);
+        int col2 = MIN(MAX(sx2 + opt->size_x - 1 - margin, 0), pixel_opt->width-1);
+        int ncol = col2 - col1 + 1;
+        
+        CodedPixelMap * strip_coding = &cache->pixel_coding;
+        ResetCodedPixelMap(strip_coding, ncol * pixel_opt->height);
+        
+        if(args->use_fused)
+        {
+            // fused, one column of pixel features at a time
+            opt->func_pixel_coding(args->img, col1 + margin, col2 + margin, cache->pixel_feat.p,
+                    strip_coding, pixel_opt, pixel_coding_opt);
+        }
+        else
+        {
+            PixelFeatureRange(args->img, col1 + margin, col2 + margin, cache->pixel_feat.p,
+                    NULL, NULL, pixel_opt);
+            
+            // code the strip
+            FloatSparseMatrix strip_sparse = cache->pixel_sparse;
+            strip_sparse.width = strip_coding->width;
+            for(int i=0; i<strip_sparse.width*strip_sparse.block_num; i++)
+                strip_sparse.i[i] = -1;
+            
+            FloatMatrix strip_feat = cache->pixel_feat;
+            strip_feat.width = strip_sparse.width;
+            Coding(&strip_feat, &strip_sparse, pixel_coding_opt);
+            SparseToCodedPixelMap(&strip_sparse, strip_coding);
+        }
+        
+        // pool encoded feature to patches of this strip
+        if(args->use_separable)
+        {
+            // grid columns with x in [sx1, sx2], x >= 0 on the default grid
+            const PoolingOpt * grid_pool = &args->grid_pool;
+            int ix1 = (sx1 + grid_pool->step_x - 1) / grid_pool->step_x;
+            int ix2 = MIN(sx2 / grid_pool->step_x, opt->width-1);
+            RegularGridTrianglePooling(strip_coding, col1, ix1, ix2,
+                    cache->grid_buffer, args->feat->p, grid_pool);
+            continue;
+        }
+        
+        float * coord_y = coord->p;
+        float * coord_x = coord->p + npatch;
+        for(int m=args->strip_start[s]; m<args->strip_start[s+1]; m++){
+            int n = args->strip_patch[m];
+            PoolPatch(strip_coding, col1, (int)coord_x[n], (int)coord_y[n], &args->pixel_weight,
+                    args->feat->p + n*opt->length, pixel_opt);
+        }
+    }
+    
+    if(cache == &local_cache)
+        FreePatchStripCache(&local_cache, args);
+}
+
 // ***************************** //
 
 // entry function for patch feature
@@ -57,6 +319,11 @@ void InitPatchFeature(FloatImage * img, PatchFeatureOpt * opt, FloatImage * coor
     
         ASSERT(opt->pixel_opt.length == opt->pixel_coding_opt.length_input);
         opt->length = opt->pixel_coding_opt.length;
+        
+        // specialized kernel for this pair if there is one
+        const CodingOpt * coding_opt = &opt->pixel_coding_opt;
+        opt->func_pixel_coding = FindPixelCoding(&opt->pixel_opt, coding_opt,
+                CodedPixelLayout(coding_opt->length, coding_opt->block_num, coding_opt->block_size));
     }
     else
     {
@@ -80,6 +347,13 @@ void InitPatchFeature(FloatImage * img, PatchFeatureOpt * opt, FloatImage * coor
     }
 }
 
+// release what InitPatchFeature() allocated
+void FreePatchFeature(PatchFeatureOpt * opt)
+{
+    if(opt->use_pixel_feature)
+        FreeCoding(&opt->pixel_coding_opt);
+}
+
 void PatchFeature(FloatImage * img, FloatImage * feat, FloatImage * coord, PatchFeatureOpt * opt)
 {        
     int size_x = opt->size_x, 
@@ -105,73 +379,77 @@ void PatchFeature(FloatImage * img, FloatImage * feat, FloatImage * coord, Patch
     
     if(opt->use_pixel_feature)
     {
-        FloatMatrix pixel_feat, pixel_coord;
-        FloatSparseMatrix pixel_coding;
         PixelFeatureOpt * pixel_opt = &opt->pixel_opt;
         CodingOpt * pixel_coding_opt = &opt->pixel_coding_opt;
+        int npatch = coord->width * coord->height;
         
-        // cache pixel level feature
-        AllocateImage(&pixel_feat,
-                pixel_opt->length,
-                pixel_opt->height*pixel_opt->width,
-                1);
-        AllocateImage(&pixel_coord,
-                pixel_opt->height,
-                pixel_opt->width,
-                2);
+        PatchStripArgs args;
+        args.img = img;
+        args.feat = feat;
+        args.coord = coord;
+        args.opt = opt;
         
-        PixelFeature(img, &pixel_feat, &pixel_coord, &opt->pixel_opt);
+        // patch x range, strips are taken over it
+        args.patch_x1 = 0;
+        int patch_x2 = -1;
+        for(int n=0; n<npatch; n++){
+            int x = (int)coord->p[npatch + n];
+            args.patch_x1 = (n == 0) ? x : MIN(args.patch_x1, x);
+            patch_x2 = (n == 0) ? x : MAX(patch_x2, x);
+        }
+        args.patch_x2 = patch_x2;
         
-        // cache pixel level coded feature
-        AllocateSparseMatrix(&pixel_coding,
-                pixel_coding_opt->length,
-                pixel_opt->height*pixel_opt->width,
-                pixel_coding_opt->block_num,
-                pixel_coding_opt->block_size);
+        args.strip = PatchStripWidth(opt, patch_x2 - args.patch_x1 + 1);
+        // pixel feature columns needed by one strip, with halo
+        args.strip_pixels = MIN(args.strip + size_x - 1, pixel_opt->width) * pixel_opt->height;
+        args.use_fused = (opt->func_pixel_coding != NULL);
         
-        Coding(&pixel_feat, &pixel_coding, pixel_coding_opt);
+        // pixel weight in patch
+        PatchPixelWeight(&args.pixel_weight, size_x, size_y);
         
-        FreeImage(&pixel_feat);
-        FreeImage(&pixel_coord);
+        // separable pooling for the default grid
+        args.use_separable = UseSeparablePooling(opt);
+        if(args.use_separable)
+            InitRegularGridPooling(&args.grid_pool, size_x, size_y, opt->height, pixel_opt->margin,
+                    pixel_opt->height, pixel_opt->width, opt->length);
         
-        // pixel weight in patch
-        FloatMatrix pixel_weight;
-        AllocateImage(&pixel_weight, size_y, size_x, 1);
-        for(int px=0; px<size_x; px++){
-            for(int py=0; py<size_y; py++){
-                float vx = 1 - abs(px+0.5f - 1.0f*size_x/2) / (1.0f*size_x/2),
-                        vy = 1 - abs(py+0.5f - 1.0f*size_y/2) / (1.0f*size_y/2);
-                
-                pixel_weight.p[px*size_y + py] = vx * vy;
-            }
+        // strips write disjoint patches, one cache per worker
+        int nstrip = patch_x2 >= args.patch_x1 ? (patch_x2 - args.patch_x1) / args.strip + 1 : 0;
+        
+        // patches bucketed by strip once for direct pooling
+        args.strip_start = NULL;
+        args.strip_patch = NULL;
+        if(!args.use_separable)
+        {
+            args.strip_start = ALLOCATE(int, nstrip+1);
+            args.strip_patch = ALLOCATE(int, MAX(npatch, 1));
+            const float * coord_x = coord->p + npatch;
+            for(int n=0; n<npatch; n++)
+                args.strip_start[((int)coord_x[n] - args.patch_x1) / args.strip + 1]++;
+            for(int k=0; k<nstrip; k++)
+                args.strip_start[k+1] += args.strip_start[k];
+            for(int n=0; n<npatch; n++)
+                args.strip_patch[args.strip_start[((int)coord_x[n] - args.patch_x1) / args.strip]++] = n;
+            for(int k=nstrip; k>0; k--)
+                args.strip_start[k] = args.strip_start[k-1];
+            args.strip_start[0] = 0;
         }
         
-        // pool encoded feature to patches
-        int npatch = coord->width * coord->height;
-        float * coord_y = coord->p;
-        float * coord_x = coord->p + npatch;
+        args.cache_num = MAX(ThreadNum(), ThreadIndex()+1);
+        args.cache = ALLOCATE(PatchStripCache, args.cache_num);
+        ParallelFor(nstrip, PatchStripTask, &args, 1, pixel_coding_opt->scratch_num);
         
-        for(int n=0; n<npatch; n++){
-            int y = (int)(*(coord_y++));
-            int x = (int)(*(coord_x++));
-            
-//         mexPrintf("%d, %d\n", y, x);
-            float * dst = feat->p + n*opt->length;
-            for(int px=0; px<size_x; px++){
-                for(int py=0; py<size_y; py++){
-                    float v = pixel_weight.p[px*size_y + py];
-                    
-                    int iy = MIN(MAX(y+py-pixel_opt->margin, 0), pixel_opt->height-1);
-                    int ix = MIN(MAX(x+px-pixel_opt->margin, 0), pixel_opt->width-1);
-                    
-                    int idx = iy + ix*pixel_opt->height;
-                    AddSparseMatrix(&pixel_coding, idx, v, dst);
-                }
-            }
+        for(int t=0; t<args.cache_num; t++)
+            FreePatchStripCache(args.cache + t, &args);
+        FREE(args.cache);
+        if(args.use_separable)
+            FreeRegularGridPooling(&args.grid_pool);
+        else
+        {
+            FREE(args.strip_start);
+            FREE(args.strip_patch);
         }
-        FreeImage(&pixel_weight);
-        
-        FreeSparseMatrix(&pixel_coding);
+        FreeImage(&args.pixel_weight);
     }
     else
     {    
@@ -224,6 +502,9 @@ void MatReadPatchFeatureOpt(const mxArray * mat_opt, PatchFeatureOpt * opt)
     // get patch size   
     COPY_INT_FIELD(size_x);
     COPY_INT_FIELD(size_y);
+    // absent strip_width is the default, as in the cli
+    mxArray * mx_strip_width = mxGetField(mat_opt, 0, "strip_width");
+    opt->strip_width = mx_strip_width == NULL ? STRIP_WIDTH_DEFAULT : (int)mxGetScalar(mx_strip_width);
 }
 #endif
 
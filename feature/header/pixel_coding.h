@@ -0,0 +1,246 @@
+#ifndef PIXEL_CODING_H
+#define PIXEL_CODING_H
+
+#include "image.h"
+#include "pixel_feature.h"
+#include "coding.h"
+
+// ***************************** //
+// fused pixel feature and coding
+//      every compatible (pixel feature, coding) pair is instantiated as a template
+//      so the coding function is inlined into the pixel loop; the pair is picked
+//      at runtime from the function pointers of the options
+
+// code image columns x1..x2 into coding, buffer holds one column of pixel features
+typedef void (*FuncPixelCodingProc)(FloatImage * img, int x1, int x2, float * buffer,
+        CodedPixelMap * coding, PixelFeatureOpt * pixel_opt, const CodingOpt * coding_opt);
+
+// the map is reset by the caller; csr blocks are coded in place and compacted,
+// dense planes take the blocks of each pixel from the stage of the map
+template <FuncPixelFeatureSpan PixelSpan, FuncCodingProc CodingProc, int Layout>
+void PixelCodingKernel(FloatImage * img, int x1, int x2, float * buffer,
+        CodedPixelMap * coding, PixelFeatureOpt * pixel_opt, const CodingOpt * coding_opt)
+{
+    int block_size = coding_opt->block_size;
+    int block_num = coding_opt->block_num;
+    int length = pixel_opt->length;
+    
+    int n = 0;
+    for(int x=x1; x<=x2; x++)
+    {
+        PixelSpan(img, x, pixel_opt->y1, pixel_opt->y2, buffer, pixel_opt);
+        
+        float * p = buffer;
+        for(int y=0; y<pixel_opt->height; y++, n++)
+        {
+            float * val = coding->stage_val;
+            int * bin = coding->stage_bin;
+            if(Layout == CODED_CSR)
+            {
+                val = coding->p + coding->start[n]*block_size;
+                bin = coding->bin + coding->start[n];
+            }
+            
+            for(int k=0; k<block_num; k++)
+                bin[k] = -1;
+            CodingProc(p, val, bin, coding_opt);
+            SetCodedPixel(coding, n, val, bin);
+            p += length;
+        }
+    }
+}
+
+// ***************************** //
+// uniform lbp straight from the image
+//      each neighbor column is compared against the center column with simd compares,
+//      the 8 bits of a pixel are or-ed into one byte, then mapped by LBP59_Map;
+//      bits follow the neighbor order of PixelGray8N, so codes equal FuncCodingPixelLBP
+
+// pixel offsets of the 8 neighbors, bit i is set when neighbor i > center
+#define LBP_NEIGHBOR_OFFSETS(h) {-1-(h), -1, -1+(h), (h), 1+(h), 1, 1-(h), -(h)}
+
+template <typename T>
+inline unsigned char LBPCode(const T * p, const int * offset)
+{
+    unsigned int code = 0;
+    for(int i=0; i<8; i++)
+        code |= (unsigned int)(p[offset[i]] > p[0]) << i;
+    return (unsigned char)code;
+}
+
+// lbp bytes of n pixels down a column, 32 (avx2) or 16 (sse) uint8 pixels per compare
+inline void LBPCodeColumn(const unsigned char * p, int h, int n, unsigned char * code)
+{
+    const int offset[8] = LBP_NEIGHBOR_OFFSETS(h);
+    int y = 0;
+#if defined(SIMD_AVX2)
+    // unsigned compare as signed after flipping the sign bit
+    const __m256i sign = _mm256_set1_epi8((char)0x80);
+    for(; y+32 <= n; y += 32)
+    {
+        const unsigned char * q = p + y;
+        __m256i c = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)q), sign);
+        __m256i bits = _mm256_setzero_si256();
+        for(int i=0; i<8; i++)
+        {
+            __m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(q + offset[i])), sign);
+            bits = _mm256_or_si256(bits, _mm256_and_si256(_mm256_cmpgt_epi8(v, c), _mm256_set1_epi8((char)(1 << i))));
+        }
+        _mm256_storeu_si256((__m256i *)(code + y), bits);
+    }
+#endif
+#if defined(SIMD_SSE)
+    const __m128i sign16 = _mm_set1_epi8((char)0x80);
+    for(; y+16 <= n; y += 16)
+    {
+        const unsigned char * q = p + y;
+        __m128i c = _mm_xor_si128(_mm_loadu_si128((const __m128i *)q), sign16);
+        __m128i bits = _mm_setzero_si128();
+        for(int i=0; i<8; i++)
+        {
+            __m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(q + offset[i])), sign16);
+            bits = _mm_or_si128(bits, _mm_and_si128(_mm_cmpgt_epi8(v, c), _mm_set1_epi8((char)(1 << i))));
+        }
+        _mm_storeu_si128((__m128i *)(code + y), bits);
+    }
+#endif
+    for(; y < n; y++)
+        code[y] = LBPCode(p + y, offset);
+}
+
+// 8 uint16 pixels per compare
+inline void LBPCodeColumn(const unsigned short * p, int h, int n, unsigned char * code)
+{
+    const int offset[8] = LBP_NEIGHBOR_OFFSETS(h);
+    int y = 0;
+#if defined(SIMD_SSE)
+    const __m128i sign = _mm_set1_epi16((short)0x8000);
+    for(; y+16 <= n; y += 16)
+    {
+        const unsigned short * q = p + y;
+        __m128i c0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)q), sign);
+        __m128i c1 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(q + 8)), sign);
+        __m128i bits0 = _mm_setzero_si128(), bits1 = _mm_setzero_si128();
+        for(int i=0; i<8; i++)
+        {
+            __m128i b = _mm_set1_epi16((short)(1 << i));
+            __m128i v0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(q + offset[i])), sign);
+            __m128i v1 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(q + offset[i] + 8)), sign);
+            bits0 = _mm_or_si128(bits0, _mm_and_si128(_mm_cmpgt_epi16(v0, c0), b));
+            bits1 = _mm_or_si128(bits1, _mm_and_si128(_mm_cmpgt_epi16(v1, c1), b));
+        }
+        _mm_storeu_si128((__m128i *)(code + y), _mm_packus_epi16(bits0, bits1));
+    }
+#endif
+    for(; y < n; y++)
+        code[y] = LBPCode(p + y, offset);
+}
+
+// 4 (sse) or 8 (avx2) float pixels per compare
+inline void LBPCodeColumn(const float * p, int h, int n, unsigned char * code)
+{
+    const int offset[8] = LBP_NEIGHBOR_OFFSETS(h);
+    int y = 0;
+#if defined(SIMD_AVX2)
+    for(; y+8 <= n; y += 8)
+    {
+        const float * q = p + y;
+        __m256 c = _mm256_loadu_ps(q);
+        __m256i bits = _mm256_setzero_si256();
+        for(int i=0; i<8; i++)
+        {
+            __m256i gt = _mm256_castps_si256(_mm256_cmp_ps(_mm256_loadu_ps(q + offset[i]), c, _CMP_GT_OQ));
+            bits = _mm256_or_si256(bits, _mm256_and_si256(gt, _mm256_set1_epi32(1 << i)));
+        }
+        __m128i w = _mm_packs_epi32(_mm256_castsi256_si128(bits), _mm256_extracti128_si256(bits, 1));
+        _mm_storel_epi64((__m128i *)(code + y), _mm_packus_epi16(w, w));
+    }
+#elif defined(SIMD_SSE)
+    for(; y+8 <= n; y += 8)
+    {
+        const float * q = p + y;
+        __m128 c0 = _mm_loadu_ps(q), c1 = _mm_loadu_ps(q + 4);
+        __m128i bits0 = _mm_setzero_si128(), bits1 = _mm_setzero_si128();
+        for(int i=0; i<8; i++)
+        {
+            __m128i b = _mm_set1_epi32(1 << i);
+            __m128i gt0 = _mm_castps_si128(_mm_cmpgt_ps(_mm_loadu_ps(q + offset[i]), c0));
+            __m128i gt1 = _mm_castps_si128(_mm_cmpgt_ps(_mm_loadu_ps(q + offset[i] + 4), c1));
+            bits0 = _mm_or_si128(bits0, _mm_and_si128(gt0, b));
+            bits1 = _mm_or_si128(bits1, _mm_and_si128(gt1, b));
+        }
+        __m128i w = _mm_packs_epi32(bits0, bits1);
+        _mm_storel_epi64((__m128i *)(code + y), _mm_packus_epi16(w, w));
+    }
+#endif
+    for(; y < n; y++)
+        code[y] = LBPCode(p + y, offset);
+}
+
+// fused Gray8N + PixelLBP, one bin of weight 1 per pixel written straight to the map;
+// buffer holds the lbp bytes of one column
+template <int Layout>
+void PixelCodingLBP(FloatImage * img, int x1, int x2, float * buffer,
+        CodedPixelMap * coding, PixelFeatureOpt * pixel_opt, const CodingOpt * coding_opt)
+{
+    unsigned char * code = (unsigned char *)buffer;
+    int height = pixel_opt->height;
+    
+    int n = 0;
+    for(int x=x1; x<=x2; x++)
+    {
+        IMAGE_TYPE_CALL(img, x*img->height + pixel_opt->y1, LBPCodeColumn, img->height, height, code);
+        
+        if(Layout == CODED_DENSE)
+        {
+            // the map is zeroed by the caller
+            for(int y=0; y<height; y++, n++)
+                coding->p[LBP59_Map[code[y]]*coding->width + n] = 1.0f;
+        }
+        else
+        {
+            for(int y=0; y<height; y++, n++)
+            {
+                coding->bin[n] = LBP59_Map[code[y]];
+                coding->p[n] = 1.0f;
+                coding->start[n+1] = n+1;
+            }
+        }
+    }
+}
+
+// ***************************** //
+// registry
+
+struct PixelCodingEntry
+{
+    FuncPixelFeatureSpan pixel_span;
+    FuncCodingProc coding_proc;
+    FuncPixelCodingProc func_proc[2];
+};
+
+// instantiated for both coded pixel layouts, indexed by CODED_DENSE / CODED_CSR
+#define PIXEL_CODING_ENTRY(pixel, coding) {Span ## pixel, Func ## coding, \
+        {PixelCodingKernel<Span ## pixel, Func ## coding, CODED_DENSE>, \
+        PixelCodingKernel<Span ## pixel, Func ## coding, CODED_CSR>}}
+
+// fisher vector is not fused, its batched coding works on whole strips
+static const PixelCodingEntry PixelCodingRegistry[] =
+{
+    {SpanPixelGray8N, FuncCodingPixelLBP, {PixelCodingLBP<CODED_DENSE>, PixelCodingLBP<CODED_CSR>}},
+    PIXEL_CODING_ENTRY(PixelGray4N, CodingPixelHOG),
+    PIXEL_CODING_ENTRY(PixelGray4N, CodingPixelHOGUoC),
+    {NULL, NULL, {NULL, NULL}}
+};
+
+// fused kernel of a pixel feature and coding writing the given layout, NULL if
+// the pair is not registered
+FuncPixelCodingProc FindPixelCoding(const PixelFeatureOpt * pixel_opt, const CodingOpt * coding_opt, int layout)
+{
+    for(const PixelCodingEntry * e = PixelCodingRegistry; e->coding_proc != NULL; e++)
+        if(e->pixel_span == pixel_opt->func_span && e->coding_proc == coding_opt->func_proc)
+            return e->func_proc[layout];
+    return NULL;
+}
+
+#endif
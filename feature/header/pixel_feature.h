@@ -3,6 +3,8 @@
 #define PIXEL_FEATURE_H
 
 #include "image.h"
+#include "simd.h"
+#include "thread.h"
 
 // ***************************** //
 // for pixel-wise feature coding
@@ -10,6 +12,8 @@ struct PixelFeatureOpt;
 
 typedef void (*FuncPixelFeatureInit)(PixelFeatureOpt * opt);
 typedef void (*FuncPixelFeatureProc)(FloatImage * img, int x, int y, float * dst, PixelFeatureOpt * opt);
+// column span: pixels (x, y1..y2) written contiguously, length floats each
+typedef void (*FuncPixelFeatureSpan)(FloatImage * img, int x, int y1, int y2, float * dst, PixelFeatureOpt * opt);
 
 // pixel feature options:
 //      image_depth: depth of image used
@@ -22,6 +26,7 @@ struct PixelFeatureOpt
     char* name; //name of the pixel feature    
     FuncPixelFeatureInit func_init;
     FuncPixelFeatureProc func_proc;
+    FuncPixelFeatureSpan func_span;
     
     // feature options 
     int image_depth;
@@ -42,6 +47,9 @@ struct PixelFeatureOpt
 // ********************************* //
 // pixel data implementation
 
+// typed kernels work on uint8, uint16 and float planes, widening to float
+// inside the kernel; the Func/Span entries dispatch on the image type
+
 // raw gray pixel 8-N & 4-N
 void InitPixelGray8N(PixelFeatureOpt * opt)
 {
@@ -50,8 +58,8 @@ void InitPixelGray8N(PixelFeatureOpt * opt)
     opt->margin = 1;
 }
 
-inline void FuncPixelGray8N(FloatImage *img, int x, int y, float * dst,
-        PixelFeatureOpt * opt)
+template <typename T>
+inline void PixelGray8N(const T * p, int h, float * dst)
 {
     // Set up a circularly indexed neighborhood using nine pointers.
     // |--------------|
@@ -62,18 +70,92 @@ inline void FuncPixelGray8N(FloatImage *img, int x, int y, float * dst,
     // | p6 | p5 | p4 |
     // |--------------|
     
-    float * p = img->p + x*img->height + y;
-    dst[0] = *(p-1-img->height);
-    dst[1] = *(p-1);
-    dst[2] = *(p-1+img->height);
-    dst[3] = *(p+img->height);
-    dst[4] = *(p+1+img->height);
-    dst[5] = *(p+1);
-    dst[6] = *(p+1-img->height);
-    dst[7] = *(p-img->height);
-    dst[8] = *p;
+    dst[0] = (float)*(p-1-h);
+    dst[1] = (float)*(p-1);
+    dst[2] = (float)*(p-1+h);
+    dst[3] = (float)*(p+h);
+    dst[4] = (float)*(p+1+h);
+    dst[5] = (float)*(p+1);
+    dst[6] = (float)*(p+1-h);
+    dst[7] = (float)*(p-h);
+    dst[8] = (float)*p;
 }
-        
+
+inline void FuncPixelGray8N(FloatImage *img, int x, int y, float * dst,
+        PixelFeatureOpt * opt)
+{
+    IMAGE_TYPE_CALL(img, x*img->height + y, PixelGray8N, img->height, dst);
+}
+
+template <typename T>
+void SpanGray8N(const T * p, int h, int n, float * dst)
+{
+    int y = 0;
+
+#if defined(SIMD_AVX2)
+    // load the 8 neighbors of 8 pixels, transpose to pixel-major
+    for(; y+8 <= n; y += 8, p += 8, dst += 72)
+    {
+        __m256 r0 = LoadFloat8(p-1-h);
+        __m256 r1 = LoadFloat8(p-1);
+        __m256 r2 = LoadFloat8(p-1+h);
+        __m256 r3 = LoadFloat8(p+h);
+        __m256 r4 = LoadFloat8(p+1+h);
+        __m256 r5 = LoadFloat8(p+1);
+        __m256 r6 = LoadFloat8(p+1-h);
+        __m256 r7 = LoadFloat8(p-h);
+        Transpose8x8(r0, r1, r2, r3, r4, r5, r6, r7);
+
+        _mm256_storeu_ps(dst, r0);
+        _mm256_storeu_ps(dst+9, r1);
+        _mm256_storeu_ps(dst+18, r2);
+        _mm256_storeu_ps(dst+27, r3);
+        _mm256_storeu_ps(dst+36, r4);
+        _mm256_storeu_ps(dst+45, r5);
+        _mm256_storeu_ps(dst+54, r6);
+        _mm256_storeu_ps(dst+63, r7);
+        for(int i=0; i<8; i++)
+            dst[i*9+8] = (float)p[i];
+    }
+#elif defined(SIMD_SSE)
+    // two 4x4 transposes per 4 pixels
+    for(; y+4 <= n; y += 4, p += 4, dst += 36)
+    {
+        __m128 r0 = LoadFloat4(p-1-h);
+        __m128 r1 = LoadFloat4(p-1);
+        __m128 r2 = LoadFloat4(p-1+h);
+        __m128 r3 = LoadFloat4(p+h);
+        __m128 r4 = LoadFloat4(p+1+h);
+        __m128 r5 = LoadFloat4(p+1);
+        __m128 r6 = LoadFloat4(p+1-h);
+        __m128 r7 = LoadFloat4(p-h);
+        _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+        _MM_TRANSPOSE4_PS(r4, r5, r6, r7);
+
+        _mm_storeu_ps(dst, r0);
+        _mm_storeu_ps(dst+4, r4);
+        _mm_storeu_ps(dst+9, r1);
+        _mm_storeu_ps(dst+13, r5);
+        _mm_storeu_ps(dst+18, r2);
+        _mm_storeu_ps(dst+22, r6);
+        _mm_storeu_ps(dst+27, r3);
+        _mm_storeu_ps(dst+31, r7);
+        for(int i=0; i<4; i++)
+            dst[i*9+8] = (float)p[i];
+    }
+#endif
+
+    // scalar tail
+    for(; y < n; y++, p++, dst += 9)
+        PixelGray8N(p, h, dst);
+}
+
+void SpanPixelGray8N(FloatImage *img, int x, int y1, int y2, float * dst,
+        PixelFeatureOpt * opt)
+{
+    IMAGE_TYPE_CALL(img, x*img->height + y1, SpanGray8N, img->height, y2-y1+1, dst);
+}
+
 void InitPixelGray4N(PixelFeatureOpt * opt)
 {
     opt->image_depth = 1;
@@ -81,8 +163,8 @@ void InitPixelGray4N(PixelFeatureOpt * opt)
     opt->margin = 1;
 }
 
-inline void FuncPixelGray4N(FloatImage *img, int x, int y, float * dst,
-        PixelFeatureOpt * opt)
+template <typename T>
+inline void PixelGray4N(const T * p, int h, float * dst)
 {
     // Set up a circularly indexed neighborhood using nine pointers.
     // |--------------|
@@ -93,13 +175,54 @@ inline void FuncPixelGray4N(FloatImage *img, int x, int y, float * dst,
     // |    | p2 |    |
     // |--------------|
     
-    float * p = img->p + x*img->height + y;
-    
-    dst[0] = *(p-1);
-    dst[1] = *(p+img->height);
-    dst[2] = *(p+1);
-    dst[3] = *(p-img->height);
-    dst[4] = *(p);
+    dst[0] = (float)*(p-1);
+    dst[1] = (float)*(p+h);
+    dst[2] = (float)*(p+1);
+    dst[3] = (float)*(p-h);
+    dst[4] = (float)*(p);
+}
+
+inline void FuncPixelGray4N(FloatImage *img, int x, int y, float * dst,
+        PixelFeatureOpt * opt)
+{
+    IMAGE_TYPE_CALL(img, x*img->height + y, PixelGray4N, img->height, dst);
+}
+
+template <typename T>
+void SpanGray4N(const T * p, int h, int n, float * dst)
+{
+    int y = 0;
+
+#ifdef SIMD_SSE
+    // 4 neighbors of 4 pixels per transpose
+    for(; y+4 <= n; y += 4, p += 4, dst += 20)
+    {
+        __m128 r0 = LoadFloat4(p-1);
+        __m128 r1 = LoadFloat4(p+h);
+        __m128 r2 = LoadFloat4(p+1);
+        __m128 r3 = LoadFloat4(p-h);
+        _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+
+        _mm_storeu_ps(dst, r0);
+        _mm_storeu_ps(dst+5, r1);
+        _mm_storeu_ps(dst+10, r2);
+        _mm_storeu_ps(dst+15, r3);
+        dst[4] = (float)p[0];
+        dst[9] = (float)p[1];
+        dst[14] = (float)p[2];
+        dst[19] = (float)p[3];
+    }
+#endif
+
+    // scalar tail
+    for(; y < n; y++, p++, dst += 5)
+        PixelGray4N(p, h, dst);
+}
+
+void SpanPixelGray4N(FloatImage *img, int x, int y1, int y2, float * dst,
+        PixelFeatureOpt * opt)
+{
+    IMAGE_TYPE_CALL(img, x*img->height + y1, SpanGray4N, img->height, y2-y1+1, dst);
 }
 
 // raw color pixel
@@ -110,16 +233,90 @@ void InitPixelColor(PixelFeatureOpt * opt)
     opt->margin = 0;
 }
 
+template <typename T>
+inline void PixelColor(const T * p, int plane, float * dst)
+{
+    dst[0] = (float)*(p);
+    dst[1] = (float)*(p + plane);
+    dst[2] = (float)*(p + 2*plane);
+}
+
 inline void FuncPixelColor(FloatImage *img, int x, int y, float * dst,
         PixelFeatureOpt * opt)
 {
-    float * p = img->p + x*img->height + y;
-    dst[0] = *(p);
-    dst[1] = *(p + img->width * img->height);
-    dst[2] = *(p + 2*img->width * img->height);
+    IMAGE_TYPE_CALL(img, x*img->height + y, PixelColor, img->width * img->height, dst);
 }
 
+template <typename T>
+void SpanColor(const T * p, int plane, int n, float * dst)
+{
+    int y = 0;
 
+#ifdef SIMD_SSE
+    // interleave 3 planes, the 4th transposed row is padding
+    for(; y+4 <= n; y += 4, p += 4, dst += 12)
+    {
+        __m128 r0 = LoadFloat4(p);
+        __m128 r1 = LoadFloat4(p + plane);
+        __m128 r2 = LoadFloat4(p + 2*plane);
+        __m128 r3 = _mm_setzero_ps();
+        _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+
+        // overlapping stores, the last one must not write past the pixel
+        _mm_storeu_ps(dst, r0);
+        _mm_storeu_ps(dst+3, r1);
+        _mm_storeu_ps(dst+6, r2);
+        StoreFloat3(dst+9, r3);
+    }
+#endif
+
+    // scalar tail
+    for(; y < n; y++, p++, dst += 3)
+        PixelColor(p, plane, dst);
+}
+
+void SpanPixelColor(FloatImage *img, int x, int y1, int y2, float * dst,
+        PixelFeatureOpt * opt)
+{
+    IMAGE_TYPE_CALL(img, x*img->height + y1, SpanColor, img->width * img->height, y2-y1+1, dst);
+}
+
+// *********************************//
+// registry by name
+
+struct PixelFeatureEntry
+{
+    const char * name;
+    FuncPixelFeatureInit func_init;
+    FuncPixelFeatureProc func_proc;
+    FuncPixelFeatureSpan func_span;
+};
+
+#define PIXEL_FEATURE_ENTRY(name) {#name, Init ## name, Func ## name, Span ## name}
+
+static const PixelFeatureEntry PixelFeatureRegistry[] = 
+{
+    PIXEL_FEATURE_ENTRY(PixelGray8N),
+    PIXEL_FEATURE_ENTRY(PixelGray4N),
+    PIXEL_FEATURE_ENTRY(PixelColor),
+    {NULL, NULL, NULL, NULL}
+};
+
+// set feature functions from name, false if not found
+bool SetPixelFeature(PixelFeatureOpt * opt, const char * name)
+{
+    for(const PixelFeatureEntry * e = PixelFeatureRegistry; e->name != NULL; e++)
+    {
+        if(RegistryNameMatch(e->name, "Pixel", name))
+        {
+            opt->func_init = e->func_init;
+            opt->func_proc = e->func_proc;
+            opt->func_span = e->func_span;
+            return true;
+        }
+    }
+    return false;
+}
 
 // *********************************//
 // entry
@@ -139,25 +336,70 @@ void InitPixelFeature(FloatMatrix * img, PixelFeatureOpt * opt)
 //     mexPrintf("%d, %d, %d, %d, %d\n", img->depth, opt->image_depth, opt->height, opt->width, opt->margin);
 }
 
-void PixelFeature(FloatMatrix * img, FloatMatrix * feat, FloatMatrix * coord, PixelFeatureOpt * opt)
-{    
-    float * dst = feat->p;
-    float * coord_y = coord->p;    
-    float * coord_x = coord->p + coord->height * coord->width;    
-    
-    for (int x = opt->x1 ; x <= opt->x2 ; ++ x) {
+// pixel features of image columns x1..x2, all rows, written to dst
+// coordinates are skipped if coord_y == NULL
+void PixelFeatureRange(FloatMatrix * img, int x1, int x2, float * dst,
+        float * coord_y, float * coord_x, PixelFeatureOpt * opt)
+{
+    for (int x = x1 ; x <= x2 ; ++ x) {
+        
+        // whole column per call if the feature has a span kernel
+        if(opt->func_span != NULL)
+        {
+            opt->func_span(img, x, opt->y1, opt->y2, dst, opt);
+            dst += opt->length * opt->height;
+        }
+        else
+        {
+            for (int y = opt->y1 ; y <= opt->y2 ; ++ y) {
+                opt->func_proc(img, x, y, dst, opt);
+                dst += opt->length;
+            }
+        }
+        
+        if(coord_y == NULL)
+            continue;
         
         for (int y = opt->y1 ; y <= opt->y2 ; ++ y) {
-            
-            opt->func_proc(img, x, y, dst, opt);
-            
             *(coord_y++) = (float)y;
             *(coord_x++) = (float)x;
-            
-            dst += opt->length;
         }
     }
+}
+
+// least pixels of a parallel chunk of columns
+#define PIXEL_FEATURE_GRAIN 16384
+
+struct PixelFeatureArgs
+{
+    FloatMatrix * img;
+    FloatMatrix * feat;
+    FloatMatrix * coord;
+    PixelFeatureOpt * opt;
+};
+
+// columns x1+begin..x1+end-1, each writes its own slice of feat and coord
+void PixelFeatureTask(void * args_in, int begin, int end)
+{
+    PixelFeatureArgs * args = (PixelFeatureArgs *)args_in;
+    PixelFeatureOpt * opt = args->opt;
+    int offset = begin * opt->height;
+    float * coord_y = args->coord->p + offset;    
+    float * coord_x = args->coord->p + args->coord->height * args->coord->width + offset;
     
+    PixelFeatureRange(args->img, opt->x1 + begin, opt->x1 + end-1, args->feat->p + offset * opt->length,
+            coord_y, coord_x, opt);
+}
+
+void PixelFeature(FloatMatrix * img, FloatMatrix * feat, FloatMatrix * coord, PixelFeatureOpt * opt)
+{    
+    PixelFeatureArgs args;
+    args.img = img;
+    args.feat = feat;
+    args.coord = coord;
+    args.opt = opt;
+    int grain = (PIXEL_FEATURE_GRAIN + opt->height-1) / MAX(opt->height, 1);
+    ParallelFor(opt->x2 - opt->x1 + 1, PixelFeatureTask, &args, grain);
 }
 
 #ifdef MATLAB_COMPILE
@@ -182,8 +424,16 @@ void MatReadPixelFeatureOpt(const mxArray * mat_opt, PixelFeatureOpt * opt)
         opt->nparam = mxGetNumberOfElements(mxGetField(mat_opt, 0, "param"));
     }    
     
+#ifdef PIXEL_FEATURE_NAME
     opt->func_init = FUNC_INIT(PIXEL_FEATURE_NAME);
     opt->func_proc = FUNC_PROC(PIXEL_FEATURE_NAME);
+    opt->func_span = FUNC_SPAN(PIXEL_FEATURE_NAME);
+#else
+    // pick the feature at runtime
+    bool found = SetPixelFeature(opt, opt->name);
+    if(!found)
+        mexErrMsgTxt("Unknown pixel feature name");
+#endif
 }
 #endif
 
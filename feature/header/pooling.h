@@ -1,41 +1,293 @@
- 
+#ifndef POOLING_H
+#define POOLING_H
+
+#include "image.h"
+#include "simd.h"
+#include "coding.h"
+#include "pixel_coding.h"
 
 // ***************************** //
 // for image pooling
 
+// regular grid triangle pooling options:
+//      size_x, size_y: patch size
+//      step_x, step_y: grid step, half the patch size
+//      grid_height: patch number in each grid column
+//      margin: pixel feature margin, patch (x, y) starts at pixel feature (x-margin, y-margin)
+//      height, width: pixel feature map size, reads are clamped to it
+//      length: coded feature length
+//      weight_x, weight_y: 1-D triangle weights, the pixel weight is weight_x[px]*weight_y[py]
 struct PoolingOpt
 {
-    CodeBook * codebook;
+    int size_x, size_y;
+    int step_x, step_y;
+    int grid_height;
+    int margin;
+    int height, width;
+    int length;
+    
+    float * weight_x;
+    float * weight_y;
+};
+
+void InitRegularGridPooling(PoolingOpt * opt, int size_x, int size_y, int grid_height,
+        int margin, int height, int width, int length)
+{
+    opt->size_x = size_x;
+    opt->size_y = size_y;
+    opt->step_x = size_x/2;
+    opt->step_y = size_y/2;
+    opt->grid_height = grid_height;
+    opt->margin = margin;
+    opt->height = height;
+    opt->width = width;
+    opt->length = length;
+    
+    opt->weight_x = ALLOCATE(float, size_x);
+    opt->weight_y = ALLOCATE(float, size_y);
+    for(int px=0; px<size_x; px++)
+        opt->weight_x[px] = 1 - abs(px+0.5f - 1.0f*size_x/2) / (1.0f*size_x/2);
+    for(int py=0; py<size_y; py++)
+        opt->weight_y[py] = 1 - abs(py+0.5f - 1.0f*size_y/2) / (1.0f*size_y/2);
+}
+
+void FreeRegularGridPooling(PoolingOpt * opt)
+{
+    FREE(opt->weight_x);
+    FREE(opt->weight_y);
+}
+
+// dst += coef * src
+inline void AddScaledVector(const float * src, float coef, float * dst, int n)
+{
+    int i = 0;
+#if defined(SIMD_AVX2)
+    __m256 c8 = _mm256_set1_ps(coef);
+    for(; i+8 <= n; i += 8)
+        _mm256_storeu_ps(dst+i, _mm256_add_ps(_mm256_loadu_ps(dst+i),
+                _mm256_mul_ps(c8, _mm256_loadu_ps(src+i))));
+#elif defined(SIMD_SSE)
+    __m128 c4 = _mm_set1_ps(coef);
+    for(; i+4 <= n; i += 4)
+        _mm_storeu_ps(dst+i, _mm_add_ps(_mm_loadu_ps(dst+i),
+                _mm_mul_ps(c4, _mm_loadu_ps(src+i))));
+#endif
+    for(; i < n; i++)
+        dst[i] += coef * src[i];
+}
+
+// sum a[i] * b[i]
+inline float DotProduct(const float * a, const float * b, int n)
+{
+    int i = 0;
+    float sum = 0;
+#if defined(SIMD_AVX2)
+    __m256 s8 = _mm256_setzero_ps();
+    for(; i+8 <= n; i += 8)
+        s8 = _mm256_add_ps(s8, _mm256_mul_ps(_mm256_loadu_ps(a+i), _mm256_loadu_ps(b+i)));
+    __m128 s4 = _mm_add_ps(_mm256_castps256_ps128(s8), _mm256_extractf128_ps(s8, 1));
+    s4 = _mm_add_ps(s4, _mm_movehl_ps(s4, s4));
+    sum = _mm_cvtss_f32(_mm_add_ss(s4, _mm_shuffle_ps(s4, s4, 1)));
+#elif defined(SIMD_SSE)
+    __m128 s4 = _mm_setzero_ps();
+    for(; i+4 <= n; i += 4)
+        s4 = _mm_add_ps(s4, _mm_mul_ps(_mm_loadu_ps(a+i), _mm_loadu_ps(b+i)));
+    s4 = _mm_add_ps(s4, _mm_movehl_ps(s4, s4));
+    sum = _mm_cvtss_f32(_mm_add_ss(s4, _mm_shuffle_ps(s4, s4, 1)));
+#endif
+    for(; i < n; i++)
+        sum += a[i] * b[i];
+    return sum;
+}
+
+// sum weight[i] * src[clamp(y+i)] over n rows, clamped to [0, height)
+inline float ClampedDotProduct(const float * weight, const float * src, int y, int n, int height)
+{
+    if(y >= 0 && y+n <= height)
+        return DotProduct(weight, src+y, n);
+    
+    float sum = 0;
+    for(int i=0; i<n; i++)
+        sum += weight[i] * src[MIN(MAX(y+i, 0), height-1)];
+    return sum;
+}
+
+// separable triangle pooling of grid columns ix1..ix2
+//      coding: coded pixel features of columns col1.., all rows, covering the patches
+//      buffer: length x height floats, horizontal pass of one grid column
+//      feat: grid features, patch (ix, iy) at (ix*grid_height + iy)*length
+// a horizontal pass adds each coded pixel once per grid column into dense rows,
+// a vertical pass sums dense rows, so the cost does not grow with the patch area.
+// dense planes are pooled plane by plane with vector kernels, csr blocks per pixel
+void RegularGridTrianglePooling(CodedPixelMap * coding, int col1, int ix1, int ix2,
+        float * buffer, float * feat, const PoolingOpt * opt)
+{
+    int length = opt->length;
+    int height = opt->height;
+    bool dense = (coding->layout == CODED_DENSE);
+    
+    for(int ix=ix1; ix<=ix2; ix++)
+    {
+        int x = ix * opt->step_x;
+        
+        // horizontal: buffer = sum_px weight_x[px] * coded column x+px
+        //      dense: bin-major, bin b at buffer + b*height
+        //      csr: pixel-major, row r at buffer + r*length
+        memset(buffer, 0, sizeof(float) * length * height);
+        for(int px=0; px<opt->size_x; px++)
+        {
+            int cx = MIN(MAX(x+px-opt->margin, 0), opt->width-1);
+            int idx = (cx-col1) * height;
+            float v = opt->weight_x[px];
+            
+            if(dense)
+            {
+                const float * plane = coding->p + idx;
+                for(int b=0; b<length; b++, plane += coding->width)
+                    AddScaledVector(plane, v, buffer + b*height, height);
+            }
+            else
+            {
+                float * row = buffer;
+                for(int r=0; r<height; r++, idx++, row += length)
+                    AddCodedPixel(coding, idx, v, row);
+            }
+        }
+        
+        // vertical: patch iy = sum_py weight_y[py] * row(y+py)
+        float * dst = feat + ix * opt->grid_height * length;
+        for(int iy=0; iy<opt->grid_height; iy++, dst += length)
+        {
+            int y = iy * opt->step_y - opt->margin;
+            if(dense)
+            {
+                for(int b=0; b<length; b++)
+                    dst[b] += ClampedDotProduct(opt->weight_y, buffer + b*height, y, opt->size_y, height);
+            }
+            else
+            {
+                for(int py=0; py<opt->size_y; py++)
+                {
+                    int cy = MIN(MAX(y+py, 0), height-1);
+                    AddScaledVector(buffer + cy*length, opt->weight_y[py], dst, length);
+                }
+            }
+        }
+    }
+}
+
+// ***************************** //
+// spatial pyramid
+//      layout l splits the region [0, width) x [0, height) into grid_x[l] x grid_y[l]
+//      cells, e.g. 1x1, 2x2 and 3x1; cells are numbered layout by layout, column-major
+//      in a layout. a patch falls into exactly one cell of every layout, picked by
+//      its coordinate
+struct SpatialPyramidOpt
+{
+    int nlayout;
+    int * grid_x;
+    int * grid_y;
+    int * cell_start; // dim nlayout, first cell of each layout
+    int ncell;
+    int height, width;
+};
+
+void InitSpatialPyramid(SpatialPyramidOpt * opt, const int * grid_x, const int * grid_y, int nlayout,
+        int height, int width)
+{
+    opt->nlayout = nlayout;
+    opt->grid_x = ALLOCATE(int, nlayout);
+    opt->grid_y = ALLOCATE(int, nlayout);
+    opt->cell_start = ALLOCATE(int, nlayout);
+    opt->ncell = 0;
+    for(int l=0; l<nlayout; l++)
+    {
+        opt->grid_x[l] = MAX(grid_x[l], 1);
+        opt->grid_y[l] = MAX(grid_y[l], 1);
+        opt->cell_start[l] = opt->ncell;
+        opt->ncell += opt->grid_x[l] * opt->grid_y[l];
+    }
+    opt->height = MAX(height, 1);
+    opt->width = MAX(width, 1);
+}
+
+void FreeSpatialPyramid(SpatialPyramidOpt * opt)
+{
+    FREE(opt->grid_x);
+    FREE(opt->grid_y);
+    FREE(opt->cell_start);
+    opt->nlayout = 0;
+    opt->ncell = 0;
+}
+
+// cells of point (x, y), one per layout, coordinates outside the region are clamped
+inline void SpatialPyramidCells(float x, float y, const SpatialPyramidOpt * opt, int * cell)
+{
+    for(int l=0; l<opt->nlayout; l++)
+    {
+        int cx = (int)floor(x * opt->grid_x[l] / opt->width);
+        int cy = (int)floor(y * opt->grid_y[l] / opt->height);
+        cx = MIN(MAX(cx, 0), opt->grid_x[l]-1);
+        cy = MIN(MAX(cy, 0), opt->grid_y[l]-1);
+        cell[l] = opt->cell_start[l] + cx*opt->grid_y[l] + cy;
+    }
+}
+
+struct SpatialPyramidCellArgs
+{
+    const float * coord;
+    int npatch;
+    const SpatialPyramidOpt * opt;
 };
 
-void RegularGridTrianglePooling(FloatMatrix * image, FloatMatrix * feat_input, FloatMatrix * coord_input, 
-        FloatMatrix * feat_output, FloatMatrix * coord_output, PoolingOpt * opt)
-{    
-}
-
-
-//     // group and encode in pyramids
-//     if(opt->codebook == NULL)
-//     {
-//         MoveImage(&patch_feat, desp);
-//     }
-//     else
-//     {
-//         if(pyra_opt != NULL)
-//         {
-//             // encode in rectangle pyramid areas
-//             int nsplit = pyra_opt->npyramid;
-//             AllocateImage(desp, opt->codebook->length, nsplit, 1);
-//             for(int i=0; i<nsplit; i++)
-//                 EncodeRect(&patch_feat, pyra_opt->pyramid+i, patch_coordinate, desp->p+i*desp->height, 1, opt->codebook);
-//         }
-//         else
-//         {
-//             // encode each patch
-//             AllocateImage(desp, opt->coded_length, patch_feat.width, 1);        
-//             for(int i=0; i<patch_feat.width; i++)
-//                 opt->codebook->f(patch_feat.p+i*patch_feat.height, desp->p+i*desp->height, 1, opt->codebook);
-//         }
-//     
-//         FreeImage(&patch_feat);
-//     }
\ No newline at end of file
+void SpatialPyramidColumnCells(const void * args_in, int n, int * cell)
+{
+    const SpatialPyramidCellArgs * args = (const SpatialPyramidCellArgs *)args_in;
+    SpatialPyramidCells(args->coord[args->npatch + n], args->coord[n], args->opt, cell);
+}
+
+// code the columns of data once and pool them into every pyramid cell
+//      coord: y of all columns then x of all columns, as written by PatchFeature()
+//      feat: dim coding_opt->length x opt->ncell, normalize: CODING_NORM_* flags per cell
+void SpatialPyramidPooling(FloatMatrix * data, const float * coord, float * feat,
+        CodingOpt * coding_opt, const SpatialPyramidOpt * opt, int normalize)
+{
+    SpatialPyramidCellArgs cell_args;
+    cell_args.coord = coord;
+    cell_args.npatch = data->width;
+    cell_args.opt = opt;
+    
+    AggregateCells cells;
+    cells.func = SpatialPyramidColumnCells;
+    cells.args = &cell_args;
+    cells.per_column = opt->nlayout;
+    cells.ncell = opt->ncell;
+    CodingAggregate(data, feat, coding_opt, normalize, &cells);
+}
+
+#ifdef MATLAB_COMPILE
+// matlab helper function
+//      fields: grid, nlayout x 2 of [cells in x, cells in y]; height, width of the region
+void MatReadSpatialPyramidOpt(const mxArray * mat_opt, SpatialPyramidOpt * opt)
+{
+    mxArray * mx_grid = mxGetField(mat_opt, 0, "grid");
+    ASSERT(mx_grid != NULL && mxGetN(mx_grid) == 2);
+    int nlayout = (int)mxGetM(mx_grid);
+    const double * grid = mxGetPr(mx_grid);
+    
+    int * grid_x = ALLOCATE(int, nlayout);
+    int * grid_y = ALLOCATE(int, nlayout);
+    for(int l=0; l<nlayout; l++)
+    {
+        grid_x[l] = (int)grid[l];
+        grid_y[l] = (int)grid[nlayout + l];
+    }
+    InitSpatialPyramid(opt, grid_x, grid_y, nlayout,
+            (int)mxGetScalar(mxGetField(mat_opt, 0, "height")),
+            (int)mxGetScalar(mxGetField(mat_opt, 0, "width")));
+    FREE(grid_x);
+    FREE(grid_y);
+}
+#endif
+
+#endif
@@ -0,0 +1,205 @@
+#ifndef PQ_CODING_H
+#define PQ_CODING_H
+
+#include <math.h>
+#include "image.h"
+#include "gemm.h"
+#include "thread.h"
+#include "vq_coding.h"
+
+// ***************************** //
+// product quantization codebook
+//      a descriptor of nDim = nSub x subDim is split into nSub subspaces of subDim
+//      consecutive dimensions, each quantized against its own nCenter centers, so it
+//      is stored as nSub uint8 codes (nCenter <= 256), e.g. 8 or 16 bytes.
+//      centers: dim subDim x nCenter x nSub, sub-codebook m at centers + m*subDim*nCenter,
+//      e.g. vl_kmeans of each subspace in single precision
+
+#define PQ_CENTER_MAX 256
+
+struct PQCodeBook
+{
+    int nDim, nSub, subDim, nCenter;
+
+    const float * centers; // dim subDim x nCenter x nSub
+
+    // set by InitCodingPQ(), sub-codebook m expanded as VQCodeBook
+    //      w(i, d) = -2 c_mi(d) at gemm_weight[m*subDim*nCenter + d*nCenter + i]
+    float * gemm_weight; // dim nCenter x subDim x nSub
+    float * gemm_bias; // dim nCenter x nSub, |c_mi|^2
+};
+
+void InitPQCodeBookGemm(PQCodeBook * cb)
+{
+    int subDim = cb->subDim, nCenter = cb->nCenter;
+    cb->gemm_weight = ALLOCATE(float, subDim*nCenter*cb->nSub);
+    cb->gemm_bias = ALLOCATE(float, nCenter*cb->nSub);
+    for(int m=0; m<cb->nSub; m++)
+    {
+        const float * centers = cb->centers + m*subDim*nCenter;
+        float * weight = cb->gemm_weight + m*subDim*nCenter;
+        for(int i=0; i<nCenter; i++)
+        {
+            double norm = 0;
+            for(int k=0; k<subDim; k++)
+            {
+                float c = centers[i*subDim+k];
+                weight[k*nCenter + i] = -2*c;
+                norm += (double)c*c;
+            }
+            cb->gemm_bias[m*nCenter + i] = (float)norm;
+        }
+    }
+}
+
+void FreePQCodeBookGemm(PQCodeBook * cb)
+{
+    FREE(cb->gemm_weight);
+    FREE(cb->gemm_bias);
+    cb->gemm_weight = NULL;
+    cb->gemm_bias = NULL;
+}
+
+// exact squared distance of subspace m of data to its center i
+inline double PQSubDistance(const float * data, int m, int i, const PQCodeBook * cb)
+{
+    int subDim = cb->subDim;
+    const float * x = data + m*subDim;
+    const float * c = cb->centers + (m*cb->nCenter + i)*subDim;
+    double dist = 0;
+    for(int k=0; k<subDim; k++)
+    {
+        double d = (double)x[k] - c[k];
+        dist += d*d;
+    }
+    return dist;
+}
+
+// nearest centers of the n columns of x (nDim x n), codes: dim nSub x n
+//      nearest, score: dim VQ_GEMM_BLOCK and VQ_GEMM_ROWS x VQ_GEMM_BLOCK
+void PQEncode(const float * x, int n, const PQCodeBook * cb, unsigned char * codes, int * nearest, float * score)
+{
+    int nSub = cb->nSub, subDim = cb->subDim, nCenter = cb->nCenter;
+    for(int j0=0; j0<n; j0+=VQ_GEMM_BLOCK)
+    {
+        int nc = MIN(VQ_GEMM_BLOCK, n-j0);
+        for(int m=0; m<nSub; m++)
+        {
+            VQNearest(x + j0*cb->nDim + m*subDim, nc, subDim, cb->nDim, cb->gemm_weight + m*subDim*nCenter,
+                    cb->gemm_bias + m*nCenter, nCenter, nearest, score);
+            for(int j=0; j<nc; j++)
+                codes[(j0+j)*nSub + m] = (unsigned char)nearest[j];
+        }
+    }
+}
+
+// ***************************** //
+// asymmetric distance computation
+//      the query stays exact, the stored descriptors are their codes: the squared
+//      distance to a code is the sum over subspaces of a table lookup, the table
+//      is computed once per query
+
+// table: dim nCenter x nSub, |q_m - c_mi|^2 at table[m*nCenter + i]
+void PQDistanceTable(const float * query, const PQCodeBook * cb, float * table)
+{
+    for(int m=0; m<cb->nSub; m++)
+        for(int i=0; i<cb->nCenter; i++)
+            table[m*cb->nCenter + i] = (float)PQSubDistance(query, m, i, cb);
+}
+
+// distance of one code by its table
+inline float PQCodeDistance(const float * table, const unsigned char * code, int nSub, int nCenter)
+{
+    float dist = 0;
+    for(int m=0; m<nSub; m++)
+        dist += table[m*nCenter + code[m]];
+    return dist;
+}
+
+// codes of 8 and 16 bytes with the loop unrolled, 4 independent sums
+template <int NSUB>
+inline float PQCodeDistanceFixed(const float * table, const unsigned char * code, int nCenter)
+{
+    float d0 = 0, d1 = 0, d2 = 0, d3 = 0;
+    for(int m=0; m<NSUB; m+=4)
+    {
+        d0 += table[m*nCenter + code[m]];
+        d1 += table[(m+1)*nCenter + code[m+1]];
+        d2 += table[(m+2)*nCenter + code[m+2]];
+        d3 += table[(m+3)*nCenter + code[m+3]];
+    }
+    return (d0 + d1) + (d2 + d3);
+}
+
+// codes per chunk of the parallel scan
+#define PQ_SCAN_CHUNK 65536
+
+struct PQScanArgs
+{
+    const float * table;
+    const unsigned char * codes;
+    long long n;
+    int nSub, nCenter;
+    float * dist;
+};
+
+void PQScanTask(void * args_in, int begin, int end)
+{
+    PQScanArgs * args = (PQScanArgs *)args_in;
+    int nSub = args->nSub, nCenter = args->nCenter;
+    long long j0 = (long long)begin * PQ_SCAN_CHUNK;
+    long long j1 = (long long)end * PQ_SCAN_CHUNK;
+    j1 = j1 < args->n ? j1 : args->n;
+    const unsigned char * code = args->codes + j0*nSub;
+    float * dist = args->dist;
+
+    if(nSub == 8)
+        for(long long j=j0; j<j1; j++, code+=8)
+            dist[j] = PQCodeDistanceFixed<8>(args->table, code, nCenter);
+    else if(nSub == 16)
+        for(long long j=j0; j<j1; j++, code+=16)
+            dist[j] = PQCodeDistanceFixed<16>(args->table, code, nCenter);
+    else
+        for(long long j=j0; j<j1; j++, code+=nSub)
+            dist[j] = PQCodeDistance(args->table, code, nSub, nCenter);
+}
+
+// distances of a query, by its table, to n codes (nSub x n), dist: dim n
+//      memory bound; the codes are split in chunks over the thread pool
+void PQScan(const float * table, const unsigned char * codes, long long n, int nSub, int nCenter, float * dist)
+{
+    PQScanArgs args;
+    args.table = table;
+    args.codes = codes;
+    args.n = n;
+    args.nSub = nSub;
+    args.nCenter = nCenter;
+    args.dist = dist;
+    ParallelFor((int)((n + PQ_SCAN_CHUNK-1) / PQ_SCAN_CHUNK), PQScanTask, &args, 1);
+}
+
+#ifdef MATLAB_COMPILE
+// matlab helper function
+//      the codebook is the single array of centers, subDim x nCenter x nSub
+void MatReadPQCodebook(const mxArray * mat_opt, PQCodeBook * opt)
+{
+    if ((mat_opt) == NULL)
+        return;
+
+    if(!mxIsSingle(mat_opt))
+        mexErrMsgTxt("pq_codebook must be single");
+    const mwSize * dim = mxGetDimensions(mat_opt);
+    int ndim = (int)mxGetNumberOfDimensions(mat_opt);
+    opt->subDim = (int)dim[0];
+    opt->nCenter = (int)dim[1];
+    opt->nSub = ndim >= 3 ? (int)dim[2] : 1;
+    if(opt->nCenter > PQ_CENTER_MAX)
+        mexErrMsgTxt("pq_codebook has more than 256 centers per subspace");
+    opt->nDim = opt->subDim * opt->nSub;
+    opt->centers = (const float *)mxGetData(mat_opt);
+    opt->gemm_weight = NULL;
+    opt->gemm_bias = NULL;
+}
+#endif
+
+#endif
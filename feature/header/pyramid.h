@@ -0,0 +1,336 @@
+#ifndef PYRAMID_H
+#define PYRAMID_H
+
+#include <math.h>
+#include "image.h"
+#include "simd.h"
+#include "thread.h"
+#include "patch_feature.h"
+
+// ***************************** //
+// multi-scale patch feature on an image pyramid
+//      level k is the input resized by scale^k, resampled from the input so the
+//      levels are independent; level 0 is the input itself. levels with a strip for
+//      every thread run one after another, split in strips by PatchFeature(), the
+//      smaller ones run in parallel, one level per thread
+
+// pyramid options:
+//      scale: size ratio between neighboring levels, e.g. 0.8
+//      nlevel: max level number, 0 for no limit
+//      min_size: stop when the shorter image side is below it
+//      level_num, levels: initialized by InitPatchFeaturePyramid()
+struct PyramidLevel
+{
+    double scale;
+    int height, width;
+    PatchFeatureOpt opt;
+};
+
+struct PyramidOpt
+{
+    double scale;
+    int nlevel;
+    int min_size;
+
+    int level_num;
+    PyramidLevel * levels;
+};
+
+// ***************************** //
+// bilinear resampler, pixel centers aligned as in imresize
+
+// scratch reused across resize calls
+struct ResizeBuffer
+{
+    float * column;
+    int * y0;
+    float * wy;
+};
+
+void AllocateResizeBuffer(ResizeBuffer * buf, int src_height, int dst_height)
+{
+    buf->column = ALLOCATE(float, src_height);
+    buf->y0 = ALLOCATE(int, dst_height);
+    buf->wy = ALLOCATE(float, dst_height);
+}
+
+void FreeResizeBuffer(ResizeBuffer * buf)
+{
+    FREE(buf->column);
+    FREE(buf->y0);
+    FREE(buf->wy);
+}
+
+// source position of dst pixel i, as lower index and weight of the upper one
+inline void ResizeMap(int i, int src_size, int dst_size, int * i0, float * w)
+{
+    float s = (i + 0.5f) * src_size / dst_size - 0.5f;
+    s = MIN(MAX(s, 0.0f), (float)(src_size-1));
+    *i0 = MIN((int)s, src_size-2 < 0 ? 0 : src_size-2);
+    *w = s - *i0;
+}
+
+// dst = c0 + w * (c1 - c0) over one column
+template <typename T>
+void ResizeBlendColumn(const T * c0, const T * c1, float w, int n, float * dst)
+{
+    int y = 0;
+#if defined(SIMD_AVX2)
+    __m256 w8 = _mm256_set1_ps(w);
+    for(; y+8 <= n; y += 8)
+    {
+        __m256 a = LoadFloat8(c0+y);
+        __m256 b = LoadFloat8(c1+y);
+        _mm256_storeu_ps(dst+y, _mm256_add_ps(a, _mm256_mul_ps(w8, _mm256_sub_ps(b, a))));
+    }
+#elif defined(SIMD_SSE)
+    __m128 w4 = _mm_set1_ps(w);
+    for(; y+4 <= n; y += 4)
+    {
+        __m128 a = LoadFloat4(c0+y);
+        __m128 b = LoadFloat4(c1+y);
+        _mm_storeu_ps(dst+y, _mm_add_ps(a, _mm_mul_ps(w4, _mm_sub_ps(b, a))));
+    }
+#endif
+    for(; y < n; y++)
+        dst[y] = (float)c0[y] + w * ((float)c1[y] - (float)c0[y]);
+}
+
+template <typename T>
+void ResizeImageTyped(const T * src, const FloatImage * src_img, FloatImage * dst, ResizeBuffer * buf)
+{
+    int sh = src_img->height, sw = src_img->width;
+    int dh = dst->height, dw = dst->width;
+
+    for(int y=0; y<dh; y++)
+        ResizeMap(y, sh, dh, buf->y0 + y, buf->wy + y);
+
+    for(int d=0; d<dst->depth; d++)
+    {
+        const T * src_plane = src + d*sh*sw;
+        float * dst_plane = dst->p + d*dh*dw;
+
+        for(int x=0; x<dw; x++)
+        {
+            // horizontal blend of two source columns, then vertical gather
+            int x0;
+            float wx;
+            ResizeMap(x, sw, dw, &x0, &wx);
+            int x1 = MIN(x0+1, sw-1);
+            ResizeBlendColumn(src_plane + x0*sh, src_plane + x1*sh, wx, sh, buf->column);
+
+            float * col = buf->column;
+            float * out = dst_plane + x*dh;
+            for(int y=0; y<dh; y++)
+            {
+                int y0 = buf->y0[y];
+                int y1 = MIN(y0+1, sh-1);
+                out[y] = col[y0] + buf->wy[y] * (col[y1] - col[y0]);
+            }
+        }
+    }
+}
+
+// resize src of any element type to the size of the float image dst
+void ResizeImage(const FloatImage * src, FloatImage * dst, ResizeBuffer * buf)
+{
+    ASSERT(src->depth == dst->depth);
+    switch(src->type)
+    {
+        case IMAGE_UINT8:
+            ResizeImageTyped((const unsigned char *)src->p, src, dst, buf); break;
+        case IMAGE_UINT16:
+            ResizeImageTyped((const unsigned short *)src->p, src, dst, buf); break;
+        default:
+            ResizeImageTyped((const float *)src->p, src, dst, buf); break;
+    }
+}
+
+// ***************************** //
+// pyramid entry
+
+// level sizes and per level patch feature options
+void InitPatchFeaturePyramid(FloatImage * img, PatchFeatureOpt * opt, PyramidOpt * pyra_opt)
+{
+    ASSERT(pyra_opt->scale > 0 && pyra_opt->scale < 1);
+
+    // a level must hold at least one patch and the pixel margin
+    int min_size = MAX(pyra_opt->min_size, MAX(opt->size_x, opt->size_y));
+    min_size = MAX(min_size, 3);
+
+    int level_num = 0;
+    double s = 1;
+    while((pyra_opt->nlevel <= 0 || level_num < pyra_opt->nlevel)
+            && MIN(img->height, img->width) * s + 0.5 >= min_size)
+    {
+        level_num++;
+        s *= pyra_opt->scale;
+    }
+
+    pyra_opt->level_num = level_num;
+    pyra_opt->levels = ALLOCATE(PyramidLevel, MAX(level_num, 1));
+
+    s = 1;
+    for(int k=0; k<level_num; k++)
+    {
+        PyramidLevel * level = pyra_opt->levels + k;
+        level->scale = s;
+        level->height = (k == 0) ? img->height : (int)(img->height * s + 0.5);
+        level->width = (k == 0) ? img->width : (int)(img->width * s + 0.5);
+
+        // only the size of the image is needed here
+        FloatImage level_img = *img;
+        level_img.p = NULL;
+        level_img.height = level->height;
+        level_img.width = level->width;
+        level_img.stride = level->height;
+
+        level->opt = *opt;
+        InitPatchFeature(&level_img, &level->opt);
+
+        s *= pyra_opt->scale;
+    }
+}
+
+void FreePatchFeaturePyramid(PyramidOpt * pyra_opt)
+{
+    for(int k=0; k<pyra_opt->level_num; k++)
+        FreePatchFeature(&pyra_opt->levels[k].opt);
+    FREE(pyra_opt->levels);
+    pyra_opt->levels = NULL;
+    pyra_opt->level_num = 0;
+}
+
+struct PyramidArgs
+{
+    FloatImage * img;
+    FloatImage * feat;
+    FloatImage * coord;
+    PyramidOpt * pyra_opt;
+    int * level_thread;
+};
+
+// levels assigned to thread t, -1 for the levels run before the others
+void PyramidLevels(PyramidArgs * args, int t)
+{
+    PyramidOpt * pyra_opt = args->pyra_opt;
+    FloatImage * img = args->img;
+
+    // the largest resized level of this thread sizes the buffers
+    int area_max = 0, height_max = 0;
+    for(int k=1; k<pyra_opt->level_num; k++)
+    {
+        if(args->level_thread[k] != t)
+            continue;
+        area_max = MAX(area_max, pyra_opt->levels[k].height * pyra_opt->levels[k].width);
+        height_max = MAX(height_max, pyra_opt->levels[k].height);
+    }
+
+    FloatImage level_img;
+    ResizeBuffer buf;
+    level_img.p = NULL;
+    if(area_max > 0)
+    {
+        AllocateImage(&level_img, height_max, area_max / height_max + 1, img->depth);
+        AllocateResizeBuffer(&buf, img->height, height_max);
+    }
+
+    for(int k=0; k<pyra_opt->level_num; k++)
+    {
+        if(args->level_thread[k] != t)
+            continue;
+        PyramidLevel * level = pyra_opt->levels + k;
+
+        if(k == 0)
+        {
+            PatchFeature(img, args->feat + k, args->coord + k, &level->opt);
+            continue;
+        }
+
+        level_img.height = level->height;
+        level_img.width = level->width;
+        level_img.stride = level->height;
+        ResizeImage(img, &level_img, &buf);
+        PatchFeature(&level_img, args->feat + k, args->coord + k, &level->opt);
+    }
+
+    if(area_max > 0)
+    {
+        FreeImage(&level_img);
+        FreeResizeBuffer(&buf);
+    }
+}
+
+// threads begin..end-1, one resize buffer per thread
+void PyramidTask(void * args_in, int begin, int end)
+{
+    for(int t=begin; t<end; t++)
+        PyramidLevels((PyramidArgs *)args_in, t);
+}
+
+// strips PatchFeature() splits a level into, 1 for patch level features
+int PyramidLevelStrips(PyramidLevel * level)
+{
+    PatchFeatureOpt * opt = &level->opt;
+    if(!opt->use_pixel_feature)
+        return 1;
+    int patch_range = (opt->width - 1) * (opt->size_x/2) + 1;
+    int strip = PatchStripWidth(opt, patch_range);
+    return (patch_range - 1) / strip + 1;
+}
+
+// patch features of all levels
+//      feat[k], coord[k]: allocated by the caller as for PatchFeature() with levels[k].opt
+void PatchFeaturePyramid(FloatImage * img, FloatImage * feat, FloatImage * coord, PyramidOpt * pyra_opt)
+{
+    int level_num = pyra_opt->level_num;
+    int * level_thread = ALLOCATE(int, MAX(level_num, 1));
+
+    // the large levels first, each over all threads by its strips; a nested
+    // PatchFeature() is serial, so a level spread to one thread caps the speedup
+    int nlarge = 0;
+    while(nlarge < level_num && PyramidLevelStrips(pyra_opt->levels + nlarge) >= ThreadNum())
+        level_thread[nlarge++] = -1;
+
+    // the small ones balanced by area, largest first to the least loaded thread
+    int nthread = MAX(MIN(ThreadNum(), level_num - nlarge), 1);
+    double * load = ALLOCATE(double, nthread);
+    for(int k=nlarge; k<level_num; k++)
+    {
+        int best = 0;
+        for(int t=1; t<nthread; t++)
+            if(load[t] < load[best])
+                best = t;
+        level_thread[k] = best;
+        load[best] += 1.0 * pyra_opt->levels[k].height * pyra_opt->levels[k].width;
+    }
+
+    PyramidArgs args;
+    args.img = img;
+    args.feat = feat;
+    args.coord = coord;
+    args.pyra_opt = pyra_opt;
+    args.level_thread = level_thread;
+    if(nlarge > 0)
+        PyramidLevels(&args, -1);
+    if(nlarge < level_num)
+        ParallelFor(nthread, PyramidTask, &args);
+
+    FREE(level_thread);
+    FREE(load);
+}
+
+#ifdef MATLAB_COMPILE
+// matlab helper function
+void MatReadPyramidOpt(const mxArray * mat_opt, PyramidOpt * opt)
+{
+    mxArray * mx_scale = mxGetField(mat_opt, 0, "scale");
+    opt->scale = (mx_scale == NULL) ? 0.8 : mxGetScalar(mx_scale);
+    COPY_INT_FIELD(nlevel);
+    COPY_INT_FIELD(min_size);
+    opt->level_num = 0;
+    opt->levels = NULL;
+}
+#endif
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef SCRATCH_H
+#define SCRATCH_H
+
+#include "image.h"
+
+// ***************************** //
+// scratch arena
+//      a fixed block of cache aligned memory handed out by bumping an offset;
+//      one arena per thread, owned by the context that sized it (e.g. CodingOpt),
+//      reset at the start of each call so the hot path never touches the heap
+
+#define SCRATCH_ALIGN 64
+
+struct ScratchArena
+{
+    char * raw;
+    char * base;
+    size_t size;
+    size_t used;
+};
+
+// bytes taken by n elements of type, rounded to the alignment
+#define SCRATCH_BYTES(type, n) ((sizeof(type)*(n) + SCRATCH_ALIGN-1) / SCRATCH_ALIGN * SCRATCH_ALIGN)
+
+void AllocateScratchArena(ScratchArena * arena, size_t size)
+{
+    arena->size = size;
+    arena->used = 0;
+    arena->raw = ALLOCATE(char, size + SCRATCH_ALIGN);
+    size_t offset = (size_t)arena->raw % SCRATCH_ALIGN;
+    arena->base = arena->raw + (offset == 0 ? 0 : SCRATCH_ALIGN - offset);
+}
+
+void FreeScratchArena(ScratchArena * arena)
+{
+    FREE(arena->raw);
+    arena->raw = NULL;
+    arena->base = NULL;
+    arena->size = 0;
+    arena->used = 0;
+}
+
+inline void ResetScratchArena(ScratchArena * arena)
+{
+    arena->used = 0;
+}
+
+// n aligned elements, the arena must have been sized for them
+#define SCRATCH_ALLOCATE(arena, type, n) ((type *)ScratchAllocate((arena), SCRATCH_BYTES(type, n)))
+
+inline void * ScratchAllocate(ScratchArena * arena, size_t bytes)
+{
+    ASSERT(arena->used + bytes <= arena->size);
+    void * p = arena->base + arena->used;
+    arena->used += bytes;
+    return p;
+}
+
+#endif
@@ -0,0 +1,227 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+// ***************************** //
+// compile time simd selection
+//      SIMD_AVX2: 256-bit float kernels
+//      SIMD_SSE: 128-bit float kernels, always on for x64 builds
+//      define NO_SIMD to force the scalar fallback
+
+#ifndef NO_SIMD
+#if defined(__AVX2__)
+    #define SIMD_AVX2
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #define SIMD_SSE
+#endif
+#endif
+
+#include <string.h>
+
+// float lanes of the widest enabled vector
+#if defined(SIMD_AVX2)
+    #define SIMD_WIDTH 8
+#elif defined(SIMD_SSE)
+    #define SIMD_WIDTH 4
+#else
+    #define SIMD_WIDTH 1
+#endif
+
+#if defined(SIMD_AVX2)
+    #include <immintrin.h>
+#elif defined(SIMD_SSE)
+    #include <emmintrin.h>
+#endif
+
+#ifdef SIMD_SSE
+// widening loads of 4 elements to float
+inline __m128 LoadFloat4(const float * p)
+{
+    return _mm_loadu_ps(p);
+}
+
+inline __m128 LoadFloat4(const unsigned char * p)
+{
+    int v;
+    memcpy(&v, p, sizeof(int));
+    __m128i zero = _mm_setzero_si128();
+    __m128i w = _mm_unpacklo_epi8(_mm_cvtsi32_si128(v), zero);
+    return _mm_cvtepi32_ps(_mm_unpacklo_epi16(w, zero));
+}
+
+inline __m128 LoadFloat4(const unsigned short * p)
+{
+    __m128i w = _mm_loadl_epi64((const __m128i *)p);
+    return _mm_cvtepi32_ps(_mm_unpacklo_epi16(w, _mm_setzero_si128()));
+}
+
+// store the 3 lower floats of v without touching dst[3]
+inline void StoreFloat3(float * dst, __m128 v)
+{
+    _mm_storel_pi((__m64 *)dst, v);
+    _mm_store_ss(dst + 2, _mm_movehl_ps(v, v));
+}
+#endif
+
+#ifdef SIMD_AVX2
+// widening loads of 8 elements to float
+inline __m256 LoadFloat8(const float * p)
+{
+    return _mm256_loadu_ps(p);
+}
+
+inline __m256 LoadFloat8(const unsigned char * p)
+{
+    __m128i w = _mm_loadl_epi64((const __m128i *)p);
+    return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(w));
+}
+
+inline __m256 LoadFloat8(const unsigned short * p)
+{
+    __m128i w = _mm_loadu_si128((const __m128i *)p);
+    return _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(w));
+}
+
+// rows r0..r7 become columns
+inline void Transpose8x8(__m256 & r0, __m256 & r1, __m256 & r2, __m256 & r3,
+        __m256 & r4, __m256 & r5, __m256 & r6, __m256 & r7)
+{
+    __m256 t0 = _mm256_unpacklo_ps(r0, r1);
+    __m256 t1 = _mm256_unpackhi_ps(r0, r1);
+    __m256 t2 = _mm256_unpacklo_ps(r2, r3);
+    __m256 t3 = _mm256_unpackhi_ps(r2, r3);
+    __m256 t4 = _mm256_unpacklo_ps(r4, r5);
+    __m256 t5 = _mm256_unpackhi_ps(r4, r5);
+    __m256 t6 = _mm256_unpacklo_ps(r6, r7);
+    __m256 t7 = _mm256_unpackhi_ps(r6, r7);
+
+    __m256 s0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 s1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 s2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 s3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 s4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 s5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 s6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 s7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+
+    r0 = _mm256_permute2f128_ps(s0, s4, 0x20);
+    r1 = _mm256_permute2f128_ps(s1, s5, 0x20);
+    r2 = _mm256_permute2f128_ps(s2, s6, 0x20);
+    r3 = _mm256_permute2f128_ps(s3, s7, 0x20);
+    r4 = _mm256_permute2f128_ps(s0, s4, 0x31);
+    r5 = _mm256_permute2f128_ps(s1, s5, 0x31);
+    r6 = _mm256_permute2f128_ps(s2, s6, 0x31);
+    r7 = _mm256_permute2f128_ps(s3, s7, 0x31);
+}
+#endif
+
+// ***************************** //
+// run time simd selection
+//      kernels for an instruction set the compiler flags do not enable are marked
+//      SIMD_TARGET, callers pick one by SimdLevel() once at init
+
+enum SimdLevelType
+{
+    SIMD_LEVEL_SCALAR = 0,
+    SIMD_LEVEL_SSE4 = 1,
+    SIMD_LEVEL_AVX2 = 2,    // avx2 + fma
+    SIMD_LEVEL_AVX512 = 3   // avx512f
+};
+
+#if !defined(NO_SIMD) && (defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86))
+    #define SIMD_DISPATCH
+    #include <immintrin.h>
+    #if defined(_MSC_VER)
+        #include <intrin.h>
+        #define SIMD_TARGET(isa)
+    #else
+        #include <cpuid.h>
+        #define SIMD_TARGET(isa) __attribute__((target(isa)))
+    #endif
+#else
+    #define SIMD_TARGET(isa)
+#endif
+
+#ifdef SIMD_DISPATCH
+inline void CpuId(int * reg, int leaf, int subleaf)
+{
+#if defined(_MSC_VER)
+    __cpuidex(reg, leaf, subleaf);
+#else
+    unsigned int a, b, c, d;
+    __cpuid_count(leaf, subleaf, a, b, c, d);
+    reg[0] = a; reg[1] = b; reg[2] = c; reg[3] = d;
+#endif
+}
+
+// register state saved by the os on context switch
+inline unsigned long long XGetBV0()
+{
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    unsigned int a, d;
+    __asm__ volatile("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+    return ((unsigned long long)d << 32) | a;
+#endif
+}
+
+inline int DetectSimdLevel()
+{
+    int reg[4];
+    CpuId(reg, 0, 0);
+    int max_leaf = reg[0];
+    
+    CpuId(reg, 1, 0);
+    bool sse4 = (reg[2] >> 19) & 1;
+    bool fma = (reg[2] >> 12) & 1;
+    bool osxsave = (reg[2] >> 27) & 1;
+    bool avx = (reg[2] >> 28) & 1;
+    if(!sse4)
+        return SIMD_LEVEL_SCALAR;
+    
+    unsigned long long xcr0 = osxsave ? XGetBV0() : 0;
+    bool ymm = avx && (xcr0 & 0x6) == 0x6;
+    bool zmm = ymm && (xcr0 & 0xe0) == 0xe0;
+    
+    bool avx2 = false, avx512 = false;
+    if(max_leaf >= 7)
+    {
+        CpuId(reg, 7, 0);
+        avx2 = (reg[1] >> 5) & 1;
+        avx512 = (reg[1] >> 16) & 1;
+    }
+    
+    if(zmm && avx512 && avx2 && fma)
+        return SIMD_LEVEL_AVX512;
+    if(ymm && avx2 && fma)
+        return SIMD_LEVEL_AVX2;
+    return SIMD_LEVEL_SSE4;
+}
+#else
+inline int DetectSimdLevel()
+{
+    return SIMD_LEVEL_SCALAR;
+}
+#endif
+
+// highest level kernels may use, see SetSimdLevel()
+inline int & SimdLevelCap()
+{
+    static int cap = SIMD_LEVEL_AVX512;
+    return cap;
+}
+
+inline int SimdLevel()
+{
+    static int detected = DetectSimdLevel();
+    return detected < SimdLevelCap() ? detected : SimdLevelCap();
+}
+
+// cap the level of kernels selected afterwards, e.g. to compare paths
+inline void SetSimdLevel(int level)
+{
+    SimdLevelCap() = level;
+}
+
+#endif
@@ -0,0 +1,489 @@
+#ifndef THREAD_H
+#define THREAD_H
+
+#include <stdlib.h>
+#include <math.h>
+#include "image.h"
+
+// ***************************** //
+// parallel loop over tasks
+//      threaded unless built with NO_THREAD. loops run on a process wide pool of
+//      worker threads, created on the first parallel loop and kept until exit;
+//      the calling thread is worker 0. the worker number defaults to the core count
+//      and can be changed at runtime with SetThreadNum().
+//      the tasks are cut into chunks of grain items, each worker starts on its own
+//      contiguous run of chunks and steals single chunks from the others when done.
+//      a loop started inside a loop, or while another thread runs one, is serial
+
+#if defined(WIN32) || defined(_WIN32)
+    #define THREAD_WIN32
+    #include <windows.h>
+#else
+    #include <unistd.h>
+    #include <time.h>
+#endif
+
+#ifndef NO_THREAD
+#ifndef THREAD_WIN32
+    #include <pthread.h>
+#endif
+#ifdef MATLAB_COMPILE
+    #include <mex.h>
+#endif
+#endif
+
+// task body for items [begin, end)
+typedef void (*FuncParallelTask)(void * args, int begin, int end);
+
+#if defined(_MSC_VER)
+    #define THREAD_LOCAL __declspec(thread)
+#else
+    #define THREAD_LOCAL __thread
+#endif
+
+// chunks per worker when the grain is not given
+#define THREAD_CHUNK_PER_WORKER 8
+// upper bound of SetThreadNum()
+#define THREAD_LIMIT 256
+// least seconds of work worth a chunk, and worth waking a worker, for ParallelGrain()
+#define THREAD_CHUNK_COST 20e-6
+#define THREAD_WORKER_COST 50e-6
+
+// 0 until the first ThreadNum(), then the core count unless set
+static int thread_num = 0;
+
+// index of the calling thread in the pool, 0 outside of it
+static THREAD_LOCAL int thread_index = 0;
+// parallel loops the calling thread is running a task of
+static THREAD_LOCAL int thread_depth = 0;
+
+inline int ThreadCoreCount()
+{
+#if defined(THREAD_WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return MAX((int)info.dwNumberOfProcessors, 1);
+#else
+    return MAX((int)sysconf(_SC_NPROCESSORS_ONLN), 1);
+#endif
+}
+
+// workers of parallel loops, the calling thread included
+inline int ThreadNum()
+{
+#ifdef NO_THREAD
+    return 1;
+#else
+    if(thread_num == 0)
+        thread_num = MIN(ThreadCoreCount(), THREAD_LIMIT);
+    return thread_num;
+#endif
+}
+
+// index of the worker running the calling task, in [0, ThreadNum())
+inline int ThreadIndex()
+{
+    return thread_index;
+}
+
+// true inside a task of a parallel loop, where nested loops run serially
+inline bool ThreadInTask()
+{
+    return thread_depth > 0;
+}
+
+// wall clock in seconds
+inline double ThreadClock()
+{
+#if defined(THREAD_WIN32)
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (double)count.QuadPart / freq.QuadPart;
+#else
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+#endif
+}
+
+inline long AtomicAdd(volatile long * value, long add)
+{
+#if defined(THREAD_WIN32)
+    return InterlockedExchangeAdd(value, add);
+#else
+    return __sync_fetch_and_add(value, add);
+#endif
+}
+
+inline bool AtomicSwap(volatile long * value, long old_value, long new_value)
+{
+#if defined(THREAD_WIN32)
+    return InterlockedCompareExchange(value, new_value, old_value) == old_value;
+#else
+    return __sync_bool_compare_and_swap(value, old_value, new_value);
+#endif
+}
+
+// short critical sections, e.g. shared caches
+inline void SpinLock(volatile long * lock)
+{
+    while(!AtomicSwap(lock, 0, 1))
+        ;
+}
+
+inline void SpinUnlock(volatile long * lock)
+{
+    AtomicSwap(lock, 1, 0);
+}
+
+#ifndef NO_THREAD
+// mutex and condition variable
+#if defined(THREAD_WIN32)
+typedef CRITICAL_SECTION PoolMutex;
+typedef CONDITION_VARIABLE PoolCond;
+inline void InitPoolMutex(PoolMutex * m) { InitializeCriticalSection(m); }
+inline void FreePoolMutex(PoolMutex * m) { DeleteCriticalSection(m); }
+inline void PoolLock(PoolMutex * m) { EnterCriticalSection(m); }
+inline void PoolUnlock(PoolMutex * m) { LeaveCriticalSection(m); }
+inline void InitPoolCond(PoolCond * c) { InitializeConditionVariable(c); }
+inline void FreePoolCond(PoolCond * c) {}
+inline void PoolWait(PoolCond * c, PoolMutex * m) { SleepConditionVariableCS(c, m, INFINITE); }
+inline void PoolBroadcast(PoolCond * c) { WakeAllConditionVariable(c); }
+#else
+typedef pthread_mutex_t PoolMutex;
+typedef pthread_cond_t PoolCond;
+inline void InitPoolMutex(PoolMutex * m) { pthread_mutex_init(m, NULL); }
+inline void FreePoolMutex(PoolMutex * m) { pthread_mutex_destroy(m); }
+inline void PoolLock(PoolMutex * m) { pthread_mutex_lock(m); }
+inline void PoolUnlock(PoolMutex * m) { pthread_mutex_unlock(m); }
+inline void InitPoolCond(PoolCond * c) { pthread_cond_init(c, NULL); }
+inline void FreePoolCond(PoolCond * c) { pthread_cond_destroy(c); }
+inline void PoolWait(PoolCond * c, PoolMutex * m) { pthread_cond_wait(c, m); }
+inline void PoolBroadcast(PoolCond * c) { pthread_cond_broadcast(c); }
+#endif
+
+// chunk run of one worker, next is taken by the owner and by thieves;
+// padded so workers do not share cache lines
+struct PoolQueue
+{
+    volatile long next;
+    long end;
+    char pad[64 - sizeof(long) - sizeof(long)];
+};
+
+struct ThreadPool
+{
+    int nworker;
+#if defined(THREAD_WIN32)
+    HANDLE * handle;
+#else
+    pthread_t * handle;
+#endif
+
+    PoolMutex mutex;
+    PoolCond cond_start;
+    PoolCond cond_done;
+    long generation;
+    int pending;
+    bool quit;
+
+    // current loop
+    FuncParallelTask task;
+    void * args;
+    int ntask;
+    int grain;
+    int nactive;
+    PoolQueue * queue;
+};
+
+static ThreadPool * thread_pool = NULL;
+// set while a loop runs on the pool
+static volatile long thread_pool_busy = 0;
+
+// run chunks of the current loop as worker w, own run first, then steal
+inline void ThreadPoolWork(ThreadPool * pool, int w)
+{
+    int nactive = pool->nactive;
+    for(int k=0; k<nactive; k++)
+    {
+        PoolQueue * q = pool->queue + (w+k) % nactive;
+        while(true)
+        {
+            long chunk = AtomicAdd(&q->next, 1);
+            if(chunk >= q->end)
+                break;
+            int begin = (int)chunk * pool->grain;
+            pool->task(pool->args, begin, MIN(begin + pool->grain, pool->ntask));
+        }
+    }
+}
+
+struct ThreadPoolWorkerArgs
+{
+    ThreadPool * pool;
+    int index;
+};
+
+#if defined(THREAD_WIN32)
+DWORD WINAPI ThreadPoolWorker(LPVOID args_in)
+#else
+void * ThreadPoolWorker(void * args_in)
+#endif
+{
+    ThreadPoolWorkerArgs * args = (ThreadPoolWorkerArgs *)args_in;
+    ThreadPool * pool = args->pool;
+    int w = args->index;
+    FREE(args);
+    thread_index = w;
+
+    long generation = 0;
+    PoolLock(&pool->mutex);
+    while(true)
+    {
+        while(!pool->quit && pool->generation == generation)
+            PoolWait(&pool->cond_start, &pool->mutex);
+        if(pool->quit)
+            break;
+        generation = pool->generation;
+        bool active = w < pool->nactive;
+        PoolUnlock(&pool->mutex);
+
+        if(active)
+        {
+            thread_depth++;
+            ThreadPoolWork(pool, w);
+            thread_depth--;
+        }
+
+        PoolLock(&pool->mutex);
+        if(active && --pool->pending == 0)
+            PoolBroadcast(&pool->cond_done);
+    }
+    PoolUnlock(&pool->mutex);
+    return 0;
+}
+
+// stops and joins the workers, the next parallel loop starts a new pool
+void FreeThreadPool()
+{
+    ThreadPool * pool = thread_pool;
+    if(pool == NULL)
+        return;
+
+    PoolLock(&pool->mutex);
+    pool->quit = true;
+    PoolBroadcast(&pool->cond_start);
+    PoolUnlock(&pool->mutex);
+    for(int t=1; t<pool->nworker; t++)
+    {
+#if defined(THREAD_WIN32)
+        WaitForSingleObject(pool->handle[t], INFINITE);
+        CloseHandle(pool->handle[t]);
+#else
+        pthread_join(pool->handle[t], NULL);
+#endif
+    }
+
+    FreePoolMutex(&pool->mutex);
+    FreePoolCond(&pool->cond_start);
+    FreePoolCond(&pool->cond_done);
+    FREE(pool->handle);
+    FREE(pool->queue);
+    FREE(pool);
+    thread_pool = NULL;
+}
+
+ThreadPool * GetThreadPool()
+{
+    if(thread_pool != NULL)
+        return thread_pool;
+
+    ThreadPool * pool = ALLOCATE(ThreadPool, 1);
+    pool->nworker = ThreadNum();
+#if defined(THREAD_WIN32)
+    pool->handle = ALLOCATE(HANDLE, pool->nworker);
+#else
+    pool->handle = ALLOCATE(pthread_t, pool->nworker);
+#endif
+    pool->queue = ALLOCATE(PoolQueue, pool->nworker);
+    InitPoolMutex(&pool->mutex);
+    InitPoolCond(&pool->cond_start);
+    InitPoolCond(&pool->cond_done);
+
+    for(int t=1; t<pool->nworker; t++)
+    {
+        ThreadPoolWorkerArgs * args = ALLOCATE(ThreadPoolWorkerArgs, 1);
+        args->pool = pool;
+        args->index = t;
+#if defined(THREAD_WIN32)
+        pool->handle[t] = CreateThread(NULL, 0, ThreadPoolWorker, args, 0, NULL);
+#else
+        pthread_create(&pool->handle[t], NULL, ThreadPoolWorker, (void *)args);
+#endif
+    }
+
+    thread_pool = pool;
+    static bool exit_registered = false;
+    if(!exit_registered)
+    {
+#ifdef MATLAB_COMPILE
+        mexAtExit(FreeThreadPool);
+#else
+        atexit(FreeThreadPool);
+#endif
+        exit_registered = true;
+    }
+    return pool;
+}
+
+// ***************************** //
+// dedicated threads, e.g. the stages of a pipeline
+
+typedef void (*FuncThreadMain)(void * args);
+
+#if defined(THREAD_WIN32)
+typedef HANDLE ThreadHandle;
+#else
+typedef pthread_t ThreadHandle;
+#endif
+
+struct ThreadMainArgs
+{
+    FuncThreadMain func;
+    void * args;
+};
+
+#if defined(THREAD_WIN32)
+DWORD WINAPI ThreadMain(LPVOID args_in)
+#else
+void * ThreadMain(void * args_in)
+#endif
+{
+    ThreadMainArgs a = *(ThreadMainArgs *)args_in;
+    FREE((ThreadMainArgs *)args_in);
+    a.func(a.args);
+    return 0;
+}
+
+void StartThread(ThreadHandle * handle, FuncThreadMain func, void * args)
+{
+    ThreadMainArgs * a = ALLOCATE(ThreadMainArgs, 1);
+    a->func = func;
+    a->args = args;
+#if defined(THREAD_WIN32)
+    *handle = CreateThread(NULL, 0, ThreadMain, a, 0, NULL);
+#else
+    pthread_create(handle, NULL, ThreadMain, (void *)a);
+#endif
+}
+
+void JoinThread(ThreadHandle * handle)
+{
+#if defined(THREAD_WIN32)
+    WaitForSingleObject(*handle, INFINITE);
+    CloseHandle(*handle);
+#else
+    pthread_join(*handle, NULL);
+#endif
+}
+#endif
+
+// workers of later parallel loops, 0 for the core count; buffers sized per worker
+// before the call, e.g. by InitCoding(), keep their count and cap their loops
+void SetThreadNum(int n)
+{
+#ifndef NO_THREAD
+    n = n <= 0 ? ThreadCoreCount() : n;
+    n = MIN(n, THREAD_LIMIT);
+    if(n != ThreadNum() && !thread_pool_busy)
+    {
+        FreeThreadPool();
+        thread_num = n;
+    }
+#endif
+}
+
+// grain of ntask items taking item_cost seconds each: chunks of at least
+// THREAD_CHUNK_COST, and no more workers than THREAD_WORKER_COST pieces of work
+//      max_worker: in, workers available, 0 for all; out, workers worth using
+int ParallelGrain(int ntask, double item_cost, int * max_worker)
+{
+    int nworker = ThreadNum();
+    if(*max_worker > 0)
+        nworker = MIN(nworker, *max_worker);
+    if(item_cost <= 0)
+    {
+        *max_worker = nworker;
+        return 0;
+    }
+    
+    double total = item_cost * ntask;
+    nworker = (int)MIN((double)nworker, MAX(total / THREAD_WORKER_COST, 1.0));
+    *max_worker = nworker;
+    
+    int grain = (int)ceil(THREAD_CHUNK_COST / item_cost);
+    grain = MAX(grain, ntask / (nworker * THREAD_CHUNK_PER_WORKER));
+    return MIN(MAX(grain, 1), MAX(ntask, 1));
+}
+
+// run task over [0, ntask) in chunks of grain items
+//      grain: 0 for THREAD_CHUNK_PER_WORKER chunks per worker
+//      max_worker: 0 for all workers, else workers with index < max_worker only,
+//      e.g. when per worker buffers were sized for fewer threads
+void ParallelFor(int ntask, FuncParallelTask task, void * args, int grain = 0, int max_worker = 0)
+{
+    if(ntask <= 0)
+        return;
+
+    int nworker = ThreadNum();
+    if(max_worker > 0)
+        nworker = MIN(nworker, max_worker);
+    if(grain <= 0)
+        grain = MAX(ntask / (nworker * THREAD_CHUNK_PER_WORKER), 1);
+    int nchunk = (ntask + grain-1) / grain;
+
+#ifndef NO_THREAD
+    if(nworker > 1 && nchunk > 1 && AtomicSwap(&thread_pool_busy, 0, 1))
+    {
+        ThreadPool * pool = GetThreadPool();
+        nworker = MIN(nworker, MIN(pool->nworker, nchunk));
+
+        // contiguous chunk runs, one per worker
+        for(int t=0; t<nworker; t++)
+        {
+            pool->queue[t].next = (long)((long long)t * nchunk / nworker);
+            pool->queue[t].end = (long)((long long)(t+1) * nchunk / nworker);
+        }
+
+        PoolLock(&pool->mutex);
+        pool->task = task;
+        pool->args = args;
+        pool->ntask = ntask;
+        pool->grain = grain;
+        pool->nactive = nworker;
+        pool->pending = nworker-1;
+        pool->generation++;
+        PoolBroadcast(&pool->cond_start);
+        PoolUnlock(&pool->mutex);
+
+        thread_depth++;
+        ThreadPoolWork(pool, 0);
+        thread_depth--;
+
+        PoolLock(&pool->mutex);
+        while(pool->pending > 0)
+            PoolWait(&pool->cond_done, &pool->mutex);
+        PoolUnlock(&pool->mutex);
+
+        AtomicSwap(&thread_pool_busy, 1, 0);
+        return;
+    }
+#endif
+
+    thread_depth++;
+    task(args, 0, ntask);
+    thread_depth--;
+}
+
+#endif
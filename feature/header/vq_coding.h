@@ -0,0 +1,125 @@
+#ifndef VQ_CODING_H
+#define VQ_CODING_H
+
+#include <math.h>
+#include "image.h"
+#include "center_index.h"
+
+// ***************************** //
+// vector quantization codebook
+//      centers: dim nDim x nBase, e.g. from vl_kmeans in single precision
+//      squared distances are expanded for the batched search as
+//          |x - c_i|^2 = |x|^2 + gemm_bias[i] + sum_d w(i, d) x_d
+
+struct VQCodeBook
+{
+    int nDim, nBase;
+
+    const float * centers; // dim nDim x nBase
+
+    // set by InitCodingVQ()
+    float * gemm_weight; // dim nBase x nDim, w(i, d) = -2 c_i(d) at gemm_weight[d*nBase + i]
+    float * gemm_bias; // dim nBase, |c_i|^2
+};
+
+void InitVQCodeBookGemm(VQCodeBook * cb)
+{
+    int nDim = cb->nDim, nBase = cb->nBase;
+    cb->gemm_weight = ALLOCATE(float, nDim*nBase);
+    cb->gemm_bias = ALLOCATE(float, nBase);
+    for(int i=0; i<nBase; i++)
+    {
+        double norm = 0;
+        for(int k=0; k<nDim; k++)
+        {
+            float c = cb->centers[i*nDim+k];
+            cb->gemm_weight[k*nBase + i] = -2*c;
+            norm += (double)c*c;
+        }
+        cb->gemm_bias[i] = (float)norm;
+    }
+}
+
+void FreeVQCodeBookGemm(VQCodeBook * cb)
+{
+    FREE(cb->gemm_weight);
+    FREE(cb->gemm_bias);
+    cb->gemm_weight = NULL;
+    cb->gemm_bias = NULL;
+}
+
+// exact squared distance of data to center i
+inline double VQDistance(const float * data, int i, const VQCodeBook * cb)
+{
+    int nDim = cb->nDim;
+    const float * c = cb->centers + i*nDim;
+    double dist = 0;
+    for(int k=0; k<nDim; k++)
+    {
+        double d = (double)data[k] - c[k];
+        dist += d*d;
+    }
+    return dist;
+}
+
+// descriptors per product and rows of the score buffer of VQNearest()
+#define VQ_GEMM_BLOCK CENTER_GEMM_BLOCK
+#define VQ_GEMM_ROWS CENTER_GEMM_ROWS
+
+// nearest of m expanded centers (weight m x nDim, lda m, and bias) for the
+// n columns of x (nDim x n, column j at x + j*x_stride), by the expanded distance
+//      score: dim VQ_GEMM_ROWS x VQ_GEMM_BLOCK
+inline void VQNearest(const float * x, int n, int nDim, int x_stride, const float * weight, const float * bias, int m,
+        int * nearest, float * score)
+{
+    CenterNearest(x, n, nDim, x_stride, weight, bias, m, nearest, score);
+}
+
+// ***************************** //
+// two-level index over the centers for approximate nearest centers
+//      a CenterIndex of the centers, unscaled, the members searched by the expanded
+//      distance of gemm_weight and gemm_bias, nDim columns. a tree of depth two, as
+//      FisherVectorIndex
+//      probe is the recall / speed knob, probe = nCluster is exhaustive
+
+typedef CenterIndex<float> VQIndex;
+
+// cb->gemm_weight and cb->gemm_bias must be set
+void InitVQIndex(VQIndex * index, const VQCodeBook * cb, int nCluster, int probe)
+{
+    InitCenterIndex(index, cb->centers, (const float *)NULL, cb->nDim, cb->nBase, nCluster, probe,
+            cb->gemm_weight, cb->gemm_bias, cb->nDim);
+}
+
+void FreeVQIndex(VQIndex * index)
+{
+    FreeCenterIndex(index);
+}
+
+// probe nearest clusters of data, widened until they hold min_num centers
+//      cluster: dim nCluster, the selected clusters come first by ascending id
+//      returns the number of selected clusters
+inline int VQIndexProbe(const float * data, const VQIndex * index, int min_num, float * dist, int * cluster)
+{
+    return CenterIndexProbe(data, index, min_num, dist, cluster);
+}
+
+#ifdef MATLAB_COMPILE
+// matlab helper function
+//      the codebook is the single matrix of centers, nDim x nBase
+void MatReadVQCodebook(const mxArray * mat_opt, VQCodeBook * opt)
+{
+    if ((mat_opt) == NULL)
+        return;
+
+    if(!mxIsSingle(mat_opt))
+        mexErrMsgTxt("vq_codebook must be single");
+    opt->nDim = (int)mxGetM(mat_opt);
+    opt->nBase = (int)mxGetN(mat_opt);
+    opt->centers = (const float *)mxGetData(mat_opt);
+    opt->gemm_weight = NULL;
+    opt->gemm_bias = NULL;
+}
+#endif
+
+#endif
@@ -0,0 +1,36 @@
+function WriteFisherVectorCodeBook(path, GMM)
+
+% WriteFisherVectorCodeBook(path, GMM)
+% Write the codebook file of codebook_io.h from GMM.Priors, GMM.Mu and
+% GMM.Sigma (variances), with the derived fields of matlab_test.m.
+% Pass the path as coding_opt.fv_codebook to map it instead of the struct.
+mu = double(GMM.Mu);
+sigma = double(GMM.Sigma);
+priors = double(GMM.Priors(:));
+[nDim, nBase] = size(mu);
+
+arrays = {priors, mu, sigma, sqrt(priors), sqrt(2*priors), ...
+    (sum(log(sigma)) + nDim * log(2*pi))', 1./sigma, 1./sqrt(sigma)};
+
+% 128 byte header, arrays at 64 byte aligned offsets
+offset = zeros(1, numel(arrays));
+pos = 128;
+for k = 1:numel(arrays)
+    offset(k) = pos;
+    pos = pos + ceil(numel(arrays{k}) * 8 / 64) * 64;
+end
+
+f = fopen(path, 'w', 'ieee-le');
+if f < 0
+    error('cannot write %s', path);
+end
+fwrite(f, double('FVCB'), 'uint8');
+fwrite(f, [1 nDim nBase], 'int32');
+fwrite(f, offset, 'int64');
+fwrite(f, zeros(1, 6), 'int64');
+offset(end+1) = pos;
+for k = 1:numel(arrays)
+    fwrite(f, arrays{k}(:), 'double');
+    fwrite(f, zeros(1, (offset(k+1) - offset(k)) / 8 - numel(arrays{k})), 'double');
+end
+fclose(f);
@@ -0,0 +1,108 @@
+#include <mexutils.h>
+#include "batch.h"
+#include "matlab_interface.h"
+
+// batch_feature(images, patch_opt, coding_opt, normalize, grid): image-level codes of
+//      a cell array of images, one column per image. patch features are extracted
+//      and coded on the pipeline of batch.h while the next images are being read.
+//      normalize: 0 none, 1 power, 2 l2, 3 power and l2
+//      grid: optional nlayout x 2 of [cells in x, cells in y], one column then holds
+//      the per cell codes of every layout, cell after cell
+//      coding_opt.thread_num sets the worker threads as for coding()
+
+struct MatBatchArgs
+{
+    FloatImage * img;
+    bool * copied;
+    float * output;
+    int column_length;
+};
+
+// images are read on the main thread, loading hands out views
+bool MatBatchLoad(void * args_in, int index, FloatImage * img)
+{
+    MatBatchArgs * args = (MatBatchArgs *)args_in;
+    *img = args->img[index];
+    return true;
+}
+
+void MatBatchRelease(void * args_in, int index, FloatImage * img)
+{
+    MatBatchArgs * args = (MatBatchArgs *)args_in;
+    if(args->copied[index])
+        FreeImage(img);
+}
+
+void MatBatchSink(void * args_in, int index, const FloatMatrix * feat)
+{
+    MatBatchArgs * args = (MatBatchArgs *)args_in;
+    ASSERT(feat->height * feat->width == args->column_length);
+    memcpy(args->output + (size_t)index * args->column_length, feat->p, sizeof(float) * args->column_length);
+}
+
+void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+
+    ASSERT(mxIsCell(prhs[0]));
+    int nimage = (int)mxGetNumberOfElements(prhs[0]);
+
+    BatchOpt opt;
+    memset(&opt, 0, sizeof(BatchOpt));
+    MatReadPatchFeatureOpt(prhs[1], &opt.patch_opt);
+    MatReadCodingOpt(prhs[2], &opt.coding_opt);
+    opt.use_coding = true;
+    opt.normalize = nrhs > 3 ? (int)mxGetScalar(prhs[3]) : 0;
+
+    // thread number of this call and grain, set before the stages start
+    int thread_num = MatReadCodingSchedule(prhs[2], &opt.coding_opt.grain);
+    int length = CodingLength(&opt.coding_opt);
+
+    int * grid = NULL;
+    int ncell = 1;
+    if(nrhs > 4 && !mxIsEmpty(prhs[4]))
+    {
+        ASSERT(mxGetN(prhs[4]) == 2);
+        opt.nlayout = (int)mxGetM(prhs[4]);
+        grid = ALLOCATE(int, 2*opt.nlayout);
+        const double * mx_grid = mxGetPr(prhs[4]);
+        ncell = 0;
+        for(int l=0; l<opt.nlayout; l++)
+        {
+            grid[l] = MAX((int)mx_grid[l], 1);
+            grid[opt.nlayout + l] = MAX((int)mx_grid[opt.nlayout + l], 1);
+            ncell += grid[l] * grid[opt.nlayout + l];
+        }
+        opt.grid_x = grid;
+        opt.grid_y = grid + opt.nlayout;
+    }
+
+    MatBatchArgs args;
+    args.img = ALLOCATE(FloatImage, nimage);
+    args.copied = ALLOCATE(bool, nimage);
+    for(int i=0; i<nimage; i++)
+    {
+        const mxArray * mx_image = mxGetCell(prhs[0], i);
+        ASSERT(mx_image != NULL);
+        if(opt.patch_opt.use_pixel_feature)
+            args.copied[i] = MatReadImage(mx_image, args.img + i);
+        else
+        {
+            MatCopyToFloatMatrix(mx_image, args.img + i);
+            args.copied[i] = true;
+        }
+    }
+    args.column_length = length * ncell;
+    plhs[0] = mxCreateNumericMatrix(args.column_length, nimage, mxSINGLE_CLASS, mxREAL);
+    args.output = (float *)mxGetData(plhs[0]);
+
+    opt.func_load = MatBatchLoad;
+    opt.func_release = MatBatchRelease;
+    opt.func_sink = MatBatchSink;
+    opt.args = &args;
+    BatchFeature(nimage, &opt);
+
+    FREE(args.img);
+    FREE(args.copied);
+    if(grid != NULL)
+        FREE(grid);
+    SetThreadNum(thread_num);
+}
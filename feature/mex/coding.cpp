@@ -9,6 +9,15 @@
 #include <mexutils.h>
 #include "image.h"
 #include "coding.h"
+#include "pooling.h"
+
+// coding(feature, coding_opt): sparse codes of every column, struct of p and i
+// coding(feature, coding_opt, normalize): sum of the codes as one dense single
+//      column of coding length, normalize: 0 none, 1 power, 2 l2, 3 power and l2
+// coding(feature, coding_opt, normalize, coordinate, pyramid_opt): sums of the
+//      codes in each spatial pyramid cell, one column per cell, normalized per cell;
+//      coordinate as returned by patch_feature, pyramid_opt.grid = [1 1; 2 2; 3 1]
+//      and pyramid_opt.height, pyramid_opt.width of the image
 
 void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
     
@@ -18,11 +27,42 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
     CodingOpt opt;
     MatReadCodingOpt(prhs[1], &opt);
     
+    // thread number of this call only
+    int grain;
+    int thread_num = MatReadCodingSchedule(prhs[1], &grain);
     InitCoding(&opt);
+    opt.grain = grain;
+    
+    if(nrhs > 4)
+    {
+        int normalize = (int)mxGetScalar(prhs[2]);
+        ASSERT(mxIsSingle(prhs[3]) && mxGetNumberOfElements(prhs[3]) == 2*patch_feat.width);
+        SpatialPyramidOpt pyramid_opt;
+        MatReadSpatialPyramidOpt(prhs[4], &pyramid_opt);
+        plhs[0] = mxCreateNumericMatrix(opt.length, pyramid_opt.ncell, mxSINGLE_CLASS, mxREAL);
+        SpatialPyramidPooling(&patch_feat, (float *)mxGetData(prhs[3]), (float *)mxGetData(plhs[0]),
+                &opt, &pyramid_opt, normalize);
+        FreeSpatialPyramid(&pyramid_opt);
+        FreeCoding(&opt);
+        SetThreadNum(thread_num);
+        return;
+    }
+    
+    if(nrhs > 2)
+    {
+        int normalize = (int)mxGetScalar(prhs[2]);
+        plhs[0] = mxCreateNumericMatrix(opt.length, 1, mxSINGLE_CLASS, mxREAL);
+        CodingAggregate(&patch_feat, (float *)mxGetData(plhs[0]), &opt, normalize);
+        FreeCoding(&opt);
+        SetThreadNum(thread_num);
+        return;
+    }
     
     FloatSparseMatrix patch_coding;
     plhs[0] = MatAllocateFloatSparseMatrix(&patch_coding, opt.length, patch_feat.width, opt.block_num, opt.block_size);    
     
     Coding(&patch_feat, &patch_coding, &opt);
+    FreeCoding(&opt);
+    SetThreadNum(thread_num);
     
 }
\ No newline at end of file
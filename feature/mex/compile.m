@@ -1,4 +1,6 @@
 function compile(file, tag, vlfeat_dir)
+% worker threads are sized at runtime from the core count, put '-DNO_THREAD'
+% in tag for a serial build
 if ~exist('vlfeat_dir', 'var')
     vlfeat_dir = 'D:\My Documents\My Work\Util\vlfeat-0.9.13\toolbox';
 end
@@ -0,0 +1,28 @@
+#include <mexutils.h>
+#define MATLAB_COMPILE
+
+#include "hog_feature.h"
+#include "matlab_interface.h"
+
+// F = hog_feature(im, sbin)
+//      im: uint8, uint16, single or double image of any depth
+//      F: single, (blocks_y-2) x (blocks_x-2) x 31, as features_hog in baseline
+void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+    
+    if(nrhs != 2)
+        mexErrMsgTxt("Wrong number of inputs");
+    
+    FloatImage img;
+    bool img_copied = MatReadImage(prhs[0], &img);
+    
+    HOGFeatureOpt opt;
+    opt.sbin = (int)mxGetScalar(prhs[1]);
+    InitHOGFeature(&img, &opt);
+    
+    FloatImage feat;
+    plhs[0] = MatAllocateFloatMatrix(&feat, opt.height, opt.width, opt.length);
+    
+    HOGFeature(&img, &feat, &opt);
+    if(img_copied)
+        FreeImage(&img);
+}
@@ -1,28 +1,27 @@
-
 %% compile
-
+% one binary for all pixel feature / coding pairs, picked by name at runtime
 pixel_opt.name = 'Gray8N';
 pixel_coding_opt.name = 'PixelLBP';
 opt.name = 'LBP';
 
-% generate feature function
 tag = [];
-tag{1} = ['-DPIXEL_FEATURE_NAME=', pixel_opt.name];
-tag{2} = ['-DPIXEL_CODING_NAME=', pixel_coding_opt.name];
-tag{3} = '-g';
-tag{4} = ['-output'];
-tag{5} = ['"patch_feature_', opt.name, '"'];
-tag{6} = ['-I"..\header"'];
-tag{7} = '-DMATLAB_COMPILE';
+tag{1} = '-g';
+tag{2} = ['-output'];
+tag{3} = '"patch_feature"';
+tag{4} = ['-I"..\header"'];
+tag{5} = '-DMATLAB_COMPILE';
 compile('patch_feature.cpp', tag);
 
+tag{3} = '"patch_feature_pyramid"';
+compile('patch_feature_pyramid.cpp', tag);
+
 %%
+% worker threads follow the core count at runtime, add '-DNO_THREAD' for serial
+tag = [];
 tag{1} = ['-I"..\header"'];
 tag{2} = '-DMATLAB_COMPILE';
-tag{3} = '-DCODING_NAME=CodingFisherVector';
-tag{4} = '-DTHREAD_MAX=2';
-tag{5} = '-DWIN32';
 compile('coding.cpp', tag);
+compile('batch_feature.cpp', tag);
 %% correctness varify
 %%
 norient = 18;
@@ -36,7 +35,7 @@ opt.size_x = sbin;
 opt.size_y = sbin;
 im = imread('..\..\test\test.jpg');
 im = rgb2gray(im);
-[feat_all, coordinate] = func(im, [], opt);
+[feat_all, coordinate] = patch_feature(im, [], opt);
 
 feat_all = bsxfun(@rdivide, feat_all, sqrt(sum(feat_all.^2)));
 feat_all = reshape(feat_all', [size(coordinate,1), size(coordinate,2), size(feat_all,1)]);
@@ -84,12 +83,102 @@ feature = single(feature);
 feat_all = coding(feature, coding_opt);
 idx = feat_all.i(1:7, :);
 
-% 0.4943s for 1 thread, 0.2671s for 2 thread
-tic;
-for i = 1:100
-    feat_all = coding(feature, coding_opt);
+% thread number of the call and chunk size, both picked at runtime by default
+coding_opt.thread_num = 1;
+coding_opt.grain = 64;
+feat_all = coding(feature, coding_opt);
+coding_opt = rmfield(coding_opt, {'thread_num', 'grain'});
+
+% codebook file, mapped and checked once by the first call; the mapping of an
+% earlier run keeps the file open, so it is released before the file is rewritten
+clear coding
+WriteFisherVectorCodeBook('codebook.fvcb', GMM);
+file_opt = coding_opt;
+file_opt.fv_codebook = 'codebook.fvcb';
+feat_file = coding(feature, file_opt);
+disp(max(abs(feat_file.p(:) - feat_all.p(:))));
+
+% bag of words, soft assignment to the 5 nearest of 256 centers
+vq_opt.name = 'CodingVQ';
+vq_opt.param = [5, 0.5];
+vq_opt.vq_codebook = single(vl_kmeans(feature, 256));
+feat_vq = coding(feature, vq_opt);
+% the same with the center index, 4 of 16 clusters probed
+vq_opt.param = [5, 0.5, 4, 16];
+feat_vq_idx = coding(feature, vq_opt);
+disp(mean(feat_vq.i(1, :) == feat_vq_idx.i(1, :)));
+
+% product quantization, 8 subspaces of 10 dimensions with 256 centers each,
+% uint8 codes of 8 bytes per descriptor
+pq_codebook = zeros(10, 256, 8, 'single');
+for m = 1:8
+    pq_codebook(:, :, m) = vl_kmeans(feature((m-1)*10+(1:10), :), 256);
+end
+pq_opt.name = 'CodingPQ';
+pq_opt.pq_codebook = pq_codebook;
+feat_pq = coding(feature, pq_opt);
+codes = uint8(bsxfun(@minus, double(feat_pq.i), (0:7)' * 256));
+% relative error of the descriptors rebuilt from their codes
+rebuilt = zeros(size(feature), 'single');
+for m = 1:8
+    rebuilt((m-1)*10+(1:10), :) = pq_codebook(:, double(codes(m, :))+1, m);
 end
-disp(toc/100);
+disp(norm(rebuilt - feature, 'fro') / norm(feature, 'fro'));
+
+% approximate gaussian selection, probe 4 of 16 mean clusters
+coding_opt.param = [4, 16];
+feat_idx = coding(feature, coding_opt);
+recall = arrayfun(@(n) numel(intersect(feat_idx.i(1:7, n), idx(:, n))), 1:size(idx, 2));
+disp(mean(recall) / 7);
+coding_opt.param = [];
+
+% image-level fisher vector, against summing the sparse codes
+feat_sum = zeros(2*codebook.nDim, codebook.nBase);
+for n = 1:size(feat_all.i, 2)
+    for j = 1:size(feat_all.i, 1)
+        feat_sum(:, feat_all.i(j, n)+1) = feat_sum(:, feat_all.i(j, n)+1) + ...
+            double(feat_all.p((j-1)*2*codebook.nDim+1:j*2*codebook.nDim, n));
+    end
+end
+feat_fv = coding(feature, coding_opt, 0);
+disp(max(abs(double(feat_fv) - feat_sum(:))));
+feat_fv = coding(feature, coding_opt, 3);
+feat_sum = sign(feat_sum(:)) .* sqrt(abs(feat_sum(:)));
+disp(max(abs(double(feat_fv) - feat_sum / norm(feat_sum))));
+
+% spatial pyramid 1x1, 2x2, 3x1 over patch coordinates, against masking in matlab
+pyramid_opt.grid = [1 1; 2 2; 3 1];
+pyramid_opt.height = 480;
+pyramid_opt.width = 640;
+coord_fv = single([rand(1, size(feature, 2))*pyramid_opt.height, rand(1, size(feature, 2))*pyramid_opt.width]);
+feat_spm = coding(feature, coding_opt, 0, coord_fv, pyramid_opt);
+feat_mask = [];
+for l = 1:size(pyramid_opt.grid, 1)
+    cx = min(floor(coord_fv(size(feature, 2)+1:end) * pyramid_opt.grid(l, 1) / pyramid_opt.width), pyramid_opt.grid(l, 1)-1);
+    cy = min(floor(coord_fv(1:size(feature, 2)) * pyramid_opt.grid(l, 2) / pyramid_opt.height), pyramid_opt.grid(l, 2)-1);
+    for c = 0:prod(pyramid_opt.grid(l, :))-1
+        mask = cx*pyramid_opt.grid(l, 2) + cy == c;
+        feat_mask = [feat_mask, coding(feature(:, mask), coding_opt, 0)];
+    end
+end
+disp(max(abs(feat_spm(:) - feat_mask(:))));
+
+% batch of images through the native pipeline, against one image at a time;
+% coding_opt must take the patch features of opt
+im = rgb2gray(imread('..\..\test\test.jpg'));
+ims = {im, im(1:2:end, :), im(:, 1:2:end), fliplr(im)};
+grid = [1 1; 2 2];
+feat_batch = batch_feature(ims, opt, coding_opt, 3, grid);
+feat_loop = [];
+for i = 1:length(ims)
+    [feat_patch, coord_patch] = patch_feature(ims{i}, [], opt);
+    pyramid_opt.grid = grid;
+    pyramid_opt.height = size(ims{i}, 1);
+    pyramid_opt.width = size(ims{i}, 2);
+    feat_cell = coding(feat_patch, coding_opt, 3, coord_patch, pyramid_opt);
+    feat_loop = [feat_loop, feat_cell(:)];
+end
+disp(max(abs(feat_batch(:) - feat_loop(:))));
 
 %%
 feature = double(feature);
@@ -107,42 +196,24 @@ for i = 1:10
     end
     feat_base = [feat_base, feat_tmp(ii)];
 end
-% 0.4826s
-tic;
-for i = 1:100
-    ftmp = fisher_vector_coding(3, feature, GMM);
-end
-disp(toc/100);
-%% speed test
-% HOG  0.0288 vs UoC HOG  0.0228s
+%% speed
+% timings come from the native suite instead of tic/toc loops, csv per case, input and
+% thread number; pass an earlier csv as --baseline to flag regressions
+%   bench_suite --image ../../test/test.jpg > results.csv
+% the last tic/toc numbers, for reference: coding 0.4943s (1 thread), 0.2671s (2 threads),
+% fisher_vector_coding 0.4826s; patch_feature HOG 0.0288s, UoC HOG 0.0228s, LBP 0.0212s,
+% LBP ver1 0.0157s
+
+%% pyramid, replaces the imresize(im, 0.8) loop
+pyra_opt.scale = 0.8;
+pyra_opt.nlevel = 0;
+pyra_opt.min_size = 50;
 im = imread('..\..\test\test.jpg');
 im = rgb2gray(im);
-tic;
-for i = 1:500
-    [feat_all, coordinate] = patch_feature_HOG(im, [], opt);
-end
-disp(toc/500);
-
-im = imread('..\..\test\test.jpg');
-tic;
-for i = 1:500
-    feat_base = features_hog(double(im), 8);
-end
-disp(toc/500);
+[feats, coords, scales] = patch_feature_pyramid(im, opt, pyra_opt);
 
-% LBP  0.0212s vs LBP ver1  0.0157s
+%% 31-d hog, float port of features_hog
 im = imread('..\..\test\test.jpg');
-im = rgb2gray(im);
-tic;
-for i = 1:500
-    [feat_all, coordinate] = patch_feature_LBP(im, [], opt);
-end
-disp(toc/500);
-
-im = imread('..\..\test\test.jpg');
-im = rgb2gray(im);
-tic;
-for i = 1:500
-    feat_base = features_lbp(double(im), 8);
-end
-disp(toc/500);
\ No newline at end of file
+feat_base = features_hog(double(im), 8);
+feat_hog = hog_feature(im, 8);
+disp(max(abs(double(feat_hog(:)) - feat_base(:))));
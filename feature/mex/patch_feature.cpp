@@ -5,14 +5,20 @@
 
 void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
     
-    FloatImage im;
-    MatCopyToFloatMatrix(prhs[0], &im);
-    
     bool use_default_patch = mxIsEmpty(prhs[1]);
     FloatImage patch_coord;
     PatchFeatureOpt opt;
     MatReadPatchFeatureOpt(prhs[2], &opt);
     
+    // pixel features read uint8, uint16 and single images in place,
+    // patch level features need a float copy
+    FloatImage im;
+    bool im_copied = true;
+    if(opt.use_pixel_feature)
+        im_copied = MatReadImage(prhs[0], &im);
+    else
+        MatCopyToFloatMatrix(prhs[0], &im);
+    
     if(!use_default_patch)
     {
         nlhs = 1;
@@ -30,8 +36,10 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
     plhs[0] = MatAllocateFloatMatrix(&patch_feat, opt.length, opt.height * opt.width, 1);    
     
     PatchFeature(&im, &patch_feat, &patch_coord, &opt);
+    FreePatchFeature(&opt);
     
-    FreeImage(&im);    
+    if(im_copied)
+        FreeImage(&im);    
     if(!use_default_patch) 
         FreeImage(&patch_coord);
 }
\ No newline at end of file
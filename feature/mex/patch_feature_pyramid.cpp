@@ -0,0 +1,52 @@
+#include <mexutils.h>
+#include "patch_feature.h"
+#include "pyramid.h"
+#include "matlab_interface.h"
+
+// [feats, coords, scales] = patch_feature_pyramid(im, opt, pyra_opt)
+//      feats, coords: level_num x 1 cells, as returned by patch_feature
+//      scales: scale of each level
+void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+    
+    PatchFeatureOpt opt;
+    MatReadPatchFeatureOpt(prhs[1], &opt);
+    
+    PyramidOpt pyra_opt;
+    MatReadPyramidOpt(prhs[2], &pyra_opt);
+    
+    FloatImage im;
+    bool im_copied = true;
+    if(opt.use_pixel_feature)
+        im_copied = MatReadImage(prhs[0], &im);
+    else
+        MatCopyToFloatMatrix(prhs[0], &im);
+    
+    InitPatchFeaturePyramid(&im, &opt, &pyra_opt);
+    int level_num = pyra_opt.level_num;
+    
+    // all outputs are created here, worker threads must not touch mxArrays
+    plhs[0] = mxCreateCellMatrix(level_num, 1);
+    plhs[1] = mxCreateCellMatrix(level_num, 1);
+    plhs[2] = mxCreateDoubleMatrix(level_num, 1, mxREAL);
+    
+    FloatImage * feat = ALLOCATE(FloatImage, MAX(level_num, 1));
+    FloatImage * coord = ALLOCATE(FloatImage, MAX(level_num, 1));
+    double * scales = mxGetPr(plhs[2]);
+    for(int k=0; k<level_num; k++)
+    {
+        PatchFeatureOpt * level_opt = &pyra_opt.levels[k].opt;
+        mxSetCell(plhs[0], k, MatAllocateFloatMatrix(feat + k, 
+                level_opt->length, level_opt->height * level_opt->width, 1));
+        mxSetCell(plhs[1], k, MatAllocateFloatMatrix(coord + k, 
+                level_opt->height, level_opt->width, 2));
+        scales[k] = pyra_opt.levels[k].scale;
+    }
+    
+    PatchFeaturePyramid(&im, feat, coord, &pyra_opt);
+    
+    FREE(feat);
+    FREE(coord);
+    FreePatchFeaturePyramid(&pyra_opt);
+    if(im_copied)
+        FreeImage(&im);
+}
@@ -18,9 +18,9 @@
 
 void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
         
-    // copy input to matrix
+    // uint8, uint16 and single images are used in place
     FloatImage img;
-    MatCopyToFloatMatrix(prhs[0], &img);
+    bool img_copied = MatReadImage(prhs[0], &img);
         
     PixelFeatureOpt opt;
     MatReadPixelFeatureOpt(prhs[1], &opt);
@@ -35,5 +35,6 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
     
     // process
     PixelFeature(&img, &pixel_feat, &pixel_coordinate, &opt);    
-    FreeImage(&img);
+    if(img_copied)
+        FreeImage(&img);
 }
\ No newline at end of file